@@ -0,0 +1,786 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "acl.hpp"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+static constexpr uint32_t NO_CHILD = UINT32_MAX;
+
+// The longest name of the DNS
+static constexpr std::size_t MAX_DOMAIN = 253;
+
+static inline int bitAt(const uint64_t key[2], uint32_t bit)
+{
+    return bit < 64 ? (key[0] >> (63 - bit)) & 1 : (key[1] >> (127 - bit)) & 1;
+}
+
+// Whether the first length bits of a and b are equal
+static inline bool samePrefix(const uint64_t a[2], const uint64_t b[2], uint32_t length)
+{
+    uint64_t high = length == 0 ? 0 : length >= 64 ? ~0ULL : ~0ULL << (64 - length);
+    uint64_t low = length <= 64 ? 0 : length >= 128 ? ~0ULL : ~0ULL << (128 - length);
+
+    return ((a[0] ^ b[0]) & high) == 0 && ((a[1] ^ b[1]) & low) == 0;
+}
+
+static uint32_t commonPrefix(const uint64_t a[2], const uint64_t b[2])
+{
+    if (a[0] != b[0])
+    {
+        return __builtin_clzll(a[0] ^ b[0]);
+    }
+    else if (a[1] != b[1])
+    {
+        return 64 + __builtin_clzll(a[1] ^ b[1]);
+    }
+
+    return 128;
+}
+
+static inline uint64_t loadBigEndian(const unsigned char *bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = value << 8 | bytes[i];
+    }
+
+    return value;
+}
+
+static inline void ipv4Key(const unsigned char *ip, uint64_t key[2])
+{
+    key[0] = 0;
+    key[1] = 0x0000ffff00000000ULL |
+        static_cast<uint64_t>(ip[0]) << 24 | ip[1] << 16 | ip[2] << 8 | ip[3];
+}
+
+static inline void ipv6Key(const unsigned char *ip, uint64_t key[2])
+{
+    key[0] = loadBigEndian(ip);
+    key[1] = loadBigEndian(ip + 8);
+}
+
+// FNV-1a of a label in lower case
+static inline uint64_t hashLabel(const char *label, std::size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < length; i++)
+    {
+        unsigned char c = label[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c += 'a' - 'A';
+        }
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+   Builds the tries of an Acl, the rules of a node keep
+   the order of the file until they are laid out flat
+ **/
+class Acl::Builder
+{
+public:
+    explicit Builder(Acl &acl)
+        : acl_(acl)
+    {
+        IpNode root;
+        memset(&root, 0, sizeof(root));
+        root.children[0] = root.children[1] = NO_CHILD;
+        root.fallback = NO_CHILD;
+        acl_.ipNodes_.push_back(root);
+        ipRules_.emplace_back();
+
+        domainRules_.emplace_back();
+    }
+
+    void addIp(const uint64_t key[2], uint32_t length, const std::vector<Rule> &rules);
+
+    // Domain in lower case, without dots at either end
+    void addDomain(const std::string &domain, const std::vector<Rule> &rules);
+
+    void addAny(const std::vector<Rule> &rules)
+    {
+        append(ipRules_[0], rules);
+        append(domainRules_[0], rules);
+    }
+
+    // Lay the rules and the edges out flat
+    void finish();
+
+    // Link the nodes to their fallbacks and fill the IPv4 jumps
+    void link();
+
+private:
+    struct Edge
+    {
+        uint32_t     parent;
+        uint64_t     hash;
+        std::string  label;
+        uint32_t     node;
+    };
+
+    static void append(std::vector<Rule> &to, const std::vector<Rule> &rules)
+    {
+        to.insert(to.end(), rules.begin(), rules.end());
+    }
+
+    uint32_t newIpNode(const uint64_t key[2], uint32_t length);
+
+    Acl                                        &acl_;
+    std::vector<std::vector<Rule>>             ipRules_;
+    std::vector<std::vector<Rule>>             domainRules_;
+    std::unordered_map<std::string, uint32_t>  children_;    // parent and label to node
+    std::vector<Edge>                          edges_;
+};
+
+uint32_t Acl::Builder::newIpNode(const uint64_t key[2], uint32_t length)
+{
+    IpNode node;
+    node.key[0] = node.key[1] = 0;
+    for (uint32_t bit = 0; bit < length; bit++)
+    {
+        if (bitAt(key, bit))
+        {
+            node.key[bit / 64] |= 1ULL << (63 - bit % 64);
+        }
+    }
+    node.children[0] = node.children[1] = NO_CHILD;
+    node.firstRule = node.ruleCount = 0;
+    node.length = length;
+    node.fallback = NO_CHILD;
+
+    acl_.ipNodes_.push_back(node);
+    ipRules_.emplace_back();
+    
+    return acl_.ipNodes_.size() - 1;
+}
+
+void Acl::Builder::addIp(const uint64_t key[2], uint32_t length, const std::vector<Rule> &rules)
+{
+    auto &nodes = acl_.ipNodes_;
+    uint32_t index = 0;
+
+    while (true)
+    {
+        if (nodes[index].length == length)
+        {
+            append(ipRules_[index], rules);
+            return;
+        }
+
+        int bit = bitAt(key, nodes[index].length);
+        auto child = nodes[index].children[bit];
+        if (child == NO_CHILD)
+        {
+            auto leaf = newIpNode(key, length);
+            nodes[index].children[bit] = leaf;
+            append(ipRules_[leaf], rules);
+            return;
+        }
+
+        auto common = std::min(commonPrefix(key, nodes[child].key),
+                               std::min(length, nodes[child].length));
+        if (common == nodes[child].length)
+        {
+            index = child;
+            continue;
+        }
+
+        // the prefixes part within the child, split it there
+        auto middle = newIpNode(key, common);
+        nodes[middle].children[bitAt(nodes[child].key, common)] = child;
+        nodes[index].children[bit] = middle;
+
+        if (common == length)
+        {
+            append(ipRules_[middle], rules);
+        }
+        else
+        {
+            auto leaf = newIpNode(key, length);
+            nodes[middle].children[bitAt(key, common)] = leaf;
+            append(ipRules_[leaf], rules);
+        }
+        return;
+    }
+}
+
+void Acl::Builder::addDomain(const std::string &domain, const std::vector<Rule> &rules)
+{
+    uint32_t node = 0;
+    std::size_t end = domain.size();
+
+    while (true)
+    {
+        auto dot = domain.rfind('.', end - 1);
+        auto start = dot == std::string::npos ? 0 : dot + 1;
+        auto label = domain.substr(start, end - start);
+
+        std::string key(reinterpret_cast<const char *>(&node), sizeof(node));
+        key += label;
+
+        auto found = children_.find(key);
+        if (found != children_.end())
+        {
+            node = found->second;
+        }
+        else
+        {
+            uint32_t child = domainRules_.size();
+            domainRules_.emplace_back();
+            children_.emplace(key, child);
+            edges_.push_back({node, hashLabel(label.data(), label.size()), label, child});
+            node = child;
+        }
+
+        if (start == 0)
+        {
+            break;
+        }
+        end = start - 1;
+    }
+
+    append(domainRules_[node], rules);
+}
+
+void Acl::Builder::finish()
+{
+    for (std::size_t i = 0; i < acl_.ipNodes_.size(); i++)
+    {
+        acl_.ipNodes_[i].firstRule = acl_.rules_.size();
+        acl_.ipNodes_[i].ruleCount = ipRules_[i].size();
+        append(acl_.rules_, ipRules_[i]);
+    }
+
+    link();
+
+    acl_.domainNodes_.resize(domainRules_.size());
+    for (std::size_t i = 0; i < domainRules_.size(); i++)
+    {
+        auto &node = acl_.domainNodes_[i];
+        node.firstEdge = node.edgeCount = 0;
+        node.firstRule = acl_.rules_.size();
+        node.ruleCount = domainRules_[i].size();
+        append(acl_.rules_, domainRules_[i]);
+    }
+
+    std::sort(edges_.begin(), edges_.end(), [](const Edge &a, const Edge &b) {
+            return a.parent < b.parent || (a.parent == b.parent && a.hash < b.hash);
+        });
+
+    for (auto &edge : edges_)
+    {
+        auto &parent = acl_.domainNodes_[edge.parent];
+        if (parent.edgeCount == 0)
+        {
+            parent.firstEdge = acl_.edges_.size();
+        }
+        parent.edgeCount++;
+
+        acl_.edges_.push_back({edge.hash, static_cast<uint32_t>(acl_.labels_.size()),
+                               static_cast<uint32_t>(edge.label.size()), edge.node});
+        acl_.labels_ += edge.label;
+    }
+}
+
+void Acl::Builder::link()
+{
+    auto &nodes = acl_.ipNodes_;
+
+    std::vector<std::pair<uint32_t, uint32_t>> stack{{0, NO_CHILD}};
+    while (!stack.empty())
+    {
+        auto index = stack.back().first;
+        auto fallback = stack.back().second;
+        stack.pop_back();
+
+        nodes[index].fallback = fallback;
+        if (nodes[index].ruleCount > 0)
+        {
+            fallback = index;
+        }
+
+        for (auto child : nodes[index].children)
+        {
+            if (child != NO_CHILD)
+            {
+                stack.emplace_back(child, fallback);
+            }
+        }
+    }
+
+    // the child taken after a node shorter than /16 depends on its first 16 bits only
+    static constexpr uint32_t JUMP_LENGTH = 96 + 16;
+    
+    acl_.ipv4Jumps_.resize(1 << 16);
+    for (uint32_t slot = 0; slot < acl_.ipv4Jumps_.size(); slot++)
+    {
+        unsigned char ip[4] = {static_cast<unsigned char>(slot >> 8),
+                               static_cast<unsigned char>(slot), 0, 0};
+        uint64_t key[2];
+        ipv4Key(ip, key);
+
+        Jump jump = {0, NO_CHILD};
+        while (jump.next != NO_CHILD && nodes[jump.next].length < JUMP_LENGTH)
+        {
+            auto &node = nodes[jump.next];
+            if (!samePrefix(node.key, key, node.length))
+            {
+                jump.next = NO_CHILD;
+                break;
+            }
+
+            if (node.ruleCount > 0)
+            {
+                jump.best = jump.next;
+            }
+            jump.next = node.children[bitAt(key, node.length)];
+        }
+
+        acl_.ipv4Jumps_[slot] = jump;
+    }
+}
+
+/**
+   Parse a port list like "25,465,587,1000-2000" into ranges,
+   an empty list is every port
+ **/
+static bool parsePorts(const std::string &ports,
+                       std::vector<std::pair<uint16_t, uint16_t>> &ranges)
+{
+    ranges.clear();
+    if (ports.empty())
+    {
+        ranges.emplace_back(0, 65535);
+        return true;
+    }
+
+    const char *spec = ports.c_str();
+    while (true)
+    {
+        char *stop = nullptr;
+        auto first = strtoul(spec, &stop, 10);
+        auto last = first;
+        if (stop == spec || first == 0 || first > 65535)
+        {
+            return false;
+        }
+
+        if (*stop == '-')
+        {
+            spec = stop + 1;
+            last = strtoul(spec, &stop, 10);
+            if (stop == spec || last < first || last > 65535)
+            {
+                return false;
+            }
+        }
+        ranges.emplace_back(first, last);
+
+        if (*stop == '\0')
+        {
+            return true;
+        }
+        else if (*stop != ',')
+        {
+            return false;
+        }
+        spec = stop + 1;
+    }
+}
+
+/**
+   Lower case a domain rule and drop a leading "*." or "." and a
+   trailing ".", return false if it isn't a domain name
+ **/
+static bool normalizeDomain(std::string &domain)
+{
+    if (domain.compare(0, 2, "*.") == 0)
+    {
+        domain.erase(0, 2);
+    }
+    else if (!domain.empty() && domain[0] == '.')
+    {
+        domain.erase(0, 1);
+    }
+
+    if (!domain.empty() && domain.back() == '.')
+    {
+        domain.pop_back();
+    }
+
+    if (domain.empty() || domain.size() > MAX_DOMAIN ||
+        domain[0] == '.' || domain.find("..") != std::string::npos)
+    {
+        return false;
+    }
+
+    for (auto &c : domain)
+    {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.')
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+   Parse an ip address with an optional "/length",
+   key and length are in the 128 bit space
+ **/
+static bool parseCidr(const std::string &cidr, uint64_t key[2], uint32_t &length)
+{
+    auto slash = cidr.find('/');
+    auto ip = cidr.substr(0, slash);
+
+    unsigned char bytes[16];
+    uint32_t bits;
+    if (inet_pton(AF_INET, ip.c_str(), bytes) == 1)
+    {
+        ipv4Key(bytes, key);
+        bits = 32;
+    }
+    else if (inet_pton(AF_INET6, ip.c_str(), bytes) == 1)
+    {
+        ipv6Key(bytes, key);
+        bits = 128;
+    }
+    else
+    {
+        return false;
+    }
+
+    length = bits;
+    if (slash != std::string::npos)
+    {
+        auto prefix = cidr.c_str() + slash + 1;
+        char *stop = nullptr;
+        auto value = strtoul(prefix, &stop, 10);
+        if (stop == prefix || *stop != '\0' || value > bits)
+        {
+            return false;
+        }
+        length = value;
+    }
+
+    // an IPv4 prefix lives under ::ffff:0:0/96
+    length += 128 - bits;
+    return true;
+}
+
+std::unique_ptr<Acl> Acl::build(const char *data, std::size_t length, std::string &error,
+                                const char *allowWord, const char *denyWord)
+{
+    std::unique_ptr<Acl> acl(new Acl());
+    Builder builder(*acl);
+
+    std::istringstream text(std::string(data, length));
+    std::string line;
+    std::vector<std::pair<uint16_t, uint16_t>> ranges;
+    std::vector<Rule> rules;
+    int lineNumber = 0;
+
+    while (std::getline(text, line))
+    {
+        lineNumber++;
+        
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+        {
+            line.resize(comment);
+        }
+
+        std::istringstream fields(line);
+        std::string action, destination, ports, extra;
+        if (!(fields >> action))
+        {
+            continue;
+        }
+        fields >> destination >> ports >> extra;
+
+        Action parsed = action == allowWord ? Action::allow : Action::deny;
+        if ((action != allowWord && action != denyWord) || destination.empty() ||
+            !extra.empty() || !parsePorts(ports, ranges))
+        {
+            error = "malformed line " + std::to_string(lineNumber);
+            return nullptr;
+        }
+
+        rules.clear();
+        for (auto &range : ranges)
+        {
+            rules.push_back({range.first, range.second, parsed});
+        }
+
+        uint64_t key[2];
+        uint32_t prefix;
+        if (destination == "*")
+        {
+            builder.addAny(rules);
+        }
+        else if (parseCidr(destination, key, prefix))
+        {
+            builder.addIp(key, prefix, rules);
+        }
+        else if (destination.find('/') == std::string::npos && normalizeDomain(destination))
+        {
+            builder.addDomain(destination, rules);
+        }
+        else
+        {
+            error = "invalid destination on line " + std::to_string(lineNumber);
+            return nullptr;
+        }
+    }
+
+    builder.finish();
+    return acl;
+}
+
+std::unique_ptr<Acl> Acl::load(const std::string &path, std::string &error,
+                               const char *allowWord, const char *denyWord)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        error = path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    std::stringstream text;
+    text << file.rdbuf();
+    auto data = text.str();
+
+    auto acl = build(data.data(), data.size(), error, allowWord, denyWord);
+    if (acl == nullptr)
+    {
+        error = path + ": " + error;
+    }
+
+    return acl;
+}
+
+uint32_t Acl::walk(const uint64_t key[2], Jump jump) const
+{
+    for (auto index = jump.next; index != NO_CHILD; )
+    {
+        auto &node = ipNodes_[index];
+        if (!samePrefix(node.key, key, node.length))
+        {
+            break;
+        }
+
+        if (node.ruleCount > 0)
+        {
+            jump.best = index;
+        }
+
+        if (node.length == 128)
+        {
+            break;
+        }
+        index = node.children[bitAt(key, node.length)];
+    }
+
+    return jump.best;
+}
+
+Acl::Action Acl::matchIp(uint32_t node, unsigned short port) const
+{
+    for (; node != NO_CHILD; node = ipNodes_[node].fallback)
+    {
+        auto rule = &rules_[ipNodes_[node].firstRule];
+        for (auto end = rule + ipNodes_[node].ruleCount; rule != end; ++rule)
+        {
+            if (port >= rule->firstPort && port <= rule->lastPort)
+            {
+                return rule->action;
+            }
+        }
+    }
+
+    return Action::allow;
+}
+
+Acl::Action Acl::matchDomain(const uint32_t *nodes, int count, unsigned short port) const
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        auto &node = domainNodes_[nodes[i]];
+        auto rule = &rules_[node.firstRule];
+        for (auto end = rule + node.ruleCount; rule != end; ++rule)
+        {
+            if (port >= rule->firstPort && port <= rule->lastPort)
+            {
+                return rule->action;
+            }
+        }
+    }
+
+    return Action::allow;
+}
+
+Acl::Action Acl::checkIPv4(const unsigned char *ip, unsigned short port) const
+{
+    uint64_t key[2];
+    ipv4Key(ip, key);
+
+    auto node = walk(key, ipv4Jumps_[ip[0] << 8 | ip[1]]);
+    return matchIp(node, port);
+}
+
+Acl::Action Acl::checkIPv6(const unsigned char *ip, unsigned short port) const
+{
+    uint64_t key[2];
+    ipv6Key(ip, key);
+
+    // an IPv4 mapped address takes the IPv4 path
+    if (key[0] == 0 && (key[1] >> 32) == 0xffff)
+    {
+        return checkIPv4(ip + 12, port);
+    }
+
+    Jump root = {0, NO_CHILD};
+    return matchIp(walk(key, root), port);
+}
+
+Acl::Action Acl::checkDomain(const char *domain, std::size_t length, unsigned short port) const
+{
+    static constexpr int MAX_LABELS = MAX_DOMAIN / 2 + 2;
+    
+    uint32_t nodes[MAX_LABELS];
+    int count = 0;
+
+    auto pushRules = [&](uint32_t index) {
+        if (domainNodes_[index].ruleCount > 0 && count < MAX_LABELS)
+        {
+            nodes[count++] = index;
+        }
+    };
+
+    if (length > 0 && domain[length - 1] == '.')
+    {
+        length--;
+    }
+
+    const DomainNode *node = &domainNodes_[0];
+    pushRules(0);
+
+    for (std::size_t end = length; end > 0 && node->edgeCount > 0; )
+    {
+        auto start = end;
+        while (start > 0 && domain[start - 1] != '.')
+        {
+            start--;
+        }
+
+        auto label = domain + start;
+        auto labelLength = end - start;
+        auto hash = hashLabel(label, labelLength);
+
+        auto first = edges_.begin() + node->firstEdge;
+        auto last = first + node->edgeCount;
+        auto edge = std::lower_bound(first, last, hash, [](const DomainEdge &edge, uint64_t hash) {
+                return edge.hash < hash;
+            });
+
+        auto next = NO_CHILD;
+        for (; edge != last && edge->hash == hash; ++edge)
+        {
+            if (edge->labelLength == labelLength &&
+                strncasecmp(labels_.data() + edge->label, label, labelLength) == 0)
+            {
+                next = edge->node;
+                break;
+            }
+        }
+
+        if (next == NO_CHILD)
+        {
+            break;
+        }
+        node = &domainNodes_[next];
+        pushRules(next);
+
+        if (start == 0)
+        {
+            break;
+        }
+        end = start - 1;
+    }
+
+    return matchDomain(nodes, count, port);
+}
+
+Acl::Action Acl::check(const Address &address) const
+{
+    auto port = address.port();
+    
+    if (address.type() == Address::Type::ipv4)
+    {
+        return checkIPv4(address.toRawIPv4().data(), port);
+    }
+    else if (address.type() == Address::Type::ipv6)
+    {
+        return checkIPv6(address.toRawIPv6().data(), port);
+    }
+
+    // the host string may be padded with zeros
+    auto host = address.host();
+    auto domain = host.c_str();
+
+    unsigned char ip[16];
+    if (inet_pton(AF_INET, domain, ip) == 1)
+    {
+        return checkIPv4(ip, port);
+    }
+    else if (inet_pton(AF_INET6, domain, ip) == 1)
+    {
+        return checkIPv6(ip, port);
+    }
+    
+    return checkDomain(domain, strlen(domain), port);
+}
+
+Acl::Action Acl::check(const sockaddr *address) const
+{
+    if (address->sa_family == AF_INET)
+    {
+        auto sin = reinterpret_cast<const sockaddr_in *>(address);
+        return checkIPv4(reinterpret_cast<const unsigned char *>(&sin->sin_addr),
+                         ntohs(sin->sin_port));
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        auto sin6 = reinterpret_cast<const sockaddr_in6 *>(address);
+        return checkIPv6(sin6->sin6_addr.s6_addr, ntohs(sin6->sin6_port));
+    }
+
+    return Action::deny;
+}
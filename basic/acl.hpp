@@ -0,0 +1,147 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef ACL_H
+#define ACL_H
+
+#include "address.hpp"
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+   Allow or deny rules over the destinations of the clients, one per line:
+
+     deny   10.0.0.0/8
+     allow  127.0.0.1       8080
+     deny   example.com     25,465,587
+     deny   *               25
+
+   A domain rule covers the domain and its subdomains, "*" covers every
+   destination, the ports are all ports unless given. The most specific
+   destination wins, i.e. the longest prefix or the longest suffix, and
+   among its rules the first one in the file whose ports match. A
+   destination no rule matches is allowed.
+
+   The CIDRs are compiled into a path compressed binary trie over 128 bit
+   keys, with IPv4 mapped into ::ffff:0:0/96, and the domains into a
+   trie of their labels from right to left, so a lookup costs a walk of
+   a few nodes whatever the number of rules. An IPv4 lookup starts from
+   a table indexed by the first 16 bits, which skips the top of the
+   trie. A compiled Acl is immutable, a reload builds a new one and
+   swaps it whole.
+ **/
+class Acl
+{
+public:
+    enum class Action { allow, deny };
+
+    // disable the copy operations
+    Acl(const Acl &) = delete;
+    Acl &operator=(const Acl &) = delete;
+
+    /**
+       Compile the text of a rules file, return nullptr and set error
+       if a line is malformed. The words of the actions may be renamed
+       for tables which don't allow or deny, e.g. routes
+     **/
+    static std::unique_ptr<Acl> build(const char *data, std::size_t length,
+                                      std::string &error,
+                                      const char *allowWord = "allow",
+                                      const char *denyWord = "deny");
+
+    // Compile a rules file
+    static std::unique_ptr<Acl> load(const std::string &path, std::string &error,
+                                     const char *allowWord = "allow",
+                                     const char *denyWord = "deny");
+
+    // The action for a destination requested by a client
+    Action check(const Address &address) const;
+
+    // The action for a resolved destination, with its port
+    Action check(const sockaddr *address) const;
+
+    // Ports are in host byte order
+    Action checkIPv4(const unsigned char *ip, unsigned short port) const;
+    Action checkIPv6(const unsigned char *ip, unsigned short port) const;
+    Action checkDomain(const char *domain, std::size_t length, unsigned short port) const;
+
+    // Number of rules
+    std::size_t size() const
+    {
+        return rules_.size();
+    }
+
+private:
+    struct Rule
+    {
+        uint16_t  firstPort;
+        uint16_t  lastPort;
+        Action    action;
+    };
+
+    struct IpNode
+    {
+        uint64_t  key[2];         // the prefix, bits past length are zero
+        uint32_t  children[2];
+        uint32_t  firstRule;
+        uint32_t  ruleCount;
+        uint32_t  length;         // of the prefix in bits
+        uint32_t  fallback;       // the nearest ancestor with rules
+    };
+
+    // Where an IPv4 lookup of a /16 goes on
+    struct Jump
+    {
+        uint32_t  next;           // the node to visit next
+        uint32_t  best;           // the deepest node with rules so far
+    };
+
+    struct DomainNode
+    {
+        uint32_t  firstEdge;      // the edges of a node are sorted by hash
+        uint32_t  edgeCount;
+        uint32_t  firstRule;
+        uint32_t  ruleCount;
+    };
+
+    struct DomainEdge
+    {
+        uint64_t  hash;           // of the label
+        uint32_t  label;          // offset in labels_
+        uint32_t  labelLength;
+        uint32_t  node;
+    };
+
+    class Builder;
+
+    Acl() = default;
+
+    // Walk the trie from a jump, return the deepest node with rules
+    uint32_t walk(const uint64_t key[2], Jump jump) const;
+
+    // The first rule of node or its fallbacks that matches port
+    Action matchIp(uint32_t node, unsigned short port) const;
+
+    // The first rule matching port on the deepest of the domain nodes
+    Action matchDomain(const uint32_t *nodes, int count, unsigned short port) const;
+
+    std::vector<Rule>        rules_;
+    std::vector<IpNode>      ipNodes_;        // the root is ::/0
+    std::vector<Jump>        ipv4Jumps_;      // by the first 16 bits of an IPv4 address
+    std::vector<DomainNode>  domainNodes_;    // the root holds the "*" rules
+    std::vector<DomainEdge>  edges_;
+    std::string              labels_;
+};
+
+#endif /* ACL_H */
@@ -24,10 +24,11 @@ Address::Address(struct sockaddr *address)
     if (address->sa_family == AF_INET)
     {
         auto sin = reinterpret_cast<sockaddr_in *>(address);
-        host_.resize(INET_ADDRSTRLEN, '\0');
+        char text[INET_ADDRSTRLEN];
 
-        if (::inet_ntop(AF_INET, &sin->sin_addr, &host_[0], host_.size()) != nullptr)
+        if (::inet_ntop(AF_INET, &sin->sin_addr, text, sizeof(text)) != nullptr)
         {
+            host_ = text;
             type_ = Type::ipv4;
             port_ = ntohs(sin->sin_port);            
         }
@@ -35,33 +36,40 @@ Address::Address(struct sockaddr *address)
     else if (address->sa_family == AF_INET6)
     {
         auto sin = reinterpret_cast<sockaddr_in6 *>(address);
-        host_.resize(INET6_ADDRSTRLEN, '\0');
+        char text[INET6_ADDRSTRLEN];
         
-        if (::inet_ntop(AF_INET6, &sin->sin6_addr, &host_[0], host_.size()) != nullptr)
+        if (::inet_ntop(AF_INET6, &sin->sin6_addr, text, sizeof(text)) != nullptr)
         {
+            host_ = text;
             type_ = Type::ipv6;
             port_ = ntohs(sin->sin6_port);            
         }
     }
 }
 
+/**
+   The text of an address is written on the stack first, a host_ of
+   its own length stays in the inline buffer of std::string
+ **/
 Address::Address(const std::array<unsigned char, 4> &host, unsigned short port)
-    : type_(Type::unknown),
-      host_(INET_ADDRSTRLEN, '\0')
+    : type_(Type::unknown)
 {
-    if (::inet_ntop(AF_INET, host.data(), &host_[0], host_.size()) != nullptr)
+    char text[INET_ADDRSTRLEN];
+    if (::inet_ntop(AF_INET, host.data(), text, sizeof(text)) != nullptr)
     {
+        host_ = text;
         type_ = Type::ipv4;
         port_ = ntohs(port);            
     }
 }
 
 Address::Address(const std::array<unsigned char, 16> &host, unsigned short port)
-    : type_(Type::unknown),
-      host_(INET6_ADDRSTRLEN, '\0')
+    : type_(Type::unknown)
 {
-    if (::inet_ntop(AF_INET6, host.data(), &host_[0], host_.size()) != nullptr)
+    char text[INET6_ADDRSTRLEN];
+    if (::inet_ntop(AF_INET6, host.data(), text, sizeof(text)) != nullptr)
     {
+        host_ = text;
         type_ = Type::ipv6;
         port_ = ntohs(port);            
     }    
@@ -99,7 +107,7 @@ Address Address::FromHostOrder(const std::string &host, unsigned short port)
     return address;
 }
 
-std::string Address::host() const
+const std::string &Address::host() const
 {
     return host_;
 }
@@ -126,7 +134,8 @@ Address::Type Address::type() const
 
 std::ostream &operator<<(std::ostream &os, const Address &addr)
 {
-    os << addr.toString();
+    // written in place, a log line needn't build the string
+    os << addr.host() << ':' << addr.port();
     return os;
 }
  
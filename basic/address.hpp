@@ -53,7 +53,7 @@ public:
     static Address FromHostOrder(const std::string &host, unsigned short port);
     
     // Return ip address or domain name
-    std::string host() const;
+    const std::string &host() const;
 
     // Return port in host byte order
     std::uint16_t port() const;
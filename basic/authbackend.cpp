@@ -0,0 +1,331 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "authbackend.hpp"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+// Bytes of an answer of the verifier
+static constexpr std::size_t ANSWER_LENGTH = 5;
+
+std::size_t AuthBackend::KeyHash::operator()(const Key &key) const
+{
+    // the key is already a keyed hash
+    std::size_t hash;
+    memcpy(&hash, key.data(), sizeof(hash));
+
+    return hash;
+}
+
+AuthBackend::AuthBackend(event_base *base, const Options &options)
+    : base_(base),
+      options_(options),
+      stats_{0, 0, 0, 0, 0},
+      conn_(nullptr),
+      nextID_(0)
+{
+    if (RAND_bytes(secret_, sizeof(secret_)) != 1)
+    {
+        LOG(FATAL) << "Failed to generate the key of the auth cache";
+    }
+}
+
+AuthBackend::~AuthBackend()
+{
+    for (auto &query : queries_)
+    {
+        event_free(query.second.timer);
+    }
+
+    if (conn_ != nullptr)
+    {
+        bufferevent_free(conn_);
+    }
+}
+
+AuthBackend::Key AuthBackend::makeKey(const unsigned char *username,
+                                      std::size_t usernameLength,
+                                      const unsigned char *password,
+                                      std::size_t passwordLength) const
+{
+    unsigned char credentials[1 + 255 + 255];
+    credentials[0] = static_cast<unsigned char>(usernameLength);
+    memcpy(credentials + 1, username, usernameLength);
+    memcpy(credentials + 1 + usernameLength, password, passwordLength);
+
+    Key key;
+    unsigned int length = key.size();
+    HMAC(EVP_sha256(), secret_, sizeof(secret_),
+         credentials, 1 + usernameLength + passwordLength, key.data(), &length);
+
+    return key;
+}
+
+long AuthBackend::now() const
+{
+    struct timeval tv;
+    event_base_gettimeofday_cached(base_, &tv);
+
+    return tv.tv_sec;
+}
+
+AuthBackend::Result AuthBackend::lookup(const Handshake::Login &login)
+{
+    auto entry = entries_.find(makeKey(login.username.data, login.username.length,
+                                       login.password.data, login.password.length));
+    if (entry == entries_.end())
+    {
+        return Result::miss;
+    }
+
+    if (entry->second.expires <= now())
+    {
+        entries_.erase(entry);
+        return Result::miss;
+    }
+
+    stats_.hits++;
+    return entry->second.allowed ? Result::allowed : Result::denied;
+}
+
+void AuthBackend::check(const std::string &username, const std::string &password,
+                        Callback callback, void *arg)
+{
+    assert(username.size() <= 255 && password.size() <= 255);
+    
+    stats_.misses++;
+
+    auto key = makeKey(reinterpret_cast<const unsigned char *>(username.data()), username.size(),
+                       reinterpret_cast<const unsigned char *>(password.data()), password.size());
+    auto pending = pending_.find(key);
+    if (pending != pending_.end())
+    {
+        stats_.coalesced++;
+        queries_[pending->second].waiters.push_back({callback, arg});
+        return;
+    }
+
+    auto id = nextID_++;
+    auto &query = queries_[id];
+    query.backend = this;
+    query.id = id;
+    query.key = key;
+    query.timer = evtimer_new(base_, timeoutCallback, &query);
+    query.waiters.push_back({callback, arg});
+    pending_[key] = id;
+
+    if (conn_ == nullptr && !connect())
+    {
+        // fail it from the event loop, never before check() returns
+        event_active(query.timer, EV_TIMEOUT, 0);
+        return;
+    }
+
+    struct timeval timeout = {options_.timeout / 1000, options_.timeout % 1000 * 1000};
+    evtimer_add(query.timer, &timeout);
+
+    unsigned char request[4 + 1 + 255 + 1 + 255];
+    uint32_t networkID = htonl(id);
+    std::size_t length = 0;
+
+    memcpy(request, &networkID, 4);
+    length += 4;
+    request[length++] = static_cast<unsigned char>(username.size());
+    memcpy(request + length, username.data(), username.size());
+    length += username.size();
+    request[length++] = static_cast<unsigned char>(password.size());
+    memcpy(request + length, password.data(), password.size());
+    length += password.size();
+
+    stats_.requests++;
+    bufferevent_write(conn_, request, length);
+}
+
+void AuthBackend::cancel(void *arg)
+{
+    for (auto &query : queries_)
+    {
+        auto &waiters = query.second.waiters;
+        waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+                                     [arg](const Waiter &waiter) {
+                                         return waiter.arg == arg;
+                                     }),
+                      waiters.end());
+    }
+}
+
+bool AuthBackend::connect()
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    
+    if (options_.path.empty() || options_.path.size() >= sizeof(address.sun_path))
+    {
+        LOG(ERROR) << "Invalid path of the auth socket: " << options_.path;
+        return false;
+    }
+    memcpy(address.sun_path, options_.path.data(), options_.path.size());
+
+    conn_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(conn_, readCallback, nullptr, eventCallback, this);
+    bufferevent_enable(conn_, EV_READ | EV_WRITE);
+
+    if (bufferevent_socket_connect(conn_, reinterpret_cast<sockaddr *>(&address),
+                                   sizeof(address)) != 0)
+    {
+        LOG(ERROR) << "Failed to connect to the auth socket " << options_.path;
+        
+        bufferevent_free(conn_);
+        conn_ = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void AuthBackend::disconnect()
+{
+    if (conn_ != nullptr)
+    {
+        bufferevent_free(conn_);
+        conn_ = nullptr;
+    }
+
+    std::vector<uint32_t> ids;
+    for (auto &query : queries_)
+    {
+        ids.push_back(query.first);
+    }
+
+    stats_.errors += ids.size();
+    for (auto id : ids)
+    {
+        finishQuery(id, false, false);
+    }
+}
+
+void AuthBackend::finishQuery(uint32_t id, bool allowed, bool cache)
+{
+    auto found = queries_.find(id);
+    if (found == queries_.end())
+    {
+        // it timed out already
+        return;
+    }
+
+    auto key = found->second.key;
+    auto waiters = std::move(found->second.waiters);
+    event_free(found->second.timer);
+    
+    queries_.erase(found);
+    pending_.erase(key);
+
+    if (cache)
+    {
+        sweep();
+        
+        auto ttl = allowed ? options_.ttl : options_.negativeTTL;
+        entries_[key] = {allowed, now() + ttl};
+    }
+
+    for (auto &waiter : waiters)
+    {
+        waiter.callback(allowed, waiter.arg);
+    }
+}
+
+void AuthBackend::sweep()
+{
+    if (entries_.size() < options_.maxEntries)
+    {
+        return;
+    }
+
+    auto current = now();
+    for (auto entry = entries_.begin(); entry != entries_.end(); )
+    {
+        if (entry->second.expires <= current)
+        {
+            entry = entries_.erase(entry);
+        }
+        else
+        {
+            ++entry;
+        }
+    }
+
+    // still full of fresh answers, start over
+    if (entries_.size() >= options_.maxEntries)
+    {
+        entries_.clear();
+    }
+}
+
+void AuthBackend::readCallback(bufferevent *conn, void *arg)
+{
+    auto backend = static_cast<AuthBackend *>(arg);
+    auto input = bufferevent_get_input(conn);
+
+    while (evbuffer_get_length(input) >= ANSWER_LENGTH)
+    {
+        unsigned char answer[ANSWER_LENGTH];
+        evbuffer_remove(input, answer, sizeof(answer));
+
+        uint32_t id;
+        memcpy(&id, answer, 4);
+        backend->finishQuery(ntohl(id), answer[4] == 0, true);
+
+        // a waiter may have closed the connection
+        if (backend->conn_ != conn)
+        {
+            return;
+        }
+    }
+}
+
+void AuthBackend::eventCallback(bufferevent *conn, short what, void *arg)
+{
+    if (what & BEV_EVENT_CONNECTED)
+    {
+        return;
+    }
+
+    auto backend = static_cast<AuthBackend *>(arg);
+    LOG(ERROR) << "Lost the connection to the auth socket " << backend->options_.path;
+    
+    backend->disconnect();
+}
+
+void AuthBackend::timeoutCallback(int fd, short what, void *arg)
+{
+    auto query = static_cast<Query *>(arg);
+    auto backend = query->backend;
+    
+    LOG(ERROR) << "No answer from the auth socket " << backend->options_.path;
+
+    backend->stats_.errors++;
+    backend->finishQuery(query->id, false, false);
+}
@@ -0,0 +1,178 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef AUTHBACKEND_H
+#define AUTHBACKEND_H
+
+#include "handshake.hpp"
+
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+struct event;
+struct event_base;
+
+/**
+   Check logins with a verifier process listening on a Unix socket,
+   without blocking the event loop
+
+   The checks are pipelined over one connection, a request is
+   +----+------+----------+------+----------+
+   | ID | ULEN |  UNAME   | PLEN |  PASSWD  |
+   +----+------+----------+------+----------+
+   | 4  |  1   | 1 to 255 |  1   | 1 to 255 |
+   +----+------+----------+------+----------+
+   and the verifier answers each in any order with
+   +----+--------+
+   | ID | STATUS |
+   +----+--------+
+   | 4  |   1    |
+   +----+--------+
+   where ID is in network byte order and a STATUS of 0 allows the login.
+
+   Answers are cached for ttl, denials for negativeTTL, and concurrent
+   checks of the same credentials share one request. A check that times
+   out or loses the connection is denied and not cached.
+ **/
+class AuthBackend
+{
+public:
+    struct Options
+    {
+        Options()
+            : ttl(60),
+              negativeTTL(5),
+              timeout(3000),
+              maxEntries(10000)
+        {
+        }
+
+        std::string   path;         // of the Unix socket
+        int           ttl;          // seconds
+        int           negativeTTL;  // seconds
+        int           timeout;      // milliseconds
+        std::size_t   maxEntries;
+    };
+
+    struct Stats
+    {
+        uint64_t  hits;
+        uint64_t  misses;
+        uint64_t  coalesced;
+        uint64_t  requests;
+        uint64_t  errors;       // timeouts and lost connections
+    };
+
+    enum class Result { allowed, denied, miss };
+
+    // Called from the event loop with the answer of a check
+    using Callback = void (*)(bool allowed, void *arg);
+
+    AuthBackend(event_base *base, const Options &options);
+    ~AuthBackend();
+
+    // disable the copy operations
+    AuthBackend(const AuthBackend &) = delete;
+    AuthBackend &operator=(const AuthBackend &) = delete;
+
+    // Look up a cached answer, call check() on a miss. A hit copies nothing
+    Result lookup(const Handshake::Login &login);
+
+    /**
+       Ask the verifier, the callback is always invoked from
+       the event loop, never before check() returns
+     **/
+    void check(const std::string &username, const std::string &password,
+               Callback callback, void *arg);
+
+    // Drop the callbacks of arg, e.g. when the tunnel waiting is gone
+    void cancel(void *arg);
+
+    Stats stats() const
+    {
+        return stats_;
+    }
+
+    std::size_t size() const
+    {
+        return entries_.size();
+    }
+
+private:
+    using Key = std::array<unsigned char, 32>;
+
+    struct KeyHash
+    {
+        std::size_t operator()(const Key &key) const;
+    };
+
+    struct Waiter
+    {
+        Callback  callback;
+        void      *arg;
+    };
+
+    struct Query
+    {
+        AuthBackend          *backend;
+        uint32_t             id;
+        Key                  key;
+        event                *timer;
+        std::vector<Waiter>  waiters;
+    };
+
+    struct Entry
+    {
+        bool  allowed;
+        long  expires;    // seconds
+    };
+
+    static void readCallback(bufferevent *conn, void *arg);
+    static void eventCallback(bufferevent *conn, short what, void *arg);
+    static void timeoutCallback(int fd, short what, void *arg);
+
+    // Keyed hash of the credentials, the cache never holds a password
+    // The fields are at most 255 bytes
+    Key makeKey(const unsigned char *username, std::size_t usernameLength,
+                const unsigned char *password, std::size_t passwordLength) const;
+
+    long now() const;
+
+    // Connect to the verifier, return false if it fails at once
+    bool connect();
+
+    // Cache the answer of a query and wake up its waiters
+    void finishQuery(uint32_t id, bool allowed, bool cache);
+
+    // Fail the queries in flight and drop the connection
+    void disconnect();
+
+    // Remove the expired entries once the cache is full
+    void sweep();
+
+    event_base                                 *base_;
+    Options                                    options_;
+    Stats                                      stats_;
+    unsigned char                              secret_[32];
+    bufferevent                                *conn_;
+    uint32_t                                   nextID_;
+    std::unordered_map<uint32_t, Query>        queries_;    // in flight by id
+    std::unordered_map<Key, uint32_t, KeyHash> pending_;    // id of the query of a key
+    std::unordered_map<Key, Entry, KeyHash>    entries_;
+};
+
+#endif /* AUTHBACKEND_H */
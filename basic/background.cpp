@@ -0,0 +1,90 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "background.hpp"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include <event2/event.h>
+
+static void notifyCallback(evutil_socket_t fd, short, void *arg)
+{
+    char byte;
+    while (read(fd, &byte, 1) > 0)
+    {
+    }
+
+    auto task = static_cast<BackgroundTask *>(arg);
+    task->onFinished();
+}
+
+BackgroundTask::BackgroundTask(event_base *base)
+    : base_(base),
+      notifyEvent_(nullptr)
+{
+    assert(base_ != nullptr);
+
+    if (pipe2(notify_, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        LOG(FATAL) << "Failed to create the pipe of a background task: "
+                   << strerror(errno);
+    }
+
+    notifyEvent_ = event_new(base_, notify_[0], EV_READ | EV_PERSIST, notifyCallback, this);
+    event_add(notifyEvent_, nullptr);
+}
+
+BackgroundTask::~BackgroundTask()
+{
+    if (worker_.joinable())
+    {
+        worker_.join();
+    }
+
+    event_free(notifyEvent_);
+    close(notify_[0]);
+    close(notify_[1]);
+}
+
+bool BackgroundTask::run(std::function<void()> work, std::function<void()> done)
+{
+    if (worker_.joinable())
+    {
+        return false;
+    }
+
+    done_ = std::move(done);
+    worker_ = std::thread([this, work]() {
+            work();
+
+            char byte = 0;
+            ssize_t written = write(notify_[1], &byte, 1);
+            (void) written;
+        });
+
+    return true;
+}
+
+void BackgroundTask::onFinished()
+{
+    if (!worker_.joinable())
+    {
+        return;
+    }
+    worker_.join();
+
+    auto done = std::move(done_);
+    done_ = nullptr;
+    done();
+}
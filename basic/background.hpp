@@ -0,0 +1,60 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <functional>
+#include <thread>
+
+/**
+   Forward declaration
+ **/
+struct event;
+struct event_base;
+
+/**
+   Run a slow job, e.g. loading a large file, in another thread and
+   finish it in the event loop, so the loop never waits for it.
+   The thread is joined before done runs, whatever work wrote is
+   visible to done without further locking
+ **/
+class BackgroundTask
+{
+public:
+    explicit BackgroundTask(event_base *base);
+    ~BackgroundTask();
+
+    // disable the copy operations
+    BackgroundTask(const BackgroundTask &) = delete;
+    BackgroundTask &operator=(const BackgroundTask &) = delete;
+
+    /**
+       Run work in another thread and then done in the event loop,
+       return false if a job is already running
+     **/
+    bool run(std::function<void()> work, std::function<void()> done);
+
+    bool running() const
+    {
+        return worker_.joinable();
+    }
+
+    // Called in the event loop when the thread is done
+    void onFinished();
+
+private:
+    event_base             *base_;
+    int                    notify_[2];    // the thread writes to notify_[1]
+    event                  *notifyEvent_;
+    std::thread            worker_;
+    std::function<void()>  done_;
+};
+
+#endif /* BACKGROUND_H */
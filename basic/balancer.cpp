@@ -0,0 +1,128 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "balancer.hpp"
+
+#include <assert.h>
+
+#include <algorithm>
+
+// Weight of a new latency sample in the moving average
+static constexpr double DECAY = 0.3;
+
+Balancer::Balancer(std::size_t servers, const Options &options)
+    : options_(options),
+      servers_(servers)
+{
+    assert(servers > 0);
+
+    for (auto &server : servers_)
+    {
+        server = Target();
+        server.backoff = options_.minBackoff;
+    }
+}
+
+double Balancer::score(const Target &server) const
+{
+    // a server without a sample yet is tried as a fast one
+    if (options_.policy == Policy::leastLoaded)
+    {
+        return server.tunnels + server.latency / (server.latency + 1);
+    }
+
+    return (server.latency + 1) * (server.tunnels + 1);
+}
+
+std::size_t Balancer::pick(long now)
+{
+    std::size_t best = servers_.size();
+    std::size_t soonest = 0;
+
+    for (std::size_t i = 0; i < servers_.size(); i++)
+    {
+        auto &server = servers_[i];
+        if (server.ejectedUntil > now)
+        {
+            if (server.ejectedUntil < servers_[soonest].ejectedUntil)
+            {
+                soonest = i;
+            }
+            continue;
+        }
+
+        if (best == servers_.size() || score(server) < score(servers_[best]))
+        {
+            best = i;
+        }
+    }
+
+    if (best == servers_.size())
+    {
+        best = soonest;
+    }
+
+    servers_[best].picks++;
+    return best;
+}
+
+void Balancer::onConnected(std::size_t server, long latency)
+{
+    auto &entry = servers_[server];
+
+    if (entry.latency == 0)
+    {
+        entry.latency = latency;
+    }
+    else
+    {
+        entry.latency += DECAY * (latency - entry.latency);
+    }
+}
+
+void Balancer::onSuccess(std::size_t server)
+{
+    auto &entry = servers_[server];
+
+    entry.failures = 0;
+    entry.ejectedUntil = 0;
+    entry.backoff = options_.minBackoff;
+}
+
+void Balancer::onFailure(std::size_t server, long now)
+{
+    auto &entry = servers_[server];
+
+    // an ejected server isn't tried until the backoff is over
+    if (entry.ejectedUntil > now)
+    {
+        return;
+    }
+
+    entry.failures++;
+    if (entry.failures < options_.maxFails)
+    {
+        return;
+    }
+
+    entry.ejectedUntil = now + entry.backoff;
+    entry.backoff = std::min(entry.backoff * 2, options_.maxBackoff);
+    entry.ejections++;
+}
+
+void Balancer::acquire(std::size_t server)
+{
+    servers_[server].tunnels++;
+}
+
+void Balancer::release(std::size_t server)
+{
+    assert(servers_[server].tunnels > 0);
+    servers_[server].tunnels--;
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+/**
+   Place new tunnels on one of several proxy servers. Each server has
+   a moving average of its connect latency and the number of its
+   tunnels, a server failing maxFails times in a row is ejected for a
+   backoff which doubles with each ejection. Once the backoff is over
+   the next tunnel or probe tries it again, a success takes it back.
+   The times are in milliseconds
+ **/
+class Balancer
+{
+public:
+    enum class Policy
+    {
+        leastLoaded,   // the fewest tunnels, then the lowest latency
+        latency        // the lowest latency weighted by the tunnels
+    };
+
+    struct Options
+    {
+        Options()
+            : policy(Policy::latency),
+              maxFails(2),
+              minBackoff(1000),
+              maxBackoff(60000)
+        {
+        }
+
+        Policy  policy;
+        int     maxFails;
+        long    minBackoff;
+        long    maxBackoff;
+    };
+
+    struct Target
+    {
+        double    latency;       // moving average, 0 before the first sample
+        int       tunnels;
+        int       failures;      // in a row
+        long      ejectedUntil;  // 0 if the server is in use
+        long      backoff;       // of the next ejection
+        uint64_t  picks;
+        uint64_t  ejections;
+    };
+
+    Balancer(std::size_t servers, const Options &options);
+
+    /**
+       The server for a new tunnel. If all are ejected the one
+       whose ejection ends first is tried anyway
+     **/
+    std::size_t pick(long now);
+
+    // A connection to server was established after latency
+    void onConnected(std::size_t server, long latency);
+
+    // The server answered, e.g. the first reply of a tunnel
+    void onSuccess(std::size_t server);
+
+    // A connection to server failed or was closed before an answer
+    void onFailure(std::size_t server, long now);
+
+    // Count the tunnels of a server
+    void acquire(std::size_t server);
+    void release(std::size_t server);
+
+    bool ejected(std::size_t server, long now) const
+    {
+        return servers_[server].ejectedUntil > now;
+    }
+
+    const Target &target(std::size_t server) const
+    {
+        return servers_[server];
+    }
+
+    std::size_t size() const
+    {
+        return servers_.size();
+    }
+
+private:
+    // Lower is better
+    double score(const Target &server) const;
+
+    Options              options_;
+    std::vector<Target>  servers_;
+};
+
+#endif /* BALANCER_H */
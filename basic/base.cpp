@@ -8,19 +8,47 @@
  ******************************************************************************/
 
 #include "base.hpp"
+#include "relay.hpp"
 #include "sockets.hpp"
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <glog/logging.h>
 
-ServerBase::ServerBase(const Address &address, AcceptCallback callback,
-                       AcceptErrorCallback errorCallback, void *arg)
+#include <event2/buffer.h>
+
+// Bulk callbacks run in a row before the event loop polls again
+static constexpr int BULK_CALLBACKS = 16;
+
+// Bytes a bulk connection reads in one callback
+static constexpr std::size_t BULK_READ = 8 * 1024;
+
+ServerBase::ServerBase(const std::vector<ListenEndpoint> &endpoints, AcceptCallback callback,
+                       AcceptErrorCallback errorCallback, void *arg,
+                       const ListenOptions &options)
+    : unixListeners_(false),
+      fastOpen_(false),
+      accepted_(0),
+      relayed_(0)
 {
-    // create the event loop
-    base_ = event_base_new();    
+    /**
+       create the event loop, it polls for new events after a few bulk
+       callbacks, so the interactive ones don't wait behind all of them
+    **/
+    auto config = event_config_new();
+    event_config_set_max_dispatch_interval(config, nullptr, BULK_CALLBACKS,
+                                           static_cast<int>(Priority::bulk));
+    
+    base_ = event_base_new_with_config(config);
+    event_config_free(config);
+    
     if (base_ == nullptr)
     {
         LOG(FATAL) << "Failed to create the event_base";
     }
+    event_base_priority_init(base_, QosOptions::PRIORITIES);
 
     // create the dns resolver
     dns_ = evdns_base_new(base_, EVDNS_BASE_INITIALIZE_NAMESERVERS);
@@ -29,26 +57,77 @@ ServerBase::ServerBase(const Address &address, AcceptCallback callback,
         LOG(FATAL) << "Failed to create the dns resolver";        
     }
 
-    // create the listening socket
-    int listeningSocket = createListeningSocket(address.host(), address.portString());
+    // resolve the tcp endpoints first, ipv6 sockets leave ipv4 to the others
+    std::vector<std::vector<sockaddr_storage>> addresses(endpoints.size());
+    bool ipv4 = false;
+    for (std::size_t i = 0; i < endpoints.size(); i++)
+    {
+        if (endpoints[i].type() != ListenEndpoint::Type::tcp)
+        {
+            continue;
+        }
+
+        if (!resolveListenEndpoint(endpoints[i], addresses[i]))
+        {
+            LOG(FATAL) << "Failed to resolve the listening address " << endpoints[i].toString();
+        }
+
+        for (auto &address : addresses[i])
+        {
+            ipv4 = ipv4 || address.ss_family == AF_INET;
+        }
+    }
+
+    // create the listening sockets
+    for (std::size_t i = 0; i < endpoints.size(); i++)
+    {
+        auto &endpoint = endpoints[i];
+        if (endpoint.type() == ListenEndpoint::Type::local)
+        {
+            listen(createUnixListeningSocket(endpoint), endpoint,
+                   callback, errorCallback, arg, options);
+
+            unixListeners_ = true;
+            if (!endpoint.abstract())
+            {
+                socketFiles_.push_back(endpoint.path());
+            }
+            continue;
+        }
+
+        for (auto &address : addresses[i])
+        {
+            listen(createListeningSocket(address, ipv4, options), endpoint,
+                   callback, errorCallback, arg, options);
+        }
+    }
+}
+
+void ServerBase::listen(int listeningSocket, const ListenEndpoint &endpoint,
+                        AcceptCallback callback, AcceptErrorCallback errorCallback,
+                        void *arg, const ListenOptions &options)
+{
     if (listeningSocket == -1)
     {
         int err = EVUTIL_SOCKET_ERROR();        
-        LOG(FATAL) << "Failed to create listening socket: "
+        LOG(FATAL) << "Failed to create listening socket on " << endpoint.toString() << ": "
                    << evutil_socket_error_to_string(err);
     }
-    LOG(INFO) << "Create listening socket-" << listeningSocket;
+    LOG(INFO) << "Create listening socket-" << listeningSocket << " on " << endpoint.toString();
 
-    // create tcp lisnener
-    listener_ = evconnlistener_new(
+    /**
+       create tcp lisnener, it takes every pending connection on a
+       wakeup with accept4(), already nonblocking and closed on exec
+    **/
+    auto listener = evconnlistener_new(
         base_,
         callback,
         arg,
         LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_EXEC,
-        -1,
+        options.backlog,
         listeningSocket
     );    
-    if (listener_ == nullptr)
+    if (listener == nullptr)
     {
         int err = EVUTIL_SOCKET_ERROR();
         LOG(FATAL) << "Failed to create listener: "
@@ -56,14 +135,28 @@ ServerBase::ServerBase(const Address &address, AcceptCallback callback,
     }
 
     // setup up error callback for the tcp listener
-    evconnlistener_set_error_cb(listener_, errorCallback);    
+    evconnlistener_set_error_cb(listener, errorCallback);    
+    listeners_.push_back(listener);
 }
 
 ServerBase::~ServerBase()
 {
-    if (listener_ != nullptr)
+    // detach the resolver cache from the queries in flight
+    dnsCache_.reset();
+    udpAssociations_.reset();
+    rateLimiter_.reset();
+    credentials_.reset();
+    authBackend_.reset();
+    loopMonitor_.reset();
+    
+    for (auto listener : listeners_)
+    {
+        evconnlistener_free(listener);        
+    }
+
+    for (auto &path : socketFiles_)
     {
-        evconnlistener_free(listener_);        
+        ::unlink(path.c_str());
     }
 
     if (dns_ != nullptr)
@@ -83,10 +176,286 @@ void ServerBase::run()
     event_base_dispatch(base_);    
 }
 
+void ServerBase::enableDnsCache(const DnsCache::Options &options)
+{
+    dnsCache_.reset(new DnsCache(base_, dns_, options));
+    dnsCache_->loadHosts("/etc/hosts");
+}
+
+void ServerBase::enableUdp(int timeout)
+{
+    udpAssociations_.reset(new UdpAssociations(base_, timeout));
+}
+
+void ServerBase::enableRateLimits(const RateLimiter::Options &options)
+{
+    rateLimiter_.reset(new RateLimiter(base_, options));
+}
+
+void ServerBase::enableConnectHistory(const ConnectHistory::Options &options)
+{
+    connectHistory_.reset(new ConnectHistory(options));
+}
+
+void ServerBase::enableSourceLimits(const SourceLimiter::Options &options)
+{
+    sourceLimiter_.reset(new SourceLimiter(options));
+}
+
+void ServerBase::enableLoopMonitor(const LoopMonitor::Options &options)
+{
+    loopMonitor_.reset(new LoopMonitor(base_, options));
+
+    // the frames of the tunnels are timed along with the callbacks
+    FrameTimer::enable();
+}
+
+void ServerBase::enableCredentials(std::unique_ptr<CredentialTable> table)
+{
+    credentials_.reset(new CredentialStore(base_));
+    credentials_->setTable(std::move(table));
+}
+
+void ServerBase::enableAuthBackend(const AuthBackend::Options &options)
+{
+    authBackend_.reset(new AuthBackend(base_, options));
+}
+
+/**
+   An outgoing connection waiting for the resolver cache,
+   it holds a reference to the bufferevent so that it
+   outlives a bufferevent_free() by its owner
+ **/
+struct PendingConnection
+{
+    bufferevent     *conn;
+    unsigned short       port;       // network byte order
+    bool                 fastOpen;
+    const SocketOptions  *options;
+    std::shared_ptr<const Acl>  acl;    // checks the resolved address
+};
+
+/**
+   Connect to the address. The socket is created here so that
+   its options, TCP_FASTOPEN_CONNECT too, are set before connect()
+ **/
+static bool connectSocket(bufferevent *conn, const sockaddr *address, socklen_t length,
+                          bool fastOpen, const SocketOptions &options)
+{
+    if (bufferevent_getfd(conn) == -1)
+    {
+        int fd = createConnectingSocket(address->sa_family, fastOpen);
+        if (fd == -1)
+        {
+            return false;
+        }
+        
+        applySocketOptions(fd, options);
+
+        // a new fd resets the priority of the events
+        int priority = bufferevent_get_priority(conn);
+        if (bufferevent_setfd(conn, fd) != 0)
+        {
+            evutil_closesocket(fd);
+            return false;
+        }
+        bufferevent_priority_set(conn, priority);
+    }
+
+    /**
+       with TCP_FASTOPEN_CONNECT connect() succeeds at once and
+       the connection is reported as connected right away
+    **/
+    return bufferevent_socket_connect(conn, const_cast<sockaddr *>(address), length) == 0;
+}
+
+/**
+   A connection failed before it was connected, its owner hears of
+   it on the next loop
+ **/
+struct FailedConnection
+{
+    bufferevent  *conn;
+    int          err;
+};
+
+static void failedCallback(evutil_socket_t, short, void *arg)
+{
+    std::unique_ptr<FailedConnection> failed(static_cast<FailedConnection *>(arg));
+    auto conn = failed->conn;
+
+    // the owner may have freed the connection meanwhile
+    bufferevent_event_cb eventCallback = nullptr;
+    bufferevent_getcb(conn, nullptr, nullptr, &eventCallback, nullptr);
+    if (eventCallback != nullptr)
+    {
+        EVUTIL_SET_SOCKET_ERROR(failed->err);
+        bufferevent_trigger_event(conn, BEV_EVENT_ERROR, 0);
+    }
+
+    bufferevent_decref(conn);
+}
+
+/**
+   Report err on conn once the current callbacks returned, an answer
+   of the resolver may come before createConnection() returns, e.g.
+   for a name of the hosts file, and its owner isn't ready for it then
+ **/
+static void failLater(bufferevent *conn, int err)
+{
+    bufferevent_incref(conn);
+    event_base_once(bufferevent_get_base(conn), -1, EV_TIMEOUT, failedCallback,
+                    new FailedConnection{conn, err}, nullptr);
+}
+
+/**
+   Called when the resolver cache answers for a pending connection
+ **/
+static void resolvedCallback(int result, const sockaddr *address,
+                             socklen_t length, void *arg)
+{
+    auto pending = static_cast<PendingConnection *>(arg);
+    auto conn = pending->conn;
+
+    bufferevent_event_cb eventCallback = nullptr;
+    void *eventArg = nullptr;
+    bufferevent_getcb(conn, nullptr, nullptr, &eventCallback, &eventArg);
+
+    // the owner has freed the connection meanwhile
+    if (eventCallback == nullptr)
+    {
+        bufferevent_decref(conn);
+        delete pending;
+        return;
+    }
+
+    if (result != DNS_ERR_NONE)
+    {
+        LOG(ERROR) << "Failed to resolve the address of outgoing connection: "
+                   << evdns_err_to_string(result);
+
+        failLater(conn, ServerBase::lookupErrno(result));
+    }
+    else
+    {
+        sockaddr_storage storage;
+        memcpy(&storage, address, length);
+        setPort(&storage, pending->port);
+
+        // a name may resolve to an address the rules deny
+        if (pending->acl != nullptr &&
+            pending->acl->check(reinterpret_cast<sockaddr *>(&storage)) == Acl::Action::deny)
+        {
+            LOG(WARNING) << "The resolved address of outgoing connection is denied";
+
+            failLater(conn, EACCES);
+        }
+        else if (!connectSocket(conn, reinterpret_cast<sockaddr *>(&storage), length,
+                           pending->fastOpen, *pending->options))
+        {
+            failLater(conn, EVUTIL_SOCKET_ERROR());
+        }
+    }
+
+    bufferevent_decref(conn);
+    delete pending;
+}
+
+/**
+   A lookup through the dns resolver when the cache is disabled
+ **/
+struct PendingLookup
+{
+    DnsCache::Callback  callback;
+    void                *arg;
+};
+
+/**
+   The dns error of a getaddrinfo() error, so a resolver that timed
+   out or failed isn't taken for a name that doesn't exist
+ **/
+static int dnsErrorOf(int error)
+{
+    if (error == EVUTIL_EAI_NONAME)
+    {
+        return DNS_ERR_NOTEXIST;
+    }
+    else if (error == EVUTIL_EAI_NODATA || error == EVUTIL_EAI_ADDRFAMILY)
+    {
+        return DNS_ERR_NODATA;
+    }
+    else if (error == EVUTIL_EAI_AGAIN)
+    {
+        return DNS_ERR_TIMEOUT;
+    }
+    else if (error == EVUTIL_EAI_FAIL)
+    {
+        return DNS_ERR_SERVERFAILED;
+    }
+    else if (error == EVUTIL_EAI_CANCEL)
+    {
+        return DNS_ERR_CANCEL;
+    }
+
+    return DNS_ERR_UNKNOWN;
+}
+
+static void addrinfoCallback(int result, evutil_addrinfo *answer, void *arg)
+{
+    std::unique_ptr<PendingLookup> pending(static_cast<PendingLookup *>(arg));
+
+    if (result != 0)
+    {
+        pending->callback(dnsErrorOf(result), nullptr, 0, pending->arg);
+        return;
+    }
+
+    pending->callback(DNS_ERR_NONE, answer->ai_addr, answer->ai_addrlen, pending->arg);
+    evutil_freeaddrinfo(answer);
+}
+
+// Seconds a closing connection may take to write its output
+static constexpr int CLOSE_TIMEOUT = 30;
+
+static void closeOnWriteComplete(bufferevent *conn, void *arg)
+{
+    if (evbuffer_get_length(bufferevent_get_output(conn)) == 0)
+    {
+        // a stream of a multiplexed connection needs to know it's closed
+        bufferevent_flush(conn, EV_WRITE, BEV_FINISHED);
+        bufferevent_free(conn);
+    }
+}
+
+static void closeOnEvent(bufferevent *conn, short what, void *arg)
+{
+    // the peer is gone or too slow, drop the rest
+    bufferevent_free(conn);
+}
+
+void ServerBase::closeAfterWrite(bufferevent *conn)
+{
+    struct timeval timeout = {CLOSE_TIMEOUT, 0};
+
+    bufferevent_disable(conn, EV_READ);
+    bufferevent_setwatermark(conn, EV_WRITE, 0, 0);
+    bufferevent_set_timeouts(conn, nullptr, &timeout);
+    bufferevent_setcb(conn, nullptr, closeOnWriteComplete, closeOnEvent, nullptr);
+
+    closeOnWriteComplete(conn, nullptr);
+}
+
 bufferevent *ServerBase::acceptConnection(evutil_socket_t inConnFd, DataCallback callback,
                                           EventCallback eventCallback, void *arg)
 {
-    evutil_make_socket_nonblocking(inConnFd);
+    // the listener accepted inConnFd nonblocking already
+    accepted_++;
+
+    // the tcp options mean nothing to the clients of a unix socket
+    if (!unixListeners_ || !isUnixSocket(inConnFd))
+    {
+        applySocketOptions(inConnFd, socketOptions_);
+    }
 
     auto inConn = bufferevent_socket_new(base_, inConnFd, BEV_OPT_CLOSE_ON_FREE);
     if (inConn == nullptr)
@@ -95,13 +464,20 @@ bufferevent *ServerBase::acceptConnection(evutil_socket_t inConnFd, DataCallback
         LOG(ERROR) << "Failed to create connection for client-" << inConnFd
                    << ": " << evutil_socket_error_to_string(err);
         
+        evutil_closesocket(inConnFd);
         return nullptr;
     }
     
+    if (rateLimiter_ != nullptr)
+    {
+        rateLimiter_->limitIncoming(inConn);
+    }
+    
     bufferevent_setcb(inConn, callback, nullptr, eventCallback, arg);
     if (bufferevent_enable(inConn, EV_READ|EV_WRITE) != 0)
     {
         LOG(ERROR) << "Failed to enable read/write for client-" << inConnFd;
+        bufferevent_free(inConn);
         return nullptr;
     }
 
@@ -113,6 +489,7 @@ bufferevent *ServerBase::createConnection(const Address &address, DataCallback c
 {
     if (address.type() == Address::Type::unknown)
     {
+        EVUTIL_SET_SOCKET_ERROR(EAFNOSUPPORT);
         return nullptr;
     }
     
@@ -128,45 +505,191 @@ bufferevent *ServerBase::createConnection(const Address &address, DataCallback c
         LOG(ERROR) << "Failed to create outgoing connection to " << address
                    << ": " << evutil_socket_error_to_string(err);
         
+        EVUTIL_SET_SOCKET_ERROR(err);
         return nullptr;
     }
 
     // setup callbacks
     bufferevent_setcb(outConn, callback, nullptr, eventCallback, arg);
 
-    int af;
-    if (address.type() == Address::Type::ipv4)
+    bool connected;
+    if (address.type() != Address::Type::domain)
     {
-        af = AF_INET;
+        // ip addresses skip the resolver
+        connected = connectAddress(outConn, address);
     }
-    else if (address.type() == Address::Type::ipv6)
+    else if (dnsCache_ != nullptr)
     {
-        af = AF_INET6;
+        // domain names go through the resolver cache when it's enabled
+        connected = connectCached(outConn, address);
     }
     else
     {
-        af = AF_UNSPEC;
+        connected = connectResolved(outConn, address);
     }
 
-    // connect to remote server
-    if (bufferevent_socket_connect_hostname(outConn, dns_, af,
-                                            address.host().c_str(),
-                                            address.port()) == -1)
+    // the caller reads errno, closing the socket mustn't change it
+    if (!connected)
     {
         int err = EVUTIL_SOCKET_ERROR();
-        LOG(ERROR) << "Failed to connect the remote server " << address
-                   << ": " << evutil_socket_error_to_string(err);
+        bufferevent_free(outConn);
         
+        EVUTIL_SET_SOCKET_ERROR(err);
         return nullptr;
     }
 
     if (bufferevent_enable(outConn, EV_READ | EV_WRITE) != 0)
     {
+        int err = EVUTIL_SOCKET_ERROR();
         LOG(ERROR) << "Failed to enable read/write for outgoing connection-"
                    << bufferevent_getfd(outConn);
+        bufferevent_free(outConn);
         
+        EVUTIL_SET_SOCKET_ERROR(err);
         return nullptr;
     }
 
     return outConn;
 }
+
+bool ServerBase::connectCached(bufferevent *outConn, const Address &address)
+{
+    sockaddr_storage storage;
+    socklen_t length = 0;
+    
+    auto result = dnsCache_->lookup(address.host(), AF_UNSPEC, &storage, &length);
+    if (result == DnsCache::Result::negative)
+    {
+        LOG(ERROR) << "Failed to resolve " << address << ": cached failure";
+
+        // fails as a lookup does, through the event callback of the connection
+        failLater(outConn, EHOSTUNREACH);
+        return true;
+    }
+    
+    if (result == DnsCache::Result::hit)
+    {
+        setPort(&storage, address.portNetworkOrder());
+        if (acl_ != nullptr &&
+            acl_->check(reinterpret_cast<sockaddr *>(&storage)) == Acl::Action::deny)
+        {
+            LOG(WARNING) << "The resolved address of " << address << " is denied";
+
+            EVUTIL_SET_SOCKET_ERROR(EACCES);
+            return false;
+        }
+        
+        if (!connectSocket(outConn, reinterpret_cast<sockaddr *>(&storage), length,
+                           fastOpen_, socketOptions_))
+        {
+            int err = EVUTIL_SOCKET_ERROR();
+            LOG(ERROR) << "Failed to connect the remote server " << address
+                       << ": " << evutil_socket_error_to_string(err);
+            
+            EVUTIL_SET_SOCKET_ERROR(err);
+            return false;
+        }
+        
+        return true;
+    }
+
+    // wait for the answer, the connection is kept alive until it arrives
+    bufferevent_incref(outConn);
+    dnsCache_->resolve(address.host(), AF_UNSPEC, resolvedCallback,
+                       new PendingConnection{outConn, address.portNetworkOrder(), fastOpen_, &socketOptions_,
+                                             acl_});
+    
+    return true;
+}
+
+bool ServerBase::connectAddress(bufferevent *outConn, const Address &address)
+{
+    sockaddr_storage storage;
+    socklen_t length = toSockaddr(address, &storage);
+
+    if (!connectSocket(outConn, reinterpret_cast<sockaddr *>(&storage), length,
+                       fastOpen_, socketOptions_))
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        LOG(ERROR) << "Failed to connect the remote server " << address
+                   << ": " << evutil_socket_error_to_string(err);
+        
+        EVUTIL_SET_SOCKET_ERROR(err);
+        return false;
+    }
+
+    return true;
+}
+
+bool ServerBase::connectResolved(bufferevent *outConn, const Address &address)
+{
+    // wait for the answer, the connection is kept alive until it arrives
+    bufferevent_incref(outConn);
+    resolve(address.host(), resolvedCallback,
+            new PendingConnection{outConn, address.portNetworkOrder(),
+                                  fastOpen_, &socketOptions_, acl_});
+
+    return true;
+}
+
+void ServerBase::resolve(const std::string &host, DnsCache::Callback callback, void *arg)
+{
+    if (dnsCache_ != nullptr)
+    {
+        dnsCache_->resolve(host, AF_UNSPEC, callback, arg);
+        return;
+    }
+    
+    evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    evdns_getaddrinfo(dns_, host.c_str(), nullptr, &hints, addrinfoCallback,
+                      new PendingLookup{callback, arg});
+}
+
+int ServerBase::lookupErrno(int dnsError)
+{
+    if (dnsError == DNS_ERR_NOTEXIST || dnsError == DNS_ERR_NODATA)
+    {
+        return EHOSTUNREACH;
+    }
+
+    // the resolver may answer the next time
+    return EAGAIN;
+}
+
+void ServerBase::tune(SocketTuner &tuner, bufferevent *conn, std::size_t bytes)
+{
+    relayed_ += bytes;
+    
+    if (!socketOptions_.adaptive)
+    {
+        return;
+    }
+    
+    tuner.onTransfer(bufferevent_getfd(conn), socketOptions_, bytes, now());
+}
+
+void ServerBase::setPriority(bufferevent *conn, Priority priority)
+{
+    // only socket bufferevents have events of their own, not the streams of a pair
+    if (bufferevent_priority_set(conn, static_cast<int>(priority)) != 0)
+    {
+        return;
+    }
+
+    // 0 restores the default of libevent
+    bufferevent_set_max_single_read(conn, priority == Priority::bulk ? BULK_READ : 0);
+}
+
+long ServerBase::now() const
+{
+    struct timeval tv;
+    event_base_gettimeofday_cached(base_, &tv);
+
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -10,9 +10,23 @@
 #ifndef BASE_H
 #define BASE_H
 
+#include "acl.hpp"
 #include "address.hpp"
+#include "authbackend.hpp"
+#include "connecthistory.hpp"
+#include "coroutine.hpp"
+#include "credentials.hpp"
+#include "dnscache.hpp"
+#include "loopmonitor.hpp"
+#include "qos.hpp"
+#include "ratelimit.hpp"
+#include "sourcelimit.hpp"
+#include "sockets.hpp"
+#include "udprelay.hpp"
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <event2/dns.h>
 #include <event2/bufferevent.h>
@@ -26,8 +40,13 @@ using EventCallback       = bufferevent_event_cb;
 class ServerBase
 {
 public:
-    ServerBase(const Address &address, AcceptCallback callback,
-               AcceptErrorCallback errorCallback, void *arg);
+    /**
+       Listen on every endpoint, the clients of all of them
+       come to the same callback
+     **/
+    ServerBase(const std::vector<ListenEndpoint> &endpoints, AcceptCallback callback,
+               AcceptErrorCallback errorCallback, void *arg,
+               const ListenOptions &options = ListenOptions());
     
     ~ServerBase();
 
@@ -50,16 +69,210 @@ public:
         return dns_;
     }
 
+    // put a resolver cache in front of the dns resolver
+    void enableDnsCache(const DnsCache::Options &options);
+
+    /**
+       Resolve host through the resolver cache, or the dns resolver
+       if the cache is disabled. The callback may run before this returns
+     **/
+    void resolve(const std::string &host, DnsCache::Callback callback, void *arg);
+
+    /**
+       The errno a connection fails with when the lookup of its name
+       ended with dnsError, only a name without addresses is unreachable
+     **/
+    static int lookupErrno(int dnsError);
+
+    // return the resolver cache, nullptr if it's disabled
+    DnsCache *dnsCache() const
+    {
+        return dnsCache_.get();
+    }
+
+    /**
+       Open outgoing connections with TCP Fast Open, the first
+       write goes out in the SYN when the kernel has a cookie
+     **/
+    void setFastOpen(bool enable)
+    {
+        fastOpen_ = enable;
+    }
+
+    // relay UDP ASSOCIATE, associations idle for timeout seconds expire
+    void enableUdp(int timeout);
+
+    // return the udp associations, nullptr if udp is disabled
+    UdpAssociations *udpAssociations() const
+    {
+        return udpAssociations_.get();
+    }
+
+    // shape the bandwidth of the tunnels, their users and the listener
+    void enableRateLimits(const RateLimiter::Options &options);
+
+    // return the rate limiter, nullptr if there are no limits
+    RateLimiter *rateLimiter() const
+    {
+        return rateLimiter_.get();
+    }
+
+    // keep the outcomes and the latencies of the connections to each destination
+    void enableConnectHistory(const ConnectHistory::Options &options);
+
+    // return the history of the connections, nullptr if it isn't kept
+    ConnectHistory *connectHistory() const
+    {
+        return connectHistory_.get();
+    }
+
+    // limit the connections of each source address
+    void enableSourceLimits(const SourceLimiter::Options &options);
+
+    // return the limiter of the source addresses, nullptr if there are no limits
+    SourceLimiter *sourceLimiter() const
+    {
+        return sourceLimiter_.get();
+    }
+
+    // measure the lag of the event loop and the time of the callbacks
+    void enableLoopMonitor(const LoopMonitor::Options &options);
+
+    // return the loop monitor, nullptr if the loop isn't measured
+    LoopMonitor *loopMonitor() const
+    {
+        return loopMonitor_.get();
+    }
+
+    // the blocks of the coroutines of this loop
+    FramePool &framePool()
+    {
+        return framePool_;
+    }
+
+    // check the logins of the clients against table
+    void enableCredentials(std::unique_ptr<CredentialTable> table);
+
+    // return the credential store, nullptr if the clients needn't log in
+    CredentialStore *credentials() const
+    {
+        return credentials_.get();
+    }
+
+    // check the logins of unknown users with a verifier process
+    void enableAuthBackend(const AuthBackend::Options &options);
+
+    // return the verifier, nullptr if there's none
+    AuthBackend *authBackend() const
+    {
+        return authBackend_.get();
+    }
+
+    /**
+       Check the destinations of the clients against acl, a tunnel
+       keeps the rules it was checked with until it's connected
+     **/
+    void setAcl(std::shared_ptr<const Acl> acl)
+    {
+        acl_ = std::move(acl);
+    }
+
+    // return the destination rules, nullptr if every destination is allowed
+    const std::shared_ptr<const Acl> &acl() const
+    {
+        return acl_;
+    }
+
+    // options of the accepted and outgoing sockets
+    void setSocketOptions(const SocketOptions &options)
+    {
+        socketOptions_ = options;
+    }
+
+    const SocketOptions &socketOptions() const
+    {
+        return socketOptions_;
+    }
+
+    /**
+       Called after bytes were queued on conn, a busy connection
+       gets its buffers sized to the measured bandwidth-delay product
+     **/
+    void tune(SocketTuner &tuner, bufferevent *conn, std::size_t bytes);
+
+    /**
+       Run the callbacks of conn at priority, a bulk connection
+       also reads less at a time
+     **/
+    static void setPriority(bufferevent *conn, Priority priority);
+
+    // return the cached time of the event loop in milliseconds
+    long now() const;
+
+    // inConnFd is closed if the connection can't be made
     bufferevent *acceptConnection(evutil_socket_t inConnFd, DataCallback callback,
                                   EventCallback eventCallback, void *arg);
 
+    // return the number of connections accepted so far
+    uint64_t accepted() const
+    {
+        return accepted_;
+    }
+
+    // return the bytes queued to the connections of the tunnels so far
+    uint64_t relayed() const
+    {
+        return relayed_;
+    }
+
+    /**
+       Start a connection to address, nullptr if it can't be started
+       and errno tells why then. A name that doesn't resolve or an
+       address denied fails later through eventCallback, the
+       connection has no socket then
+     **/
     bufferevent *createConnection(const Address &address, DataCallback callback,
                                   EventCallback eventCallback, void *arg);
+
+    /**
+       Free conn once its output is written to the peer, so the
+       last data of a closed tunnel still reaches the other side
+     **/
+    static void closeAfterWrite(bufferevent *conn);
     
 private:
-    event_base        *base_;           // event loop
-    evconnlistener    *listener_;       // tcp listener
-    evdns_base        *dns_;            // dns resolver    
+    // listen on a socket of an endpoint
+    void listen(int listeningSocket, const ListenEndpoint &endpoint, AcceptCallback callback,
+                AcceptErrorCallback errorCallback, void *arg, const ListenOptions &options);
+
+    // connect to a domain name through the resolver cache
+    bool connectCached(bufferevent *outConn, const Address &address);
+
+    // connect to an ip address without the resolver
+    bool connectAddress(bufferevent *outConn, const Address &address);
+
+    // connect to a domain name through the dns resolver
+    bool connectResolved(bufferevent *outConn, const Address &address);
+
+    event_base                 *base_;      // event loop
+    std::vector<evconnlistener *> listeners_;
+    std::vector<std::string>   socketFiles_; // of the unix listeners, removed at the end
+    bool                       unixListeners_;
+    evdns_base                 *dns_;       // dns resolver    
+    std::unique_ptr<DnsCache>  dnsCache_;   // resolver cache
+    std::unique_ptr<UdpAssociations> udpAssociations_;
+    std::unique_ptr<RateLimiter> rateLimiter_;
+    std::unique_ptr<SourceLimiter> sourceLimiter_;
+    std::unique_ptr<ConnectHistory> connectHistory_;
+    std::unique_ptr<CredentialStore> credentials_;
+    std::unique_ptr<AuthBackend> authBackend_;
+    std::unique_ptr<LoopMonitor> loopMonitor_;
+    FramePool                  framePool_;
+    std::shared_ptr<const Acl> acl_;
+    bool                       fastOpen_;   // tcp fast open for outgoing connections
+    uint64_t                   accepted_;   // connections accepted
+    uint64_t                   relayed_;    // bytes passed to tune()
+    SocketOptions              socketOptions_;
 };
 
 #endif /* BASE_H */
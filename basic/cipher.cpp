@@ -1,6 +1,9 @@
 #include "cipher.hpp"
 
 #include <assert.h>
+#include <string.h>
+
+#include <algorithm>
 
 Cryptor::Cryptor(const std::string &key, const std::string &iv)
 {
@@ -16,6 +19,58 @@ Cryptor::Cryptor(const std::string &key, const std::string &iv)
     {
         iv_[i] = static_cast<Byte>(iv[i]);
     }    
+
+    cipher_ = std::make_shared<CbcCipher>(key_.data(), iv_.data());
+}
+
+/**
+   Seal the input of inConn into a frame, timed if the timing is on.
+   The instrumentation is chosen here once, not for every frame
+ **/
+template <class Framing>
+static bool sealFrame(CbcCipher &cipher, Framing &framing, bufferevent *inConn,
+                      bufferevent *outConn, ZeroCopySender *sender)
+{
+    if (FrameTimer::enabled())
+    {
+        FrameTimer timer;
+        return FrameRelay<CbcCipher, Framing, FrameTimer>(cipher, framing, timer)
+            .seal(inConn, outConn, sender);
+    }
+
+    NoInstrument none;
+    return FrameRelay<CbcCipher, Framing, NoInstrument>(cipher, framing, none)
+        .seal(inConn, outConn, sender);
+}
+
+// Open the whole frames of inConn, timed if the timing is on
+template <class Framing>
+static bool openFrames(CbcCipher &cipher, Framing &framing, bufferevent *inConn,
+                       bufferevent *outConn)
+{
+    if (FrameTimer::enabled())
+    {
+        FrameTimer timer;
+        return FrameRelay<CbcCipher, Framing, FrameTimer>(cipher, framing, timer)
+            .open(inConn, outConn);
+    }
+
+    NoInstrument none;
+    return FrameRelay<CbcCipher, Framing, NoInstrument>(cipher, framing, none)
+        .open(inConn, outConn);
+}
+
+void Cryptor::enableCompression(const FrameCompressor::Options &options)
+{
+    compression_ = std::make_shared<Compression>(options);
+}
+
+void Cryptor::renewCompression()
+{
+    if (compression_ != nullptr)
+    {
+        enableCompression(compression_->compressor.options());
+    }
 }
 
 Cryptor::BufferPtr Cryptor::encrypt(const Byte *in, std::size_t inLength) const
@@ -52,66 +107,152 @@ Cryptor::BufferPtr Cryptor::encrypt(const Byte *in, std::size_t inLength) const
 }
 
 Cryptor::BufferPtr Cryptor::decrypt(const Byte *in, std::size_t inLength) const
+{
+    auto result = BufferPtr(new Buffer(inLength, 0));
+
+    int length = decryptTo(in, inLength, result->data());
+    if (length < 0)
+    {
+        return nullptr;
+    }
+
+    result->resize(length);
+
+    return result;    
+}
+
+int Cryptor::decryptTo(const Byte *in, std::size_t inLength, Byte *out) const
 {
     ContextPtr ctx(EVP_CIPHER_CTX_new(), contextDeleter);
     if (ctx == nullptr)
     {
-        return nullptr;
+        return -1;
     }
         
     if(EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_cbc(), nullptr,
                           key_.data(), iv_.data()) != 1)
     {
-        return nullptr;
+        return -1;
     }
 
     int length1 = inLength;    
-    auto result = BufferPtr(new Buffer(length1, 0));
-
-    if(EVP_DecryptUpdate(ctx.get(), result->data(), &length1, in, inLength) != 1)
+    if(EVP_DecryptUpdate(ctx.get(), out, &length1, in, inLength) != 1)
     {
-        return nullptr;
+        return -1;
     }    
 
-    int length2 = result->size() - length1;    
-    if(EVP_DecryptFinal_ex(ctx.get(), result->data() + length1, &length2) != 1)
+    // the padding is checked here, the output of a block cipher never grows
+    int length2 = inLength - length1;    
+    if(EVP_DecryptFinal_ex(ctx.get(), out + length1, &length2) != 1)
     {
-        return nullptr;
+        return -1;
     }
 
-    result->resize(length1 + length2);
-
-    return result;    
+    return length1 + length2;
 }
 
-int Cryptor::lengthOfEncryptedData(const Buffer &buff) const
+Cryptor::BufferPtr Cryptor::openFrame(const Byte *in, std::size_t inLength) const
 {
-    int length = 0;
-    
-    std::copy(buff.begin(), buff.begin() + 4,
-              reinterpret_cast<unsigned char *>(&length));
+    auto decrypted = decrypt(in, inLength);
+    if (decrypted == nullptr || compression_ == nullptr)
+    {
+        return decrypted;
+    }
 
-    return ntohl(length);
+    auto result = BufferPtr(new Buffer());
+    if (!compression_->compressor.decompress(decrypted->data(), decrypted->size(), *result))
+    {
+        return nullptr;
+    }
+
+    return result;
 }
 
 Cryptor::BufferPtr Cryptor::decryptFrom(bufferevent *inConn) const
 {
     assert(inConn != nullptr);
     
-    int inBuffLength = lengthOfInput(inConn);
-    if (inBuffLength <= LEN_BYTES)
+    if (!hasFrame(inConn))
     {
         return nullptr;
     }
 
-    auto buff = readFrom(inConn);
-    int length = lengthOfEncryptedData(buff);
-    if (inBuffLength < length + LEN_BYTES)
+    // the frame is read again until it's removed, its context moved on already
+    if (compression_ != nullptr && compression_->peeked)
+    {
+        return BufferPtr(new Buffer(compression_->head));
+    }
+
+    // only the frame at the head is made contiguous, not the whole input
+    auto inBuff = bufferevent_get_input(inConn);
+    int lengthNetwork = 0;
+    evbuffer_copyout(inBuff, &lengthNetwork, LEN_BYTES);
+    std::size_t length = ntohl(lengthNetwork);
+
+    auto frame = evbuffer_pullup(inBuff, LEN_BYTES + length);
+    if (frame == nullptr)
     {
         return nullptr;
     }
 
-    return decrypt(buff.data() + 4, length);
+    auto result = openFrame(frame + LEN_BYTES, length);
+    if (result != nullptr && compression_ != nullptr)
+    {
+        compression_->head = *result;
+        compression_->peeked = true;
+    }
+
+    return result;
+}
+
+bool Cryptor::decryptFrom(bufferevent *inConn, Byte *out, std::size_t capacity,
+                          std::size_t &length) const
+{
+    assert(inConn != nullptr);
+
+    // a compressed frame is decompressed into a buffer of its own
+    if (compression_ != nullptr)
+    {
+        auto data = decryptFrom(inConn);
+        if (data == nullptr || data->size() > capacity)
+        {
+            return false;
+        }
+
+        length = std::copy(data->begin(), data->end(), out) - out;
+        return true;
+    }
+
+    if (!hasFrame(inConn))
+    {
+        return false;
+    }
+
+    auto inBuff = bufferevent_get_input(inConn);
+
+    int lengthNetwork = 0;
+    evbuffer_copyout(inBuff, &lengthNetwork, LEN_BYTES);
+    std::size_t frameLength = ntohl(lengthNetwork);
+    if (frameLength > capacity)
+    {
+        return false;
+    }
+
+    // a frame in one chain of the buffer is decrypted where it is
+    auto frame = evbuffer_pullup(inBuff, LEN_BYTES + frameLength);
+    if (frame == nullptr)
+    {
+        return false;
+    }
+
+    int decrypted = decryptTo(frame + LEN_BYTES, frameLength, out);
+    if (decrypted < 0)
+    {
+        return false;
+    }
+
+    length = decrypted;
+    return true;
 }
 
 bool Cryptor::decryptTransfer(bufferevent *inConn, bufferevent *outConn) const
@@ -119,76 +260,79 @@ bool Cryptor::decryptTransfer(bufferevent *inConn, bufferevent *outConn) const
     assert(inConn != nullptr);
     assert(outConn != nullptr);
 
-    int inBuffLength = lengthOfInput(inConn);
-    if (inBuffLength <= LEN_BYTES)
+    if (compression_ == nullptr)
     {
-        return false;
+        RawFrames framing;
+        return openFrames(*cipher_, framing, inConn, outConn);
     }
 
-    while(lengthOfInput(inConn) > 0)
+    // a frame peeked at already moved its context on, it's taken as it is
+    if (compression_->peeked && hasFrame(inConn))
     {
-        auto buff = readFrom(inConn);
-        int length = lengthOfEncryptedData(buff);
-        if (inBuffLength < length + LEN_BYTES)
-        {
-            return false;
-        }
-        
-        auto decrypted = decrypt(buff.data() + LEN_BYTES, length);
-        if (decrypted == nullptr)
-        {
-            return false;
-        }
-        
-        if (bufferevent_write(outConn, decrypted->data(), decrypted->size()) == -1)
+        auto &head = compression_->head;
+        if (bufferevent_write(outConn, head.data(), head.size()) == -1)
         {
             return false;
         }
-        
-        evbuffer_drain(bufferevent_get_input(inConn), length + LEN_BYTES); 
+
+        removeFrom(inConn);
     }
-    
-    return true;    
+
+    return openFrames(*cipher_, compression_->frames, inConn, outConn);
 }
 
-bool Cryptor::encryptTransfer(bufferevent *inConn, bufferevent *outConn) const
+bool Cryptor::encryptTransfer(bufferevent *inConn, bufferevent *outConn,
+                              ZeroCopySender *sender) const
 {
     assert(inConn != nullptr);
     assert(outConn != nullptr);
-    
-    auto buff = readFrom(inConn);
-    if (!encryptTo(outConn, buff.data(), buff.size()))
+
+    if (compression_ == nullptr)
     {
-        return false;
+        RawFrames framing;
+        return sealFrame(*cipher_, framing, inConn, outConn, sender);
     }
-    
-    evbuffer_drain(bufferevent_get_input(inConn), buff.size());
-    
-    return true;
+
+    return sealFrame(*cipher_, compression_->frames, inConn, outConn, sender);
 }
 
 bool Cryptor::encryptTo(bufferevent *outConn, const Byte *in, std::size_t inLength) const
 {
     assert(outConn != nullptr);
 
-    auto encrypted = encrypt(in, inLength);
-    if (encrypted == nullptr)
+    Buffer packed;
+    if (compression_ != nullptr)
+    {
+        if (!compression_->compressor.compress(in, inLength, packed))
+        {
+            return false;
+        }
+
+        in = packed.data();
+        inLength = packed.size();
+    }
+
+    // the length and the sealed data go straight into the output
+    auto output = bufferevent_get_output(outConn);
+    evbuffer_iovec space;
+    if (evbuffer_reserve_space(output, LEN_BYTES + inLength + CbcCipher::OVERHEAD,
+                               &space, 1) != 1)
     {
         return false;
     }
 
-    int size = encrypted->size();
-    int sizeNetwork = htonl(size);
-    
-    bufferevent_write(outConn, reinterpret_cast<unsigned char *>(&sizeNetwork),
-                      LEN_BYTES);
-    
-    if (bufferevent_write(outConn, encrypted->data(), encrypted->size()) == -1)
+    auto frame = static_cast<Byte *>(space.iov_base);
+    int size = cipher_->seal(in, inLength, frame + LEN_BYTES);
+    if (size < 0)
     {
         return false;
     }
-    
-    return true;
+
+    int sizeNetwork = htonl(size);
+    memcpy(frame, &sizeNetwork, LEN_BYTES);
+
+    space.iov_len = LEN_BYTES + size;
+    return evbuffer_commit_space(output, &space, 1) == 0;
 }
 
 
@@ -205,22 +349,61 @@ Cryptor::Buffer Cryptor::readFrom(bufferevent *inConn) const
     return buff;
 }
 
+bool Cryptor::hasFrame(bufferevent *inConn) const
+{
+    assert(inConn != nullptr);
+
+    auto inBuff = bufferevent_get_input(inConn);
+    if (evbuffer_get_length(inBuff) <= LEN_BYTES)
+    {
+        return false;
+    }
+
+    int length = 0;
+    evbuffer_copyout(inBuff, &length, LEN_BYTES);
+
+    return evbuffer_get_length(inBuff) >= ntohl(length) + LEN_BYTES;
+}
+
 void Cryptor::removeFrom(bufferevent *inConn) const
 {
     assert(inConn != nullptr);
     
-    int inBuffLength = lengthOfInput(inConn);
-    if (inBuffLength <= LEN_BYTES)
+    if (!hasFrame(inConn))
     {
         return;
     }
 
-    auto buff = readFrom(inConn);
-    int length = lengthOfEncryptedData(buff);
-    if (inBuffLength < length + LEN_BYTES)
+    auto inBuff = bufferevent_get_input(inConn);
+    int lengthNetwork = 0;
+    evbuffer_copyout(inBuff, &lengthNetwork, LEN_BYTES);
+    evbuffer_drain(inBuff, ntohl(lengthNetwork) + LEN_BYTES);
+
+    if (compression_ != nullptr)
     {
-        return;
+        compression_->peeked = false;
+    }
+}
+
+bool Cryptor::sealBlock(const Byte *in, std::size_t inLength, Byte *out) const
+{
+    assert(inLength < BLOCK_SIZE);
+
+    return cipher_->seal(in, inLength, out) == BLOCK_SIZE;
+}
+
+bool Cryptor::openBlock(const Byte *in, Byte *out, std::size_t &length) const
+{
+    // openssl writes up to a block past the plain text
+    Byte block[2 * BLOCK_SIZE];
+    int opened = cipher_->open(in, BLOCK_SIZE, block);
+    if (opened < 0)
+    {
+        return false;
     }
 
-    evbuffer_drain(bufferevent_get_input(inConn), length + LEN_BYTES);
+    length = opened;
+    memcpy(out, block, length);
+
+    return true;
 }
@@ -1,6 +1,10 @@
 #ifndef CIPHER_H
 #define CIPHER_H
 
+#include "compress.hpp"
+#include "relay.hpp"
+#include "zerocopy.hpp"
+
 #include <array>
 #include <memory>
 #include <vector>
@@ -35,12 +39,28 @@ public:
     
     Cryptor(const Key &key, const IV &iv)
         : key_(key),
-          iv_(iv)
+          iv_(iv),
+          cipher_(std::make_shared<CbcCipher>(key_.data(), iv_.data()))
     {    
     }        
 
     Cryptor(const std::string &key, const std::string &iv);
 
+    /**
+       Compress the frames before they're encrypted, the peer must
+       compress as well. The contexts are shared by the copies of
+       the cryptor, a connection needs contexts of its own
+     **/
+    void enableCompression(const FrameCompressor::Options &options);
+
+    // Give this copy contexts of its own if it compresses
+    void renewCompression();
+
+    bool compressing() const
+    {
+        return compression_ != nullptr;
+    }
+
     /**
        Encrypt data - return the encrypted data on success, nullptr on failed
      **/
@@ -58,10 +78,11 @@ public:
     bool decryptTransfer(bufferevent *inConn, bufferevent *outConn) const;
 
     /**
-       Encrypt data and transfer data from inConn to outConn,
-       return true on success, false on failed
+       Encrypt data and transfer data from inConn to outConn, through
+       sender if it isn't null, return true on success, false on failed
      **/
-    bool encryptTransfer(bufferevent *inConn, bufferevent *outConn) const;
+    bool encryptTransfer(bufferevent *inConn, bufferevent *outConn,
+                         ZeroCopySender *sender = nullptr) const;
 
     /**
        Read data from conn and decrypt the data,
@@ -69,6 +90,14 @@ public:
      **/
     BufferPtr decryptFrom(bufferevent *conn) const;
 
+    /**
+       Decrypt the frame at the head of the input of conn into out,
+       which holds capacity bytes, without copying the input. Return
+       false if there's no whole frame or it doesn't fit
+     **/
+    bool decryptFrom(bufferevent *conn, Byte *out, std::size_t capacity,
+                     std::size_t &length) const;
+
     /**
        Encrypt data and send the data to conn,
        return true on success, nullptr on failed
@@ -84,18 +113,50 @@ public:
        Remove data from conn and return the data
      **/
     void removeFrom(bufferevent *conn) const;
+
+    /**
+       Whether a whole encrypted frame is in the input of conn
+     **/
+    bool hasFrame(bufferevent *conn) const;
+
+    /**
+       Encrypt less than BLOCK_SIZE bytes into the one block at out,
+       without a length in front, return true on success
+     **/
+    bool sealBlock(const Byte *in, std::size_t inLength, Byte *out) const;
+
+    /**
+       Decrypt the block at in into out, which holds BLOCK_SIZE bytes,
+       return false if its padding is wrong
+     **/
+    bool openBlock(const Byte *in, Byte *out, std::size_t &length) const;
     
 private:
-    int lengthOfEncryptedData(const Buffer &buff) const;
-
-    int lengthOfInput(bufferevent *inConn) const
+    struct Compression
     {
-        auto inBuff = bufferevent_get_input(inConn);
-        return evbuffer_get_length(inBuff);    
-    }
-    
-    Key  key_;
-    IV   iv_;
+        explicit Compression(const FrameCompressor::Options &options)
+            : compressor(options),
+              frames(compressor),
+              peeked(false)
+        {
+        }
+
+        FrameCompressor  compressor;
+        CompressedFrames frames;    // framing of the relay
+        Buffer           head;      // the frame at the head of the input, decompressed
+        bool             peeked;    // head is valid until the frame is removed
+    };
+
+    // Decrypt into out, which holds inLength bytes, return the length or -1
+    int decryptTo(const Byte *in, std::size_t inLength, Byte *out) const;
+
+    // Decrypt the frame of length bytes at in, and decompress it
+    BufferPtr openFrame(const Byte *in, std::size_t inLength) const;
+
+    Key                           key_;
+    IV                            iv_;
+    std::shared_ptr<CbcCipher>    cipher_;         // contexts of the relay, shared by the copies
+    std::shared_ptr<Compression>  compression_;
 };
 
 #endif /* CIPHER_H */
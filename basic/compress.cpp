@@ -0,0 +1,263 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "compress.hpp"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+constexpr unsigned char  FrameCompressor::RAW;
+constexpr unsigned char  FrameCompressor::DEFLATED;
+constexpr std::size_t    FrameCompressor::SAMPLE_SIZE;
+constexpr std::size_t    FrameCompressor::MAX_FRAME;
+
+// A small window keeps the contexts of many tunnels cheap, about 32KB a deflater
+static constexpr int WINDOW_BITS = 12;
+static constexpr int MEMORY_LEVEL = 5;
+
+// A flush ends a deflated frame with these bytes, they're left out on the wire
+static const unsigned char FLUSH_TAIL[4] = {0x00, 0x00, 0xff, 0xff};
+
+// Bytes of each slice of a sample, the slices are spread over the frame
+static constexpr std::size_t SLICE_SIZE = 256;
+
+static FrameCompressor::Stats stats;
+
+static uint64_t nowMicros()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+FrameCompressor::FrameCompressor(const Options &options)
+    : options_(options),
+      deflating_(false),
+      inflating_(false)
+{
+    memset(&deflater_, 0, sizeof(deflater_));
+    memset(&inflater_, 0, sizeof(inflater_));
+}
+
+FrameCompressor::~FrameCompressor()
+{
+    if (deflating_)
+    {
+        deflateEnd(&deflater_);
+    }
+
+    if (inflating_)
+    {
+        inflateEnd(&inflater_);
+    }
+}
+
+const FrameCompressor::Stats &FrameCompressor::totals()
+{
+    return stats;
+}
+
+double FrameCompressor::entropy(const unsigned char *data, std::size_t length)
+{
+    if (length == 0)
+    {
+        return 0.0;
+    }
+
+    /**
+       Four tables let the increments of neighbouring bytes run in
+       parallel, a run of one byte would otherwise stall on the same
+       counter every time
+     **/
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+
+    auto count = [&counts](const unsigned char *p, std::size_t n) {
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            counts[0][p[i]]++;
+            counts[1][p[i + 1]]++;
+            counts[2][p[i + 2]]++;
+            counts[3][p[i + 3]]++;
+        }
+        for (; i < n; i++)
+        {
+            counts[0][p[i]]++;
+        }
+    };
+
+    std::size_t sampled = 0;
+    if (length <= SAMPLE_SIZE)
+    {
+        count(data, length);
+        sampled = length;
+    }
+    else
+    {
+        // slices spread over the frame see its head and its body alike
+        auto slices = SAMPLE_SIZE / SLICE_SIZE;
+        auto stride = (length - SLICE_SIZE) / (slices - 1);
+        for (std::size_t i = 0; i < slices; i++)
+        {
+            count(data + i * stride, SLICE_SIZE);
+        }
+        sampled = slices * SLICE_SIZE;
+    }
+
+    double sum = 0.0;
+    for (int byte = 0; byte < 256; byte++)
+    {
+        auto n = counts[0][byte] + counts[1][byte] + counts[2][byte] + counts[3][byte];
+        if (n != 0)
+        {
+            sum += n * log2(static_cast<double>(n));
+        }
+    }
+
+    return std::max(0.0, log2(static_cast<double>(sampled)) - sum / sampled);
+}
+
+bool FrameCompressor::compressible(const unsigned char *data, std::size_t length) const
+{
+    return length >= options_.minSize && entropy(data, length) <= options_.maxEntropy;
+}
+
+bool FrameCompressor::compress(const unsigned char *data, std::size_t length, Buffer &out)
+{
+    stats.frames++;
+    stats.bytesIn += length;
+
+    if (!compressible(data, length))
+    {
+        out.resize(length + 1);
+        out[0] = RAW;
+        memcpy(out.data() + 1, data, length);
+
+        stats.bytesOut += out.size();
+        return true;
+    }
+
+    auto start = nowMicros();
+    if (!deflating_)
+    {
+        if (deflateInit2(&deflater_, options_.level, Z_DEFLATED, -WINDOW_BITS,
+                         MEMORY_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+        deflating_ = true;
+    }
+
+    // a bound of the deflated bytes, with room for the flush
+    out.resize(1 + deflateBound(&deflater_, length) + 16);
+    out[0] = DEFLATED;
+
+    deflater_.next_in = const_cast<unsigned char *>(data);
+    deflater_.avail_in = static_cast<uInt>(length);
+    deflater_.next_out = out.data() + 1;
+    deflater_.avail_out = static_cast<uInt>(out.size() - 1);
+
+    if (deflate(&deflater_, Z_SYNC_FLUSH) != Z_OK ||
+        deflater_.avail_in != 0 || deflater_.avail_out == 0)
+    {
+        return false;
+    }
+
+    auto written = out.size() - deflater_.avail_out;
+    if (written >= 1 + sizeof(FLUSH_TAIL) &&
+        memcmp(out.data() + written - sizeof(FLUSH_TAIL), FLUSH_TAIL, sizeof(FLUSH_TAIL)) == 0)
+    {
+        written -= sizeof(FLUSH_TAIL);
+    }
+    out.resize(written);
+
+    stats.deflated++;
+    stats.bytesOut += out.size();
+    stats.deflateMicros += nowMicros() - start;
+
+    return true;
+}
+
+bool FrameCompressor::decompress(const unsigned char *frame, std::size_t length, Buffer &out)
+{
+    if (length == 0)
+    {
+        return false;
+    }
+
+    if (frame[0] == RAW)
+    {
+        out.assign(frame + 1, frame + length);
+        return true;
+    }
+    else if (frame[0] != DEFLATED)
+    {
+        return false;
+    }
+
+    auto start = nowMicros();
+    if (!inflating_)
+    {
+        if (inflateInit2(&inflater_, -WINDOW_BITS) != Z_OK)
+        {
+            return false;
+        }
+        inflating_ = true;
+    }
+
+    Buffer input(frame + 1, frame + length);
+    input.insert(input.end(), FLUSH_TAIL, FLUSH_TAIL + sizeof(FLUSH_TAIL));
+
+    inflater_.next_in = input.data();
+    inflater_.avail_in = static_cast<uInt>(input.size());
+
+    out.resize(std::max<std::size_t>(input.size() * 4, 4096));
+    std::size_t produced = 0;
+
+    while (true)
+    {
+        inflater_.next_out = out.data() + produced;
+        inflater_.avail_out = static_cast<uInt>(out.size() - produced);
+
+        auto status = inflate(&inflater_, Z_SYNC_FLUSH);
+        produced = out.size() - inflater_.avail_out;
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+        {
+            return false;
+        }
+
+        // the whole frame is in once the input is used up and the output has room
+        if (inflater_.avail_in == 0 && inflater_.avail_out != 0)
+        {
+            break;
+        }
+
+        if (status == Z_BUF_ERROR && inflater_.avail_out != 0)
+        {
+            return false;
+        }
+
+        if (out.size() >= MAX_FRAME)
+        {
+            return false;
+        }
+        out.resize(std::min(out.size() * 2, MAX_FRAME));
+    }
+
+    out.resize(produced);
+    stats.inflateMicros += nowMicros() - start;
+
+    return true;
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <zlib.h>
+
+/**
+   Compress the frames of one connection before they're encrypted.
+   A frame starts with a flag byte, RAW or DEFLATED, and a frame is
+   deflated only if the entropy of a sample says it will shrink, so
+   TLS, video and the like cost a histogram rather than a deflate.
+
+   The deflated frames of each direction are one zlib stream flushed
+   at every frame, the peer inflates them in the same order and the
+   later frames refer back to the earlier ones. The contexts are set
+   up by the first frame which needs them
+ **/
+class FrameCompressor
+{
+public:
+    using Buffer = std::vector<unsigned char>;
+
+    static constexpr unsigned char  RAW         = 0x00;
+    static constexpr unsigned char  DEFLATED    = 0x01;
+    static constexpr std::size_t    SAMPLE_SIZE = 4096;               // bytes of a frame measured
+    static constexpr std::size_t    MAX_FRAME   = 16 * 1024 * 1024;   // largest inflated frame
+
+    struct Options
+    {
+        Options()
+            : level(1),
+              minSize(128),
+              maxEntropy(7.0)
+        {
+        }
+
+        int          level;       // zlib level, 1 is the fastest
+        std::size_t  minSize;     // smaller frames are sent raw
+        double       maxEntropy;  // bits per byte above which a frame is sent raw
+    };
+
+    struct Stats
+    {
+        uint64_t  frames;        // frames written
+        uint64_t  deflated;
+        uint64_t  bytesIn;       // bytes of the frames written
+        uint64_t  bytesOut;      // bytes of them after compression
+        uint64_t  deflateMicros;
+        uint64_t  inflateMicros;
+    };
+
+    explicit FrameCompressor(const Options &options);
+    ~FrameCompressor();
+
+    // disable the copy operations
+    FrameCompressor(const FrameCompressor &) = delete;
+    FrameCompressor &operator=(const FrameCompressor &) = delete;
+
+    /**
+       Write a frame of data to out, deflated or not,
+       return false if zlib fails
+     **/
+    bool compress(const unsigned char *data, std::size_t length, Buffer &out);
+
+    /**
+       Read a frame of the peer into out, return false if it's
+       malformed. The frames must be given in the order they came
+     **/
+    bool decompress(const unsigned char *frame, std::size_t length, Buffer &out);
+
+    // Entropy in bits per byte of a sample of data, 0 to 8
+    static double entropy(const unsigned char *data, std::size_t length);
+
+    // Counters of all the compressors of the process
+    static const Stats &totals();
+
+    const Options &options() const
+    {
+        return options_;
+    }
+
+private:
+    // Whether a frame of data is worth deflating
+    bool compressible(const unsigned char *data, std::size_t length) const;
+
+    Options   options_;
+    z_stream  deflater_;
+    z_stream  inflater_;
+    bool      deflating_;     // deflater_ is set up
+    bool      inflating_;     // inflater_ is set up
+};
+
+#endif /* COMPRESS_H */
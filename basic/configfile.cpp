@@ -0,0 +1,196 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "configfile.hpp"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+static const char *SPACES = " \t\r";
+
+// Remove the blanks around s
+static std::string trim(const std::string &s)
+{
+    auto first = s.find_first_not_of(SPACES);
+    if (first == std::string::npos)
+    {
+        return std::string();
+    }
+
+    auto last = s.find_last_not_of(SPACES);
+    return s.substr(first, last - first + 1);
+}
+
+std::unique_ptr<ConfigFile> ConfigFile::build(const char *data, std::size_t length,
+                                              std::string &error)
+{
+    std::unique_ptr<ConfigFile> file(new ConfigFile());
+
+    std::istringstream text(std::string(data, length));
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(text, line))
+    {
+        lineNumber++;
+
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+        {
+            line.resize(comment);
+        }
+
+        line = trim(line);
+        if (line.empty())
+        {
+            continue;
+        }
+
+        auto equal = line.find('=');
+        auto name = trim(line.substr(0, std::min(equal, line.size())));
+        if (equal == std::string::npos || name.empty() ||
+            name.find_first_of(SPACES) != std::string::npos)
+        {
+            error = "malformed line " + std::to_string(lineNumber);
+            return nullptr;
+        }
+
+        if (!file->values_.emplace(name, trim(line.substr(equal + 1))).second)
+        {
+            error = name + " is set twice on line " + std::to_string(lineNumber);
+            return nullptr;
+        }
+    }
+
+    return file;
+}
+
+std::unique_ptr<ConfigFile> ConfigFile::load(const std::string &path, std::string &error)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        error = path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    std::stringstream text;
+    text << in.rdbuf();
+    auto data = text.str();
+
+    auto file = build(data.data(), data.size(), error);
+    if (file == nullptr)
+    {
+        error = path + ": " + error;
+    }
+
+    return file;
+}
+
+bool ConfigFile::get(const std::string &name, std::string &value, std::string &error) const
+{
+    auto found = values_.find(name);
+    if (found != values_.end())
+    {
+        value = found->second;
+    }
+
+    return true;
+}
+
+bool ConfigFile::get(const std::string &name, bool &value, std::string &error) const
+{
+    auto found = values_.find(name);
+    if (found == values_.end())
+    {
+        return true;
+    }
+
+    auto &text = found->second;
+    if (text == "true" || text == "yes" || text == "1")
+    {
+        value = true;
+    }
+    else if (text == "false" || text == "no" || text == "0")
+    {
+        value = false;
+    }
+    else
+    {
+        error = name + " expects true or false";
+        return false;
+    }
+
+    return true;
+}
+
+bool ConfigFile::get(const std::string &name, int64_t &value, std::string &error) const
+{
+    auto found = values_.find(name);
+    if (found == values_.end())
+    {
+        return true;
+    }
+
+    auto &text = found->second;
+    char *end = nullptr;
+    errno = 0;
+    auto parsed = strtoll(text.c_str(), &end, 10);
+
+    if (text.empty() || *end != '\0' || errno == ERANGE)
+    {
+        error = name + " expects an integer";
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
+
+bool ConfigFile::get(const std::string &name, double &value, std::string &error) const
+{
+    auto found = values_.find(name);
+    if (found == values_.end())
+    {
+        return true;
+    }
+
+    auto &text = found->second;
+    char *end = nullptr;
+    errno = 0;
+    auto parsed = strtod(text.c_str(), &end);
+
+    if (text.empty() || *end != '\0' || errno == ERANGE || !isfinite(parsed))
+    {
+        error = name + " expects a number";
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
+
+std::string ConfigFile::unknown(const std::vector<std::string> &known) const
+{
+    for (auto &value : values_)
+    {
+        if (std::find(known.begin(), known.end(), value.first) == known.end())
+        {
+            return value.first;
+        }
+    }
+
+    return std::string();
+}
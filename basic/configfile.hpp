@@ -0,0 +1,68 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef CONFIGFILE_H
+#define CONFIGFILE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+   The settings of a configuration file, lines of
+     name = value
+   where name is the name of a command line flag, empty lines
+   and lines starting with '#' are skipped
+ **/
+class ConfigFile
+{
+public:
+    /**
+       Parse the text of a configuration file, return nullptr
+       and set error if a line is malformed or a name repeats
+     **/
+    static std::unique_ptr<ConfigFile> build(const char *data, std::size_t length,
+                                             std::string &error);
+
+    // Parse a configuration file
+    static std::unique_ptr<ConfigFile> load(const std::string &path, std::string &error);
+
+    // Whether the file sets name
+    bool has(const std::string &name) const
+    {
+        return values_.find(name) != values_.end();
+    }
+
+    /**
+       Read the value of name, value is left alone if the file doesn't
+       set it. Return false and set error if the value is malformed
+     **/
+    bool get(const std::string &name, std::string &value, std::string &error) const;
+    bool get(const std::string &name, bool &value, std::string &error) const;
+    bool get(const std::string &name, int64_t &value, std::string &error) const;
+    bool get(const std::string &name, double &value, std::string &error) const;
+
+    // Return the first name which isn't one of known, empty if there's none
+    std::string unknown(const std::vector<std::string> &known) const;
+
+    std::size_t size() const
+    {
+        return values_.size();
+    }
+
+private:
+    ConfigFile() = default;
+
+    std::map<std::string, std::string>  values_;
+};
+
+#endif /* CONFIGFILE_H */
@@ -0,0 +1,153 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "connecthistory.hpp"
+
+#include <errno.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+ConnectHistory::Entry::Entry()
+    : latency(0),
+      deviation(0),
+      measured(false),
+      failures(0),
+      error(0),
+      failedAt(0),
+      used(0)
+{
+}
+
+ConnectHistory::ConnectHistory(const Options &options)
+    : options_(options),
+      stats_()
+{
+    options_.minTimeout = std::min(options_.minTimeout, options_.maxTimeout);
+}
+
+bool ConnectHistory::isDestinationError(int err)
+{
+    return err == ECONNREFUSED || err == EHOSTUNREACH ||
+        err == ENETUNREACH || err == ETIMEDOUT;
+}
+
+bool ConnectHistory::failing(const std::string &destination, long now, int &err)
+{
+    auto iter = entries_.find(destination);
+    if (iter == entries_.end())
+    {
+        return false;
+    }
+
+    auto &entry = iter->second;
+    if (entry.failures < options_.failures || now - entry.failedAt >= options_.failWindow)
+    {
+        return false;
+    }
+
+    err = entry.error;
+    stats_.fastFailures++;
+
+    return true;
+}
+
+long ConnectHistory::timeout(const std::string &destination) const
+{
+    auto iter = entries_.find(destination);
+    if (iter == entries_.end() || !iter->second.measured)
+    {
+        return options_.maxTimeout;
+    }
+
+    auto &entry = iter->second;
+    auto estimate = static_cast<long>(ceil(entry.latency + 4 * entry.deviation));
+
+    return std::max(options_.minTimeout, std::min(estimate, options_.maxTimeout));
+}
+
+void ConnectHistory::onConnected(const std::string &destination, long latency, long now)
+{
+    stats_.connected++;
+
+    auto &entry = this->entry(destination, now);
+    entry.failures = 0;
+
+    double sample = std::max(latency, 0L);
+    if (!entry.measured)
+    {
+        entry.latency = sample;
+        entry.deviation = sample / 2;
+        entry.measured = true;
+        return;
+    }
+
+    // the gains of the retransmission timer of TCP, RFC 6298
+    entry.deviation += (fabs(entry.latency - sample) - entry.deviation) / 4;
+    entry.latency += (sample - entry.latency) / 8;
+}
+
+void ConnectHistory::onFailed(const std::string &destination, int err, long now)
+{
+    stats_.failed++;
+    if (err == ETIMEDOUT)
+    {
+        stats_.timeouts++;
+    }
+
+    // no file descriptors or a denied address say nothing of the destination
+    if (!isDestinationError(err))
+    {
+        return;
+    }
+
+    auto &entry = this->entry(destination, now);
+    entry.failures++;
+    entry.error = err;
+    entry.failedAt = now;
+}
+
+ConnectHistory::Entry &ConnectHistory::entry(const std::string &destination, long now)
+{
+    auto iter = entries_.find(destination);
+    if (iter == entries_.end())
+    {
+        if (entries_.size() >= options_.maxEntries && !entries_.empty())
+        {
+            std::vector<long> used;
+            used.reserve(entries_.size());
+            for (auto &pair : entries_)
+            {
+                used.push_back(pair.second.used);
+            }
+
+            auto middle = used.begin() + used.size() / 2;
+            std::nth_element(used.begin(), middle, used.end());
+            auto oldest = *middle;
+
+            for (auto each = entries_.begin(); each != entries_.end(); )
+            {
+                if (each->second.used <= oldest)
+                {
+                    each = entries_.erase(each);
+                }
+                else
+                {
+                    ++each;
+                }
+            }
+        }
+
+        iter = entries_.emplace(destination, Entry()).first;
+    }
+
+    iter->second.used = now;
+    return iter->second;
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef CONNECTHISTORY_H
+#define CONNECTHISTORY_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+/**
+   The recent connections to each destination, a name or an address
+   with its port as the clients asked for it.
+
+   A destination whose last failures connections in a row failed
+   within failWindow fails fast, the clients get the error of the
+   last one at once instead of waiting for the kernel to give up.
+   The first connection after the window goes through again.
+
+   The deadline of a connection is estimated from the latencies of
+   the connections made, as TCP does with its retransmission timeout:
+   the smoothed latency plus four times its mean deviation, within
+   [minTimeout, maxTimeout]. A destination without a history gets
+   maxTimeout
+ **/
+class ConnectHistory
+{
+public:
+    struct Options
+    {
+        Options()
+            : failures(3),
+              failWindow(5000),
+              minTimeout(2000),
+              maxTimeout(10000),
+              maxEntries(10000)
+        {
+        }
+
+        int          failures;      // in a row before a destination fails fast
+        long         failWindow;    // milliseconds
+        long         minTimeout;    // milliseconds
+        long         maxTimeout;    // milliseconds
+        std::size_t  maxEntries;
+    };
+
+    struct Stats
+    {
+        uint64_t  connected;
+        uint64_t  failed;
+        uint64_t  timeouts;
+        uint64_t  fastFailures;     // answered from the history
+    };
+
+    explicit ConnectHistory(const Options &options);
+
+    // disable the copy operations
+    ConnectHistory(const ConnectHistory &) = delete;
+    ConnectHistory &operator=(const ConnectHistory &) = delete;
+
+    /**
+       Whether a connection to destination fails fast at now, in
+       milliseconds, err is the error of the last one then
+     **/
+    bool failing(const std::string &destination, long now, int &err);
+
+    // The milliseconds a connection to destination may take
+    long timeout(const std::string &destination) const;
+
+    // A connection to destination was made after latency milliseconds
+    void onConnected(const std::string &destination, long latency, long now);
+
+    // A connection to destination failed with err, ETIMEDOUT past its deadline
+    void onFailed(const std::string &destination, int err, long now);
+
+    Stats stats() const
+    {
+        return stats_;
+    }
+
+    std::size_t size() const
+    {
+        return entries_.size();
+    }
+
+private:
+    struct Entry
+    {
+        Entry();
+
+        double  latency;        // smoothed, milliseconds
+        double  deviation;      // mean deviation of the latency
+        bool    measured;       // a connection was made
+        int     failures;       // in a row
+        int     error;          // of the last failure
+        long    failedAt;       // milliseconds
+        long    used;           // milliseconds
+    };
+
+    // Whether err tells about the destination rather than this host
+    static bool isDestinationError(int err);
+
+    // The entry of destination, a full table drops the half used the longest ago
+    Entry &entry(const std::string &destination, long now);
+
+    Options                                 options_;
+    Stats                                   stats_;
+    std::unordered_map<std::string, Entry>  entries_;
+};
+
+#endif /* CONNECTHISTORY_H */
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "coroutine.hpp"
+
+#include <assert.h>
+
+#include <new>
+
+constexpr int Coroutine::DONE;
+
+FramePool::~FramePool()
+{
+    // the objects of the loop must be gone before it
+    assert(allocated_ == 0);
+
+    while (head_ != nullptr)
+    {
+        auto next = head_->next;
+        ::operator delete(head_);
+        head_ = next;
+    }
+}
+
+void *FramePool::allocate(std::size_t size)
+{
+    assert(size_ == 0 || size_ == size);
+    size_ = size;
+
+    Header *header;
+    if (head_ != nullptr)
+    {
+        header = head_;
+        head_ = head_->next;
+        free_--;
+    }
+    else
+    {
+        header = static_cast<Header *>(::operator new(sizeof(Header) + size));
+    }
+
+    header->pool = this;
+    allocated_++;
+
+    return header + 1;
+}
+
+void FramePool::release(void *block)
+{
+    if (block == nullptr)
+    {
+        return;
+    }
+
+    auto header = static_cast<Header *>(block) - 1;
+    auto pool = header->pool;
+
+    pool->allocated_--;
+    header->next = pool->head_;
+    pool->head_ = header;
+    pool->free_++;
+}
@@ -0,0 +1,135 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <cstddef>
+
+/**
+   A stackless coroutine, the point to resume a function at.
+
+   The body of the function goes between COROUTINE_BEGIN and
+   COROUTINE_END, COROUTINE_AWAIT returns from the function until
+   its condition holds, the next call starts again at the condition.
+   Nothing on the stack survives an await, so the state lives in the
+   members of the object and the body declares no local variables,
+   the steps between the awaits are functions of their own:
+
+       void Session::run()
+       {
+           COROUTINE_BEGIN(coroutine_);
+           COROUTINE_AWAIT(coroutine_, readMessage());
+           ...
+           COROUTINE_END(coroutine_);
+       }
+ **/
+class Coroutine
+{
+public:
+    static constexpr int DONE = -1;
+
+    Coroutine()
+        : point_(0)
+    {
+    }
+
+    bool done() const
+    {
+        return point_ == DONE;
+    }
+
+    // End the coroutine, later calls return at once
+    void finish()
+    {
+        point_ = DONE;
+    }
+
+    int  point_;      // the line of the await to resume at, 0 at the start
+};
+
+#define COROUTINE_BEGIN(coroutine)                              \
+    switch ((coroutine).point_)                                 \
+    {                                                           \
+    case Coroutine::DONE:                                       \
+        return;                                                 \
+    case 0:
+
+#define COROUTINE_AWAIT(coroutine, ready)                       \
+    do                                                          \
+    {                                                           \
+        (coroutine).point_ = __LINE__;                          \
+    case __LINE__:                                              \
+        if (!(ready))                                           \
+        {                                                       \
+            return;                                             \
+        }                                                       \
+    } while (false)
+
+#define COROUTINE_END(coroutine)                                \
+    }                                                           \
+    (coroutine).finish()
+
+/**
+   Blocks of one size for the objects of the coroutines of an event
+   loop, the size of the first block. A freed block is kept for the
+   next one, so the pool holds as many as were alive at once, and
+   a block knows its pool to go back to
+ **/
+class FramePool
+{
+public:
+    FramePool()
+        : size_(0),
+          allocated_(0),
+          free_(0),
+          head_(nullptr)
+    {
+    }
+
+    ~FramePool();
+
+    // disable the copy operations
+    FramePool(const FramePool &) = delete;
+    FramePool &operator=(const FramePool &) = delete;
+
+    // Return a block of size bytes, size is the same every time
+    void *allocate(std::size_t size);
+
+    // Give a block of a pool back to its pool
+    static void release(void *block);
+
+    // Blocks handed out and not released
+    std::size_t allocated() const
+    {
+        return allocated_;
+    }
+
+    // Blocks kept for reuse
+    std::size_t free() const
+    {
+        return free_;
+    }
+
+private:
+    // a block starts with its pool, or the next free block, the object follows aligned
+    union Header
+    {
+        FramePool         *pool;
+        Header            *next;
+        std::max_align_t  align;
+    };
+
+    std::size_t  size_;
+    std::size_t  allocated_;
+    std::size_t  free_;
+    Header       *head_;      // the free blocks
+};
+
+#endif /* COROUTINE_H */
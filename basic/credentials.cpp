@@ -0,0 +1,579 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "credentials.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+constexpr std::size_t CredentialTable::SALT_BYTES;
+constexpr std::size_t CredentialTable::HASH_BYTES;
+constexpr int         CredentialStore::ITERATIONS;
+constexpr std::size_t CredentialStore::MAX_PENDING;
+
+static const char ALGORITHM[] = "pbkdf2-sha256";
+
+// Usernames of SOCKS5 are at most this long
+static constexpr std::size_t MAX_NAME = 255;
+
+static bool pbkdf2(const std::string &password, const unsigned char *salt,
+                   int iterations, unsigned char *key)
+{
+    return PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()),
+                             salt, CredentialTable::SALT_BYTES, iterations, EVP_sha256(),
+                             CredentialTable::HASH_BYTES, key) == 1;
+}
+
+static std::string toHex(const unsigned char *data, std::size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    std::string hex;
+    for (std::size_t i = 0; i < length; i++)
+    {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0x0f]);
+    }
+
+    return hex;
+}
+
+static int fromHexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+static bool fromHex(const char *hex, std::size_t hexLength, unsigned char *out, std::size_t length)
+{
+    if (hexLength != 2 * length)
+    {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < length; i++)
+    {
+        int high = fromHexDigit(hex[2 * i]);
+        int low = fromHexDigit(hex[2 * i + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        out[i] = static_cast<unsigned char>(high << 4 | low);
+    }
+
+    return true;
+}
+
+CredentialTable::CredentialTable(void *region, std::size_t regionLength,
+                                 std::size_t capacity, std::size_t size)
+    : region_(region),
+      regionLength_(regionLength),
+      slots_(static_cast<const Slot *>(region)),
+      names_(static_cast<const char *>(region) + capacity * sizeof(Slot)),
+      capacity_(capacity),
+      size_(size),
+      typicalIterations_(0)
+{
+}
+
+CredentialTable::~CredentialTable()
+{
+    munmap(region_, regionLength_);
+}
+
+uint64_t CredentialTable::hashName(const char *name, std::size_t length)
+{
+    // FNV-1a, never 0 which marks an empty slot
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash | 1;
+}
+
+std::unique_ptr<CredentialTable> CredentialTable::build(const char *data, std::size_t length,
+                                                        std::string &error)
+{
+    struct Line
+    {
+        const char  *fields[5];
+        std::size_t lengths[5];
+    };
+
+    // split the lines into their fields first, to size the table
+    std::vector<Line> lines;
+    std::size_t namesLength = 0;
+    std::size_t lineNumber = 0;
+    
+    const char *end = data + length;
+    for (const char *line = data; line < end; )
+    {
+        auto lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+        lineNumber++;
+
+        auto next = lineEnd + 1;
+        if (lineEnd > line && lineEnd[-1] == '\r')
+        {
+            lineEnd--;
+        }
+        
+        if (lineEnd == line || *line == '#')
+        {
+            line = next;
+            continue;
+        }
+
+        Line fields;
+        int count = 0;
+        for (const char *field = line; count < 5; count++)
+        {
+            auto fieldEnd = static_cast<const char *>(memchr(field, ':', lineEnd - field));
+            if (fieldEnd == nullptr || count == 4)
+            {
+                fieldEnd = lineEnd;
+            }
+
+            fields.fields[count] = field;
+            fields.lengths[count] = fieldEnd - field;
+
+            if (fieldEnd == lineEnd)
+            {
+                count++;
+                break;
+            }
+            field = fieldEnd + 1;
+        }
+
+        if (count != 5 ||
+            fields.lengths[0] == 0 || fields.lengths[0] > MAX_NAME ||
+            fields.lengths[1] != strlen(ALGORITHM) ||
+            memcmp(fields.fields[1], ALGORITHM, fields.lengths[1]) != 0)
+        {
+            error = "malformed line " + std::to_string(lineNumber);
+            return nullptr;
+        }
+
+        lines.push_back(fields);
+        namesLength += fields.lengths[0];
+        line = next;
+    }
+
+    // at most half full, so a probe ends soon
+    std::size_t capacity = 16;
+    while (capacity < 2 * lines.size())
+    {
+        capacity *= 2;
+    }
+
+    auto regionLength = capacity * sizeof(Slot) + namesLength;
+    auto region = mmap(nullptr, regionLength, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        error = std::string("mmap: ") + strerror(errno);
+        return nullptr;
+    }
+    
+    std::unique_ptr<CredentialTable> table(
+        new CredentialTable(region, regionLength, capacity, lines.size())
+    );
+
+    auto slots = static_cast<Slot *>(region);
+    auto names = static_cast<char *>(region) + capacity * sizeof(Slot);
+    std::size_t nameOffset = 0;
+    std::map<uint32_t, std::size_t> iterationCounts;
+
+    for (auto &fields : lines)
+    {
+        Slot slot;
+        memset(&slot, 0, sizeof(slot));
+
+        std::string iterations(fields.fields[2], fields.lengths[2]);
+        char *stop = nullptr;
+        auto count = strtol(iterations.c_str(), &stop, 10);
+
+        std::string name(fields.fields[0], fields.lengths[0]);
+        if (iterations.empty() || *stop != '\0' || count < 1 || count > 100000000 ||
+            !fromHex(fields.fields[3], fields.lengths[3], slot.salt, SALT_BYTES) ||
+            !fromHex(fields.fields[4], fields.lengths[4], slot.key, HASH_BYTES))
+        {
+            error = "malformed entry of user " + name;
+            return nullptr;
+        }
+
+        if (table->find(name) != nullptr)
+        {
+            error = "duplicate user " + name;
+            return nullptr;
+        }
+
+        slot.hash = hashName(name.data(), name.size());
+        slot.name = static_cast<uint32_t>(nameOffset);
+        slot.nameLength = static_cast<uint32_t>(name.size());
+        slot.iterations = static_cast<uint32_t>(count);
+        iterationCounts[slot.iterations]++;
+
+        memcpy(names + nameOffset, name.data(), name.size());
+        nameOffset += name.size();
+
+        auto index = slot.hash & (capacity - 1);
+        while (slots[index].hash != 0)
+        {
+            index = (index + 1) & (capacity - 1);
+        }
+        slots[index] = slot;
+    }
+
+    // the most users, the more iterations on a tie
+    std::size_t users = 0;
+    for (auto &count : iterationCounts)
+    {
+        if (count.second >= users)
+        {
+            users = count.second;
+            table->typicalIterations_ = count.first;
+        }
+    }
+
+    // the table never changes once it's built
+    mprotect(region, regionLength, PROT_READ);
+    
+    return table;
+}
+
+std::unique_ptr<CredentialTable> CredentialTable::load(const std::string &path,
+                                                       std::string &error)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        error = path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        error = path + ": " + strerror(errno);
+        close(fd);
+        return nullptr;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return build(nullptr, 0, error);
+    }
+
+    auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (data == MAP_FAILED)
+    {
+        error = path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    auto table = build(static_cast<const char *>(data), st.st_size, error);
+    munmap(data, st.st_size);
+
+    if (table == nullptr)
+    {
+        error = path + ": " + error;
+    }
+    
+    return table;
+}
+
+const CredentialTable::Slot *CredentialTable::find(const std::string &username) const
+{
+    return find(username.data(), username.size());
+}
+
+const CredentialTable::Slot *CredentialTable::find(const char *username,
+                                                   std::size_t length) const
+{
+    auto hash = hashName(username, length);
+    
+    for (auto index = hash & (capacity_ - 1); slots_[index].hash != 0;
+         index = (index + 1) & (capacity_ - 1))
+    {
+        auto &slot = slots_[index];
+        if (slot.hash == hash && slot.nameLength == length &&
+            memcmp(names_ + slot.name, username, slot.nameLength) == 0)
+        {
+            return &slot;
+        }
+    }
+
+    return nullptr;
+}
+
+std::string CredentialTable::makeEntry(const std::string &username,
+                                       const std::string &password, int iterations)
+{
+    unsigned char salt[SALT_BYTES];
+    unsigned char key[HASH_BYTES];
+
+    if (RAND_bytes(salt, sizeof(salt)) != 1 || !pbkdf2(password, salt, iterations, key))
+    {
+        return "";
+    }
+
+    return username + ":" + ALGORITHM + ":" + std::to_string(iterations) + ":" +
+        toHex(salt, sizeof(salt)) + ":" + toHex(key, sizeof(key));
+}
+
+CredentialStore::CredentialStore(event_base *base)
+    : table_(nullptr),
+      generation_(0),
+      stats_{0, 0, 0, 0, 0},
+      checkMatched_(false),
+      reload_(base),
+      verifier_(base)
+{
+    if (RAND_bytes(secret_, sizeof(secret_)) != 1)
+    {
+        LOG(FATAL) << "Failed to generate the key of the login cache";
+    }
+}
+
+void CredentialStore::setTable(std::unique_ptr<CredentialTable> table)
+{
+    table_ = std::move(table);
+    generation_++;
+    cache_.clear();
+}
+
+bool CredentialStore::reload(const std::string &path)
+{
+    auto work = [this, path]() {
+        reloaded_ = CredentialTable::load(path, reloadError_);
+    };
+
+    auto done = [this]() {
+        if (reloaded_ == nullptr)
+        {
+            LOG(ERROR) << "Failed to reload the credentials, keep the "
+                       << size() << " users loaded: " << reloadError_;
+            return;
+        }
+
+        stats_.reloads++;
+        setTable(std::move(reloaded_));
+
+        LOG(WARNING) << "Reload the credentials: " << size() << " users";
+    };
+    
+    return reload_.run(work, done);
+}
+
+bool CredentialStore::contains(const Handshake::Bytes &username) const
+{
+    return table_ != nullptr &&
+        table_->find(reinterpret_cast<const char *>(username.data), username.length) != nullptr;
+}
+
+std::size_t CredentialStore::size() const
+{
+    return table_ != nullptr ? table_->size() : 0;
+}
+
+std::size_t CredentialStore::CachedKeyHash::operator()(const CachedKey &key) const
+{
+    // the key is already a keyed hash
+    std::size_t hash;
+    memcpy(&hash, key.data(), sizeof(hash));
+
+    return hash;
+}
+
+CredentialStore::CachedKey CredentialStore::cacheKey(const unsigned char *username,
+                                                     std::size_t usernameLength,
+                                                     const unsigned char *password,
+                                                     std::size_t passwordLength) const
+{
+    assert(usernameLength <= 255 && passwordLength <= 255);
+
+    // the length of the name keeps the fields apart
+    unsigned char login[1 + 255 + 255];
+    login[0] = static_cast<unsigned char>(usernameLength);
+    memcpy(login + 1, username, usernameLength);
+    memcpy(login + 1 + usernameLength, password, passwordLength);
+    
+    CachedKey key;
+    unsigned int keyLength = key.size();
+    HMAC(EVP_sha256(), secret_, sizeof(secret_),
+         login, 1 + usernameLength + passwordLength, key.data(), &keyLength);
+    OPENSSL_cleanse(login, sizeof(login));
+
+    return key;
+}
+
+CredentialStore::Result CredentialStore::lookup(const Handshake::Login &login)
+{
+    if (cache_.empty())
+    {
+        return Result::miss;
+    }
+
+    auto key = cacheKey(login.username.data, login.username.length,
+                        login.password.data, login.password.length);
+    if (cache_.count(key) != 0)
+    {
+        stats_.cacheHits++;
+        return Result::allowed;
+    }
+
+    return Result::miss;
+}
+
+bool CredentialStore::check(const std::string &username, const std::string &password,
+                            Callback callback, void *arg)
+{
+    assert(callback != nullptr);
+    assert(username.size() <= 255 && password.size() <= 255);
+
+    if (checks_.size() >= MAX_PENDING)
+    {
+        stats_.overflows++;
+        return false;
+    }
+
+    Check check;
+    check.username = username;
+    check.password = password;
+    check.generation = generation_;
+    check.callback = callback;
+    check.arg = arg;
+
+    auto slot = table_ != nullptr ? table_->find(username) : nullptr;
+    check.known = slot != nullptr;
+    if (check.known)
+    {
+        check.slot = *slot;
+    }
+    else
+    {
+        // hash the password of an unknown user too, so it takes as long as most known ones
+        memset(&check.slot, 0, sizeof(check.slot));
+        check.slot.iterations = table_ != nullptr && table_->typicalIterations() > 0 ?
+            table_->typicalIterations() : ITERATIONS;
+    }
+
+    checks_.push_back(std::move(check));
+    if (checks_.size() == 1)
+    {
+        startCheck();
+    }
+
+    return true;
+}
+
+void CredentialStore::cancel(void *arg)
+{
+    if (checks_.empty())
+    {
+        return;
+    }
+
+    // the running check finishes without anyone to tell
+    if (checks_.front().arg == arg)
+    {
+        checks_.front().callback = nullptr;
+    }
+
+    for (auto it = checks_.begin() + 1; it != checks_.end(); )
+    {
+        it = it->arg == arg ? checks_.erase(it) : it + 1;
+    }
+}
+
+void CredentialStore::startCheck()
+{
+    assert(!checks_.empty());
+
+    // the front of the deque stays put while checks are added behind it
+    auto &check = checks_.front();
+    auto work = [this, &check]() {
+        unsigned char key[CredentialTable::HASH_BYTES];
+        checkMatched_ = pbkdf2(check.password, check.slot.salt, check.slot.iterations, key) &&
+            CRYPTO_memcmp(key, check.slot.key, sizeof(key)) == 0 && check.known;
+    };
+
+    verifier_.run(work, [this]() { finishCheck(); });
+}
+
+void CredentialStore::finishCheck()
+{
+    auto check = std::move(checks_.front());
+    checks_.pop_front();
+
+    bool allowed = checkMatched_;
+    stats_.verified++;
+
+    if (!allowed)
+    {
+        stats_.failures++;
+    }
+    else if (check.generation == generation_)
+    {
+        // a reload meanwhile may have changed the password
+        cache_.insert(cacheKey(reinterpret_cast<const unsigned char *>(check.username.data()),
+                               check.username.size(),
+                               reinterpret_cast<const unsigned char *>(check.password.data()),
+                               check.password.size()));
+    }
+    OPENSSL_cleanse(&check.password[0], check.password.size());
+
+    if (!checks_.empty())
+    {
+        startCheck();
+    }
+
+    if (check.callback != nullptr)
+    {
+        check.callback(allowed, check.arg);
+    }
+}
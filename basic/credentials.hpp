@@ -0,0 +1,220 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include "background.hpp"
+#include "handshake.hpp"
+
+#include <stdint.h>
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+/**
+   Forward declaration
+ **/
+struct event_base;
+
+/**
+   An immutable open addressing hash table of salted password hashes,
+   the slots and the usernames live in one read-only anonymous mapping.
+
+   It's built from lines of
+     username:pbkdf2-sha256:iterations:salt:hash
+   with salt and hash in hex, empty lines and lines
+   starting with '#' are skipped
+ **/
+class CredentialTable
+{
+public:
+    static constexpr std::size_t SALT_BYTES = 16;
+    static constexpr std::size_t HASH_BYTES = 32;
+
+    struct Slot
+    {
+        uint64_t       hash;          // of the username, 0 for an empty slot
+        uint32_t       name;          // offset of the username
+        uint32_t       nameLength;
+        uint32_t       iterations;
+        unsigned char  salt[SALT_BYTES];
+        unsigned char  key[HASH_BYTES];
+    };
+
+    ~CredentialTable();
+
+    // disable the copy operations
+    CredentialTable(const CredentialTable &) = delete;
+    CredentialTable &operator=(const CredentialTable &) = delete;
+
+    /**
+       Build a table from the text of a credentials file,
+       return nullptr and set error if a line is malformed
+     **/
+    static std::unique_ptr<CredentialTable> build(const char *data, std::size_t length,
+                                                  std::string &error);
+
+    // Build a table from a credentials file
+    static std::unique_ptr<CredentialTable> load(const std::string &path,
+                                                 std::string &error);
+
+    // Return the slot of username, nullptr if it's unknown
+    const Slot *find(const std::string &username) const;
+    const Slot *find(const char *username, std::size_t length) const;
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    // The iterations most users have, 0 for an empty table
+    uint32_t typicalIterations() const
+    {
+        return typicalIterations_;
+    }
+
+    // Format a line of the credentials file, with a random salt
+    static std::string makeEntry(const std::string &username,
+                                 const std::string &password, int iterations);
+
+private:
+    CredentialTable(void *region, std::size_t regionLength,
+                    std::size_t capacity, std::size_t size);
+
+    static uint64_t hashName(const char *name, std::size_t length);
+
+    void            *region_;
+    std::size_t     regionLength_;
+    const Slot      *slots_;
+    const char      *names_;
+    std::size_t     capacity_;      // a power of two
+    std::size_t     size_;
+    uint32_t        typicalIterations_;
+};
+
+/**
+   The users of the server. A login runs PBKDF2 once, afterwards a
+   keyed hash of the password is cached so that logging in again costs
+   one HMAC. The table is swapped whole, so a reload never blocks logins.
+
+   PBKDF2 runs in another thread, one check at a time, so the event loop
+   never waits for it and a flood of logins costs one core at most.
+   The checks waiting are bounded, a login past them is denied at once
+ **/
+class CredentialStore
+{
+public:
+    static constexpr int ITERATIONS = 10000;
+    static constexpr std::size_t MAX_PENDING = 64;
+
+    struct Stats
+    {
+        uint64_t  cacheHits;
+        uint64_t  verified;     // PBKDF2 runs
+        uint64_t  failures;
+        uint64_t  reloads;
+        uint64_t  overflows;    // logins denied with MAX_PENDING checks waiting
+    };
+
+    enum class Result { allowed, denied, miss };
+
+    // Called from the event loop with the answer of a check
+    using Callback = void (*)(bool allowed, void *arg);
+
+    // A reload finishes in the event loop of base
+    explicit CredentialStore(event_base *base);
+
+    // disable the copy operations
+    CredentialStore(const CredentialStore &) = delete;
+    CredentialStore &operator=(const CredentialStore &) = delete;
+
+    // Replace the table, e.g. with one loaded at startup
+    void setTable(std::unique_ptr<CredentialTable> table);
+
+    /**
+       Load path again in another thread and swap the table in
+       the event loop once it's built, a broken file keeps the old
+       table. Return false if a reload is already running
+     **/
+    bool reload(const std::string &path);
+
+    /**
+       Look up a login in the cache, call check() on a miss. The
+       fields are read in place, a hit copies nothing
+     **/
+    Result lookup(const Handshake::Login &login);
+
+    /**
+       Run PBKDF2 on the password of username, the callback is always
+       invoked from the event loop, never before check() returns.
+       Return false without calling back if too many checks are waiting
+     **/
+    bool check(const std::string &username, const std::string &password,
+               Callback callback, void *arg);
+
+    // Drop the callbacks of arg, e.g. when the tunnel waiting is gone
+    void cancel(void *arg);
+
+    // Whether username is one of the users
+    bool contains(const Handshake::Bytes &username) const;
+
+    std::size_t size() const;
+
+    const Stats &stats() const
+    {
+        return stats_;
+    }
+
+private:
+    using CachedKey = std::array<unsigned char, CredentialTable::HASH_BYTES>;
+
+    struct CachedKeyHash
+    {
+        std::size_t operator()(const CachedKey &key) const;
+    };
+
+    struct Check
+    {
+        std::string            username;
+        std::string            password;
+        CredentialTable::Slot  slot;          // a copy, the table may be swapped meanwhile
+        bool                   known;
+        uint64_t               generation;    // of the table the slot is from
+        Callback               callback;      // nullptr once it's cancelled
+        void                   *arg;
+    };
+
+    // Keyed hash of a login for the cache, the fields are at most 255 bytes
+    CachedKey cacheKey(const unsigned char *username, std::size_t usernameLength,
+                       const unsigned char *password, std::size_t passwordLength) const;
+
+    // Hash the password of the first check in another thread
+    void startCheck();
+
+    // Answer the first check in the event loop
+    void finishCheck();
+
+    std::shared_ptr<CredentialTable>  table_;
+    uint64_t                          generation_;        // counts the tables set
+    std::unordered_set<CachedKey, CachedKeyHash> cache_;  // logins since the last reload
+    unsigned char                     secret_[32];        // key of the cached hashes
+    Stats                             stats_;
+    std::unique_ptr<CredentialTable>  reloaded_;      // built by the reload thread
+    std::string                       reloadError_;
+    std::deque<Check>                 checks_;        // the first one is running
+    bool                              checkMatched_;  // written by the check thread
+    BackgroundTask                    reload_;        // joined before the fields above go
+    BackgroundTask                    verifier_;
+};
+
+#endif /* CREDENTIALS_H */
@@ -0,0 +1,486 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "dnscache.hpp"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include <event2/dns.h>
+#include <event2/event.h>
+
+/**
+   A query in flight, owned by the cache until evdns calls back
+ **/
+struct DnsCache::Query
+{
+    DnsCache     *cache;
+    std::string  key;
+    std::string  host;
+    int          af;
+};
+
+DnsCache::Entry::Entry()
+    : error(DNS_ERR_NONE),
+      expires(0),
+      staleUntil(0),
+      next(0),
+      valid(false),
+      permanent(false),
+      pending(false),
+      used(false)
+{
+}
+
+DnsCache::DnsCache(event_base *base, evdns_base *dns, const Options &options)
+    : base_(base),
+      dns_(dns),
+      options_(options),
+      stats_()
+{
+    assert(base_ != nullptr);
+    assert(dns_ != nullptr);
+    assert(options_.minTTL <= options_.maxTTL);
+}
+
+DnsCache::~DnsCache()
+{
+    /**
+       evdns still owns the queries in flight,
+       they are freed by their callbacks
+    **/
+    for (auto query : queries_)
+    {
+        query->cache = nullptr;
+    }
+}
+
+std::string DnsCache::makeKey(const std::string &host, int af)
+{
+    std::string key(host.size() + 1, '\0');
+
+    std::transform(host.begin(), host.end(), key.begin(),
+                   [](char c) { return static_cast<char>(::tolower(c)); });
+    key.back() = static_cast<char>(af);
+
+    return key;
+}
+
+long DnsCache::now() const
+{
+    struct timeval tv;
+    event_base_gettimeofday_cached(base_, &tv);
+
+    return tv.tv_sec;
+}
+
+DnsCache::Result DnsCache::lookup(const std::string &host, int af,
+                                  sockaddr_storage *address, socklen_t *length)
+{
+    auto iter = entries_.find(makeKey(host, af));
+    if (iter == entries_.end())
+    {
+        stats_.misses++;
+        return Result::miss;
+    }
+
+    auto &entry = iter->second;
+    auto current = now();
+
+    if (entry.valid && (entry.permanent || current < entry.expires))
+    {
+        entry.used = true;
+
+        if (entry.error != DNS_ERR_NONE)
+        {
+            stats_.negativeHits++;
+            return Result::negative;
+        }
+
+        stats_.hits++;
+        pickAddress(entry, address, length);
+        return Result::hit;
+    }
+
+    /**
+       The answer has expired. A name that was used while it was fresh
+       is served stale while the refresh is in flight
+    **/
+    if (entry.valid && entry.error == DNS_ERR_NONE &&
+        entry.used && current < entry.staleUntil)
+    {
+        if (!entry.pending)
+        {
+            entry.used = false;
+            entry.pending = startQuery(iter->first, host, af);
+        }
+
+        stats_.staleHits++;
+        pickAddress(entry, address, length);
+        return Result::hit;
+    }
+
+    stats_.misses++;
+    return Result::miss;
+}
+
+void DnsCache::resolve(const std::string &host, int af, Callback callback, void *arg)
+{
+    assert(callback != nullptr);
+
+    auto key = makeKey(host, af);
+
+    auto iter = entries_.find(key);
+    if (iter == entries_.end())
+    {
+        if (entries_.size() >= options_.maxEntries)
+        {
+            sweep();
+        }
+        iter = entries_.emplace(key, Entry()).first;
+    }
+
+    auto &entry = iter->second;
+    entry.waiters.push_back(Waiter{callback, arg});
+
+    if (entry.pending)
+    {
+        stats_.coalesced++;
+        return;
+    }
+
+    entry.pending = startQuery(key, host, af);
+    if (!entry.pending)
+    {
+        /**
+           evdns refused the query, report the failure
+           from the event loop like any other answer
+        **/
+        auto query = new Query{this, key, host, af};
+        queries_.push_back(query);
+        entry.pending = true;
+
+        struct timeval zero = {0, 0};
+        event_base_once(base_, -1, EV_TIMEOUT, [](evutil_socket_t, short, void *arg) {
+                ipv4Callback(DNS_ERR_UNKNOWN, DNS_IPv4_A, 0, 0, nullptr, arg);
+            }, query, &zero);
+    }
+}
+
+bool DnsCache::startQuery(const std::string &key, const std::string &host, int af)
+{
+    auto query = new Query{this, key, host, af};
+
+    evdns_request *request;
+    if (af == AF_INET6)
+    {
+        request = evdns_base_resolve_ipv6(dns_, host.c_str(), 0, ipv6Callback, query);
+    }
+    else
+    {
+        request = evdns_base_resolve_ipv4(dns_, host.c_str(), 0, ipv4Callback, query);
+    }
+
+    if (request == nullptr)
+    {
+        delete query;
+        return false;
+    }
+
+    stats_.queries++;
+    queries_.push_back(query);
+
+    return true;
+}
+
+void DnsCache::ipv4Callback(int result, char type, int count, int ttl,
+                            void *addresses, void *arg)
+{
+    auto query = static_cast<Query *>(arg);
+    auto cache = query->cache;
+
+    if (cache == nullptr)
+    {
+        delete query;
+        return;
+    }
+
+    std::vector<sockaddr_storage> answers;
+    if (result == DNS_ERR_NONE && type == DNS_IPv4_A)
+    {
+        auto raw = static_cast<const struct in_addr *>(addresses);
+        for (int i = 0; i < count; i++)
+        {
+            sockaddr_storage storage;
+            memset(&storage, 0, sizeof(storage));
+
+            auto sin = reinterpret_cast<sockaddr_in *>(&storage);
+            sin->sin_family = AF_INET;
+            sin->sin_addr = raw[i];
+            answers.push_back(storage);
+        }
+    }
+
+    /**
+       For AF_UNSPEC a name without A records may still have AAAA records
+    **/
+    bool noAnswer = (result == DNS_ERR_NONE && answers.empty()) ||
+        result == DNS_ERR_NODATA;
+    if (query->af == AF_UNSPEC && noAnswer)
+    {
+        if (evdns_base_resolve_ipv6(cache->dns_, query->host.c_str(), 0,
+                                    ipv6Callback, query) != nullptr)
+        {
+            cache->stats_.queries++;
+            return;
+        }
+    }
+
+    cache->finishQuery(query, result, ttl, std::move(answers));
+    delete query;
+}
+
+void DnsCache::ipv6Callback(int result, char type, int count, int ttl,
+                            void *addresses, void *arg)
+{
+    auto query = static_cast<Query *>(arg);
+    auto cache = query->cache;
+
+    if (cache == nullptr)
+    {
+        delete query;
+        return;
+    }
+
+    std::vector<sockaddr_storage> answers;
+    if (result == DNS_ERR_NONE && type == DNS_IPv6_AAAA)
+    {
+        auto raw = static_cast<const struct in6_addr *>(addresses);
+        for (int i = 0; i < count; i++)
+        {
+            sockaddr_storage storage;
+            memset(&storage, 0, sizeof(storage));
+
+            auto sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_addr = raw[i];
+            answers.push_back(storage);
+        }
+    }
+
+    cache->finishQuery(query, result, ttl, std::move(answers));
+    delete query;
+}
+
+void DnsCache::finishQuery(Query *query, int result, int ttl,
+                           std::vector<sockaddr_storage> &&addresses)
+{
+    queries_.erase(std::remove(queries_.begin(), queries_.end(), query),
+                   queries_.end());
+
+    auto iter = entries_.find(query->key);
+    if (iter == entries_.end())
+    {
+        return;
+    }
+
+    auto &entry = iter->second;
+    auto current = now();
+    entry.pending = false;
+
+    if (result == DNS_ERR_NONE && addresses.empty())
+    {
+        result = DNS_ERR_NODATA;
+    }
+
+    if (result == DNS_ERR_NONE)
+    {
+        ttl = std::max(options_.minTTL, std::min(ttl, options_.maxTTL));
+
+        entry.addresses = std::move(addresses);
+        entry.error = DNS_ERR_NONE;
+        entry.expires = current + ttl;
+        entry.staleUntil = entry.expires + options_.staleTTL;
+        entry.next = 0;
+        entry.valid = true;
+    }
+    else if (result == DNS_ERR_NOTEXIST ||
+             result == DNS_ERR_SERVERFAILED ||
+             result == DNS_ERR_NODATA)
+    {
+        entry.addresses.clear();
+        entry.error = result;
+        entry.expires = current + options_.negativeTTL;
+        entry.staleUntil = entry.expires;
+        entry.valid = true;
+    }
+    else if (!(entry.valid && current < entry.staleUntil))
+    {
+        // transient failure (timeout etc.), don't remember it
+        entry.valid = false;
+    }
+
+    /**
+       The callbacks may call resolve() again, so take the waiters
+       and the addresses out of the entry before running them
+    **/
+    std::vector<Waiter> waiters;
+    waiters.swap(entry.waiters);
+
+    bool success = entry.valid && entry.error == DNS_ERR_NONE;
+    int error = entry.valid ? entry.error : result;
+
+    std::vector<std::pair<sockaddr_storage, socklen_t>> picks(waiters.size());
+    if (success)
+    {
+        for (auto &pick : picks)
+        {
+            pickAddress(entry, &pick.first, &pick.second);
+        }
+    }
+
+    if (!entry.valid)
+    {
+        entries_.erase(iter);
+    }
+    else if (entries_.size() > options_.maxEntries)
+    {
+        sweep();
+    }
+
+    for (std::size_t i = 0; i < waiters.size(); i++)
+    {
+        if (success)
+        {
+            waiters[i].callback(DNS_ERR_NONE,
+                                reinterpret_cast<sockaddr *>(&picks[i].first),
+                                picks[i].second, waiters[i].arg);
+        }
+        else
+        {
+            waiters[i].callback(error == DNS_ERR_NONE ? DNS_ERR_UNKNOWN : error,
+                                nullptr, 0, waiters[i].arg);
+        }
+    }
+}
+
+void DnsCache::pickAddress(Entry &entry, sockaddr_storage *address, socklen_t *length)
+{
+    assert(!entry.addresses.empty());
+
+    auto &picked = entry.addresses[entry.next % entry.addresses.size()];
+    entry.next++;
+
+    *address = picked;
+    *length = picked.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+void DnsCache::sweep()
+{
+    auto current = now();
+
+    for (auto iter = entries_.begin(); iter != entries_.end(); )
+    {
+        auto &entry = iter->second;
+        if (!entry.permanent && !entry.pending && current >= entry.staleUntil)
+        {
+            iter = entries_.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+
+    if (entries_.size() < options_.maxEntries)
+    {
+        return;
+    }
+
+    // still full, drop the answers nobody used since they were refreshed
+    for (auto iter = entries_.begin(); iter != entries_.end(); )
+    {
+        auto &entry = iter->second;
+        if (!entry.permanent && !entry.pending && !entry.used)
+        {
+            iter = entries_.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+void DnsCache::loadHosts(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        LOG(WARNING) << "Failed to open hosts file " << path;
+        return;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+        {
+            line.resize(comment);
+        }
+
+        std::istringstream fields(line);
+        std::string ip;
+        if (!(fields >> ip))
+        {
+            continue;
+        }
+
+        sockaddr_storage storage;
+        memset(&storage, 0, sizeof(storage));
+
+        auto sin = reinterpret_cast<sockaddr_in *>(&storage);
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+        if (::inet_pton(AF_INET, ip.c_str(), &sin->sin_addr) == 1)
+        {
+            sin->sin_family = AF_INET;
+        }
+        else if (::inet_pton(AF_INET6, ip.c_str(), &sin6->sin6_addr) == 1)
+        {
+            sin6->sin6_family = AF_INET6;
+        }
+        else
+        {
+            continue;
+        }
+
+        std::string name;
+        while (fields >> name)
+        {
+            int families[] = {AF_UNSPEC, storage.ss_family};
+            for (auto af : families)
+            {
+                auto &entry = entries_[makeKey(name, af)];
+                entry.addresses.push_back(storage);
+                entry.error = DNS_ERR_NONE;
+                entry.valid = true;
+                entry.permanent = true;
+            }
+        }
+    }
+}
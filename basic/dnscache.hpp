@@ -0,0 +1,170 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct event_base;
+struct evdns_base;
+
+/**
+   Resolver cache in front of evdns
+
+   Answers are kept for their record TTL clamped to [minTTL, maxTTL],
+   NXDOMAIN/SERVFAIL answers are kept for negativeTTL, and concurrent
+   lookups of the same name share one query. Names that were used while
+   fresh are served stale for up to staleTTL while a refresh runs.
+ **/
+class DnsCache
+{
+public:
+    struct Options
+    {
+        Options()
+            : minTTL(5),
+              maxTTL(3600),
+              negativeTTL(5),
+              staleTTL(30),
+              maxEntries(10000)
+        {
+        }
+
+        int           minTTL;       // seconds
+        int           maxTTL;       // seconds
+        int           negativeTTL;  // seconds
+        int           staleTTL;     // seconds
+        std::size_t   maxEntries;
+    };
+
+    struct Stats
+    {
+        uint64_t  hits;
+        uint64_t  staleHits;
+        uint64_t  negativeHits;
+        uint64_t  misses;
+        uint64_t  coalesced;
+        uint64_t  queries;
+    };
+
+    enum class Result { hit, negative, miss };
+
+    /**
+       Called with DNS_ERR_NONE and an address (port is zero) on success,
+       or with a DNS_ERR_* code and a null address on failure
+     **/
+    using Callback = void (*)(int result, const sockaddr *address,
+                              socklen_t length, void *arg);
+
+    DnsCache(event_base *base, evdns_base *dns, const Options &options);
+    ~DnsCache();
+
+    // disable the copy operations
+    DnsCache(const DnsCache &) = delete;
+    DnsCache &operator=(const DnsCache &) = delete;
+
+    /**
+       Look up host in the cache without blocking,
+       af is AF_INET, AF_INET6 or AF_UNSPEC
+
+       Returns:
+         Result::hit        address holds a cached answer
+         Result::negative   the name is known not to resolve
+         Result::miss       call resolve() to wait for an answer
+     **/
+    Result lookup(const std::string &host, int af,
+                  sockaddr_storage *address, socklen_t *length);
+
+    /**
+       Resolve host, the callback is always invoked from the event loop,
+       never before resolve() returns
+     **/
+    void resolve(const std::string &host, int af, Callback callback, void *arg);
+
+    /**
+       Load static entries from a hosts file,
+       these entries never expire
+     **/
+    void loadHosts(const std::string &path);
+
+    Stats stats() const
+    {
+        return stats_;
+    }
+
+    std::size_t size() const
+    {
+        return entries_.size();
+    }
+
+private:
+    struct Waiter
+    {
+        Callback  callback;
+        void      *arg;
+    };
+
+    struct Entry
+    {
+        Entry();
+
+        std::vector<sockaddr_storage>  addresses;
+        int                            error;       // DNS_ERR_NONE or a cached failure
+        long                           expires;     // fresh until, seconds
+        long                           staleUntil;  // may be served stale until, seconds
+        unsigned                       next;        // round robin index
+        bool                           valid;       // holds an answer
+        bool                           permanent;   // from the hosts file
+        bool                           pending;     // a query is in flight
+        bool                           used;        // hit since the last refresh
+        std::vector<Waiter>            waiters;
+    };
+
+    struct Query;
+
+    static void ipv4Callback(int result, char type, int count, int ttl,
+                             void *addresses, void *arg);
+    static void ipv6Callback(int result, char type, int count, int ttl,
+                             void *addresses, void *arg);
+
+    static std::string makeKey(const std::string &host, int af);
+
+    long now() const;
+
+    // Send a query for the entry, returns false when evdns refused it
+    bool startQuery(const std::string &key, const std::string &host, int af);
+
+    // Record the answer of a finished query and wake up its waiters
+    void finishQuery(Query *query, int result, int ttl,
+                     std::vector<sockaddr_storage> &&addresses);
+
+    // Pick the next address of the entry in round robin order
+    void pickAddress(Entry &entry, sockaddr_storage *address, socklen_t *length);
+
+    // Remove the entries which can't be served anymore
+    void sweep();
+
+    event_base                              *base_;
+    evdns_base                              *dns_;
+    Options                                 options_;
+    Stats                                   stats_;
+    std::unordered_map<std::string, Entry>  entries_;
+    std::vector<Query *>                    queries_;  // queries in flight
+};
+
+#endif /* DNSCACHE_H */
@@ -0,0 +1,188 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "endpoint.hpp"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+constexpr std::size_t ListenEndpoint::MAX_PATH;
+
+static const std::string UNIX_PREFIX = "unix:";
+
+static std::string trim(const std::string &text)
+{
+    auto begin = text.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+    {
+        return "";
+    }
+    auto end = text.find_last_not_of(" \t");
+
+    return text.substr(begin, end - begin + 1);
+}
+
+static bool validPort(const std::string &port)
+{
+    if (port.empty() || port.size() > 5 ||
+        !std::all_of(port.begin(), port.end(), [](char c) { return c >= '0' && c <= '9'; }))
+    {
+        return false;
+    }
+
+    auto number = atoi(port.c_str());
+    return number > 0 && number <= 65535;
+}
+
+ListenEndpoint ListenEndpoint::tcp(const std::string &host, const std::string &port)
+{
+    ListenEndpoint endpoint;
+    endpoint.type_ = Type::tcp;
+    endpoint.host_ = host;
+    endpoint.port_ = port;
+
+    return endpoint;
+}
+
+bool ListenEndpoint::parse(const std::string &text, ListenEndpoint &endpoint, std::string &error)
+{
+    if (text.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0)
+    {
+        auto path = text.substr(UNIX_PREFIX.size());
+        if (path.empty() || path == "@")
+        {
+            error = "\"" + text + "\" has no path";
+            return false;
+        }
+
+        // an abstract name takes the place of the terminator of sun_path
+        if (path.size() > MAX_PATH + (path[0] == '@' ? 1 : 0))
+        {
+            error = "the path of \"" + text + "\" is too long";
+            return false;
+        }
+
+        endpoint.type_ = Type::local;
+        endpoint.host_.clear();
+        endpoint.port_.clear();
+        endpoint.path_ = path;
+
+        return true;
+    }
+
+    std::string host, port;
+    if (!text.empty() && text[0] == '[')
+    {
+        auto close = text.find("]:");
+        if (close == std::string::npos)
+        {
+            error = "\"" + text + "\" isn't [host]:port";
+            return false;
+        }
+
+        host = text.substr(1, close - 1);
+        port = text.substr(close + 2);
+    }
+    else
+    {
+        auto colon = text.rfind(':');
+        if (colon == std::string::npos)
+        {
+            error = "\"" + text + "\" isn't host:port";
+            return false;
+        }
+
+        host = text.substr(0, colon);
+        port = text.substr(colon + 1);
+
+        // an ipv6 address needs the brackets to tell its port apart
+        if (host.find(':') != std::string::npos)
+        {
+            error = "\"" + text + "\" needs brackets around the ipv6 address";
+            return false;
+        }
+    }
+
+    if (!validPort(port))
+    {
+        error = "\"" + text + "\" has an invalid port";
+        return false;
+    }
+
+    endpoint = tcp(host == "*" ? "" : host, port);
+    return true;
+}
+
+bool ListenEndpoint::parseList(const std::string &text, std::vector<ListenEndpoint> &endpoints,
+                               std::string &error)
+{
+    std::vector<ListenEndpoint> parsed;
+
+    std::size_t begin = 0;
+    while (begin <= text.size())
+    {
+        auto end = text.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+
+        auto item = trim(text.substr(begin, end - begin));
+        begin = end + 1;
+
+        if (item.empty())
+        {
+            error = "an endpoint is empty";
+            return false;
+        }
+
+        ListenEndpoint endpoint;
+        if (!parse(item, endpoint, error))
+        {
+            return false;
+        }
+
+        if (std::find(parsed.begin(), parsed.end(), endpoint) != parsed.end())
+        {
+            error = "\"" + item + "\" is listed twice";
+            return false;
+        }
+        parsed.push_back(endpoint);
+    }
+
+    endpoints.swap(parsed);
+    return true;
+}
+
+std::string ListenEndpoint::toString() const
+{
+    if (type_ == Type::local)
+    {
+        return UNIX_PREFIX + path_;
+    }
+
+    if (host_.empty())
+    {
+        return "*:" + port_;
+    }
+
+    if (host_.find(':') != std::string::npos)
+    {
+        return "[" + host_ + "]:" + port_;
+    }
+
+    return host_ + ":" + port_;
+}
+
+bool ListenEndpoint::operator==(const ListenEndpoint &other) const
+{
+    return type_ == other.type_ && host_ == other.host_ &&
+        port_ == other.port_ && path_ == other.path_;
+}
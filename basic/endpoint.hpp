@@ -0,0 +1,86 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <string>
+#include <vector>
+
+/**
+   An endpoint to listen on, written as "host:port", "[ipv6]:port",
+   "*:port" for every address, "unix:/path" for a unix socket or
+   "unix:@name" for one in the abstract namespace
+ **/
+class ListenEndpoint
+{
+public:
+    enum class Type { tcp, local };
+
+    // Construct a tcp endpoint of every address and no port
+    ListenEndpoint()
+        : type_(Type::tcp)
+    {
+    }
+
+    // Construct a tcp endpoint, an empty host is every address
+    static ListenEndpoint tcp(const std::string &host, const std::string &port);
+
+    /**
+       Parse a comma separated list of endpoints into endpoints,
+       return false with error if one is malformed or listed twice
+     **/
+    static bool parseList(const std::string &text, std::vector<ListenEndpoint> &endpoints,
+                          std::string &error);
+
+    Type type() const
+    {
+        return type_;
+    }
+
+    const std::string &host() const
+    {
+        return host_;
+    }
+
+    const std::string &port() const
+    {
+        return port_;
+    }
+
+    // path of a unix socket, it starts with '@' in the abstract namespace
+    const std::string &path() const
+    {
+        return path_;
+    }
+
+    bool abstract() const
+    {
+        return type_ == Type::local && !path_.empty() && path_[0] == '@';
+    }
+
+    // Return the endpoint written the way it's parsed
+    std::string toString() const;
+
+    bool operator==(const ListenEndpoint &other) const;
+
+    // Longest path of a unix socket, sun_path less its terminator
+    static constexpr std::size_t MAX_PATH = 107;
+
+private:
+    // parse one endpoint, return false with error if it's malformed
+    static bool parse(const std::string &text, ListenEndpoint &endpoint, std::string &error);
+
+    Type         type_;
+    std::string  host_;
+    std::string  port_;
+    std::string  path_;
+};
+
+#endif /* ENDPOINT_H */
@@ -0,0 +1,193 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "handshake.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <algorithm>
+
+constexpr unsigned char  Handshake::SOCKS5_VERSION;
+constexpr unsigned char  Handshake::USER_AUTH_VERSION;
+constexpr unsigned char  Handshake::ADDRESS_TYPE_IPV4;
+constexpr unsigned char  Handshake::ADDRESS_TYPE_DOMAIN_NAME;
+constexpr unsigned char  Handshake::ADDRESS_TYPE_IPV6;
+constexpr std::size_t    Handshake::MAX_MESSAGE;
+constexpr std::size_t    Handshake::MAX_REPLY;
+
+// Whether a message of length bytes is the whole message of expected bytes
+static Handshake::Result checkLength(std::size_t length, std::size_t expected)
+{
+    if (length < expected)
+    {
+        return Handshake::Result::incomplete;
+    }
+
+    return length > expected ? Handshake::Result::invalid : Handshake::Result::done;
+}
+
+std::string Handshake::Bytes::toString() const
+{
+    return std::string(reinterpret_cast<const char *>(data), length);
+}
+
+bool Handshake::Greeting::offers(unsigned char method) const
+{
+    return memchr(methods.data, method, methods.length) != nullptr;
+}
+
+Address Handshake::Request::address() const
+{
+    if (addressType == ADDRESS_TYPE_IPV4)
+    {
+        std::array<unsigned char, 4> ip;
+        std::copy(host.data, host.data + ip.size(), ip.begin());
+        return Address(ip, htons(port));
+    }
+    else if (addressType == ADDRESS_TYPE_IPV6)
+    {
+        std::array<unsigned char, 16> ip;
+        std::copy(host.data, host.data + ip.size(), ip.begin());
+        return Address(ip, htons(port));
+    }
+
+    return Address(std::string(reinterpret_cast<const char *>(host.data), host.length),
+                   htons(port));
+}
+
+Handshake::Result Handshake::parseGreeting(const unsigned char *data, std::size_t length,
+                                           Greeting &greeting)
+{
+    if (length < 2)
+    {
+        return Result::incomplete;
+    }
+
+    if (data[0] != SOCKS5_VERSION)
+    {
+        return Result::invalid;
+    }
+
+    greeting.methods = {data + 2, data[1]};
+    return checkLength(length, 2 + data[1]);
+}
+
+Handshake::Result Handshake::parseLogin(const unsigned char *data, std::size_t length,
+                                        Login &login)
+{
+    if (length < 2)
+    {
+        return Result::incomplete;
+    }
+
+    if (data[0] != USER_AUTH_VERSION)
+    {
+        return Result::invalid;
+    }
+
+    std::size_t userLength = data[1];
+    if (length < 3 + userLength)
+    {
+        return Result::incomplete;
+    }
+
+    std::size_t passLength = data[2 + userLength];
+    login.username = {data + 2, userLength};
+    login.password = {data + 3 + userLength, passLength};
+
+    return checkLength(length, 3 + userLength + passLength);
+}
+
+Handshake::Result Handshake::parseRequest(const unsigned char *data, std::size_t length,
+                                          Request &request)
+{
+    if (length < 4)
+    {
+        return Result::incomplete;
+    }
+
+    if (data[0] != SOCKS5_VERSION)
+    {
+        return Result::invalid;
+    }
+
+    request.command = data[1];
+    request.addressType = data[3];
+
+    std::size_t hostOffset = 4, hostLength;
+    if (request.addressType == ADDRESS_TYPE_IPV4)
+    {
+        hostLength = 4;
+    }
+    else if (request.addressType == ADDRESS_TYPE_IPV6)
+    {
+        hostLength = 16;
+    }
+    else if (request.addressType == ADDRESS_TYPE_DOMAIN_NAME)
+    {
+        if (length < 5)
+        {
+            return Result::incomplete;
+        }
+
+        hostOffset = 5;
+        hostLength = data[4];
+    }
+    else
+    {
+        return Result::unsupported;
+    }
+
+    auto result = checkLength(length, hostOffset + hostLength + 2);
+    if (result != Result::done)
+    {
+        return result;
+    }
+
+    request.host = {data + hostOffset, hostLength};
+    request.port = static_cast<unsigned short>(data[hostOffset + hostLength] << 8 |
+                                               data[hostOffset + hostLength + 1]);
+
+    return Result::done;
+}
+
+std::size_t Handshake::writeReply(unsigned char code, const Address &address,
+                                  unsigned char (&out)[MAX_REPLY])
+{
+    out[0] = SOCKS5_VERSION;
+    out[1] = code;
+    out[2] = 0x00;
+
+    std::size_t length = 4;
+    if (address.type() == Address::Type::ipv4)
+    {
+        out[3] = ADDRESS_TYPE_IPV4;
+        auto ip = address.toRawIPv4();
+        length = std::copy(ip.begin(), ip.end(), out + 4) - out;
+    }
+    else if (address.type() == Address::Type::ipv6)
+    {
+        out[3] = ADDRESS_TYPE_IPV6;
+        auto ip = address.toRawIPv6();
+        length = std::copy(ip.begin(), ip.end(), out + 4) - out;
+    }
+    else
+    {
+        out[3] = ADDRESS_TYPE_IPV4;
+        memset(out + 4, 0, 6);
+        return 10;
+    }
+
+    auto port = address.rawPortNetworkOrder();
+    out[length] = port[0];
+    out[length + 1] = port[1];
+
+    return length + 2;
+}
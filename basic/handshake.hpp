@@ -0,0 +1,115 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include "address.hpp"
+
+/**
+   The messages of the SOCKS5 handshake. They're parsed in place,
+   the fields point into the message, and the replies are written
+   into fixed arrays, so neither touches the heap
+ **/
+class Handshake
+{
+public:
+    static constexpr unsigned char  SOCKS5_VERSION     = 0x05;
+    static constexpr unsigned char  USER_AUTH_VERSION  = 0x01;
+
+    static constexpr unsigned char  ADDRESS_TYPE_IPV4         = 0x01;
+    static constexpr unsigned char  ADDRESS_TYPE_DOMAIN_NAME  = 0x03;
+    static constexpr unsigned char  ADDRESS_TYPE_IPV6         = 0x04;
+
+    // The largest message, a username/password message
+    static constexpr std::size_t    MAX_MESSAGE = 1 + 1 + 255 + 1 + 255;
+
+    // The largest reply to a request, with an IPv6 address
+    static constexpr std::size_t    MAX_REPLY   = 4 + 16 + 2;
+
+    enum class Result
+    {
+        incomplete,     // more bytes are needed
+        done,
+        invalid,
+        unsupported     // the request has an unknown address type
+    };
+
+    // Bytes of a message
+    struct Bytes
+    {
+        const unsigned char  *data;
+        std::size_t          length;
+
+        // A copy, for what outlives the message
+        std::string toString() const;
+    };
+
+    /**
+       +----+----------+----------+
+       |VER | NMETHODS | METHODS  |
+       +----+----------+----------+
+       | 1  |    1     | 1 to 255 |
+       +----+----------+----------+
+     **/
+    struct Greeting
+    {
+        Bytes  methods;
+
+        bool offers(unsigned char method) const;
+    };
+
+    /**
+       +----+------+----------+------+----------+
+       |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+       +----+------+----------+------+----------+
+       | 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+       +----+------+----------+------+----------+
+     **/
+    struct Login
+    {
+        Bytes  username;
+        Bytes  password;
+    };
+
+    /**
+       +----+-----+-------+------+----------+----------+
+       |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+       +----+-----+-------+------+----------+----------+
+       | 1  |  1  | X'00' |  1   | Variable |    2     |
+       +----+-----+-------+------+----------+----------+
+     **/
+    struct Request
+    {
+        unsigned char   command;
+        unsigned char   addressType;
+        Bytes           host;       // 4 or 16 bytes of an ip, or a domain name
+        unsigned short  port;       // host byte order
+
+        // The destination, it copies a domain name
+        Address address() const;
+    };
+
+    // Parse a whole message, a message with bytes after it is invalid
+    static Result parseGreeting(const unsigned char *data, std::size_t length,
+                                Greeting &greeting);
+    static Result parseLogin(const unsigned char *data, std::size_t length,
+                             Login &login);
+    static Result parseRequest(const unsigned char *data, std::size_t length,
+                               Request &request);
+
+    /**
+       Write the reply to a request with the bound address into out,
+       0.0.0.0:0 if address is neither IPv4 nor IPv6. Return its length
+     **/
+    static std::size_t writeReply(unsigned char code, const Address &address,
+                                  unsigned char (&out)[MAX_REPLY]);
+};
+
+#endif /* HANDSHAKE_H */
@@ -0,0 +1,203 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "loopmonitor.hpp"
+
+#include <string.h>
+#include <time.h>
+
+#include <glog/logging.h>
+
+#include <event2/event.h>
+
+constexpr int  LoopMonitor::CATEGORIES;
+constexpr int  LoopMonitor::BUCKETS;
+
+/**
+   Called when the probe is due, late by the lag of the loop
+ **/
+static void probeCallback(evutil_socket_t, short, void *arg)
+{
+    auto monitor = static_cast<LoopMonitor *>(arg);
+    monitor->probe();
+}
+
+void LoopMonitor::Histogram::add(uint64_t micros)
+{
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && (micros >> (bucket + 1)) != 0)
+    {
+        bucket++;
+    }
+
+    counts[bucket]++;
+    samples++;
+    if (micros > max)
+    {
+        max = micros;
+    }
+}
+
+uint64_t LoopMonitor::Histogram::percentile(double p) const
+{
+    if (samples == 0)
+    {
+        return 0;
+    }
+
+    // the rank of the sample, rounded up
+    auto rank = static_cast<uint64_t>(p / 100.0 * samples);
+    if (rank * 100.0 < p * samples)
+    {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        seen += counts[bucket];
+        if (seen >= rank && counts[bucket] != 0)
+        {
+            // the last bucket has no bound but the largest sample
+            return bucket == BUCKETS - 1 ? max : (uint64_t(2) << bucket) - 1;
+        }
+    }
+
+    return max;
+}
+
+LoopMonitor::Scope::Scope(LoopMonitor *monitor, Category category)
+    : monitor_(monitor),
+      category_(category),
+      start_(monitor != nullptr ? LoopMonitor::now() : 0)
+{
+}
+
+LoopMonitor::Scope::~Scope()
+{
+    if (monitor_ != nullptr)
+    {
+        monitor_->record(category_, LoopMonitor::now() - start_);
+    }
+}
+
+LoopMonitor::LoopMonitor(event_base *base, const Options &options)
+    : options_(options),
+      probe_(nullptr),
+      expected_(0)
+{
+    memset(&lag_, 0, sizeof(lag_));
+    memset(callbacks_, 0, sizeof(callbacks_));
+    memset(warned_, 0, sizeof(warned_));
+
+    if (base != nullptr && options_.interval > 0)
+    {
+        probe_ = evtimer_new(base, probeCallback, this);
+        schedule();
+    }
+}
+
+LoopMonitor::~LoopMonitor()
+{
+    if (probe_ != nullptr)
+    {
+        event_free(probe_);
+    }
+}
+
+uint64_t LoopMonitor::now()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+const char *LoopMonitor::name(Category category)
+{
+    switch (category)
+    {
+    case Category::accept:
+        return "accept";
+    case Category::inConnRead:
+        return "inConn read";
+    case Category::outConnRead:
+        return "outConn read";
+    case Category::event:
+        return "event";
+    }
+
+    return "unknown";
+}
+
+void LoopMonitor::record(Category category, uint64_t micros)
+{
+    auto index = static_cast<int>(category);
+    auto &stats = callbacks_[index];
+
+    stats.calls++;
+    stats.micros += micros;
+    if (micros > stats.max)
+    {
+        stats.max = micros;
+    }
+
+    if (micros >= options_.slowCallback)
+    {
+        stats.slow++;
+
+        // one warning of each kind a report, the count has the rest
+        if (!warned_[index])
+        {
+            LOG(WARNING) << "Slow " << name(category) << " callback: " << micros << " us";
+            warned_[index] = true;
+        }
+    }
+}
+
+void LoopMonitor::schedule()
+{
+    struct timeval interval = {options_.interval / 1000, (options_.interval % 1000) * 1000};
+
+    expected_ = now() + static_cast<uint64_t>(options_.interval) * 1000;
+    evtimer_add(probe_, &interval);
+}
+
+void LoopMonitor::probe()
+{
+    auto ranAt = now();
+    lag_.add(ranAt > expected_ ? ranAt - expected_ : 0);
+
+    schedule();
+}
+
+void LoopMonitor::report()
+{
+    if (probe_ != nullptr)
+    {
+        LOG(INFO) << "Loop lag: samples = " << lag_.samples
+                  << ", p50 us <= " << lag_.percentile(50)
+                  << ", p99 us <= " << lag_.percentile(99)
+                  << ", max us = " << lag_.max;
+    }
+
+    for (int i = 0; i < CATEGORIES; i++)
+    {
+        auto &stats = callbacks_[i];
+        LOG(INFO) << "Callbacks " << name(static_cast<Category>(i))
+                  << ": calls = " << stats.calls
+                  << ", us = " << stats.micros
+                  << ", slow = " << stats.slow
+                  << ", max us = " << stats.max;
+    }
+
+    memset(&lag_, 0, sizeof(lag_));
+    memset(callbacks_, 0, sizeof(callbacks_));
+    memset(warned_, 0, sizeof(warned_));
+}
@@ -0,0 +1,144 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef LOOPMONITOR_H
+#define LOOPMONITOR_H
+
+#include <stdint.h>
+
+/**
+   Forward declaration
+ **/
+struct event;
+struct event_base;
+
+/**
+   Measure how far the event loop falls behind and where its time goes.
+
+   A probe timer expects to run every interval, the delay past that is
+   the lag of the loop, kept in a histogram. The callbacks of the
+   tunnels time themselves with a Scope, the time is added up by the
+   kind of callback and the ones above slowCallback are counted. The
+   counters start again after each report
+ **/
+class LoopMonitor
+{
+public:
+    enum class Category
+    {
+        accept,         // accepting a client
+        inConnRead,     // data from the client
+        outConnRead,    // data from the other side
+        event           // connected, EOF and errors
+    };
+
+    static constexpr int  CATEGORIES = 4;
+    static constexpr int  BUCKETS    = 24;   // powers of two of microseconds
+
+    struct Options
+    {
+        Options()
+            : interval(100),
+              slowCallback(10000)
+        {
+        }
+
+        int       interval;       // milliseconds between the probes
+        uint64_t  slowCallback;   // microseconds
+    };
+
+    /**
+       Bucket i counts the samples of [2^i, 2^(i+1)) microseconds,
+       the first also 0 and the last everything above
+     **/
+    struct Histogram
+    {
+        uint64_t  counts[BUCKETS];
+        uint64_t  samples;
+        uint64_t  max;
+
+        void add(uint64_t micros);
+
+        // upper bound of the bucket of the p-th percentile, p in (0, 100]
+        uint64_t percentile(double p) const;
+    };
+
+    struct CallbackStats
+    {
+        uint64_t  calls;
+        uint64_t  micros;
+        uint64_t  slow;       // calls above slowCallback
+        uint64_t  max;
+    };
+
+    /**
+       Time a callback from here to the end of the block,
+       a null monitor costs nothing
+     **/
+    class Scope
+    {
+    public:
+        Scope(LoopMonitor *monitor, Category category);
+        ~Scope();
+
+        // disable the copy operations
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        LoopMonitor  *monitor_;
+        Category     category_;
+        uint64_t     start_;
+    };
+
+    // base may be null, then there's no probe and no lag
+    LoopMonitor(event_base *base, const Options &options);
+    ~LoopMonitor();
+
+    // disable the copy operations
+    LoopMonitor(const LoopMonitor &) = delete;
+    LoopMonitor &operator=(const LoopMonitor &) = delete;
+
+    // add a callback of category which ran for micros
+    void record(Category category, uint64_t micros);
+
+    // called by the probe timer
+    void probe();
+
+    // log the lag and the callbacks since the last report, then clear them
+    void report();
+
+    const Histogram &lag() const
+    {
+        return lag_;
+    }
+
+    const CallbackStats &callbacks(Category category) const
+    {
+        return callbacks_[static_cast<int>(category)];
+    }
+
+    static const char *name(Category category);
+
+    // microseconds of the monotonic clock
+    static uint64_t now();
+
+private:
+    // arm the probe to expect a run after one interval
+    void schedule();
+
+    Options        options_;
+    event          *probe_;
+    uint64_t       expected_;     // when the probe should run
+    Histogram      lag_;
+    CallbackStats  callbacks_[CATEGORIES];
+    bool           warned_[CATEGORIES];   // a slow one was logged since the report
+};
+
+#endif /* LOOPMONITOR_H */
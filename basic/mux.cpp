@@ -0,0 +1,552 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "mux.hpp"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <openssl/rand.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+constexpr unsigned char MuxSession::MAGIC[4];
+constexpr int           MuxSession::NONCE_BYTES;
+constexpr int           MuxSession::HEADER_BYTES;
+constexpr uint32_t      MuxSession::MAX_PAYLOAD;
+constexpr uint32_t      MuxSession::WINDOW;
+constexpr std::size_t   MuxSession::MAX_STREAMS;
+
+// The bytes of a header before it's sealed
+static constexpr int PLAIN_HEADER_BYTES = 13;
+
+struct MuxSession::Stream
+{
+    MuxSession   *session;
+    uint32_t     id;
+    bufferevent  *end;          // our end of the pair
+    uint32_t     credit;        // bytes we may still send
+    uint32_t     unacked;       // bytes delivered to the user but not credited back
+    bool         userClosed;    // the user has freed its end
+};
+
+static void connReadCallback(bufferevent *conn, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto session = static_cast<MuxSession *>(arg);
+    session->onRead();
+}
+
+static void connEventCallback(bufferevent *conn, short what, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto session = static_cast<MuxSession *>(arg);
+
+    if (what & BEV_EVENT_ERROR)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        LOG(ERROR) << "Multiplexed connection error: "
+                   << evutil_socket_error_to_string(err);
+
+        session->onClosed();
+    }
+    else if (what & BEV_EVENT_EOF)
+    {
+        LOG(INFO) << "Multiplexed connection closed by peer";
+        session->onClosed();
+    }
+}
+
+static void streamReadCallback(bufferevent *end, void *arg)
+{
+    auto stream = static_cast<MuxSession::Stream *>(arg);
+    stream->session->onStreamRead(stream);
+}
+
+static void streamWriteCallback(bufferevent *end, void *arg)
+{
+    auto stream = static_cast<MuxSession::Stream *>(arg);
+    stream->session->onStreamDrained(stream);
+}
+
+static void streamEventCallback(bufferevent *end, short what, void *arg)
+{
+    auto stream = static_cast<MuxSession::Stream *>(arg);
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    {
+        stream->session->onStreamClosed(stream);
+    }
+}
+
+MuxSession::MuxSession(event_base *base, bufferevent *conn, const Cryptor &cryptor)
+    : base_(base),
+      conn_(conn),
+      cryptor_(cryptor),
+      role_(Role::client),
+      maxStreams_(0),
+      nextId_(1),
+      sendSequence_(0),
+      receiveSequence_(0)
+{
+    assert(conn_ != nullptr);
+
+    bufferevent_setcb(conn_, connReadCallback, nullptr, connEventCallback, this);
+    bufferevent_enable(conn_, EV_READ | EV_WRITE);
+
+    unsigned char opening[sizeof(MAGIC) + NONCE_BYTES];
+    memcpy(opening, MAGIC, sizeof(MAGIC));
+
+    unsigned char sealed[HEADER_BYTES];
+    auto nonce = opening + sizeof(MAGIC);
+    if (RAND_bytes(nonce, NONCE_BYTES) != 1 ||
+        !cryptor_.sealBlock(opening, sizeof(opening), sealed))
+    {
+        LOG(ERROR) << "Failed to open a multiplexed connection";
+        onClosed();
+        return;
+    }
+
+    startSequences(nonce);
+    bufferevent_write(conn_, sealed, sizeof(sealed));
+}
+
+MuxSession::MuxSession(event_base *base, bufferevent *conn, const Cryptor &cryptor,
+                       AcceptCallback callback, std::size_t maxStreams)
+    : base_(base),
+      conn_(conn),
+      cryptor_(cryptor),
+      role_(Role::server),
+      acceptCallback_(callback),
+      maxStreams_(maxStreams),
+      nextId_(2),
+      sendSequence_(0),
+      receiveSequence_(0)
+{
+    assert(conn_ != nullptr);
+
+    auto input = bufferevent_get_input(conn_);
+
+    unsigned char nonce[NONCE_BYTES];
+    bool opened = openOpening(cryptor_, input, nonce);
+    assert(opened);
+    (void)opened;
+
+    evbuffer_drain(input, HEADER_BYTES);
+    startSequences(nonce);
+
+    bufferevent_setcb(conn_, connReadCallback, nullptr, connEventCallback, this);
+    bufferevent_enable(conn_, EV_READ | EV_WRITE);
+
+    // the first frames may have come with MAGIC, don't wait for more data
+    bufferevent_trigger(conn_, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+MuxSession::~MuxSession()
+{
+    while (!streams_.empty())
+    {
+        freeStream(streams_.begin()->second);
+    }
+
+    if (conn_ != nullptr)
+    {
+        bufferevent_free(conn_);
+    }
+}
+
+bool MuxSession::hasMagic(const Cryptor &cryptor, bufferevent *conn, bool &incomplete)
+{
+    auto input = bufferevent_get_input(conn);
+
+    incomplete = evbuffer_get_length(input) < static_cast<std::size_t>(HEADER_BYTES);
+    if (incomplete)
+    {
+        return false;
+    }
+
+    unsigned char nonce[NONCE_BYTES];
+    return openOpening(cryptor, input, nonce);
+}
+
+bool MuxSession::openOpening(const Cryptor &cryptor, evbuffer *input,
+                             unsigned char nonce[NONCE_BYTES])
+{
+    unsigned char sealed[HEADER_BYTES];
+    if (evbuffer_copyout(input, sealed, sizeof(sealed)) != sizeof(sealed))
+    {
+        return false;
+    }
+
+    // a plain connection starts with the length of its first frame, which never opens as this
+    unsigned char opening[HEADER_BYTES];
+    std::size_t length;
+    if (!cryptor.openBlock(sealed, opening, length) ||
+        length != sizeof(MAGIC) + NONCE_BYTES ||
+        memcmp(opening, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    memcpy(nonce, opening + sizeof(MAGIC), NONCE_BYTES);
+    return true;
+}
+
+void MuxSession::startSequences(const unsigned char nonce[NONCE_BYTES])
+{
+    uint32_t client, server;
+    memcpy(&client, nonce, 4);
+    memcpy(&server, nonce + 4, 4);
+
+    sendSequence_ = role_ == Role::client ? client : server;
+    receiveSequence_ = role_ == Role::client ? server : client;
+}
+
+bufferevent *MuxSession::openStream()
+{
+    assert(role_ == Role::client);
+
+    if (closed())
+    {
+        return nullptr;
+    }
+
+    // client streams are odd, server streams would be even
+    auto id = nextId_;
+    nextId_ += 2;
+
+    auto user = createStream(id);
+    if (user != nullptr)
+    {
+        writeHeader(FRAME_OPEN, id, 0);
+    }
+
+    return user;
+}
+
+bufferevent *MuxSession::createStream(uint32_t id)
+{
+    /**
+       callbacks are deferred, so that neither side of the pair
+       runs inside the other one's callback
+    **/
+    bufferevent *pair[2];
+    if (bufferevent_pair_new(base_, BEV_OPT_DEFER_CALLBACKS, pair) != 0)
+    {
+        LOG(ERROR) << "Failed to create multiplexed stream-" << id;
+        return nullptr;
+    }
+
+    auto stream = new Stream{this, id, pair[0], WINDOW, 0, false};
+    streams_[id] = stream;
+
+    bufferevent_setcb(stream->end, streamReadCallback, streamWriteCallback,
+                      streamEventCallback, stream);
+    bufferevent_enable(stream->end, EV_READ | EV_WRITE);
+
+    // the user can't hold more than the window we granted
+    auto user = pair[1];
+    bufferevent_setwatermark(user, EV_READ, 0, WINDOW);
+
+    return user;
+}
+
+void MuxSession::acceptStream(uint32_t id)
+{
+    // every stream costs a pair here and a connection to its destination
+    if (streams_.size() >= maxStreams_)
+    {
+        LOG(WARNING) << "Refuse multiplexed stream-" << id << ": "
+                     << streams_.size() << " streams open";
+
+        writeHeader(FRAME_CLOSE, id, 0);
+        return;
+    }
+
+    auto user = createStream(id);
+    if (user == nullptr)
+    {
+        writeHeader(FRAME_CLOSE, id, 0);
+        return;
+    }
+
+    if (!acceptCallback_(user, id))
+    {
+        auto stream = streams_[id];
+        stream->userClosed = true;
+        bufferevent_free(user);
+
+        writeHeader(FRAME_CLOSE, id, 0);
+        freeStream(stream);
+    }
+}
+
+void MuxSession::freeStream(Stream *stream)
+{
+    streams_.erase(stream->id);
+
+    // deliver what's left and tell the user with an EOF
+    if (!stream->userClosed)
+    {
+        bufferevent_flush(stream->end, EV_WRITE, BEV_FINISHED);
+    }
+
+    bufferevent_free(stream->end);
+    delete stream;
+}
+
+void MuxSession::writeHeader(unsigned char type, uint32_t id, uint32_t value)
+{
+    assert(conn_ != nullptr);
+
+    unsigned char header[PLAIN_HEADER_BYTES];
+    header[0] = type;
+
+    uint32_t idNetwork = htonl(id);
+    uint32_t valueNetwork = htonl(value);
+    uint32_t sequenceNetwork = htonl(sendSequence_++);
+    memcpy(header + 1, &idNetwork, 4);
+    memcpy(header + 5, &valueNetwork, 4);
+    memcpy(header + 9, &sequenceNetwork, 4);
+
+    // a header that can't be sealed is left out, the peer closes at the gap
+    unsigned char sealed[HEADER_BYTES];
+    if (!cryptor_.sealBlock(header, sizeof(header), sealed))
+    {
+        LOG(ERROR) << "Failed to seal multiplexed frame of stream-" << id;
+        return;
+    }
+
+    evbuffer_add(bufferevent_get_output(conn_), sealed, sizeof(sealed));
+}
+
+bool MuxSession::readHeader(unsigned char &type, uint32_t &id, uint32_t &value) const
+{
+    unsigned char sealed[HEADER_BYTES];
+    evbuffer_copyout(bufferevent_get_input(conn_), sealed, sizeof(sealed));
+
+    unsigned char header[HEADER_BYTES];
+    std::size_t length;
+    if (!cryptor_.openBlock(sealed, header, length) || length != PLAIN_HEADER_BYTES)
+    {
+        return false;
+    }
+
+    uint32_t sequence;
+    memcpy(&id, header + 1, 4);
+    memcpy(&value, header + 5, 4);
+    memcpy(&sequence, header + 9, 4);
+
+    type = header[0];
+    id = ntohl(id);
+    value = ntohl(value);
+
+    return ntohl(sequence) == receiveSequence_;
+}
+
+void MuxSession::onRead()
+{
+    auto input = bufferevent_get_input(conn_);
+
+    while (conn_ != nullptr && evbuffer_get_length(input) >= HEADER_BYTES)
+    {
+        unsigned char type;
+        uint32_t id, value;
+        if (!readHeader(type, id, value))
+        {
+            LOG(ERROR) << "Invalid multiplexed header, closing the connection";
+            onClosed();
+            return;
+        }
+
+        uint32_t length = type == FRAME_DATA ? value : 0;
+        if (length > MAX_PAYLOAD)
+        {
+            LOG(ERROR) << "Multiplexed frame too large: " << length;
+            onClosed();
+            return;
+        }
+
+        // the header is opened again once the payload is here
+        if (evbuffer_get_length(input) < HEADER_BYTES + length)
+        {
+            return;
+        }
+
+        evbuffer_drain(input, HEADER_BYTES);
+        receiveSequence_++;
+
+        if (!handleFrame(type, id, value))
+        {
+            LOG(ERROR) << "Invalid multiplexed frame, type = "
+                       << static_cast<int>(type) << ", stream-" << id;
+            onClosed();
+            return;
+        }
+    }
+}
+
+bool MuxSession::handleFrame(unsigned char type, uint32_t id, uint32_t value)
+{
+    auto input = bufferevent_get_input(conn_);
+
+    auto iter = streams_.find(id);
+    auto stream = iter != streams_.end() ? iter->second : nullptr;
+
+    if (type == FRAME_OPEN)
+    {
+        if (role_ != Role::server || stream != nullptr || value != 0)
+        {
+            return false;
+        }
+
+        acceptStream(id);
+        return true;
+    }
+
+    if (type == FRAME_DATA)
+    {
+        if (stream == nullptr || stream->userClosed)
+        {
+            // the stream is already gone on our side
+            evbuffer_drain(input, value);
+            return true;
+        }
+
+        if (stream->unacked + value > WINDOW)
+        {
+            return false;
+        }
+
+        stream->unacked += value;
+        evbuffer_remove_buffer(input, bufferevent_get_output(stream->end), value);
+        return true;
+    }
+
+    if (type == FRAME_WINDOW)
+    {
+        auto credit = value;
+        if (stream != nullptr)
+        {
+            // the peer can't grant more than the window it holds
+            if (credit > WINDOW - stream->credit)
+            {
+                return false;
+            }
+
+            stream->credit += credit;
+            bufferevent_enable(stream->end, EV_READ);
+            onStreamRead(stream);
+        }
+        return true;
+    }
+
+    if (type == FRAME_CLOSE)
+    {
+        if (value != 0)
+        {
+            return false;
+        }
+
+        if (stream != nullptr)
+        {
+            freeStream(stream);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void MuxSession::onClosed()
+{
+    while (!streams_.empty())
+    {
+        freeStream(streams_.begin()->second);
+    }
+
+    if (conn_ != nullptr)
+    {
+        bufferevent_free(conn_);
+        conn_ = nullptr;
+    }
+
+    if (role_ == Role::server)
+    {
+        delete this;
+    }
+}
+
+void MuxSession::onStreamRead(Stream *stream)
+{
+    if (conn_ == nullptr)
+    {
+        return;
+    }
+
+    auto input = bufferevent_get_input(stream->end);
+    auto output = bufferevent_get_output(conn_);
+
+    while (evbuffer_get_length(input) > 0 && stream->credit > 0)
+    {
+        uint32_t length = std::min<std::size_t>(
+            {evbuffer_get_length(input), stream->credit, MAX_PAYLOAD}
+        );
+
+        // move the payload without copying it out of the pair
+        writeHeader(FRAME_DATA, stream->id, length);
+        evbuffer_remove_buffer(input, output, length);
+        stream->credit -= length;
+    }
+
+    if (evbuffer_get_length(input) > 0)
+    {
+        // out of credit, wait for the peer to take the data
+        bufferevent_disable(stream->end, EV_READ);
+    }
+    else if (stream->userClosed)
+    {
+        writeHeader(FRAME_CLOSE, stream->id, 0);
+        freeStream(stream);
+    }
+}
+
+void MuxSession::onStreamDrained(Stream *stream)
+{
+    if (conn_ == nullptr)
+    {
+        return;
+    }
+
+    // hand the credit back in batches, not for every frame
+    auto output = bufferevent_get_output(stream->end);
+    if (stream->unacked >= WINDOW / 4 && evbuffer_get_length(output) == 0)
+    {
+        writeHeader(FRAME_WINDOW, stream->id, stream->unacked);
+        stream->unacked = 0;
+    }
+}
+
+void MuxSession::onStreamClosed(Stream *stream)
+{
+    stream->userClosed = true;
+
+    // send what the user wrote before it closed, then the CLOSE frame
+    onStreamRead(stream);
+}
@@ -0,0 +1,179 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef MUX_H
+#define MUX_H
+
+#include "cipher.hpp"
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+struct event_base;
+
+/**
+   Carry many logical streams over one connection between
+   the local server and the proxy server.
+
+   The connection starts with an opening block, MAGIC and a random
+   nonce sealed with the key, then every frame is a sealed header and
+   its payload:
+   +------+-----------+-------+----------+
+   | TYPE | STREAM ID | VALUE | SEQUENCE |
+   +------+-----------+-------+----------+
+   |  1   |     4     |   4   |    4     |
+   +------+-----------+-------+----------+
+   VALUE is the length of the payload of a DATA frame and the credit
+   of a WINDOW frame, the other frames have no payload. SEQUENCE counts
+   the frames of each direction from a number of the nonce, so no two
+   headers seal to the same block, and a header which was changed,
+   replayed or dropped closes the connection. An observer sees neither
+   the streams nor their sizes, only blocks and the frames of the
+   streams, which are encrypted already.
+
+   A stream is handed to its user as one end of a bufferevent pair,
+   the user reads and writes it as it would read and write a socket,
+   the bytes are the same encrypted frames a plain connection carries.
+   Each direction of a stream has a credit window, the receiver grants
+   more credit once its user has taken the data, so a bulk stream
+   can't hold the connection against its neighbours.
+ **/
+class MuxSession
+{
+public:
+    static constexpr unsigned char  MAGIC[4]        = {'S', 'M', 'U', 'X'};
+    static constexpr int            NONCE_BYTES     = 8;
+    static constexpr int            HEADER_BYTES    = Cryptor::BLOCK_SIZE;  // sealed
+    static constexpr uint32_t       MAX_PAYLOAD     = 16 * 1024;
+    static constexpr uint32_t       WINDOW          = 256 * 1024;
+    static constexpr std::size_t    MAX_STREAMS     = 256;
+
+    static constexpr unsigned char  FRAME_OPEN      = 0x01;
+    static constexpr unsigned char  FRAME_DATA      = 0x02;
+    static constexpr unsigned char  FRAME_CLOSE     = 0x03;
+    static constexpr unsigned char  FRAME_WINDOW    = 0x04;
+
+    enum class Role { client, server };
+
+    /**
+       Called on the server for each stream opened by the client,
+       it returns false to refuse the stream, which is closed then
+     **/
+    using AcceptCallback = std::function<bool (bufferevent *stream, uint32_t id)>;
+
+    /**
+       Client session over conn, the frames are sealed with the key
+       of cryptor. The session owns conn
+     **/
+    MuxSession(event_base *base, bufferevent *conn, const Cryptor &cryptor);
+
+    /**
+       Server session over conn, the opening block must already be in
+       the input of conn. The session owns conn and deletes itself once conn
+       is closed. The client may have maxStreams streams open at once,
+       the ones past it are closed as they're opened
+     **/
+    MuxSession(event_base *base, bufferevent *conn, const Cryptor &cryptor,
+               AcceptCallback callback, std::size_t maxStreams = MAX_STREAMS);
+
+    ~MuxSession();
+
+    // disable the copy operations
+    MuxSession(const MuxSession &) = delete;
+    MuxSession &operator=(const MuxSession &) = delete;
+
+    /**
+       Whether the input of conn starts with an opening block sealed
+       with the key of cryptor, incomplete is set when there are too
+       few bytes to tell
+     **/
+    static bool hasMagic(const Cryptor &cryptor, bufferevent *conn, bool &incomplete);
+
+    /**
+       Open a new stream, return the user end of it or nullptr
+       if the session is closed. The user flushes it with BEV_FINISHED
+       and frees it when it's done
+     **/
+    bufferevent *openStream();
+
+    // Whether the connection is gone
+    bool closed() const
+    {
+        return conn_ == nullptr;
+    }
+
+    // Number of open streams
+    std::size_t streams() const
+    {
+        return streams_.size();
+    }
+
+    // Called when the connection has data
+    void onRead();
+
+    // Called when the connection is closed or fails
+    void onClosed();
+
+    struct Stream;
+
+    // Called when the user of the stream has written data
+    void onStreamRead(Stream *stream);
+
+    // Called when the user of the stream has taken the data
+    void onStreamDrained(Stream *stream);
+
+    // Called when the user of the stream frees it
+    void onStreamClosed(Stream *stream);
+
+private:
+    // Create the stream and return the user end of it
+    bufferevent *createStream(uint32_t id);
+
+    // Free the stream, the user is told with an EOF
+    void freeStream(Stream *stream);
+
+    // Open the stream the client asked for, or close it at once
+    void acceptStream(uint32_t id);
+
+    // Open the block at the head of input, false if it isn't one of ours
+    static bool openOpening(const Cryptor &cryptor, evbuffer *input,
+                            unsigned char nonce[NONCE_BYTES]);
+
+    // Count the frames of each direction from the nonce
+    void startSequences(const unsigned char nonce[NONCE_BYTES]);
+
+    // Seal the header of the next frame into the output of conn
+    void writeHeader(unsigned char type, uint32_t id, uint32_t value);
+
+    // Open the header at the head of the input, false if it's forged or out of order
+    bool readHeader(unsigned char &type, uint32_t &id, uint32_t &value) const;
+
+    // Handle a complete frame, the payload is still in the input of conn
+    bool handleFrame(unsigned char type, uint32_t id, uint32_t value);
+
+    event_base                                  *base_;
+    bufferevent                                 *conn_;
+    Cryptor                                     cryptor_;
+    Role                                        role_;
+    AcceptCallback                              acceptCallback_;
+    std::size_t                                 maxStreams_;
+    uint32_t                                    nextId_;
+    uint32_t                                    sendSequence_;
+    uint32_t                                    receiveSequence_;
+    std::unordered_map<uint32_t, Stream *>      streams_;
+};
+
+#endif /* MUX_H */
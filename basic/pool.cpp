@@ -0,0 +1,226 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "pool.hpp"
+
+#include <assert.h>
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+/**
+   The proxy server speaks only after the greeting,
+   an idle connection with data is no use
+ **/
+static void poolReadCallback(bufferevent *conn, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto pool = static_cast<ConnectionPool *>(arg);
+    pool->onUnexpectedData(conn);
+}
+
+static void poolEventCallback(bufferevent *conn, short what, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto pool = static_cast<ConnectionPool *>(arg);
+
+    if (what & BEV_EVENT_CONNECTED)
+    {
+        pool->onConnected(conn);
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    {
+        pool->onClosed(conn);
+    }
+}
+
+static void poolTimerCallback(evutil_socket_t, short, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto pool = static_cast<ConnectionPool *>(arg);
+    pool->refill();
+}
+
+ConnectionPool::ConnectionPool(std::shared_ptr<ServerBase> base, const Address &address,
+                               int size, int maxIdle)
+    : base_(base),
+      address_(address),
+      size_(std::max(size, 0)),
+      maxIdle_(maxIdle),
+      failures_(0),
+      retryAt_(0),
+      creating_(false),
+      failedEarly_(false),
+      timer_(nullptr)
+{
+    timer_ = event_new(base_->base(), -1, EV_PERSIST, poolTimerCallback, this);
+
+    struct timeval interval = {1, 0};
+    event_add(timer_, &interval);
+
+    refill();
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    event_free(timer_);
+
+    for (auto &idle : idle_)
+    {
+        bufferevent_free(idle.conn);
+    }
+
+    for (auto conn : connecting_)
+    {
+        bufferevent_free(conn);
+    }
+}
+
+long ConnectionPool::now() const
+{
+    struct timeval tv;
+    event_base_gettimeofday_cached(base_->base(), &tv);
+
+    return tv.tv_sec;
+}
+
+bufferevent *ConnectionPool::take()
+{
+    expire();
+
+    if (idle_.empty())
+    {
+        return nullptr;
+    }
+
+    // the newest connection is the least likely to be dead
+    auto conn = idle_.back().conn;
+    idle_.pop_back();
+
+    // refill from the event loop, not on the path of this tunnel
+    event_active(timer_, EV_TIMEOUT, 0);
+
+    return conn;
+}
+
+void ConnectionPool::refill()
+{
+    expire();
+
+    // back off while the proxy server is unreachable
+    if (now() < retryAt_)
+    {
+        return;
+    }
+
+    while (idle_.size() + connecting_.size() < size_)
+    {
+        /**
+           the connection may fail before createConnection() returns,
+           onClosed() leaves it to us in that case
+        **/
+        creating_ = true;
+        failedEarly_ = false;
+
+        auto conn = base_->createConnection(
+            address_, poolReadCallback, poolEventCallback, this
+        );
+        creating_ = false;
+
+        if (conn == nullptr || failedEarly_)
+        {
+            if (conn != nullptr)
+            {
+                bufferevent_free(conn);
+            }
+
+            backoff();
+            return;
+        }
+
+        connecting_.insert(conn);
+    }
+}
+
+void ConnectionPool::onConnected(bufferevent *conn)
+{
+    auto erased = connecting_.erase(conn);
+    assert(erased == 1);
+
+    failures_ = 0;
+    idle_.push_back(Idle{conn, now()});
+}
+
+void ConnectionPool::onClosed(bufferevent *conn)
+{
+    if (creating_)
+    {
+        failedEarly_ = true;
+        return;
+    }
+
+    if (connecting_.erase(conn) == 1)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        LOG(ERROR) << "Failed to open pooled connection to the proxy server: "
+                   << evutil_socket_error_to_string(err);
+
+        backoff();
+    }
+    else
+    {
+        LOG(INFO) << "Pooled connection closed by the proxy server";
+        evict(conn);
+    }
+
+    bufferevent_free(conn);
+}
+
+void ConnectionPool::onUnexpectedData(bufferevent *conn)
+{
+    LOG(WARNING) << "Pooled connection got data before the greeting, dropped";
+
+    evict(conn);
+    bufferevent_free(conn);
+}
+
+void ConnectionPool::evict(bufferevent *conn)
+{
+    auto iter = std::find_if(idle_.begin(), idle_.end(),
+                             [conn](const Idle &idle) { return idle.conn == conn; });
+    assert(iter != idle_.end());
+
+    idle_.erase(iter);
+}
+
+void ConnectionPool::backoff()
+{
+    // after N consecutive failures wait N seconds, at most 30 seconds
+    failures_++;
+    retryAt_ = now() + std::min(failures_, 30);
+}
+
+void ConnectionPool::expire()
+{
+    auto deadline = now() - maxIdle_;
+
+    while (!idle_.empty() && idle_.front().since <= deadline)
+    {
+        bufferevent_free(idle_.front().conn);
+        idle_.pop_front();
+    }
+}
@@ -0,0 +1,97 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "address.hpp"
+#include "base.hpp"
+
+#include <deque>
+#include <memory>
+#include <unordered_set>
+
+/**
+   Forward declaration
+ **/
+struct event;
+struct bufferevent;
+
+/**
+   Keep a number of established connections to the proxy server,
+   so that a new tunnel doesn't pay for the TCP handshake
+ **/
+class ConnectionPool
+{
+public:
+    ConnectionPool(std::shared_ptr<ServerBase> base, const Address &address,
+                   int size, int maxIdle);
+    ~ConnectionPool();
+
+    // disable the copy operations
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    /**
+       Take an established connection out of the pool,
+       return nullptr if none is ready. The caller owns
+       the connection and must set its callbacks
+     **/
+    bufferevent *take();
+
+    // Open connections until the pool is full
+    void refill();
+
+    // Called when a connection of the pool is established
+    void onConnected(bufferevent *conn);
+
+    // Called when a connection of the pool fails or is closed by the server
+    void onClosed(bufferevent *conn);
+
+    // Called when an idle connection has data, the server is out of step
+    void onUnexpectedData(bufferevent *conn);
+
+    // Number of established connections waiting in the pool
+    std::size_t idle() const
+    {
+        return idle_.size();
+    }
+
+private:
+    struct Idle
+    {
+        bufferevent  *conn;
+        long         since;    // seconds
+    };
+
+    long now() const;
+
+    // Forget an idle connection, the caller frees it
+    void evict(bufferevent *conn);
+
+    // Free the connections which have been idle for too long
+    void expire();
+
+    // Delay the next refill after a failure
+    void backoff();
+
+    std::shared_ptr<ServerBase>       base_;
+    Address                           address_;    // address of the proxy server
+    std::size_t                       size_;       // number of connections to keep
+    long                              maxIdle_;    // seconds
+    std::deque<Idle>                  idle_;       // established connections
+    std::unordered_set<bufferevent *> connecting_; // connections in progress
+    int                               failures_;   // consecutive failures
+    long                              retryAt_;    // no refill before, seconds
+    bool                              creating_;   // inside createConnection()
+    bool                              failedEarly_;
+    event                             *timer_;     // refill and expire timer
+};
+
+#endif /* POOL_H */
@@ -0,0 +1,138 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "qos.hpp"
+
+#include <stdlib.h>
+
+constexpr int   QosOptions::PRIORITIES;
+constexpr long  FlowMeter::INTERVAL;
+
+bool QosOptions::setInteractivePorts(const std::string &ports)
+{
+    return parsePorts(ports, interactivePorts_);
+}
+
+bool QosOptions::setBulkPorts(const std::string &ports)
+{
+    return parsePorts(ports, bulkPorts_);
+}
+
+Priority QosOptions::classify(unsigned short port) const
+{
+    if (interactivePorts_.test(port))
+    {
+        return Priority::interactive;
+    }
+    else if (bulkPorts_.test(port))
+    {
+        return Priority::bulk;
+    }
+
+    return Priority::normal;
+}
+
+bool QosOptions::pinned(unsigned short port) const
+{
+    return interactivePorts_.test(port) || bulkPorts_.test(port);
+}
+
+/**
+   Read a single port or a range "first-last" from the start of spec,
+   end points past it
+ **/
+static bool parsePort(const char *spec, const char **end, unsigned long &port)
+{
+    char *stop = nullptr;
+    port = strtoul(spec, &stop, 10);
+
+    if (stop == spec || port == 0 || port > 65535)
+    {
+        return false;
+    }
+
+    *end = stop;
+    return true;
+}
+
+bool QosOptions::parsePorts(const std::string &ports, std::bitset<65536> &out)
+{
+    std::bitset<65536> parsed;
+    const char *spec = ports.c_str();
+
+    while (*spec != '\0')
+    {
+        unsigned long first, last;
+        if (!parsePort(spec, &spec, first))
+        {
+            return false;
+        }
+
+        last = first;
+        if (*spec == '-' && (!parsePort(spec + 1, &spec, last) || last < first))
+        {
+            return false;
+        }
+
+        for (auto port = first; port <= last; port++)
+        {
+            parsed.set(port);
+        }
+
+        if (*spec == ',' && *(spec + 1) != '\0')
+        {
+            spec++;
+        }
+        else if (*spec != '\0')
+        {
+            return false;
+        }
+    }
+
+    out = parsed;
+    return true;
+}
+
+Priority FlowMeter::onTransfer(std::size_t bytes, long now, std::size_t bulkRate)
+{
+    if (startedAt_ < 0)
+    {
+        startedAt_ = now;
+    }
+
+    bytes_ += bytes;
+
+    auto elapsed = now - startedAt_;
+    if (elapsed < INTERVAL)
+    {
+        // a flow already past the rate needn't wait for the interval
+        if (bytes_ >= bulkRate * INTERVAL / 1000)
+        {
+            priority_ = Priority::bulk;
+        }
+
+        return priority_;
+    }
+
+    auto rate = bytes_ * 1000 / elapsed;
+    if (rate >= bulkRate)
+    {
+        priority_ = Priority::bulk;
+    }
+    else if (rate < bulkRate / 4)
+    {
+        // slowed down well below the rate, e.g. a reused connection
+        priority_ = Priority::normal;
+    }
+
+    bytes_ = 0;
+    startedAt_ = now;
+
+    return priority_;
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef QOS_H
+#define QOS_H
+
+#include <bitset>
+#include <string>
+
+/**
+   Event priorities of the tunnels, libevent runs the active
+   callbacks of a lower value first. The listener, the resolver
+   and the timers keep the default priority, which is normal
+ **/
+enum class Priority
+{
+    interactive = 0,
+    normal      = 1,
+    bulk        = 2
+};
+
+/**
+   How tunnels are classified, a tunnel to a port in a rule keeps
+   its class, the others turn bulk while they move more than
+   bulkRate and back to normal once they slow down
+ **/
+class QosOptions
+{
+public:
+    static constexpr int PRIORITIES = 3;
+
+    QosOptions()
+        : enabled(false),
+          bulkRate(256 * 1024)
+    {
+    }
+
+    /**
+       Set the ports of a class from a list like "22,53,5900-5999",
+       return false if it's malformed
+     **/
+    bool setInteractivePorts(const std::string &ports);
+    bool setBulkPorts(const std::string &ports);
+
+    // The class of a tunnel to port (host byte order)
+    Priority classify(unsigned short port) const;
+
+    // Whether the class of a tunnel to port is fixed by a rule
+    bool pinned(unsigned short port) const;
+
+    bool         enabled;
+    std::size_t  bulkRate;     // bytes per second
+
+private:
+    static bool parsePorts(const std::string &ports, std::bitset<65536> &out);
+
+    std::bitset<65536>  interactivePorts_;
+    std::bitset<65536>  bulkPorts_;
+};
+
+/**
+   Measure the rate of a tunnel once per interval, so a transfer
+   costs an addition and a compare
+ **/
+class FlowMeter
+{
+public:
+    static constexpr long INTERVAL = 1000;    // milliseconds
+
+    FlowMeter()
+        : bytes_(0),
+          startedAt_(-1),
+          priority_(Priority::normal)
+    {
+    }
+
+    /**
+       Called after bytes went through the tunnel, now in milliseconds,
+       return the class for the rate measured over the last interval
+     **/
+    Priority onTransfer(std::size_t bytes, long now, std::size_t bulkRate);
+
+private:
+    std::size_t  bytes_;       // bytes since startedAt_
+    long         startedAt_;   // milliseconds
+    Priority     priority_;
+};
+
+#endif /* QOS_H */
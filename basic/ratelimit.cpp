@@ -0,0 +1,214 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "ratelimit.hpp"
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+// The buckets refill every tick, a short one keeps the traffic smooth
+static constexpr int TICK_MS = 100;
+
+RateLimiter::RateLimiter(event_base *base, const Options &options)
+    : base_(base),
+      tunnel_(nullptr),
+      user_(nullptr),
+      listener_(nullptr),
+      unlimited_(nullptr),
+      listenerGroup_(nullptr)
+{
+    assert(base_ != nullptr);
+
+    RateLimit unlimited;
+    unlimited.rate = EV_RATE_LIMIT_MAX;
+    unlimited_ = newConfig(unlimited);
+
+    setOptions(options);
+}
+
+RateLimiter::~RateLimiter()
+{
+    for (auto &user : users_)
+    {
+        bufferevent_rate_limit_group_free(user.second.group);
+    }
+
+    if (listenerGroup_ != nullptr)
+    {
+        bufferevent_rate_limit_group_free(listenerGroup_);
+    }
+
+    retired_.insert(retired_.end(), {tunnel_, user_, listener_, unlimited_});
+    for (auto config : retired_)
+    {
+        if (config != nullptr)
+        {
+            ev_token_bucket_cfg_free(config);
+        }
+    }
+}
+
+void RateLimiter::setOptions(const Options &options)
+{
+    // a bufferevent keeps pointing to its config, the groups copy theirs
+    if (tunnel_ != nullptr)
+    {
+        retired_.push_back(tunnel_);
+    }
+    tunnel_ = newConfig(options.tunnel);
+
+    for (auto config : {user_, listener_})
+    {
+        if (config != nullptr)
+        {
+            ev_token_bucket_cfg_free(config);
+        }
+    }
+    user_ = newConfig(options.user);
+    listener_ = newConfig(options.listener);
+
+    for (auto &user : users_)
+    {
+        bufferevent_rate_limit_group_set_cfg(user.second.group,
+                                             user_ != nullptr ? user_ : unlimited_);
+    }
+
+    // the connections accepted so far stay in the group, without a limit if it's gone
+    if (listenerGroup_ != nullptr)
+    {
+        bufferevent_rate_limit_group_set_cfg(listenerGroup_,
+                                             listener_ != nullptr ? listener_ : unlimited_);
+    }
+    else if (listener_ != nullptr)
+    {
+        listenerGroup_ = bufferevent_rate_limit_group_new(base_, listener_);
+    }
+}
+
+ev_token_bucket_cfg *RateLimiter::newConfig(const RateLimit &limit)
+{
+    if (limit.rate == 0)
+    {
+        return nullptr;
+    }
+
+    struct timeval tick = {0, TICK_MS * 1000};
+
+    std::size_t maxRate = EV_RATE_LIMIT_MAX;
+    std::size_t ticks = 1000 / TICK_MS;
+    
+    std::size_t rate = std::min(std::max(limit.rate / ticks, std::size_t(1)), maxRate);
+    std::size_t burst = limit.burst > 0 ? limit.burst : limit.rate;
+    burst = std::min(std::max(burst, rate), maxRate);
+
+    auto config = ev_token_bucket_cfg_new(rate, burst, rate, burst, &tick);
+    if (config == nullptr)
+    {
+        LOG(ERROR) << "Invalid rate limit: rate = " << limit.rate
+                   << ", burst = " << limit.burst;
+    }
+
+    return config;
+}
+
+void RateLimiter::limitIncoming(bufferevent *conn)
+{
+    assert(conn != nullptr);
+    
+    if (listener_ != nullptr && listenerGroup_ != nullptr)
+    {
+        bufferevent_add_to_rate_limit_group(conn, listenerGroup_);
+    }
+}
+
+void RateLimiter::limitTunnel(bufferevent *inConn, bufferevent *outConn,
+                              const std::string &user)
+{
+    assert(inConn != nullptr);
+    assert(outConn != nullptr);
+    
+    if (tunnel_ != nullptr)
+    {
+        bufferevent_set_rate_limit(inConn, tunnel_);
+        bufferevent_set_rate_limit(outConn, tunnel_);
+    }
+
+    if (user.empty())
+    {
+        return;
+    }
+
+    auto it = users_.find(user);
+    if (it == users_.end())
+    {
+        auto group = bufferevent_rate_limit_group_new(base_, user_ != nullptr ? user_ : unlimited_);
+        if (group == nullptr)
+        {
+            return;
+        }
+
+        it = users_.insert(std::make_pair(user, UserGroup{group, 0})).first;
+    }
+
+    bufferevent_add_to_rate_limit_group(outConn, it->second.group);
+    ++it->second.tunnels;
+}
+
+void RateLimiter::release(bufferevent *outConn, const std::string &user)
+{
+    assert(outConn != nullptr);
+
+    auto it = users_.find(user);
+    if (it == users_.end())
+    {
+        return;
+    }
+
+    // a group is freed without members
+    bufferevent_remove_from_rate_limit_group(outConn);
+
+    assert(it->second.tunnels > 0);
+    if (--it->second.tunnels > 0)
+    {
+        return;
+    }
+
+    addTotals(it->second.group, released_[user]);
+    bufferevent_rate_limit_group_free(it->second.group);
+    users_.erase(it);
+}
+
+void RateLimiter::addTotals(bufferevent_rate_limit_group *group, Usage &usage)
+{
+    ev_uint64_t received = 0, sent = 0;
+    bufferevent_rate_limit_group_get_totals(group, &received, &sent);
+    bufferevent_rate_limit_group_reset_totals(group);
+
+    usage.received += received;
+    usage.sent += sent;
+}
+
+std::map<std::string, RateLimiter::Usage> RateLimiter::takeUsage()
+{
+    std::map<std::string, Usage> usage;
+    usage.swap(released_);
+
+    for (auto &user : users_)
+    {
+        addTotals(user.second.group, usage[user.first]);
+    }
+
+    return usage;
+}
@@ -0,0 +1,134 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+struct bufferevent_rate_limit_group;
+struct event_base;
+struct ev_token_bucket_cfg;
+
+/**
+   A token bucket, rate and burst are in bytes per second
+   and bytes, a rate of 0 means no limit
+ **/
+struct RateLimit
+{
+    RateLimit()
+        : rate(0),
+          burst(0)
+    {
+    }
+
+    std::size_t  rate;
+    std::size_t  burst;    // 0 for one second of rate
+};
+
+/**
+   Bandwidth limits of a server at three levels, built on the token
+   buckets of libevent which refill once per tick rather than per read:
+
+   - each connection of a tunnel has its own bucket, so a client
+     can't send faster than the tunnel takes in either direction
+   - the tunnels of an authenticated user share a group, which also
+     counts the bytes of the user, it's freed with the last tunnel
+   - the connections accepted by the listener share a group
+
+   A bufferevent belongs to one group at most, so the listener group
+   holds the accepted connections and the user groups the outgoing
+   ones, every byte of a tunnel goes through both
+ **/
+class RateLimiter
+{
+public:
+    struct Options
+    {
+        RateLimit  tunnel;
+        RateLimit  user;
+        RateLimit  listener;
+    };
+
+    struct Usage
+    {
+        uint64_t  received;    // bytes from the remote hosts
+        uint64_t  sent;        // bytes to the remote hosts
+    };
+
+    RateLimiter(event_base *base, const Options &options);
+    ~RateLimiter();
+
+    // disable the copy operations
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    /**
+       Change the limits, e.g. on a reload: the groups take the new
+       ones at once, a tunnel keeps the bucket it started with
+     **/
+    void setOptions(const Options &options);
+
+    // Limit a connection accepted by the listener
+    void limitIncoming(bufferevent *conn);
+
+    /**
+       Limit both connections of a tunnel,
+       user is empty if the client didn't authenticate
+     **/
+    void limitTunnel(bufferevent *inConn, bufferevent *outConn, const std::string &user);
+
+    /**
+       The tunnel of outConn closes, call it before outConn is freed,
+       a user without tunnels left gives up its group
+     **/
+    void release(bufferevent *outConn, const std::string &user);
+
+    // Bytes relayed for each user since the last call
+    std::map<std::string, Usage> takeUsage();
+
+    // The users with a group
+    std::size_t users() const
+    {
+        return users_.size();
+    }
+
+private:
+    struct UserGroup
+    {
+        bufferevent_rate_limit_group  *group;
+        std::size_t                   tunnels;
+    };
+
+    // Move the bytes counted by group into usage
+    static void addTotals(bufferevent_rate_limit_group *group, Usage &usage);
+
+    // A bucket config for limit, nullptr if there's no limit
+    static ev_token_bucket_cfg *newConfig(const RateLimit &limit);
+
+    event_base                    *base_;
+    ev_token_bucket_cfg           *tunnel_;
+    ev_token_bucket_cfg           *user_;
+    ev_token_bucket_cfg           *listener_;
+    ev_token_bucket_cfg           *unlimited_;    // of the groups without a limit, they still count
+    std::vector<ev_token_bucket_cfg *> retired_;  // of the tunnels started before a reload
+    bufferevent_rate_limit_group  *listenerGroup_;
+    std::map<std::string, UserGroup>  users_;
+    std::map<std::string, Usage>      released_;    // bytes of the groups freed since the last call
+};
+
+#endif /* RATELIMIT_H */
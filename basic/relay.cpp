@@ -0,0 +1,125 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "relay.hpp"
+#include "loopmonitor.hpp"
+
+constexpr std::size_t CbcCipher::KEY_SIZE;
+constexpr std::size_t CbcCipher::BLOCK_SIZE;
+constexpr std::size_t CbcCipher::OVERHEAD;
+constexpr std::size_t NullCipher::OVERHEAD;
+
+static bool timing = false;
+static FrameTimer::Stats stats;
+
+CbcCipher::CbcCipher(const unsigned char *key, const unsigned char *iv)
+    : encrypt_(EVP_CIPHER_CTX_new()),
+      decrypt_(EVP_CIPHER_CTX_new())
+{
+    memcpy(iv_, iv, BLOCK_SIZE);
+
+    // the key is expanded once here, a null context fails every frame
+    if (encrypt_ != nullptr &&
+        EVP_EncryptInit_ex(encrypt_, EVP_aes_256_cbc(), nullptr, key, iv_) != 1)
+    {
+        EVP_CIPHER_CTX_free(encrypt_);
+        encrypt_ = nullptr;
+    }
+
+    if (decrypt_ != nullptr &&
+        EVP_DecryptInit_ex(decrypt_, EVP_aes_256_cbc(), nullptr, key, iv_) != 1)
+    {
+        EVP_CIPHER_CTX_free(decrypt_);
+        decrypt_ = nullptr;
+    }
+}
+
+CbcCipher::~CbcCipher()
+{
+    EVP_CIPHER_CTX_free(encrypt_);
+    EVP_CIPHER_CTX_free(decrypt_);
+}
+
+int CbcCipher::seal(const unsigned char *in, std::size_t length, unsigned char *out)
+{
+    // every frame starts from the IV, the key schedule stays
+    if (encrypt_ == nullptr ||
+        EVP_EncryptInit_ex(encrypt_, nullptr, nullptr, nullptr, iv_) != 1)
+    {
+        return -1;
+    }
+
+    int length1 = 0;
+    if (EVP_EncryptUpdate(encrypt_, out, &length1, in, length) != 1)
+    {
+        return -1;
+    }
+
+    int length2 = 0;
+    if (EVP_EncryptFinal_ex(encrypt_, out + length1, &length2) != 1)
+    {
+        return -1;
+    }
+
+    return length1 + length2;
+}
+
+int CbcCipher::open(const unsigned char *in, std::size_t length, unsigned char *out)
+{
+    if (decrypt_ == nullptr ||
+        EVP_DecryptInit_ex(decrypt_, nullptr, nullptr, nullptr, iv_) != 1)
+    {
+        return -1;
+    }
+
+    int length1 = 0;
+    if (EVP_DecryptUpdate(decrypt_, out, &length1, in, length) != 1)
+    {
+        return -1;
+    }
+
+    // the padding is checked here
+    int length2 = 0;
+    if (EVP_DecryptFinal_ex(decrypt_, out + length1, &length2) != 1)
+    {
+        return -1;
+    }
+
+    return length1 + length2;
+}
+
+void FrameTimer::begin()
+{
+    start_ = LoopMonitor::now();
+}
+
+void FrameTimer::end(std::size_t bytes)
+{
+    stats.frames++;
+    stats.bytes += bytes;
+    stats.micros += LoopMonitor::now() - start_;
+}
+
+void FrameTimer::enable()
+{
+    timing = true;
+}
+
+bool FrameTimer::enabled()
+{
+    return timing;
+}
+
+FrameTimer::Stats FrameTimer::takeTotals()
+{
+    auto totals = stats;
+    stats = Stats();
+
+    return totals;
+}
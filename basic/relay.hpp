@@ -0,0 +1,382 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "compress.hpp"
+#include "zerocopy.hpp"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+/**
+   The relay of the frames of a tunnel is put together at compile time
+   from three policies, so a frame meets no virtual call and no check
+   of a setting on its way:
+
+     Cipher      seal(in, length, out) and open(in, length, out) return
+                 the bytes written to out or -1, OVERHEAD is how much
+                 longer a sealed frame may get
+     Framing     pack(in, length, packed) gives the bytes to seal,
+                 space(output, length) the bytes to open a frame into
+                 and commit(output, data, length) puts them in output
+     Instrument  begin() and end(bytes) around every frame
+
+   A frame on the wire is a 4 bytes length in network order followed
+   by the sealed bytes
+ **/
+
+/**
+   AES-256-CBC of every frame with the same key and IV, the cipher of
+   the peer. The contexts keep the key schedule, a frame only sets the
+   IV again
+ **/
+class CbcCipher
+{
+public:
+    static constexpr std::size_t  KEY_SIZE   = 32;
+    static constexpr std::size_t  BLOCK_SIZE = 16;
+    static constexpr std::size_t  OVERHEAD   = BLOCK_SIZE;
+
+    CbcCipher(const unsigned char *key, const unsigned char *iv);
+    ~CbcCipher();
+
+    // disable the copy operations
+    CbcCipher(const CbcCipher &) = delete;
+    CbcCipher &operator=(const CbcCipher &) = delete;
+
+    int seal(const unsigned char *in, std::size_t length, unsigned char *out);
+
+    // out holds length + OVERHEAD bytes, as openssl asks
+    int open(const unsigned char *in, std::size_t length, unsigned char *out);
+
+private:
+    unsigned char   iv_[BLOCK_SIZE];
+    EVP_CIPHER_CTX  *encrypt_;
+    EVP_CIPHER_CTX  *decrypt_;
+};
+
+/**
+   The frames as they are, for the tests and the benchmarks of the
+   relay without the cost of the cipher
+ **/
+class NullCipher
+{
+public:
+    static constexpr std::size_t  OVERHEAD = 0;
+
+    int seal(const unsigned char *in, std::size_t length, unsigned char *out)
+    {
+        memcpy(out, in, length);
+        return static_cast<int>(length);
+    }
+
+    int open(const unsigned char *in, std::size_t length, unsigned char *out)
+    {
+        memcpy(out, in, length);
+        return static_cast<int>(length);
+    }
+};
+
+/**
+   The data of a frame as the client sent it, a frame is opened right
+   into the output of the connection
+ **/
+class RawFrames
+{
+public:
+    const unsigned char *pack(const unsigned char *in, std::size_t length, std::size_t &packed)
+    {
+        packed = length;
+        return in;
+    }
+
+    unsigned char *space(evbuffer *output, std::size_t length)
+    {
+        if (evbuffer_reserve_space(output, length, &reserved_, 1) < 1)
+        {
+            return nullptr;
+        }
+
+        return static_cast<unsigned char *>(reserved_.iov_base);
+    }
+
+    bool commit(evbuffer *output, unsigned char *, std::size_t length)
+    {
+        reserved_.iov_len = length;
+        return evbuffer_commit_space(output, &reserved_, 1) == 0;
+    }
+
+private:
+    evbuffer_iovec  reserved_;
+};
+
+/**
+   The data of a frame compressed by a FrameCompressor, the flag byte
+   in front tells whether it's deflated
+ **/
+class CompressedFrames
+{
+public:
+    explicit CompressedFrames(FrameCompressor &compressor)
+        : compressor_(compressor)
+    {
+    }
+
+    const unsigned char *pack(const unsigned char *in, std::size_t length, std::size_t &packed)
+    {
+        if (!compressor_.compress(in, length, packed_))
+        {
+            return nullptr;
+        }
+
+        packed = packed_.size();
+        return packed_.data();
+    }
+
+    unsigned char *space(evbuffer *, std::size_t length)
+    {
+        sealed_.resize(length);
+        return sealed_.data();
+    }
+
+    bool commit(evbuffer *output, unsigned char *data, std::size_t length)
+    {
+        if (!compressor_.decompress(data, length, packed_))
+        {
+            return false;
+        }
+
+        return evbuffer_add(output, packed_.data(), packed_.size()) == 0;
+    }
+
+private:
+    FrameCompressor                 &compressor_;
+    std::vector<unsigned char>      packed_;    // the last frame compressed or inflated
+    std::vector<unsigned char>      sealed_;    // the last frame opened
+};
+
+/**
+   No instrumentation, the calls are compiled away
+ **/
+class NoInstrument
+{
+public:
+    void begin()
+    {
+    }
+
+    void end(std::size_t)
+    {
+    }
+};
+
+/**
+   Count the frames and the microseconds spent on them, the counters
+   of all the relays are logged with the statistics of the event loop
+ **/
+class FrameTimer
+{
+public:
+    struct Stats
+    {
+        uint64_t  frames;
+        uint64_t  bytes;      // bytes of the frames read
+        uint64_t  micros;
+    };
+
+    FrameTimer()
+        : start_(0)
+    {
+    }
+
+    void begin();
+
+    void end(std::size_t bytes);
+
+    // Turn the timing of the frames on for the whole process
+    static void enable();
+
+    static bool enabled();
+
+    // Counters of all the relays of the process since the last call
+    static Stats takeTotals();
+
+private:
+    uint64_t  start_;
+};
+
+/**
+   Move the data of one connection to another, sealing it into frames
+   or opening the frames
+ **/
+template <class Cipher, class Framing, class Instrument>
+class FrameRelay
+{
+public:
+    static constexpr std::size_t LEN_BYTES = 4;
+
+    FrameRelay(Cipher &cipher, Framing &framing, Instrument &instrument)
+        : cipher_(cipher),
+          framing_(framing),
+          instrument_(instrument)
+    {
+    }
+
+    /**
+       Seal the input of inConn into one frame to outConn, through
+       sender if it isn't null, return false on failure
+     **/
+    bool seal(bufferevent *inConn, bufferevent *outConn, ZeroCopySender *sender);
+
+    /**
+       Open the whole frames in the input of inConn to outConn, a
+       partial frame waits for the rest, return false on failure
+     **/
+    bool open(bufferevent *inConn, bufferevent *outConn);
+
+private:
+    Cipher      &cipher_;
+    Framing     &framing_;
+    Instrument  &instrument_;
+};
+
+template <class Cipher, class Framing, class Instrument>
+constexpr std::size_t FrameRelay<Cipher, Framing, Instrument>::LEN_BYTES;
+
+template <class Cipher, class Framing, class Instrument>
+bool FrameRelay<Cipher, Framing, Instrument>::seal(bufferevent *inConn, bufferevent *outConn,
+                                                   ZeroCopySender *sender)
+{
+    auto input = bufferevent_get_input(inConn);
+    auto length = evbuffer_get_length(input);
+    if (length == 0)
+    {
+        return true;
+    }
+
+    instrument_.begin();
+
+    auto in = evbuffer_pullup(input, -1);
+    std::size_t packedLength = 0;
+    auto packed = framing_.pack(in, length, packedLength);
+    if (packed == nullptr)
+    {
+        return false;
+    }
+
+    auto frameLength = LEN_BYTES + packedLength + Cipher::OVERHEAD;
+
+    // the sender keeps the frame until the kernel has sent it
+    if (sender != nullptr)
+    {
+        auto frame = ZeroCopySender::BufferPtr(new ZeroCopySender::Buffer(frameLength));
+        int sealed = cipher_.seal(packed, packedLength, frame->data() + LEN_BYTES);
+        if (sealed < 0)
+        {
+            return false;
+        }
+
+        uint32_t sealedNetwork = htonl(sealed);
+        memcpy(frame->data(), &sealedNetwork, LEN_BYTES);
+        frame->resize(LEN_BYTES + sealed);
+
+        if (!sender->send(std::move(frame)))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // the frame is sealed right into the output
+        auto output = bufferevent_get_output(outConn);
+
+        evbuffer_iovec reserved;
+        if (evbuffer_reserve_space(output, frameLength, &reserved, 1) < 1)
+        {
+            return false;
+        }
+
+        auto out = static_cast<unsigned char *>(reserved.iov_base);
+        int sealed = cipher_.seal(packed, packedLength, out + LEN_BYTES);
+        if (sealed < 0)
+        {
+            return false;
+        }
+
+        uint32_t sealedNetwork = htonl(sealed);
+        memcpy(out, &sealedNetwork, LEN_BYTES);
+
+        reserved.iov_len = LEN_BYTES + sealed;
+        if (evbuffer_commit_space(output, &reserved, 1) != 0)
+        {
+            return false;
+        }
+    }
+
+    evbuffer_drain(input, length);
+    instrument_.end(length);
+
+    return true;
+}
+
+template <class Cipher, class Framing, class Instrument>
+bool FrameRelay<Cipher, Framing, Instrument>::open(bufferevent *inConn, bufferevent *outConn)
+{
+    auto input = bufferevent_get_input(inConn);
+    auto output = bufferevent_get_output(outConn);
+
+    while (true)
+    {
+        auto available = evbuffer_get_length(input);
+        if (available <= LEN_BYTES)
+        {
+            return true;
+        }
+
+        uint32_t lengthNetwork = 0;
+        evbuffer_copyout(input, &lengthNetwork, LEN_BYTES);
+        std::size_t length = ntohl(lengthNetwork);
+        if (available < LEN_BYTES + length)
+        {
+            return true;
+        }
+
+        instrument_.begin();
+
+        auto frame = evbuffer_pullup(input, LEN_BYTES + length);
+        // room for a whole block more, as openssl asks of the output
+        auto out = framing_.space(output, length + Cipher::OVERHEAD);
+        if (frame == nullptr || out == nullptr)
+        {
+            return false;
+        }
+
+        int opened = cipher_.open(frame + LEN_BYTES, length, out);
+        if (opened < 0 || !framing_.commit(output, out, opened))
+        {
+            return false;
+        }
+
+        evbuffer_drain(input, LEN_BYTES + length);
+        instrument_.end(LEN_BYTES + length);
+    }
+}
+
+#endif /* RELAY_H */
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "routes.hpp"
+
+#include <glog/logging.h>
+
+// the tunnel is the action of the destinations no rule matches
+static constexpr const char *TUNNEL = "tunnel";
+static constexpr const char *DIRECT = "direct";
+
+constexpr std::size_t Routes::CACHE_SIZE;
+
+Routes::Routes(event_base *base)
+    : stats_(),
+      reload_(base)
+{
+}
+
+std::unique_ptr<Acl> Routes::build(const char *data, std::size_t length, std::string &error)
+{
+    return Acl::build(data, length, error, TUNNEL, DIRECT);
+}
+
+std::unique_ptr<Acl> Routes::load(const std::string &path, std::string &error)
+{
+    return Acl::load(path, error, TUNNEL, DIRECT);
+}
+
+void Routes::setTable(std::unique_ptr<Acl> table)
+{
+    table_ = std::move(table);
+    cache_.clear();
+}
+
+bool Routes::reload(const std::string &path)
+{
+    auto work = [this, path]() {
+        reloaded_ = load(path, reloadError_);
+    };
+
+    auto done = [this]() {
+        if (reloaded_ == nullptr)
+        {
+            LOG(ERROR) << "Failed to reload the routes, keep the "
+                       << size() << " rules loaded: " << reloadError_;
+            return;
+        }
+
+        stats_.reloads++;
+        setTable(std::move(reloaded_));
+
+        LOG(WARNING) << "Reload the routes: " << size() << " rules";
+    };
+
+    return reload_.run(work, done);
+}
+
+Routes::Route Routes::route(const Address &destination)
+{
+    stats_.lookups++;
+
+    auto route = lookup(destination);
+    if (route == Route::direct)
+    {
+        stats_.direct++;
+    }
+
+    return route;
+}
+
+Routes::Route Routes::lookup(const Address &destination)
+{
+    if (table_ == nullptr)
+    {
+        return Route::tunnel;
+    }
+
+    if (destination.type() != Address::Type::domain)
+    {
+        return table_->check(destination) == Acl::Action::deny ? Route::direct : Route::tunnel;
+    }
+
+    // the host string may be padded with zeros
+    auto host = destination.host();
+    std::string key(host.c_str());
+    key += ':';
+    key += std::to_string(destination.port());
+
+    auto cached = cache_.find(key);
+    if (cached != cache_.end())
+    {
+        stats_.cacheHits++;
+        return cached->second;
+    }
+
+    auto route = table_->check(destination) == Acl::Action::deny ? Route::direct : Route::tunnel;
+    if (cache_.size() >= CACHE_SIZE)
+    {
+        cache_.clear();
+    }
+    cache_.emplace(std::move(key), route);
+
+    return route;
+}
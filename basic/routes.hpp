@@ -0,0 +1,109 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include "acl.hpp"
+#include "address.hpp"
+#include "background.hpp"
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/**
+   Forward declaration
+ **/
+struct event_base;
+
+/**
+   Where the local server sends each destination, one rule per line:
+
+     direct  192.168.0.0/16
+     direct  cn
+     tunnel  google.cn
+     direct  *               53
+
+   The rules are those of an Acl with "direct" and "tunnel" as the
+   actions, so a destination no rule matches goes through the tunnel.
+   The answers for domains are cached until the next reload
+ **/
+class Routes
+{
+public:
+    enum class Route { direct, tunnel };
+
+    // Domains cached before the cache starts over
+    static constexpr std::size_t CACHE_SIZE = 4096;
+
+    struct Stats
+    {
+        uint64_t  lookups;
+        uint64_t  cacheHits;
+        uint64_t  direct;
+        uint64_t  reloads;
+    };
+
+    // A reload finishes in the event loop of base
+    explicit Routes(event_base *base);
+
+    // disable the copy operations
+    Routes(const Routes &) = delete;
+    Routes &operator=(const Routes &) = delete;
+
+    /**
+       Compile the text of a routes file,
+       return nullptr and set error if a line is malformed
+     **/
+    static std::unique_ptr<Acl> build(const char *data, std::size_t length,
+                                      std::string &error);
+
+    // Compile a routes file
+    static std::unique_ptr<Acl> load(const std::string &path, std::string &error);
+
+    // Replace the table, e.g. with one loaded at startup
+    void setTable(std::unique_ptr<Acl> table);
+
+    /**
+       Load path again in another thread and swap the table in
+       the event loop once it's built, a broken file keeps the old
+       table. Return false if a reload is already running
+     **/
+    bool reload(const std::string &path);
+
+    // The route of a destination requested by a client
+    Route route(const Address &destination);
+
+    // Number of rules
+    std::size_t size() const
+    {
+        return table_ != nullptr ? table_->size() : 0;
+    }
+
+    const Stats &stats() const
+    {
+        return stats_;
+    }
+
+private:
+    // The route of destination from the cache or the table
+    Route lookup(const Address &destination);
+
+    std::unique_ptr<Acl>                    table_;
+    std::unordered_map<std::string, Route>  cache_;     // by "domain:port"
+    Stats                                   stats_;
+    std::unique_ptr<Acl>                    reloaded_;  // built by the reload thread
+    std::string                             reloadError_;
+    BackgroundTask                          reload_;    // joined before the fields above go
+};
+
+#endif /* ROUTES_H */
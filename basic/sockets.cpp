@@ -10,56 +10,475 @@
 #include "sockets.hpp"
 
 #include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
 #include <string.h>
 
+#include <algorithm>
+#include <unordered_set>
+
+#include <glog/logging.h>
+
 #include <event2/util.h>
 
-int createListeningSocket(const char *hostname, const char *service)
+bool resolveListenEndpoint(const ListenEndpoint &endpoint,
+                           std::vector<sockaddr_storage> &addresses)
 {
     struct addrinfo hints;
     
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
     
+    // an empty host is the wildcard address of each family
+    auto host = endpoint.host().empty() ? nullptr : endpoint.host().c_str();
+
     struct addrinfo *servinfo;
-    int status = getaddrinfo(hostname, service, &hints, &servinfo);
+    int status = getaddrinfo(host, endpoint.port().c_str(), &hints, &servinfo);
     if(status != 0)
     {
-        return -1;
+        return false;
     }
 
-    int sockfd;
-    struct addrinfo *ptr;
-    for(ptr = servinfo; ptr != nullptr; ptr = ptr->ai_next)
+    for(auto ptr = servinfo; ptr != nullptr; ptr = ptr->ai_next)
     {
-        sockfd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (sockfd != -1)
+        sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        memcpy(&address, ptr->ai_addr, ptr->ai_addrlen);
+
+        // a host may resolve to the same address more than once
+        auto same = [&address, ptr](const sockaddr_storage &other) {
+            return memcmp(&other, &address, ptr->ai_addrlen) == 0;
+        };
+        if (std::none_of(addresses.begin(), addresses.end(), same))
         {
-            if (evutil_make_socket_nonblocking(sockfd) == 0
-                && ::bind(sockfd, ptr->ai_addr, ptr->ai_addrlen) == 0)
-            {
-                break;
-            }
-            
-            ::close(sockfd);
-            sockfd = -1;
-        }        
+            addresses.push_back(address);
+        }
     }
     
     freeaddrinfo(servinfo);
+    return true;
+}
+
+int createListeningSocket(const sockaddr_storage &address, bool v6Only,
+                          const ListenOptions &options)
+{
+    socklen_t length = address.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+
+    int sockfd = ::socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    // a restart binds again while the old connections are in TIME_WAIT
+    if (evutil_make_listen_socket_reuseable(sockfd) != 0)
+    {
+        ::close(sockfd);
+        return -1;
+    }
+
+    if (address.ss_family == AF_INET6)
+    {
+        int on = v6Only ? 1 : 0;
+        ::setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+    }
+
+    if (::bind(sockfd, reinterpret_cast<const sockaddr *>(&address), length) != 0)
+    {
+        int err = errno;
+        ::close(sockfd);
+        errno = err;
+        return -1;
+    }
+
+    /**
+       clients without a cookie still connect with a normal handshake,
+       so a kernel without TCP_FASTOPEN only costs us the feature
+    **/
+    if (options.fastOpen > 0)
+    {
+        int qlen = options.fastOpen;
+        if (::setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0)
+        {
+            int err = EVUTIL_SOCKET_ERROR();
+            LOG(WARNING) << "Failed to enable TCP Fast Open on the listening socket: "
+                         << evutil_socket_error_to_string(err);
+        }
+    }
+
+    /**
+       the kernel holds a connection back until its first bytes arrive,
+       the clients speak first so the accept and the read come together
+    **/
+    if (options.deferAccept > 0)
+    {
+        int seconds = options.deferAccept;
+        if (::setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) != 0)
+        {
+            int err = EVUTIL_SOCKET_ERROR();
+            LOG(WARNING) << "Failed to defer the accept on the listening socket: "
+                         << evutil_socket_error_to_string(err);
+        }
+    }
     
     return sockfd;    
 }
 
-int createListeningSocket(const std::string &hostname, const std::string &service)
+int createUnixListeningSocket(const ListenEndpoint &endpoint)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    auto &path = endpoint.path();
+    if (path.size() > sizeof(address.sun_path) - (endpoint.abstract() ? 0 : 1))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // an abstract name starts with a NUL instead of the '@', it has no file
+    memcpy(address.sun_path, path.data(), path.size());
+    socklen_t length = offsetof(sockaddr_un, sun_path) + path.size();
+    if (endpoint.abstract())
+    {
+        address.sun_path[0] = '\0';
+    }
+    else
+    {
+        length++;
+    }
+
+    int sockfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    auto bound = ::bind(sockfd, reinterpret_cast<sockaddr *>(&address), length) == 0;
+
+    /**
+       the socket file of a server that's gone refuses connections,
+       it's removed and bound again. A live server keeps its file
+    **/
+    struct stat info;
+    if (!bound && errno == EADDRINUSE && !endpoint.abstract() &&
+        ::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe != -1 &&
+            ::connect(probe, reinterpret_cast<sockaddr *>(&address), length) != 0 &&
+            errno == ECONNREFUSED)
+        {
+            ::unlink(path.c_str());
+            bound = ::bind(sockfd, reinterpret_cast<sockaddr *>(&address), length) == 0;
+        }
+        else
+        {
+            errno = EADDRINUSE;
+        }
+
+        if (probe != -1)
+        {
+            ::close(probe);
+        }
+    }
+
+    if (!bound)
+    {
+        int err = errno;
+        ::close(sockfd);
+        errno = err;
+        return -1;
+    }
+
+    return sockfd;
+}
+
+bool isUnixSocket(int fd)
 {
-    return createListeningSocket(hostname.c_str(), service.c_str());
+    int domain = 0;
+    socklen_t length = sizeof(domain);
+
+    return ::getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
+}
+
+int createConnectingSocket(int family, bool fastOpen)
+{
+    int sockfd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    /**
+       connect() returns at once without sending the SYN, the first
+       write sends it with the data. Without a cookie the kernel falls
+       back to a normal handshake by itself
+    **/
+    if (fastOpen)
+    {
+        int on = 1;
+        if (::setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) != 0)
+        {
+            static bool warned = false;
+            if (!warned)
+            {
+                int err = EVUTIL_SOCKET_ERROR();
+                LOG(WARNING) << "TCP Fast Open is not available for outgoing connections: "
+                             << evutil_socket_error_to_string(err);
+                warned = true;
+            }
+        }
+    }
+
+    return sockfd;
+}
+
+/**
+   Set a socket option, a failure is logged once for each option
+   since it's most likely the kernel doesn't support it
+ **/
+static void setOption(int fd, int level, int option, const void *value,
+                      socklen_t length, const char *name)
+{
+    static std::unordered_set<std::string> warned;
+
+    if (::setsockopt(fd, level, option, value, length) != 0 &&
+        warned.insert(name).second)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        LOG(WARNING) << "Failed to set " << name << " on socket-" << fd << ": "
+                     << evutil_socket_error_to_string(err);
+    }
+}
+
+static void setIntOption(int fd, int level, int option, int value, const char *name)
+{
+    setOption(fd, level, option, &value, sizeof(value), name);
+}
+
+void applySocketOptions(int fd, const SocketOptions &options)
+{
+    if (options.noDelay)
+    {
+        setIntOption(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+    if (options.notSentLowat > 0)
+    {
+        setIntOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat,
+                     "TCP_NOTSENT_LOWAT");
+    }
+
+    if (options.keepAlive > 0)
+    {
+        setIntOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        setIntOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepAlive, "TCP_KEEPIDLE");
+        setIntOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveInterval,
+                     "TCP_KEEPINTVL");
+        setIntOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount, "TCP_KEEPCNT");
+    }
+
+    if (!options.congestion.empty())
+    {
+        setOption(fd, IPPROTO_TCP, TCP_CONGESTION, options.congestion.c_str(),
+                  options.congestion.size(), "TCP_CONGESTION");
+    }
+
+    if (options.sendBuffer > 0)
+    {
+        setIntOption(fd, SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF");
+    }
+
+    if (options.receiveBuffer > 0)
+    {
+        setIntOption(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer, "SO_RCVBUF");
+    }
+}
+
+bool sampleTcpInfo(int fd, TcpSample &sample)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, len);
+    if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    {
+        return false;
+    }
+
+    sample.rtt = info.tcpi_rtt;
+    sample.rate = info.tcpi_delivery_rate;
+    sample.appLimited = info.tcpi_delivery_rate_app_limited;
+
+    // older kernels don't report the delivery rate, estimate it from cwnd
+    if (sample.rate == 0 && sample.rtt > 0)
+    {
+        sample.rate = static_cast<uint64_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss
+            * 1000000 / sample.rtt;
+    }
+
+    return true;
+}
+
+constexpr std::size_t  SocketTuner::SAMPLE_BYTES;
+constexpr long         SocketTuner::SAMPLE_INTERVAL;
+constexpr int          SocketTuner::MIN_BUFFER;
+constexpr int          SocketTuner::MIN_LOWAT;
+
+/**
+   Whether value is at least a quarter away from current,
+   so that a noisy sample doesn't cost a setsockopt()
+ **/
+static bool farFrom(int value, int current)
+{
+    return value > current + current / 4 || value < current - current / 4;
+}
+
+void SocketTuner::onTransfer(int fd, const SocketOptions &options,
+                             std::size_t bytes, long now)
+{
+    if (!options.adaptive || fd == -1)
+    {
+        return;
+    }
+
+    bytes_ += bytes;
+    if (bytes_ < SAMPLE_BYTES || now - sampledAt_ < SAMPLE_INTERVAL)
+    {
+        return;
+    }
+    bytes_ = 0;
+    sampledAt_ = now;
+
+    // a rate the tunnel held down says nothing of the path
+    TcpSample sample;
+    if (!sampleTcpInfo(fd, sample) || sample.rtt == 0 || sample.rate == 0 ||
+        sample.appLimited)
+    {
+        return;
+    }
+
+    auto maxBuffer = static_cast<uint64_t>(std::max(options.maxBuffer, MIN_BUFFER));
+    auto bdp = std::min(sample.rate * sample.rtt / 1000000, maxBuffer);
+
+    /**
+       the send buffer holds two round trips, one in flight and one
+       waiting for acks. The unsent part only needs to cover what
+       goes out between two wakeups of the event loop
+    **/
+    int sendBuffer = static_cast<int>(std::min(std::max<uint64_t>(2 * bdp, MIN_BUFFER),
+                                               maxBuffer));
+    int notSentLowat = static_cast<int>(std::max<uint64_t>(bdp / 4, MIN_LOWAT));
+
+    // never below what the kernel has grown the buffer to by itself
+    int current = 0;
+    socklen_t length = sizeof(current);
+    if (sendBuffer > sendBuffer_ && farFrom(sendBuffer, sendBuffer_) &&
+        ::getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &current, &length) == 0 &&
+        sendBuffer > current)
+    {
+        setIntOption(fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, "SO_SNDBUF");
+        sendBuffer_ = sendBuffer;
+    }
+
+    if (farFrom(notSentLowat, notSentLowat_))
+    {
+        setIntOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notSentLowat, "TCP_NOTSENT_LOWAT");
+        notSentLowat_ = notSentLowat;
+    }
+
+    LOG(INFO) << "Tune socket-" << fd << ": rtt = " << sample.rtt << "us, rate = "
+            << sample.rate << "B/s, sndbuf = " << sendBuffer
+            << ", notsent_lowat = " << notSentLowat;
+}
+
+int createUdpSocket(const Address &address)
+{
+    sockaddr_storage storage;
+    socklen_t length = toSockaddr(address, &storage);
+    if (length == 0)
+    {
+        return -1;
+    }
+
+    int sockfd = ::socket(storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    // ipv4 destinations go out as v4-mapped addresses
+    if (storage.ss_family == AF_INET6)
+    {
+        int off = 0;
+        ::setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+
+    if (::bind(sockfd, reinterpret_cast<sockaddr *>(&storage), length) != 0)
+    {
+        ::close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+socklen_t toSockaddr(const Address &address, sockaddr_storage *storage)
+{
+    memset(storage, 0, sizeof(*storage));
+
+    if (address.type() == Address::Type::ipv4)
+    {
+        auto sin = reinterpret_cast<sockaddr_in *>(storage);
+        auto host = address.toRawIPv4();
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = address.portNetworkOrder();
+        memcpy(&sin->sin_addr, host.data(), host.size());
+
+        return sizeof(sockaddr_in);
+    }
+    else if (address.type() == Address::Type::ipv6)
+    {
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(storage);
+        auto host = address.toRawIPv6();
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = address.portNetworkOrder();
+        memcpy(&sin6->sin6_addr, host.data(), host.size());
+
+        return sizeof(sockaddr_in6);
+    }
+
+    return 0;
+}
+
+bool setPort(sockaddr_storage *address, unsigned short port)
+{
+    if (address->ss_family == AF_INET)
+    {
+        reinterpret_cast<sockaddr_in *>(address)->sin_port = port;
+        return true;
+    }
+    else if (address->ss_family == AF_INET6)
+    {
+        reinterpret_cast<sockaddr_in6 *>(address)->sin6_port = port;
+        return true;
+    }
+
+    return false;
 }
 
 Address getSocketLocalAddress(int fd)
@@ -11,16 +11,167 @@
 #define SOCKETS_H
 
 #include "address.hpp"
+#include "endpoint.hpp"
+
+#include <stdint.h>
 
 #include <string>
+#include <vector>
 #include <arpa/inet.h>
 
 /**
-    Create the listening socket and make it nonblocking
+    Options of the listening socket
+ **/
+struct ListenOptions
+{
+    ListenOptions()
+        : fastOpen(0),
+          backlog(-1),
+          deferAccept(0)
+    {
+    }
+
+    int  fastOpen;      // TCP_FASTOPEN queue length, 0 to disable
+    int  backlog;       // queue length of listen(), -1 for the libevent default
+    int  deferAccept;   // seconds of TCP_DEFER_ACCEPT, 0 to wake on the handshake
+};
+
+/**
+    Options of the accepted and outgoing sockets,
+    zero or empty leaves the kernel default
+ **/
+struct SocketOptions
+{
+    SocketOptions()
+        : noDelay(true),
+          notSentLowat(0),
+          keepAlive(0),
+          keepAliveInterval(10),
+          keepAliveCount(3),
+          sendBuffer(0),
+          receiveBuffer(0),
+          adaptive(false),
+          maxBuffer(4 * 1024 * 1024)
+    {
+    }
+
+    bool         noDelay;            // TCP_NODELAY
+    int          notSentLowat;       // TCP_NOTSENT_LOWAT, bytes
+    int          keepAlive;          // idle seconds before the first probe
+    int          keepAliveInterval;  // seconds between probes
+    int          keepAliveCount;     // probes before the connection is dropped
+    std::string  congestion;         // TCP_CONGESTION, e.g. "bbr"
+    int          sendBuffer;         // SO_SNDBUF, bytes
+    int          receiveBuffer;      // SO_RCVBUF, bytes
+    bool         adaptive;           // tune busy sockets with TCP_INFO
+    int          maxBuffer;          // upper bound of the tuned buffers
+};
+
+/**
+    Apply the options to a connected or connecting socket,
+    an option the kernel refuses is logged once and skipped
+ **/
+void applySocketOptions(int fd, const SocketOptions &options);
+
+/**
+    Round trip time and delivery rate of a connection
+ **/
+struct TcpSample
+{
+    uint32_t  rtt;         // microseconds
+    uint64_t  rate;        // bytes per second
+    bool      appLimited;  // the sender, not the network, held the rate down
+};
+
+/**
+    Read TCP_INFO of the socket, return false on failure
+ **/
+bool sampleTcpInfo(int fd, TcpSample &sample);
+
+/**
+    Size the send buffer and TCP_NOTSENT_LOWAT of a socket to its
+    bandwidth-delay product. A socket is sampled only after it has
+    sent a number of bytes and some time has passed, so idle and
+    short connections never pay for getsockopt(). The send buffer
+    only grows past the size the kernel gave it, since a set size
+    turns off its autotuning
+ **/
+class SocketTuner
+{
+public:
+    static constexpr std::size_t  SAMPLE_BYTES     = 256 * 1024;
+    static constexpr long         SAMPLE_INTERVAL  = 1000;         // milliseconds
+    static constexpr int          MIN_BUFFER       = 64 * 1024;
+    static constexpr int          MIN_LOWAT        = 16 * 1024;
+
+    SocketTuner()
+        : bytes_(0),
+          sampledAt_(0),
+          sendBuffer_(0),
+          notSentLowat_(0)
+    {
+    }
+
+    // Called after bytes were queued on fd, now in milliseconds
+    void onTransfer(int fd, const SocketOptions &options, std::size_t bytes, long now);
+
+private:
+    std::size_t  bytes_;          // bytes queued since the last sample
+    long         sampledAt_;      // milliseconds
+    int          sendBuffer_;     // last value we set
+    int          notSentLowat_;   // last value we set
+};
+
+/**
+    Resolve a tcp endpoint to every address it listens on,
+    Returns false if it doesn't resolve
+ **/
+bool resolveListenEndpoint(const ListenEndpoint &endpoint,
+                           std::vector<sockaddr_storage> &addresses);
+
+/**
+    Create a tcp listening socket bound to address, nonblocking and closed
+    on exec. With v6Only an ipv6 socket leaves ipv4 to another socket
     Returns the listening socket descriptor on success, -1 on failure
  **/
-int createListeningSocket(const char *hostname, const char *service);
-int createListeningSocket(const std::string &hostname, const std::string &service);
+int createListeningSocket(const sockaddr_storage &address, bool v6Only,
+                          const ListenOptions &options = ListenOptions());
+
+/**
+    Create a unix stream listening socket, nonblocking and closed on exec.
+    A stale socket file at path is replaced, one a server listens on isn't
+    Returns the listening socket descriptor on success, -1 on failure
+ **/
+int createUnixListeningSocket(const ListenEndpoint &endpoint);
+
+// Whether fd is a unix domain socket
+bool isUnixSocket(int fd);
+
+/**
+    Create a nonblocking socket for an outgoing connection,
+    with fastOpen the data of the first write goes out in the SYN
+    Returns the socket descriptor on success, -1 on failure
+ **/
+int createConnectingSocket(int family, bool fastOpen);
+
+/**
+    Create a nonblocking udp socket bound to address, the port may be 0.
+    An unspecified ipv6 address gives a dual stack socket
+    Returns the socket descriptor on success, -1 on failure
+ **/
+int createUdpSocket(const Address &address);
+
+/**
+    Fill storage with an ip address,
+    Returns the length of the address, 0 if it's not an ip address
+ **/
+socklen_t toSockaddr(const Address &address, sockaddr_storage *storage);
+
+/**
+    Set the port of an ip address, port in network byte order
+    Returns false if it's not an ip address
+ **/
+bool setPort(sockaddr_storage *address, unsigned short port);
 
 Address getSocketLocalAddress(int fd);
 
@@ -0,0 +1,222 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "sourcelimit.hpp"
+
+#include <assert.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <random>
+
+constexpr int SourceLimiter::PROBES;
+constexpr int SourceLimiter::NONE;
+
+SourceLimiter::SourceLimiter(const Options &options)
+    : options_(options),
+      mask_(0),
+      seed_(0),
+      stats_()
+{
+    options_.burst = std::max(options_.burst, std::max(options_.rate, 1.0));
+
+    std::size_t size = PROBES;
+    while (size < options_.slots)
+    {
+        size *= 2;
+    }
+
+    Slot empty;
+    memset(&empty, 0, sizeof(empty));
+    slots_.assign(size, empty);
+    mask_ = size - 1;
+
+    std::random_device random;
+    seed_ = (static_cast<uint64_t>(random()) << 32) | random();
+}
+
+void SourceLimiter::setLimits(const Options &options)
+{
+    options_.maxConnections = options.maxConnections;
+    options_.rate = options.rate;
+    options_.burst = std::max(options.burst, std::max(options.rate, 1.0));
+}
+
+bool SourceLimiter::keyOf(const sockaddr *address, Key &key)
+{
+    key.fill(0);
+
+    if (address->sa_family == AF_INET)
+    {
+        // the form of an IPv4 address mapped into IPv6
+        auto ipv4 = reinterpret_cast<const sockaddr_in *>(address);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(&key[12], &ipv4->sin_addr, 4);
+        return true;
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        auto ipv6 = reinterpret_cast<const sockaddr_in6 *>(address);
+        if (IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr))
+        {
+            memcpy(key.data(), &ipv6->sin6_addr, 16);
+        }
+        else
+        {
+            memcpy(key.data(), &ipv6->sin6_addr, 8);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+std::size_t SourceLimiter::hash(const Key &key) const
+{
+    // FNV-1a from a random basis
+    uint64_t hash = 14695981039346656037ULL ^ seed_;
+    for (auto byte : key)
+    {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    }
+
+    return static_cast<std::size_t>(hash ^ (hash >> 32));
+}
+
+int SourceLimiter::find(const Key &key) const
+{
+    auto start = hash(key);
+    for (int i = 0; i < PROBES; i++)
+    {
+        auto index = (start + i) & mask_;
+        if (slots_[index].used && slots_[index].key == key)
+        {
+            return static_cast<int>(index);
+        }
+    }
+
+    return NONE;
+}
+
+bool SourceLimiter::admit(const sockaddr *address, long now, int &slot)
+{
+    slot = NONE;
+
+    Key key;
+    if (!keyOf(address, key))
+    {
+        stats_.admitted++;
+        return true;
+    }
+
+    int index = find(key);
+    if (index == NONE)
+    {
+        // a free slot, or the one idle for the longest time
+        auto start = hash(key);
+        for (int i = 0; i < PROBES; i++)
+        {
+            auto candidate = static_cast<int>((start + i) & mask_);
+            auto &entry = slots_[candidate];
+            if (!entry.used)
+            {
+                index = candidate;
+                break;
+            }
+
+            if (entry.connections == 0 &&
+                (index == NONE || entry.updated < slots_[index].updated))
+            {
+                index = candidate;
+            }
+        }
+
+        if (index == NONE)
+        {
+            stats_.untracked++;
+            stats_.admitted++;
+            return true;
+        }
+
+        auto &entry = slots_[index];
+        entry.key = key;
+        entry.used = true;
+        entry.connections = 0;
+        entry.tokens = options_.burst;
+        entry.updated = now;
+    }
+
+    auto &entry = slots_[index];
+    if (options_.maxConnections > 0 && entry.connections >= options_.maxConnections)
+    {
+        stats_.overConnections++;
+        return false;
+    }
+
+    if (options_.rate > 0)
+    {
+        auto elapsed = std::max(now - entry.updated, 0L);
+        entry.tokens = std::min(options_.burst, entry.tokens + elapsed * options_.rate / 1000);
+        entry.updated = now;
+
+        if (entry.tokens < 1)
+        {
+            stats_.overRate++;
+            return false;
+        }
+        entry.tokens -= 1;
+    }
+    else
+    {
+        entry.updated = now;
+    }
+
+    entry.connections++;
+    stats_.admitted++;
+    slot = index;
+
+    return true;
+}
+
+void SourceLimiter::release(int slot)
+{
+    if (slot == NONE)
+    {
+        return;
+    }
+
+    // a slot with open connections is never taken by another source
+    auto &entry = slots_[slot];
+    assert(entry.used && entry.connections > 0);
+
+    entry.connections--;
+}
+
+std::size_t SourceLimiter::connections(const sockaddr *address) const
+{
+    Key key;
+    if (!keyOf(address, key))
+    {
+        return 0;
+    }
+
+    int index = find(key);
+    return index != NONE ? slots_[index].connections : 0;
+}
+
+SourceLimiter::Stats SourceLimiter::takeStats()
+{
+    auto stats = stats_;
+    memset(&stats_, 0, sizeof(stats_));
+
+    return stats;
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef SOURCELIMIT_H
+#define SOURCELIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <vector>
+
+/**
+   Limits on the connections of each source address, checked when a
+   connection is accepted: the connections open at once, and the new
+   connections per second as a token bucket refilled by the time since
+   the last one.
+
+   The sources are kept in an open addressing table of a fixed number
+   of slots, so a flood of spoofed or scanning addresses can't make it
+   grow. A source is looked for among PROBES slots after its hash, a
+   new one takes a free slot there or the idle source seen the longest
+   time ago, and is let in without a limit if all of them have open
+   connections. An IPv6 source is its /64 prefix, the block a single
+   host usually gets
+ **/
+class SourceLimiter
+{
+public:
+    static constexpr int  PROBES = 8;
+    static constexpr int  NONE   = -1;
+
+    struct Options
+    {
+        Options()
+            : maxConnections(0),
+              rate(0),
+              burst(0),
+              slots(65536)
+        {
+        }
+
+        std::size_t  maxConnections;  // open at once, 0 for no limit
+        double       rate;            // new connections per second, 0 for no limit
+        double       burst;           // new connections at once, at least rate and 1
+        std::size_t  slots;           // rounded up to a power of two
+    };
+
+    struct Stats
+    {
+        uint64_t  admitted;
+        uint64_t  overConnections;    // refused for the connections open
+        uint64_t  overRate;           // refused for the new connections per second
+        uint64_t  untracked;          // let in without a slot
+    };
+
+    explicit SourceLimiter(const Options &options);
+
+    // disable the copy operations
+    SourceLimiter(const SourceLimiter &) = delete;
+    SourceLimiter &operator=(const SourceLimiter &) = delete;
+
+    /**
+       Whether a new connection from address is let in at now, in
+       milliseconds. slot is to release() once the connection closes,
+       NONE if the source isn't counted
+     **/
+    bool admit(const sockaddr *address, long now, int &slot);
+
+    // A connection of slot closed
+    void release(int slot);
+
+    /**
+       Change the limits, e.g. on a reload, the sources keep their
+       connections and tokens and the table keeps its size
+     **/
+    void setLimits(const Options &options);
+
+    // The connections open from the source of address
+    std::size_t connections(const sockaddr *address) const;
+
+    // The counters since the last call
+    Stats takeStats();
+
+private:
+    using Key = std::array<unsigned char, 16>;
+
+    struct Slot
+    {
+        Key       key;
+        bool      used;
+        uint32_t  connections;
+        double    tokens;
+        long      updated;      // milliseconds, when tokens was right
+    };
+
+    // the key of the source of address, false if it has no ip
+    static bool keyOf(const sockaddr *address, Key &key);
+
+    std::size_t hash(const Key &key) const;
+
+    // the slot holding key, NONE if it isn't in the table
+    int find(const Key &key) const;
+
+    Options            options_;
+    std::vector<Slot>  slots_;
+    std::size_t        mask_;
+    uint64_t           seed_;      // random, the hashes can't be aimed at one slot
+    Stats              stats_;
+};
+
+#endif /* SOURCELIMIT_H */
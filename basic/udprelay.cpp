@@ -0,0 +1,467 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "udprelay.hpp"
+#include "sockets.hpp"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include <event2/event.h>
+
+constexpr int          UdpRelay::BATCH;
+constexpr std::size_t  UdpRelay::MAX_DATAGRAM;
+constexpr int          UdpRelay::MAX_SEGMENTS;
+constexpr std::size_t  UdpHeader::MAX_BYTES;
+
+bool UdpRelay::gso_ = true;
+
+/**
+   Receive buffers shared by all relays, the loop is single threaded
+   and a datagram is handed to its callback before the next read
+ **/
+static unsigned char receiveBuffers[UdpRelay::BATCH][UdpRelay::MAX_DATAGRAM];
+
+// Larger datagrams are not coalesced, a GSO segment must fit the MTU of the device
+static constexpr std::size_t MAX_SEGMENT_SIZE = 1400;
+
+// At most this many recvmmsg() calls in a row, so one busy socket can't starve the others
+static constexpr int MAX_READS = 4;
+
+static void relayReadCallback(evutil_socket_t, short, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto relay = static_cast<UdpRelay *>(arg);
+    relay->onRead();
+}
+
+UdpRelay::UdpRelay(event_base *base, int fd, ReadCallback callback, void *arg)
+    : fd_(fd),
+      family_(AF_UNSPEC),
+      event_(nullptr),
+      callback_(callback),
+      arg_(arg),
+      stats_{0, 0, 0, 0, 0}
+{
+    assert(fd_ != -1);
+
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (::getsockname(fd_, reinterpret_cast<sockaddr *>(&address), &length) == 0)
+    {
+        family_ = address.ss_family;
+    }
+
+    event_ = event_new(base, fd_, EV_READ | EV_PERSIST, relayReadCallback, this);
+    event_add(event_, nullptr);
+}
+
+UdpRelay::~UdpRelay()
+{
+    event_free(event_);
+    ::close(fd_);
+}
+
+Address UdpRelay::localAddress() const
+{
+    return getSocketLocalAddress(fd_);
+}
+
+void UdpRelay::send(const sockaddr *to, socklen_t toLength,
+                    const unsigned char *data, std::size_t length)
+{
+    Outgoing outgoing;
+    memset(&outgoing.to, 0, sizeof(outgoing.to));
+
+    // a dual stack socket reaches ipv4 peers through v4-mapped addresses
+    if (family_ == AF_INET6 && to->sa_family == AF_INET)
+    {
+        auto sin = reinterpret_cast<const sockaddr_in *>(to);
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(&outgoing.to);
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = sin->sin_port;
+        sin6->sin6_addr.s6_addr[10] = 0xff;
+        sin6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+        outgoing.toLength = sizeof(sockaddr_in6);
+    }
+    else if (to->sa_family == family_ && toLength <= sizeof(outgoing.to))
+    {
+        memcpy(&outgoing.to, to, toLength);
+        outgoing.toLength = toLength;
+    }
+    else
+    {
+        stats_.dropped++;
+        return;
+    }
+
+    outgoing.offset = queueData_.size();
+    outgoing.length = length;
+
+    queueData_.insert(queueData_.end(), data, data + length);
+    queue_.push_back(outgoing);
+
+    if (queue_.size() >= static_cast<std::size_t>(BATCH) * MAX_SEGMENTS)
+    {
+        flush();
+    }
+}
+
+bool UdpRelay::sameSegment(const Outgoing &first, const Outgoing &prev,
+                           const Outgoing &next)
+{
+    /**
+       every segment but the last one has the size of the first,
+       a segment must fit the path MTU and the whole message must
+       fit in one ip datagram
+    **/
+    return first.length <= MAX_SEGMENT_SIZE &&
+        next.toLength == first.toLength &&
+        memcmp(&next.to, &first.to, first.toLength) == 0 &&
+        prev.length == first.length &&
+        next.length <= first.length &&
+        next.offset + next.length - first.offset <= MAX_DATAGRAM - 8 - 40;
+}
+
+void UdpRelay::flush()
+{
+    if (queue_.empty())
+    {
+        return;
+    }
+    
+    std::vector<mmsghdr> messages;
+    std::vector<iovec> iovecs(queue_.size());
+    std::vector<std::size_t> ends;     // the queue index after each message
+    std::vector<char> controls;
+
+#ifdef UDP_SEGMENT
+    const std::size_t controlSpace = CMSG_SPACE(sizeof(uint16_t));
+#else
+    const std::size_t controlSpace = 0;
+    gso_ = false;
+#endif
+
+    for (std::size_t i = 0; i < queue_.size(); i++)
+    {
+        iovecs[i].iov_base = queueData_.data() + queue_[i].offset;
+        iovecs[i].iov_len = queue_[i].length;
+    }
+
+    std::size_t next = 0;
+    while (next < queue_.size())
+    {
+        messages.clear();
+        ends.clear();
+        controls.assign(controlSpace * BATCH, 0);
+
+        std::size_t first = next;
+        while (first < queue_.size() && messages.size() < static_cast<std::size_t>(BATCH))
+        {
+            std::size_t last = first + 1;
+            while (gso_ && last < queue_.size() && last - first < MAX_SEGMENTS &&
+                   sameSegment(queue_[first], queue_[last - 1], queue_[last]))
+            {
+                last++;
+            }
+
+            mmsghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_hdr.msg_name = &queue_[first].to;
+            message.msg_hdr.msg_namelen = queue_[first].toLength;
+            message.msg_hdr.msg_iov = &iovecs[first];
+            message.msg_hdr.msg_iovlen = last - first;
+
+#ifdef UDP_SEGMENT
+            if (last - first > 1)
+            {
+                auto control = &controls[messages.size() * controlSpace];
+                message.msg_hdr.msg_control = control;
+                message.msg_hdr.msg_controllen = controlSpace;
+
+                auto cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                uint16_t segment = queue_[first].length;
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+#endif
+
+            messages.push_back(message);
+            ends.push_back(last);
+            first = last;
+        }
+
+        int sent = ::sendmmsg(fd_, messages.data(), messages.size(), 0);
+        stats_.sendCalls++;
+
+        if (sent > 0)
+        {
+            stats_.sent += ends[sent - 1] - next;
+            next = ends[sent - 1];
+            continue;
+        }
+
+        int err = errno;
+        if (err == EINTR)
+        {
+            continue;
+        }
+
+        // the kernel or the device doesn't do GSO, send the segments one by one
+        if (gso_ && ends[0] - next > 1 && (err == EIO || err == EINVAL || err == ENOPROTOOPT))
+        {
+            LOG(WARNING) << "UDP GSO is not available: " << strerror(err);
+            gso_ = false;
+            continue;
+        }
+
+        if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            // the socket buffer is full, drop the rest as the network would
+            stats_.dropped += queue_.size() - next;
+            break;
+        }
+
+        // e.g. an unreachable peer, drop the first message and go on
+        LOG(ERROR) << "Failed to send datagrams: " << strerror(err);
+        stats_.dropped += ends[0] - next;
+        next = ends[0];
+    }
+
+    queue_.clear();
+    queueData_.clear();
+}
+
+void UdpRelay::onRead()
+{
+    mmsghdr messages[BATCH];
+    iovec iovecs[BATCH];
+    sockaddr_storage addresses[BATCH];
+
+    for (int round = 0; round < MAX_READS; round++)
+    {
+        for (int i = 0; i < BATCH; i++)
+        {
+            iovecs[i].iov_base = receiveBuffers[i];
+            iovecs[i].iov_len = MAX_DATAGRAM;
+
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int received = ::recvmmsg(fd_, messages, BATCH, MSG_DONTWAIT, nullptr);
+        stats_.recvCalls++;
+
+        if (received <= 0)
+        {
+            return;
+        }
+
+        for (int i = 0; i < received; i++)
+        {
+            if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                stats_.dropped++;
+                continue;
+            }
+
+            stats_.received++;
+            callback_(reinterpret_cast<sockaddr *>(&addresses[i]),
+                      messages[i].msg_hdr.msg_namelen,
+                      receiveBuffers[i], messages[i].msg_len, arg_);
+        }
+
+        if (received < BATCH)
+        {
+            return;
+        }
+    }
+}
+
+std::size_t UdpHeader::parse(const unsigned char *data, std::size_t length,
+                             Address &address)
+{
+    // RSV must be zero, fragments are not supported
+    if (length < 4 || data[0] != 0 || data[1] != 0 || data[2] != 0)
+    {
+        return 0;
+    }
+
+    unsigned short port;
+    std::size_t headerLength;
+
+    if (data[3] == 0x01)
+    {
+        headerLength = 4 + 4 + 2;
+        if (length < headerLength)
+        {
+            return 0;
+        }
+
+        std::array<unsigned char, 4> host;
+        std::copy(data + 4, data + 8, host.data());
+        memcpy(&port, data + 8, 2);
+
+        address = Address(host, port);
+    }
+    else if (data[3] == 0x04)
+    {
+        headerLength = 4 + 16 + 2;
+        if (length < headerLength)
+        {
+            return 0;
+        }
+
+        std::array<unsigned char, 16> host;
+        std::copy(data + 4, data + 20, host.data());
+        memcpy(&port, data + 20, 2);
+
+        address = Address(host, port);
+    }
+    else if (data[3] == 0x03)
+    {
+        if (length < 5)
+        {
+            return 0;
+        }
+
+        std::size_t domainLength = data[4];
+        headerLength = 4 + 1 + domainLength + 2;
+        if (domainLength == 0 || length < headerLength)
+        {
+            return 0;
+        }
+
+        std::string domain(reinterpret_cast<const char *>(data + 5), domainLength);
+        memcpy(&port, data + 5 + domainLength, 2);
+
+        address = Address(domain, port);
+    }
+    else
+    {
+        return 0;
+    }
+
+    return address.isValid() ? headerLength : 0;
+}
+
+std::size_t UdpHeader::write(const sockaddr *address, unsigned char *out)
+{
+    memset(out, 0, 4);
+
+    if (address->sa_family == AF_INET)
+    {
+        auto sin = reinterpret_cast<const sockaddr_in *>(address);
+
+        out[3] = 0x01;
+        memcpy(out + 4, &sin->sin_addr, 4);
+        memcpy(out + 8, &sin->sin_port, 2);
+
+        return 10;
+    }
+
+    auto sin6 = reinterpret_cast<const sockaddr_in6 *>(address);
+
+    // a v4-mapped address of a dual stack socket is an ipv4 peer
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+    {
+        out[3] = 0x01;
+        memcpy(out + 4, &sin6->sin6_addr.s6_addr[12], 4);
+        memcpy(out + 8, &sin6->sin6_port, 2);
+
+        return 10;
+    }
+
+    out[3] = 0x04;
+    memcpy(out + 4, &sin6->sin6_addr, 16);
+    memcpy(out + 20, &sin6->sin6_port, 2);
+
+    return 22;
+}
+
+static void associationsTimerCallback(evutil_socket_t, short, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto associations = static_cast<UdpAssociations *>(arg);
+    associations->expire();
+}
+
+UdpAssociations::UdpAssociations(event_base *base, int timeout)
+    : base_(base),
+      timeout_(std::max(timeout, 0)),
+      timer_(nullptr)
+{
+    timer_ = event_new(base_, -1, EV_PERSIST, associationsTimerCallback, this);
+
+    // an association lives at most a quarter of the timeout too long
+    struct timeval interval = {std::max(timeout_ / 4, 1L), 0};
+    event_add(timer_, &interval);
+}
+
+UdpAssociations::~UdpAssociations()
+{
+    event_free(timer_);
+}
+
+long UdpAssociations::now() const
+{
+    struct timeval tv;
+    event_base_gettimeofday_cached(base_, &tv);
+
+    return tv.tv_sec;
+}
+
+UdpAssociations::Handle UdpAssociations::add(ExpireCallback callback, void *arg)
+{
+    return entries_.insert(entries_.end(), Entry{now(), callback, arg});
+}
+
+void UdpAssociations::touch(Handle handle)
+{
+    handle->lastActive = now();
+    entries_.splice(entries_.end(), entries_, handle);
+}
+
+void UdpAssociations::remove(Handle handle)
+{
+    entries_.erase(handle);
+}
+
+void UdpAssociations::expire()
+{
+    auto deadline = now() - timeout_;
+
+    while (!entries_.empty() && entries_.front().lastActive <= deadline)
+    {
+        auto size = entries_.size();
+        auto entry = entries_.front();
+
+        entry.callback(entry.arg);
+        assert(entries_.size() < size);
+    }
+}
@@ -0,0 +1,193 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef UDPRELAY_H
+#define UDPRELAY_H
+
+#include "address.hpp"
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <list>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct event;
+struct event_base;
+
+/**
+   Relay datagrams through a udp socket, datagrams are read
+   with recvmmsg() and written with sendmmsg() in batches.
+   Consecutive datagrams of one size to one peer are handed
+   to the kernel as a single UDP_SEGMENT (GSO) message
+ **/
+class UdpRelay
+{
+public:
+    static constexpr int          BATCH         = 32;
+    static constexpr std::size_t  MAX_DATAGRAM  = 65535;
+    static constexpr int          MAX_SEGMENTS  = 64;
+
+    /**
+       Called for each datagram received,
+       the callback must not free the relay
+     **/
+    using ReadCallback = void (*)(const sockaddr *from, socklen_t fromLength,
+                                  const unsigned char *data, std::size_t length,
+                                  void *arg);
+
+    struct Stats
+    {
+        uint64_t  received;     // datagrams
+        uint64_t  sent;         // datagrams
+        uint64_t  dropped;      // datagrams
+        uint64_t  recvCalls;    // recvmmsg() calls
+        uint64_t  sendCalls;    // sendmmsg() calls
+    };
+
+    /**
+       The relay owns fd, a nonblocking udp socket
+     **/
+    UdpRelay(event_base *base, int fd, ReadCallback callback, void *arg);
+    ~UdpRelay();
+
+    // disable the copy operations
+    UdpRelay(const UdpRelay &) = delete;
+    UdpRelay &operator=(const UdpRelay &) = delete;
+
+    // Address the socket is bound to
+    Address localAddress() const;
+
+    /**
+       Queue a datagram, it's sent by flush() or once a batch is full.
+       A datagram the socket can't take is dropped, as udp would
+     **/
+    void send(const sockaddr *to, socklen_t toLength,
+              const unsigned char *data, std::size_t length);
+
+    // Send the queued datagrams
+    void flush();
+
+    // Called when the socket is readable
+    void onRead();
+
+    const Stats &stats() const
+    {
+        return stats_;
+    }
+
+private:
+    struct Outgoing
+    {
+        sockaddr_storage  to;
+        socklen_t         toLength;
+        std::size_t       offset;     // in queueData_
+        std::size_t       length;
+    };
+
+    // Whether two queued datagrams may share one GSO message
+    static bool sameSegment(const Outgoing &first, const Outgoing &prev,
+                            const Outgoing &next);
+
+    int                    fd_;
+    int                    family_;
+    event                  *event_;
+    ReadCallback           callback_;
+    void                   *arg_;
+    std::vector<Outgoing>  queue_;
+    std::vector<unsigned char> queueData_;
+    Stats                  stats_;
+    static bool            gso_;       // cleared once the kernel refuses UDP_SEGMENT
+};
+
+/**
+   The header of a SOCKS5 UDP request
+   +----+------+------+----------+----------+----------+
+   |RSV | FRAG | ATYP | DST.ADDR | DST.PORT |   DATA   |
+   +----+------+------+----------+----------+----------+
+   | 2  |  1   |  1   | Variable |    2     | Variable |
+   +----+------+------+----------+----------+----------+
+ **/
+class UdpHeader
+{
+public:
+    static constexpr std::size_t MAX_BYTES = 4 + 1 + 255 + 2;
+
+    /**
+       Parse the header of a datagram, return the length of
+       the header, 0 if it's invalid or a fragment
+     **/
+    static std::size_t parse(const unsigned char *data, std::size_t length,
+                             Address &address);
+
+    /**
+       Write the header for a datagram from address into out,
+       which holds at least MAX_BYTES. Return the length of the header
+     **/
+    static std::size_t write(const sockaddr *address, unsigned char *out);
+};
+
+/**
+   The udp associations of a server ordered by their last activity,
+   touching one moves it to the back, so the sweep only looks at
+   the associations which expire
+ **/
+class UdpAssociations
+{
+public:
+    using ExpireCallback = void (*)(void *arg);
+
+    struct Entry
+    {
+        long            lastActive;    // seconds
+        ExpireCallback  callback;
+        void            *arg;
+    };
+
+    using Handle = std::list<Entry>::iterator;
+
+    // Associations idle for timeout seconds expire
+    UdpAssociations(event_base *base, int timeout);
+    ~UdpAssociations();
+
+    // disable the copy operations
+    UdpAssociations(const UdpAssociations &) = delete;
+    UdpAssociations &operator=(const UdpAssociations &) = delete;
+
+    Handle add(ExpireCallback callback, void *arg);
+
+    // Called when a datagram goes through the association
+    void touch(Handle handle);
+
+    void remove(Handle handle);
+
+    /**
+       Run the callbacks of the idle associations,
+       each callback must remove its association
+     **/
+    void expire();
+
+    std::size_t size() const
+    {
+        return entries_.size();
+    }
+
+private:
+    long now() const;
+
+    event_base         *base_;
+    long               timeout_;    // seconds
+    std::list<Entry>   entries_;    // the least recently active first
+    event              *timer_;
+};
+
+#endif /* UDPRELAY_H */
@@ -0,0 +1,249 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "zerocopy.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <linux/errqueue.h>
+
+#include <utility>
+
+#include <glog/logging.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+constexpr int  ZeroCopySender::RETIRE_SECONDS;
+
+static ZeroCopySender::Stats stats;
+
+// The frames of the senders gone while the kernel may still read them
+static std::deque<std::pair<time_t, ZeroCopySender::BufferPtr>> retired;
+
+static time_t nowSeconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+// Free the retired frames old enough
+static void purgeRetired()
+{
+    auto now = nowSeconds();
+    while (!retired.empty() && retired.front().first <= now)
+    {
+        retired.pop_front();
+    }
+}
+
+/**
+   Called when the socket has an error, a notification of
+   the zerocopy sends is queued as one
+ **/
+static void notificationCallback(evutil_socket_t, short, void *arg)
+{
+    auto sender = static_cast<ZeroCopySender *>(arg);
+    sender->onNotification();
+}
+
+const ZeroCopySender::Stats &ZeroCopySender::totals()
+{
+    return stats;
+}
+
+std::unique_ptr<ZeroCopySender> ZeroCopySender::create(event_base *base, bufferevent *conn,
+                                                       const Options &options)
+{
+    purgeRetired();
+
+    // the streams of a multiplexed connection have no socket
+    int fd = bufferevent_getfd(conn);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+
+    int on = 1;
+    if (::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0)
+    {
+        static bool warned = false;
+        if (!warned)
+        {
+            int err = EVUTIL_SOCKET_ERROR();
+            LOG(WARNING) << "MSG_ZEROCOPY is not available: "
+                         << evutil_socket_error_to_string(err);
+            warned = true;
+        }
+        return nullptr;
+    }
+
+    return std::unique_ptr<ZeroCopySender>(new ZeroCopySender(base, conn, fd, options));
+}
+
+ZeroCopySender::ZeroCopySender(event_base *base, bufferevent *conn, int fd,
+                               const Options &options)
+    : options_(options),
+      conn_(conn),
+      fd_(fd),
+      notification_(nullptr),
+      waiting_(false),
+      enabled_(true),
+      nextId_(0),
+      sent_(0),
+      pendingBytes_(0)
+{
+    // a readable error queue wakes a reader of the socket
+    notification_ = event_new(base, fd, EV_READ | EV_PERSIST, notificationCallback, this);
+}
+
+ZeroCopySender::~ZeroCopySender()
+{
+    // the socket is still open, take what the kernel has told
+    if (!pending_.empty())
+    {
+        onNotification();
+    }
+
+    auto expires = nowSeconds() + RETIRE_SECONDS;
+    for (auto &pending : pending_)
+    {
+        if (!pending.done)
+        {
+            retired.emplace_back(expires, std::move(pending.frame));
+        }
+    }
+
+    event_free(notification_);
+}
+
+bool ZeroCopySender::send(BufferPtr frame)
+{
+    auto output = bufferevent_get_output(conn_);
+    auto size = frame->size();
+
+    if (!enabled_ || size < options_.minWrite || evbuffer_get_length(output) != 0 ||
+        pendingBytes_ + size > options_.maxPending)
+    {
+        if (enabled_ && size >= options_.minWrite)
+        {
+            stats.fallbacks++;
+        }
+        return bufferevent_write(conn_, frame->data(), size) == 0;
+    }
+
+    auto sent = ::send(fd_, frame->data(), size, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent <= 0)
+    {
+        /**
+           a full socket or no room for the pinned pages, the
+           bufferevent writes it later or reports the error
+        **/
+        stats.fallbacks++;
+        return bufferevent_write(conn_, frame->data(), size) == 0;
+    }
+
+    stats.sends++;
+    stats.bytes += sent;
+    sent_ += sent;
+
+    // the rest of a partial send follows in the bufferevent
+    auto rest = static_cast<std::size_t>(sent);
+    if (rest < size && bufferevent_write(conn_, frame->data() + rest, size - rest) != 0)
+    {
+        return false;
+    }
+
+    pendingBytes_ += size;
+    pending_.push_back(Pending{nextId_++, std::move(frame), false});
+
+    if (!waiting_)
+    {
+        event_add(notification_, nullptr);
+        waiting_ = true;
+    }
+
+    return true;
+}
+
+void ZeroCopySender::onNotification()
+{
+    while (true)
+    {
+        unsigned char control[128];
+        msghdr message = {};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (::recvmsg(fd_, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            break;
+        }
+
+        for (auto header = CMSG_FIRSTHDR(&message); header != nullptr;
+             header = CMSG_NXTHDR(&message, header))
+        {
+            if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) &&
+                !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            auto error = reinterpret_cast<sock_extended_err *>(CMSG_DATA(header));
+            if (error->ee_errno == 0 && error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+            {
+                complete(error->ee_info, error->ee_data,
+                         (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+            }
+        }
+    }
+
+    while (!pending_.empty() && pending_.front().done)
+    {
+        pendingBytes_ -= pending_.front().frame->size();
+        pending_.pop_front();
+    }
+
+    if (pending_.empty() && waiting_)
+    {
+        event_del(notification_);
+        waiting_ = false;
+    }
+}
+
+void ZeroCopySender::complete(uint32_t first, uint32_t last, bool copied)
+{
+    for (auto &pending : pending_)
+    {
+        // the ids wrap around, compare them as distances from first
+        if (static_cast<uint32_t>(pending.id - first) <= static_cast<uint32_t>(last - first))
+        {
+            pending.done = true;
+        }
+    }
+
+    if (copied)
+    {
+        stats.copied++;
+
+        // a copy behind our back costs more than a plain send
+        if (enabled_)
+        {
+            LOG(INFO) << "The kernel copies the zerocopy sends of socket-" << fd_
+                      << ", send with copies";
+            enabled_ = false;
+        }
+    }
+}
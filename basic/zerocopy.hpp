@@ -0,0 +1,129 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+struct event;
+struct event_base;
+
+/**
+   Send the large frames of a connection with MSG_ZEROCOPY, the kernel
+   reads them from our memory instead of copying them. A frame goes
+   out this way only if nothing waits in the output of the bufferevent,
+   so the order of the bytes stays, everything else is written to the
+   bufferevent as usual.
+
+   A frame is kept until the error queue of the socket tells the
+   kernel is done with it. The frames still in flight when the sender
+   goes are kept for RETIRE_SECONDS more, the socket that would tell
+   is closed by then. A kernel which copies anyway, over loopback or
+   a device without scatter-gather, turns the sender off
+ **/
+class ZeroCopySender
+{
+public:
+    using Buffer    = std::vector<unsigned char>;
+    using BufferPtr = std::unique_ptr<Buffer>;
+
+    static constexpr int  RETIRE_SECONDS = 60;
+
+    struct Options
+    {
+        Options()
+            : minWrite(32 * 1024),
+              maxPending(4 * 1024 * 1024)
+        {
+        }
+
+        std::size_t  minWrite;     // smaller frames are copied
+        std::size_t  maxPending;   // bytes in flight, more are copied
+    };
+
+    struct Stats
+    {
+        uint64_t  sends;      // frames sent without a copy
+        uint64_t  bytes;      // bytes of them
+        uint64_t  copied;     // completions the kernel copied anyway
+        uint64_t  fallbacks;  // large frames written to the bufferevent
+    };
+
+    /**
+       Return a sender of conn, nullptr if conn isn't a socket
+       or the kernel doesn't support SO_ZEROCOPY
+     **/
+    static std::unique_ptr<ZeroCopySender> create(event_base *base, bufferevent *conn,
+                                                  const Options &options);
+
+    ~ZeroCopySender();
+
+    // disable the copy operations
+    ZeroCopySender(const ZeroCopySender &) = delete;
+    ZeroCopySender &operator=(const ZeroCopySender &) = delete;
+
+    /**
+       Send frame to the peer, without a copy if it's worth it.
+       Return false if it can't be queued
+     **/
+    bool send(BufferPtr frame);
+
+    // Called when the error queue of the socket has notifications
+    void onNotification();
+
+    // Whether the kernel sends without copying, false once it copied
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    // Bytes this sender has handed to the kernel without a copy
+    uint64_t sent() const
+    {
+        return sent_;
+    }
+
+    // Counters of all the senders of the process
+    static const Stats &totals();
+
+private:
+    struct Pending
+    {
+        uint32_t   id;      // counter of the zerocopy sends of the socket
+        BufferPtr  frame;
+        bool       done;
+    };
+
+    ZeroCopySender(event_base *base, bufferevent *conn, int fd, const Options &options);
+
+    // mark the sends of ids [first, last] done
+    void complete(uint32_t first, uint32_t last, bool copied);
+
+    Options              options_;
+    bufferevent          *conn_;
+    int                  fd_;
+    event                *notification_;   // the error queue is readable
+    bool                 waiting_;         // notification_ is added
+    bool                 enabled_;
+    uint32_t             nextId_;
+    uint64_t             sent_;
+    std::deque<Pending>  pending_;
+    std::size_t          pendingBytes_;
+};
+
+#endif /* ZEROCOPY_H */
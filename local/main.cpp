@@ -11,6 +11,12 @@
 #include "cipher.hpp"
 #include "server.hpp"
 
+#include <stdlib.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -26,17 +32,95 @@ static bool isValidSecretKey(const char *flagname, const std::string &value)
     return value.size() == Cryptor::KEY_SIZE;
 }
 
+// Check whether the balancing policy is known
+static bool isValidBalance(const char *flagname, const std::string &value)
+{
+    return value == "latency" || value == "leastLoaded";
+}
+
+/**
+   Parse a list of proxy servers like "10.0.0.1:6060,[::1]:6060",
+   return false if it's malformed
+ **/
+static bool parseRemotes(const std::string &list, std::vector<Address> &remotes)
+{
+    std::istringstream items(list);
+    std::string item;
+    
+    while (std::getline(items, item, ','))
+    {
+        auto colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            return false;
+        }
+
+        auto host = item.substr(0, colon);
+        if (host.front() == '[' && host.back() == ']')
+        {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        char *end = nullptr;
+        auto port = strtol(item.c_str() + colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535 || host.empty())
+        {
+            return false;
+        }
+
+        remotes.push_back(Address::FromHostOrder(host, static_cast<unsigned short>(port)));
+    }
+
+    return !remotes.empty();
+}
+
 // Listening address of the local server
 DEFINE_string(host, "0.0.0.0", "Listening host");
 DEFINE_int32(port, 5050, "Listening port");
+DEFINE_string(listen, "", "Endpoints like 127.0.0.1:5050,[::1]:5050,unix:/run/socks5.sock,unix:@socks5, replaces host and port");
 
 // Listening address of the proxy server
 DEFINE_string(remoteHost, "127.0.0.1", "Remote host");
 DEFINE_int32(remotePort, 6060, "Remote port");
+DEFINE_string(remotes, "", "Proxy servers like host:port,host:port, replaces remoteHost and remotePort");
+
+// Placement of the tunnels on the proxy servers
+DEFINE_string(balance, "latency", "Place new tunnels by latency or leastLoaded");
+DEFINE_int32(healthInterval, 5, "Seconds between probes of the proxy servers, 0 to disable");
+DEFINE_int32(maxFails, 2, "Failures in a row before a proxy server is ejected");
 
 // Secret key
 DEFINE_string(key, "12345678123456781234567812345678", "Secret key");
 
+// Connections to the proxy server
+DEFINE_int32(poolSize, 4, "Number of established connections kept to the proxy server");
+DEFINE_int32(poolMaxIdle, 30, "Seconds before an unused pooled connection is closed");
+DEFINE_int32(remoteRefresh, 300, "Seconds between resolving the proxy server again");
+DEFINE_int32(mux, 0, "Carry all clients over this many connections to the proxy server, 0 to disable");
+DEFINE_bool(fastOpen, false, "Send the first frame to the proxy server in the SYN");
+DEFINE_int32(udpTimeout, 0, "Seconds before an idle udp association expires, e.g. 60, 0 to disable udp");
+DEFINE_bool(compress, false, "Compress the frames to the proxy server, which must use -compress too");
+DEFINE_int32(compressLevel, 1, "Level of the compression, 1 (fastest) to 9 (smallest)");
+DEFINE_string(routes, "", "File of the destinations connected directly or through the proxy server");
+
+// Accept path
+DEFINE_int32(backlog, 1024, "Queue length of the connections waiting for accept, capped by net.core.somaxconn");
+DEFINE_int32(deferAccept, 0, "Seconds the kernel holds a new connection until its first bytes, 0 to disable");
+
+// Event loop monitor
+DEFINE_bool(loopMonitor, false, "Report the lag of the event loop and the time of the callbacks every minute");
+DEFINE_int32(slowCallback, 10, "Milliseconds above which a callback is reported as slow");
+
+// Socket options of the accepted and outgoing connections
+DEFINE_bool(tcpNoDelay, true, "Disable Nagle's algorithm");
+DEFINE_int32(tcpNotSentLowat, 0, "Bytes of unsent data kept in the kernel, 0 for the default");
+DEFINE_int32(tcpKeepAlive, 60, "Seconds before probing an idle connection, 0 to disable");
+DEFINE_string(tcpCongestion, "", "Congestion control algorithm, e.g. bbr, empty for the default");
+DEFINE_int32(tcpSendBuffer, 0, "Socket send buffer in bytes, 0 for the default");
+DEFINE_int32(tcpReceiveBuffer, 0, "Socket receive buffer in bytes, 0 for the default");
+DEFINE_bool(tcpAdaptive, false, "Size the buffers of busy connections from TCP_INFO");
+DEFINE_int32(tcpMaxBuffer, 4 * 1024 * 1024, "Upper bound of the adapted send buffer in bytes");
+
 int main(int argc, char *argv[])
 {
     if (!gflags::RegisterFlagValidator(&FLAGS_port, &isValidPort))
@@ -53,6 +137,11 @@ int main(int argc, char *argv[])
     {
         LOG(FATAL) << "Failed to register key validator";
     }
+
+    if (!gflags::RegisterFlagValidator(&FLAGS_balance, &isValidBalance))
+    {
+        LOG(FATAL) << "Failed to register balance validator";
+    }
     
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
@@ -63,15 +152,100 @@ int main(int argc, char *argv[])
     // address of the local server
     auto address = Address::FromHostOrder(FLAGS_host, port);
 
-    // address of the proxy server
-    auto remoteAddress = Address::FromHostOrder(FLAGS_remoteHost, remotePort);
+    // endpoints of the local server, -listen replaces -host and -port
+    std::vector<ListenEndpoint> endpoints;
+    std::string error;
+    if (FLAGS_listen.empty())
+    {
+        endpoints.push_back(ListenEndpoint::tcp(FLAGS_host, address.portString()));
+    }
+    else if (!ListenEndpoint::parseList(FLAGS_listen, endpoints, error))
+    {
+        LOG(FATAL) << "Invalid list of listening endpoints: " << error;
+    }
+
+    std::ostringstream listens;
+    for (auto &endpoint : endpoints)
+    {
+        listens << (listens.tellp() > 0 ? ", " : "") << endpoint.toString();
+    }
+
+    // addresses of the proxy servers
+    std::vector<Address> remoteAddresses;
+    if (FLAGS_remotes.empty())
+    {
+        remoteAddresses.push_back(Address::FromHostOrder(FLAGS_remoteHost, remotePort));
+    }
+    else if (!parseRemotes(FLAGS_remotes, remoteAddresses))
+    {
+        LOG(FATAL) << "Invalid list of proxy servers: " << FLAGS_remotes;
+    }
 
+    std::ostringstream remotes;
+    for (auto &remoteAddress : remoteAddresses)
+    {
+        remotes << (remotes.tellp() > 0 ? ", " : "") << remoteAddress;
+    }
+    
     LOG(WARNING) << "Local server options: "
-                 << "Listening address = " << address << ", "
-                 << "Proxy server address = " << remoteAddress << ", "
+                 << "Listening address = " << listens.str() << ", "
+                 << "Proxy server address = " << remotes.str() << ", "
                  << "Secret key = " << FLAGS_key;
+
+    Balancer::Options balancerOptions;
+    balancerOptions.policy = FLAGS_balance == "leastLoaded" ?
+        Balancer::Policy::leastLoaded : Balancer::Policy::latency;
+    balancerOptions.maxFails = std::max(FLAGS_maxFails, 1);
     
-    Server server(address, remoteAddress, FLAGS_key);
+    ListenOptions listenOptions;
+    listenOptions.backlog = FLAGS_backlog > 0 ? FLAGS_backlog : -1;
+    listenOptions.deferAccept = std::max(FLAGS_deferAccept, 0);
+
+    Server server(endpoints, remoteAddresses, FLAGS_key, balancerOptions, listenOptions);
+
+    SocketOptions socketOptions;
+    socketOptions.noDelay = FLAGS_tcpNoDelay;
+    socketOptions.notSentLowat = FLAGS_tcpNotSentLowat;
+    socketOptions.keepAlive = FLAGS_tcpKeepAlive;
+    socketOptions.congestion = FLAGS_tcpCongestion;
+    socketOptions.sendBuffer = FLAGS_tcpSendBuffer;
+    socketOptions.receiveBuffer = FLAGS_tcpReceiveBuffer;
+    socketOptions.adaptive = FLAGS_tcpAdaptive;
+    socketOptions.maxBuffer = FLAGS_tcpMaxBuffer;
+    server.setSocketOptions(socketOptions);
+    if (FLAGS_udpTimeout > 0)
+    {
+        server.enableUdp(FLAGS_udpTimeout);
+    }
+    
+    if (FLAGS_fastOpen)
+    {
+        server.enableFastOpen();
+    }
+    if (FLAGS_compress)
+    {
+        FrameCompressor::Options compressOptions;
+        compressOptions.level = std::min(std::max(FLAGS_compressLevel, 1), 9);
+        server.enableCompression(compressOptions);
+    }
+    if (FLAGS_loopMonitor)
+    {
+        LoopMonitor::Options loopOptions;
+        loopOptions.slowCallback = static_cast<uint64_t>(std::max(FLAGS_slowCallback, 1)) * 1000;
+        server.enableLoopMonitor(loopOptions);
+    }
+    // multiplexed connections are persistent, they don't need the pool
+    server.enableConnectionPool(FLAGS_mux > 0 ? 0 : FLAGS_poolSize, FLAGS_poolMaxIdle,
+                                std::max(FLAGS_remoteRefresh, 1));
+    server.enableMux(std::max(FLAGS_mux, 0));
+    if (FLAGS_healthInterval > 0 && remoteAddresses.size() > 1)
+    {
+        server.enableHealthChecks(FLAGS_healthInterval);
+    }
+    if (!FLAGS_routes.empty())
+    {
+        server.enableRoutes(FLAGS_routes);
+    }
     server.run();
     
     return 0;
@@ -11,8 +11,14 @@
 #include "server.hpp"
 #include "tunnel.hpp"
 
+#include <signal.h>
+
+#include <algorithm>
+
 #include <glog/logging.h>
 
+#include <event2/event.h>
+
 /**
    Called when the server accept new connection
  **/
@@ -20,12 +26,20 @@ static void acceptCallback(evconnlistener *listener, evutil_socket_t inConnFd,
                            sockaddr *address, int socklen, void *arg)
 {
     Address addr(address);
-    if (addr.type() == Address::Type::unknown)
+    if (address->sa_family == AF_UNIX)
+    {
+        LOG(INFO) << "Accept new connection on a unix socket: client-" << inConnFd;
+    }
+    else if (addr.type() == Address::Type::unknown)
     {
         LOG(ERROR) << "Address of Client-" << inConnFd << " is unknown";
+        evutil_closesocket(inConnFd);
         return;
     }
-    LOG(INFO) << "Accept new connection from: " << addr;
+    else
+    {
+        LOG(INFO) << "Accept new connection from: " << addr;
+    }
     
     auto server = static_cast<Server *>(arg);
     server->createTunnel(inConnFd);
@@ -48,12 +62,75 @@ static void acceptErrorCallback(evconnlistener *listener, void *arg)
     event_base_loopexit(base, nullptr); 
 }
 
-Server::Server(const Address &address, const Address &remoteAddress,
-               const std::string &key)
-    : base_(new ServerBase(address, acceptCallback, acceptErrorCallback, this)),
-      remoteAddress_(remoteAddress),
-      key_(key)
+/**
+   Called periodically to report the counters of the proxy servers and the routes
+ **/
+static void statsCallback(evutil_socket_t, short, void *arg)
 {
+    auto server = static_cast<Server *>(arg);
+    server->logUpstreamStats();
+    server->logRouteStats();
+    server->logCompressionStats();
+    server->logLoopStats();
+}
+
+/**
+   Called periodically to check the health of the proxy servers
+ **/
+static void probeCallback(evutil_socket_t, short, void *arg)
+{
+    auto server = static_cast<Server *>(arg);
+    server->probe();
+}
+
+/**
+   Called on SIGHUP to reload the routes file
+ **/
+static void reloadCallback(evutil_socket_t, short, void *arg)
+{
+    auto server = static_cast<Server *>(arg);
+    server->reload();
+}
+
+Server::Server(const std::vector<ListenEndpoint> &endpoints,
+               const std::vector<Address> &remoteAddresses,
+               const std::string &key, const Balancer::Options &options,
+               const ListenOptions &listenOptions)
+    : base_(new ServerBase(endpoints, acceptCallback, acceptErrorCallback, this,
+                           listenOptions)),
+      cryptor_(key, "0000000000000000"),  // FIXME: use random initialized vector
+      balancer_(remoteAddresses.size(), options),
+      probeTimer_(nullptr),
+      reloadSignal_(nullptr),
+      statsTimer_(nullptr)
+{
+    for (std::size_t i = 0; i < remoteAddresses.size(); i++)
+    {
+        upstreams_.emplace_back(new Upstream(base_, balancer_, i, remoteAddresses[i], key));
+    }
+
+    if (upstreams_.size() > 1)
+    {
+        startStatsTimer();
+    }
+}
+
+Server::~Server()
+{
+    if (probeTimer_ != nullptr)
+    {
+        event_free(probeTimer_);
+    }
+
+    if (statsTimer_ != nullptr)
+    {
+        event_free(statsTimer_);
+    }
+
+    if (reloadSignal_ != nullptr)
+    {
+        event_free(reloadSignal_);
+    }
 }
 
 /**
@@ -64,7 +141,222 @@ void Server::run()
     base_->run();
 }
 
+void Server::enableConnectionPool(int poolSize, int maxIdle, int refresh)
+{
+    /**
+       the remote address is kept for refresh seconds and served
+       while it's being refreshed, so no tunnel waits for the resolver
+    **/
+    DnsCache::Options options;
+    options.minTTL = std::min(options.minTTL, refresh);
+    options.maxTTL = refresh;
+    options.staleTTL = 24 * 3600;
+    base_->enableDnsCache(options);
+
+    for (auto &upstream : upstreams_)
+    {
+        upstream->enablePool(poolSize, maxIdle);
+    }
+}
+
+void Server::enableMux(int connections)
+{
+    for (auto &upstream : upstreams_)
+    {
+        upstream->enableMux(connections);
+    }
+}
+
+void Server::enableHealthChecks(int interval)
+{
+    probeTimer_ = event_new(base_->base(), -1, EV_PERSIST, probeCallback, this);
+    struct timeval timeout = {interval, 0};
+    event_add(probeTimer_, &timeout);
+}
+
+void Server::probe()
+{
+    for (auto &upstream : upstreams_)
+    {
+        upstream->probe();
+    }
+}
+
+void Server::logUpstreamStats() const
+{
+    if (upstreams_.size() < 2)
+    {
+        return;
+    }
+
+    auto now = base_->now();
+    for (std::size_t i = 0; i < upstreams_.size(); i++)
+    {
+        auto &target = balancer_.target(i);
+        LOG(INFO) << "Proxy server " << upstreams_[i]->address()
+                  << ": latency = " << target.latency << " ms"
+                  << ", tunnels = " << target.tunnels
+                  << ", picks = " << target.picks
+                  << ", ejections = " << target.ejections
+                  << (balancer_.ejected(i, now) ? ", ejected" : "");
+    }
+}
+
+void Server::enableFastOpen()
+{
+    base_->setFastOpen(true);
+}
+
+void Server::enableUdp(int timeout)
+{
+    base_->enableUdp(timeout);
+}
+
+void Server::enableRoutes(const std::string &file)
+{
+    std::string error;
+    auto table = Routes::load(file, error);
+    if (table == nullptr)
+    {
+        LOG(FATAL) << "Failed to load the routes: " << error;
+    }
+
+    routes_.reset(new Routes(base_->base()));
+    routes_->setTable(std::move(table));
+    routesFile_ = file;
+    LOG(WARNING) << "Load the routes: " << routes_->size() << " rules";
+
+    reloadSignal_ = evsignal_new(base_->base(), SIGHUP, reloadCallback, this);
+    evsignal_add(reloadSignal_, nullptr);
+
+    startStatsTimer();
+}
+
+void Server::startStatsTimer()
+{
+    if (statsTimer_ != nullptr)
+    {
+        return;
+    }
+    
+    statsTimer_ = event_new(base_->base(), -1, EV_PERSIST, statsCallback, this);
+    struct timeval interval = {60, 0};
+    event_add(statsTimer_, &interval);
+}
+
+void Server::reload()
+{
+    // the tunnels already routed keep their connections
+    if (!routes_->reload(routesFile_))
+    {
+        LOG(WARNING) << "A reload of the routes is already running";
+    }
+}
+
+void Server::enableCompression(const FrameCompressor::Options &options)
+{
+    cryptor_.enableCompression(options);
+    for (auto &upstream : upstreams_)
+    {
+        upstream->enableCompression(options);
+    }
+
+    startStatsTimer();
+}
+
+void Server::logCompressionStats() const
+{
+    if (!cryptor_.compressing())
+    {
+        return;
+    }
+
+    auto &stats = FrameCompressor::totals();
+    LOG(INFO) << "Compression: frames = " << stats.frames
+              << ", deflated = " << stats.deflated
+              << ", bytes in = " << stats.bytesIn
+              << ", bytes out = " << stats.bytesOut
+              << ", deflate us = " << stats.deflateMicros
+              << ", inflate us = " << stats.inflateMicros;
+}
+
+void Server::enableLoopMonitor(const LoopMonitor::Options &options)
+{
+    base_->enableLoopMonitor(options);
+    startStatsTimer();
+}
+
+void Server::logLoopStats() const
+{
+    auto monitor = base_->loopMonitor();
+    if (monitor != nullptr)
+    {
+        monitor->report();
+
+        auto frames = FrameTimer::takeTotals();
+        LOG(INFO) << "Frames: relayed = " << frames.frames
+                  << ", bytes = " << frames.bytes
+                  << ", microseconds = " << frames.micros
+                  << ", nanoseconds per frame = "
+                  << (frames.frames > 0 ? frames.micros * 1000 / frames.frames : 0);
+    }
+}
+
+void Server::logRouteStats() const
+{
+    if (routes_ == nullptr)
+    {
+        return;
+    }
+    
+    auto stats = routes_->stats();
+    LOG(INFO) << "Routes: rules = " << routes_->size()
+              << ", lookups = " << stats.lookups
+              << ", cache hits = " << stats.cacheHits
+              << ", direct = " << stats.direct
+              << ", reloads = " << stats.reloads;
+}
+
+void Server::setSocketOptions(const SocketOptions &options)
+{
+    base_->setSocketOptions(options);
+}
+
+Upstream *Server::takeRemoteConnection(int inConnFd, bufferevent *&outConn)
+{
+    // a proxy server which can't open a stream is passed over
+    for (std::size_t attempt = 0; attempt < upstreams_.size(); attempt++)
+    {
+        auto &upstream = upstreams_[balancer_.pick(base_->now())];
+        if (upstream->take(inConnFd, outConn))
+        {
+            return upstream.get();
+        }
+
+        upstream->onFailure();
+    }
+
+    return nullptr;
+}
+
 void Server::createTunnel(int inConnFd)
 {
-    new Tunnel(base_, inConnFd, remoteAddress_, key_);
+    LoopMonitor::Scope timing(base_->loopMonitor(), LoopMonitor::Category::accept);
+
+    // a routed client gets its connection once its request is read
+    if (routes_ != nullptr)
+    {
+        Tunnel::create(base_, inConnFd, nullptr, cryptor_, nullptr, this);
+        return;
+    }
+    
+    bufferevent *outConn = nullptr;
+    auto upstream = takeRemoteConnection(inConnFd, outConn);
+    if (upstream == nullptr)
+    {
+        evutil_closesocket(inConnFd);
+        return;
+    }
+    
+    Tunnel::create(base_, inConnFd, upstream, cryptor_, outConn);
 }
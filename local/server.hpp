@@ -11,16 +11,93 @@
 #define SERVER_H
 
 #include "address.hpp"
+#include "balancer.hpp"
 #include "base.hpp"
+#include "cipher.hpp"
+#include "routes.hpp"
+#include "upstream.hpp"
 
 #include <memory>
 #include <string>
+#include <vector>
 
 class Server
 {
 public:
-    Server(const Address &address, const Address &remoteAddress,
-           const std::string &key);
+    /**
+       Listen on every endpoint, new tunnels are placed
+       on the proxy servers by the balancer
+     **/
+    Server(const std::vector<ListenEndpoint> &endpoints,
+           const std::vector<Address> &remoteAddresses,
+           const std::string &key, const Balancer::Options &options,
+           const ListenOptions &listenOptions = ListenOptions());
+
+    ~Server();
+
+    /**
+       Resolve the proxy servers through a cache refreshed every
+       refresh seconds and keep poolSize connections open to each
+     **/
+    void enableConnectionPool(int poolSize, int maxIdle, int refresh);
+
+    /**
+       Carry all clients over this many multiplexed connections
+       to each proxy server instead of one connection per client
+     **/
+    void enableMux(int connections);
+
+    // Probe each proxy server every interval seconds
+    void enableHealthChecks(int interval);
+
+    // Send a greeting to each proxy server
+    void probe();
+
+    // log the counters of the proxy servers
+    void logUpstreamStats() const;
+
+    /**
+       Send the first frame of each connection to the proxy
+       server in the SYN with TCP Fast Open
+     **/
+    void enableFastOpen();
+
+    // Relay UDP ASSOCIATE, associations idle for timeout seconds expire
+    void enableUdp(int timeout);
+
+    /**
+       Connect the clients directly or through the proxy server by
+       the destinations of their requests, the routes file is loaded
+       again on SIGHUP
+     **/
+    void enableRoutes(const std::string &file);
+
+    // nullptr if the clients aren't routed
+    Routes *routes() const
+    {
+        return routes_.get();
+    }
+
+    // load the routes file again
+    void reload();
+
+    // log the counters of the routes
+    void logRouteStats() const;
+    
+    // Options of the client connections and the connections to the proxy server
+    void setSocketOptions(const SocketOptions &options);
+
+    // Compress the frames to the proxy servers, which must compress as well
+    void enableCompression(const FrameCompressor::Options &options);
+
+    // log the counters of the compressed frames
+    void logCompressionStats() const;
+
+    // Measure the lag of the event loop and the time of the callbacks
+    void enableLoopMonitor(const LoopMonitor::Options &options);
+
+    // log the lag and the callback times since the last report
+    void logLoopStats() const;
     
     // disable the copy operations    
     Server(const Server &) = delete;
@@ -28,14 +105,30 @@ public:
 
     // create tunnel between the client and the proxy server
     void createTunnel(int inConnFd);
+
+    /**
+       Pick a proxy server for the client and take a connection to it,
+       outConn is nullptr if the tunnel opens a new one. Return nullptr
+       if no proxy server has a multiplexed connection to open a stream on
+     **/
+    Upstream *takeRemoteConnection(int inConnFd, bufferevent *&outConn);
     
     // run the event loop
     void run();
     
 private:
+    // Report the counters every minute
+    void startStatsTimer();
+    
     std::shared_ptr<ServerBase>   base_;
-    Address                       remoteAddress_;  // address of the proxy server    
-    std::string                   key_;            // secret key
+    Cryptor                       cryptor_;        // copied by the tunnels
+    Balancer                      balancer_;
+    std::vector<std::unique_ptr<Upstream>> upstreams_; // the proxy servers
+    event                         *probeTimer_;
+    std::unique_ptr<Routes>       routes_;
+    std::string                   routesFile_;
+    event                         *reloadSignal_;  // SIGHUP
+    event                         *statsTimer_;
 };
 
 #endif /* SERVER_H */
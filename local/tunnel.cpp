@@ -8,20 +8,36 @@
  ******************************************************************************/
 
 #include "tunnel.hpp"
+#include "server.hpp"
+#include "sockets.hpp"
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
 
+// Bytes of datagrams queued for the proxy server before the next ones are dropped
+static constexpr std::size_t UDP_BACKLOG = 1024 * 1024;
+
 static void inConnReadCallback(bufferevent *inConn, void *arg)
 {
     assert(arg != nullptr);
     
     auto tunnel = static_cast<Tunnel *>(arg);    
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::inConnRead);
     tunnel->encryptTransfer();
+
+    if (tunnel->failed())
+    {
+        tunnel->closeAfterWrite();
+        delete tunnel;
+    }
 }
 
 static void inConnEventCallback(bufferevent *bev, short what, void *arg)
@@ -29,6 +45,7 @@ static void inConnEventCallback(bufferevent *bev, short what, void *arg)
     assert(arg != nullptr);
     
     auto tunnel = static_cast<Tunnel *>(arg);
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::event);
     auto fd = tunnel->clientFd();
     
     if (what & BEV_EVENT_EOF)
@@ -52,7 +69,14 @@ static void outConnReadCallback(bufferevent *outConn, void *arg)
     assert(arg != nullptr);
     
     auto tunnel = static_cast<Tunnel *>(arg);
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::outConnRead);
     tunnel->decryptTransfer();    
+
+    if (tunnel->failed())
+    {
+        tunnel->closeAfterWrite();
+        delete tunnel;
+    }
 }
 
 static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
@@ -60,11 +84,22 @@ static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
     assert(arg != nullptr);
     
     auto tunnel = static_cast<Tunnel *>(arg);
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::event);
     auto fd = tunnel->clientFd();
+
+    if (what & BEV_EVENT_CONNECTED)
+    {
+        tunnel->onConnected();
+    }
     
     if (what & BEV_EVENT_EOF)
     {
         LOG(INFO) << "Proxy server close connection of client-" << fd;        
+
+        tunnel->onProxyClosed();
+
+        // the client still gets what the proxy server sent before it closed
+        tunnel->closeAfterWrite();
         delete tunnel;
     }
 
@@ -73,43 +108,222 @@ static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
         int err = EVUTIL_SOCKET_ERROR();
         LOG(ERROR) << "Connect to proxy server error for client-" << fd
                    << ": " << evutil_socket_error_to_string(err);
-        
+
+        tunnel->onConnectError(err);
         delete tunnel;
     }    
 }
 
+/**
+   Called for each datagram the client sends to the udp relay
+ **/
+static void udpReadCallback(const sockaddr *from, socklen_t fromLength,
+                            const unsigned char *data, std::size_t length, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto tunnel = static_cast<Tunnel *>(arg);
+    tunnel->onDatagram(from, fromLength, data, length);
+}
+
+/**
+   Called when the udp association of the client is idle for too long
+ **/
+static void udpExpiredCallback(void *arg)
+{
+    assert(arg != nullptr);
+    
+    auto tunnel = static_cast<Tunnel *>(arg);
+    LOG(INFO) << "UDP association of client-" << tunnel->clientFd() << " expired";
+
+    delete tunnel;
+}
+
+/**
+   Whether the reply of the proxy server is a successful UDP ASSOCIATE,
+   it carries no relay address since the datagrams go through us
+ **/
+static bool isUdpAssociateReply(const Cryptor::Buffer &reply)
+{
+    static const unsigned char udpReply[] = {0x05, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+
+    return reply.size() == sizeof(udpReply) &&
+        memcmp(reply.data(), udpReply, sizeof(udpReply)) == 0;
+}
+
+/**
+   Length of the next handshake message of the client in input, or 0
+   if it's incomplete. The greeting comes first, then the request, with
+   a username/password negotiation (version 0x01) in between if asked
+ **/
+static std::size_t handshakeMessageLength(evbuffer *input, bool greeted)
+{
+    // no message of the handshake is longer
+    static constexpr std::size_t MAX_MESSAGE = 3 + 255 + 255;
+
+    auto length = evbuffer_get_length(input);
+    auto data = evbuffer_pullup(input, std::min(length, MAX_MESSAGE));
+    std::size_t message = 0;
+
+    if (length < 2)
+    {
+        return 0;
+    }
+    else if (!greeted)
+    {
+        // +----+----------+----------+
+        // |VER | NMETHODS | METHODS  |
+        message = 2 + data[1];
+    }
+    else if (data[0] == 0x01)
+    {
+        // +----+------+----------+------+----------+
+        // |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+        std::size_t passwordOffset = 2 + data[1];
+        if (length <= passwordOffset)
+        {
+            return 0;
+        }
+        message = passwordOffset + 1 + data[passwordOffset];
+    }
+    else if (length < 5)
+    {
+        return 0;
+    }
+    else if (data[3] == 0x01)
+    {
+        message = 4 + 4 + 2;
+    }
+    else if (data[3] == 0x04)
+    {
+        message = 4 + 16 + 2;
+    }
+    else if (data[3] == 0x03)
+    {
+        message = 4 + 1 + data[4] + 2;
+    }
+    else
+    {
+        // the proxy server rejects it
+        message = length;
+    }
+
+    return length >= message ? message : 0;
+}
+
+/**
+   Put the address the server bound for the client at the end of
+   a reply, as BND.ADDR and BND.PORT
+ **/
+static void setBoundAddress(Cryptor::Buffer &reply, const Address &bound)
+{
+    Cryptor::Buffer address;
+    if (bound.type() == Address::Type::ipv4)
+    {
+        auto host = bound.toRawIPv4();
+        address.assign(host.begin(), host.end());
+    }
+    else
+    {
+        auto host = bound.toRawIPv6();
+        address.assign(host.begin(), host.end());
+    }
+    auto port = bound.rawPortNetworkOrder();
+
+    reply.resize(4);
+    reply[3] = bound.type() == Address::Type::ipv4 ? 0x01 : 0x04;
+    reply.insert(reply.end(), address.begin(), address.end());
+    reply.insert(reply.end(), port.begin(), port.end());
+}
+
+/**
+   Whether two socket addresses have the same host
+ **/
+static bool sameHost(const sockaddr_storage &a, const sockaddr *b)
+{
+    if (a.ss_family != b->sa_family)
+    {
+        return false;
+    }
+
+    if (a.ss_family == AF_INET)
+    {
+        return memcmp(&reinterpret_cast<const sockaddr_in *>(&a)->sin_addr,
+                      &reinterpret_cast<const sockaddr_in *>(b)->sin_addr, 4) == 0;
+    }
+
+    return memcmp(&reinterpret_cast<const sockaddr_in6 *>(&a)->sin6_addr,
+                  &reinterpret_cast<const sockaddr_in6 *>(b)->sin6_addr, 16) == 0;
+}
+
+Tunnel *Tunnel::create(std::shared_ptr<ServerBase> base, int inConnFd,
+                       Upstream *upstream, const Cryptor &cryptor,
+                       bufferevent *outConn, Server *router)
+{
+    auto tunnel = new Tunnel(base, inConnFd, cryptor, router);
+    if (!tunnel->start(upstream, outConn))
+    {
+        delete tunnel;
+        return nullptr;
+    }
+
+    return tunnel;
+}
+
 Tunnel::Tunnel(std::shared_ptr<ServerBase> base, int inConnFd,
-               const Address &address, const std::string &key)
+               const Cryptor &cryptor, Server *router)
     : base_(base),
       inConnFd_(inConnFd),
       inConn_(nullptr),
       outConn_(nullptr),
-      cryptor_(key, "0000000000000000")  // FIXME: use random initialized vector
+      cryptor_(cryptor),
+      handshake_(true),
+      greeted_(false),
+      requested_(false),
+      router_(router),
+      upstream_(nullptr),
+      connectingSince_(-1),
+      answered_(false),
+      routing_(router != nullptr),
+      direct_(false),
+      method_(0x00),
+      skipReplies_(0),
+      failed_(false),
+      clientLength_(0)
+{
+    cryptor_.renewCompression();
+}
+
+bool Tunnel::start(Upstream *upstream, bufferevent *outConn)
 {
     inConn_ = base_->acceptConnection(
         inConnFd_, inConnReadCallback, inConnEventCallback, this
     );
-    
-    if (inConn_ != nullptr)
+
+    if (inConn_ == nullptr)
     {
-        /**
-           if we can't create the outgoing connection,
-           we need to free the incoming connection
-        **/
-        outConn_ = base_->createConnection(
-            address, outConnReadCallback, outConnEventCallback, this
-        );        
-        if (outConn_ == nullptr)
-        {
-            bufferevent_free(inConn_);
-            inConn_ = nullptr;
-        }
+        // the destructor closes a pooled connection or stream
+        outConn_ = outConn;
+        return false;
     }
+
+    // without a router the tunnel goes through the proxy server at once
+    return routing_ || connectProxy(upstream, outConn);
 }
 
 Tunnel::~Tunnel()
 {
     LOG(INFO) << "Free client-" << inConnFd_;
+
+    if (udp_ != nullptr)
+    {
+        base_->udpAssociations()->remove(udpEntry_);
+    }
+
+    if (upstream_ != nullptr)
+    {
+        upstream_->release();
+    }
     
     if (inConn_ != nullptr)
     {
@@ -118,20 +332,306 @@ Tunnel::~Tunnel()
     
     if (outConn_ != nullptr)
     {
+        // a stream of a multiplexed connection needs to know it's closed
+        bufferevent_flush(outConn_, EV_WRITE, BEV_FINISHED);
         bufferevent_free(outConn_);
     } 
 }
 
 
+bool Tunnel::connectProxy(Upstream *upstream, bufferevent *outConn)
+{
+    if (outConn != nullptr)
+    {
+        // the pooled connection or stream is already established
+        outConn_ = outConn;
+        bufferevent_setcb(outConn_, outConnReadCallback, nullptr,
+                          outConnEventCallback, this);
+        bufferevent_enable(outConn_, EV_READ | EV_WRITE);
+    }
+    else
+    {
+        connectingSince_ = base_->now();
+        outConn_ = base_->createConnection(
+            upstream->address(), outConnReadCallback, outConnEventCallback, this
+        );
+
+        if (outConn_ == nullptr)
+        {
+            upstream->onFailure();
+            return false;
+        }
+    }
+
+    // the destructor releases the upstream, so only a tunnel connected to it holds it
+    upstream_ = upstream;
+    upstream_->acquire();
+
+    return true;
+}
+
+bool Tunnel::route()
+{
+    auto input = bufferevent_get_input(inConn_);
+
+    if (!greeted_)
+    {
+        auto length = handshakeMessageLength(input, false);
+        if (length == 0)
+        {
+            return false;
+        }
+
+        // the login is taken if the client has one, the proxy server may want it
+        auto greeting = evbuffer_pullup(input, length);
+        bool userPass = memchr(greeting + 2, 0x02, greeting[1]) != nullptr;
+        bool noAuth = memchr(greeting + 2, 0x00, greeting[1]) != nullptr;
+        
+        if (greeting[0] != 0x05 || (!userPass && !noAuth))
+        {
+            // the proxy server rejects it
+            routing_ = false;
+            return tunnelRequest(Cryptor::Buffer());
+        }
+
+        method_ = userPass ? 0x02 : 0x00;
+        unsigned char reply[] = {0x05, method_};
+        evbuffer_drain(input, length);
+        bufferevent_write(inConn_, reply, sizeof(reply));
+        greeted_ = true;
+    }
+
+    if (method_ == 0x02 && login_.empty())
+    {
+        // +----+------+----------+------+----------+
+        // |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+        auto length = handshakeMessageLength(input, true);
+        if (length == 0)
+        {
+            return false;
+        }
+
+        login_.resize(length);
+        evbuffer_remove(input, login_.data(), length);
+
+        // the proxy server checks it if the client is tunneled
+        bool valid = login_[0] == 0x01;
+        unsigned char status[] = {0x01, static_cast<unsigned char>(valid ? 0x00 : 0x01)};
+        bufferevent_write(inConn_, status, sizeof(status));
+        if (!valid)
+        {
+            failed_ = true;
+            return false;
+        }
+    }
+
+    auto length = handshakeMessageLength(input, true);
+    if (length == 0)
+    {
+        return false;
+    }
+
+    Cryptor::Buffer request(length);
+    evbuffer_remove(input, request.data(), length);
+    routing_ = false;
+
+    // after VER and CMD the request reads like the header of a datagram
+    auto header = request;
+    header[0] = header[1] = 0x00;
+
+    Address destination;
+    if (request[0] == 0x05 && request[1] == 0x01 &&
+        UdpHeader::parse(header.data(), header.size(), destination) != 0 &&
+        router_->routes()->route(destination) == Routes::Route::direct)
+    {
+        return connectDirect(destination);
+    }
+
+    return tunnelRequest(request);
+}
+
+bool Tunnel::connectDirect(const Address &destination)
+{
+    LOG(INFO) << "Client-" << inConnFd_ << " connects directly to " << destination;
+    
+    outConn_ = base_->createConnection(
+        destination, outConnReadCallback, outConnEventCallback, this
+    );
+    if (outConn_ == nullptr)
+    {
+        replyError(0x04);    // host unreachable
+        return false;
+    }
+
+    direct_ = true;
+    return true;
+}
+
+bool Tunnel::tunnelRequest(const Cryptor::Buffer &request)
+{
+    bufferevent *outConn = nullptr;
+    auto upstream = router_->takeRemoteConnection(inConnFd_, outConn);
+    if (upstream == nullptr || !connectProxy(upstream, outConn))
+    {
+        replyError(0x01);    // general SOCKS server failure
+        return false;
+    }
+
+    if (!greeted_)
+    {
+        return true;
+    }
+
+    // the client greeted us, the proxy server gets a greeting of its own
+    if (method_ == 0x00)
+    {
+        static const unsigned char greeting[] = {0x05, 0x01, 0x00};
+        cryptor_.encryptTo(outConn_, greeting, sizeof(greeting));
+        cryptor_.encryptTo(outConn_, request.data(), request.size());
+    }
+    else
+    {
+        // whether the login goes first shows in the answer
+        static const unsigned char greeting[] = {0x05, 0x02, 0x00, 0x02};
+        cryptor_.encryptTo(outConn_, greeting, sizeof(greeting));
+        request_ = request;
+    }
+
+    requested_ = true;
+    skipReplies_ = 1;
+
+    return true;
+}
+
+void Tunnel::replyError(unsigned char code)
+{
+    unsigned char reply[] = {0x05, code, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+    bufferevent_write(inConn_, reply, sizeof(reply));
+
+    failed_ = true;
+}
+
+void Tunnel::onConnected()
+{
+    if (connectingSince_ >= 0)
+    {
+        upstream_->onConnected(base_->now() - connectingSince_);
+        connectingSince_ = -1;
+    }
+    
+    if (!direct_ || !handshake_)
+    {
+        return;
+    }
+
+    handshake_ = false;
+
+    Cryptor::Buffer reply = {0x05, 0x00, 0x00};
+    setBoundAddress(reply, getSocketLocalAddress(bufferevent_getfd(outConn_)));
+    bufferevent_write(inConn_, reply.data(), reply.size());
+}
+
+void Tunnel::onConnectError(int err)
+{
+    if (!direct_)
+    {
+        onProxyClosed();
+        return;
+    }
+    
+    if (!handshake_ || inConn_ == nullptr)
+    {
+        return;
+    }
+
+    // connection refused, or else host unreachable
+    replyError(err == ECONNREFUSED ? 0x05 : 0x04);
+    closeAfterWrite();
+}
+
+void Tunnel::onProxyClosed()
+{
+    // the proxy server is gone or broken unless it answered
+    if (upstream_ != nullptr && !answered_)
+    {
+        answered_ = true;
+        upstream_->onFailure();
+    }
+}
+
+void Tunnel::closeAfterWrite()
+{
+    assert(inConn_ != nullptr);
+
+    ServerBase::closeAfterWrite(inConn_);
+    inConn_ = nullptr;
+}
+
 void Tunnel::encryptTransfer()
 {
     assert(inConn_ != nullptr);
+
+    if (routing_ && !route())
+    {
+        return;
+    }
     assert(outConn_ != nullptr);
 
-    LOG(INFO) << "Encrypt and transfer data from client-"
-              << inConnFd_ << " to the proxy server";
+    // the data of the client waits for its request
+    if (!request_.empty())
+    {
+        return;
+    }
+
+    // the destination reads the data of the client as it is
+    if (direct_)
+    {
+        auto bytes = evbuffer_get_length(bufferevent_get_input(inConn_));
+        
+        bufferevent_write_buffer(outConn_, bufferevent_get_input(inConn_));
+        base_->tune(outTuner_, outConn_, bytes);
+        return;
+    }
+
+    // the connection of a udp association only keeps it alive
+    if (udp_ != nullptr)
+    {
+        auto input = bufferevent_get_input(inConn_);
+        evbuffer_drain(input, evbuffer_get_length(input));
+        return;
+    }
+    
+    // the bytes read are counted, the output of a mux stream moves to its peer at once
+    auto input = bufferevent_get_input(inConn_);
+    auto before = evbuffer_get_length(input);
+
+    /**
+       The proxy server reads one handshake message per frame, a client
+       may write its greeting, request and first data at once
+     **/
+    while (!requested_)
+    {
+        auto length = handshakeMessageLength(input, greeted_);
+        if (length == 0)
+        {
+            return;
+        }
+
+        Cryptor::Buffer message(length);
+        evbuffer_remove(input, message.data(), length);
+        cryptor_.encryptTo(outConn_, message.data(), length);
+
+        requested_ = greeted_ && message[0] != 0x01;
+        greeted_ = true;
+    }
+
+    if (evbuffer_get_length(input) == 0)
+    {
+        return;
+    }
     
     cryptor_.encryptTransfer(inConn_, outConn_);
+    base_->tune(outTuner_, outConn_, before - evbuffer_get_length(input));
 }
 
 void Tunnel::decryptTransfer()
@@ -139,8 +639,187 @@ void Tunnel::decryptTransfer()
     assert(inConn_ != nullptr);
     assert(outConn_ != nullptr);
     
-    LOG(INFO) << "Decrypt and transfer data from proxy server to the client-"
-              << inConnFd_;
+    if (direct_)
+    {
+        auto bytes = evbuffer_get_length(bufferevent_get_input(outConn_));
+        
+        bufferevent_write_buffer(inConn_, bufferevent_get_input(outConn_));
+        base_->tune(inTuner_, inConn_, bytes);
+        return;
+    }
+    
+    if (!answered_ && cryptor_.hasFrame(outConn_))
+    {
+        answered_ = true;
+        upstream_->onSuccess();
+    }
+    
+    // the replies of the handshake are looked at one frame at a time
+    while (handshake_ && !failed_ && cryptor_.hasFrame(outConn_))
+    {
+        auto reply = cryptor_.decryptFrom(outConn_);
+        cryptor_.removeFrom(outConn_);
+
+        if (reply != nullptr)
+        {
+            handleReply(*reply);
+        }
+    }
+
+    if (handshake_ || failed_)
+    {
+        return;
+    }
+
+    if (udp_ != nullptr)
+    {
+        relayToClient();
+        return;
+    }
+    
+    auto input = bufferevent_get_input(outConn_);
+    auto before = evbuffer_get_length(input);
     
     cryptor_.decryptTransfer(outConn_, inConn_);
+    base_->tune(inTuner_, inConn_, before - evbuffer_get_length(input));
+}
+
+void Tunnel::handleReply(Cryptor::Buffer &reply)
+{
+    // the method selection and the login status were answered by us
+    if (skipReplies_ > 0 && reply.size() == 2)
+    {
+        skipReplies_--;
+        
+        if (reply[0] == 0x05 && reply[1] == 0x02 && !login_.empty())
+        {
+            cryptor_.encryptTo(outConn_, login_.data(), login_.size());
+            skipReplies_++;
+        }
+        else if (reply[1] != 0x00)
+        {
+            LOG(ERROR) << "The proxy server refused the login of client-" << inConnFd_;
+            replyError(0x01);    // general SOCKS server failure
+            return;
+        }
+
+        if (!request_.empty())
+        {
+            cryptor_.encryptTo(outConn_, request_.data(), request_.size());
+            request_.clear();
+
+            // what the client sent meanwhile follows the request
+            if (evbuffer_get_length(bufferevent_get_input(inConn_)) > 0)
+            {
+                cryptor_.encryptTransfer(inConn_, outConn_);
+            }
+        }
+        return;
+    }
+    
+    // the method selection and the username/password replies are 2 bytes
+    if (reply.size() >= 4)
+    {
+        handshake_ = false;
+
+        if (isUdpAssociateReply(reply))
+        {
+            startUdpAssociation(reply);
+        }
+    }
+
+    bufferevent_write(inConn_, reply.data(), reply.size());
+}
+
+void Tunnel::startUdpAssociation(Cryptor::Buffer &reply)
+{
+    auto associations = base_->udpAssociations();
+    
+    // the relay listens where the client reached us
+    auto local = getSocketLocalAddress(inConnFd_);
+    int fd = associations != nullptr ?
+        createUdpSocket(Address::FromHostOrder(local.host().c_str(), 0)) : -1;
+
+    socklen_t length = sizeof(peer_);
+    if (fd == -1 ||
+        ::getpeername(inConnFd_, reinterpret_cast<sockaddr *>(&peer_), &length) != 0)
+    {
+        LOG(ERROR) << "Failed to open udp relay for client-" << inConnFd_;
+        
+        if (fd != -1)
+        {
+            evutil_closesocket(fd);
+        }
+        reply[1] = 0x01;     // general SOCKS server failure
+        return;
+    }
+
+    udp_.reset(new UdpRelay(base_->base(), fd, udpReadCallback, this));
+    udpEntry_ = associations->add(udpExpiredCallback, this);
+
+    // the largest frame of a datagram the proxy server may send
+    fromServer_.resize(UdpHeader::MAX_BYTES + UdpRelay::MAX_DATAGRAM + Cryptor::BLOCK_SIZE);
+
+    auto relay = udp_->localAddress();
+    setBoundAddress(reply, relay);
+
+    LOG(INFO) << "UDP association of client-" << inConnFd_ << " relays through " << relay;
+}
+
+void Tunnel::relayToClient()
+{
+    // each frame is opened and drained on its own, a backlog costs no more than its bytes
+    while (cryptor_.hasFrame(outConn_))
+    {
+        std::size_t length = 0;
+        bool opened = cryptor_.decryptFrom(outConn_, fromServer_.data(), fromServer_.size(),
+                                           length);
+        cryptor_.removeFrom(outConn_);
+
+        // nowhere to send it before the client sent its first datagram
+        if (opened && clientLength_ != 0)
+        {
+            udp_->send(reinterpret_cast<sockaddr *>(&client_), clientLength_,
+                       fromServer_.data(), length);
+        }
+    }
+
+    udp_->flush();
+    base_->udpAssociations()->touch(udpEntry_);
+}
+
+void Tunnel::onDatagram(const sockaddr *from, socklen_t fromLength,
+                        const unsigned char *data, std::size_t length)
+{
+    // only the client may use the relay, and only from one port
+    if (!sameHost(peer_, from))
+    {
+        return;
+    }
+
+    if (clientLength_ == 0)
+    {
+        memcpy(&client_, from, fromLength);
+        clientLength_ = fromLength;
+    }
+    else if (clientLength_ != fromLength || memcmp(&client_, from, fromLength) != 0)
+    {
+        return;
+    }
+
+    Address destination;
+    if (UdpHeader::parse(data, length, destination) == 0)
+    {
+        LOG(ERROR) << "Invalid datagram from client-" << inConnFd_;
+        return;
+    }
+
+    // the proxy server doesn't keep up, drop as the network would
+    if (evbuffer_get_length(bufferevent_get_output(outConn_)) >= UDP_BACKLOG)
+    {
+        return;
+    }
+
+    cryptor_.encryptTo(outConn_, data, length);
+    base_->udpAssociations()->touch(udpEntry_);
 }
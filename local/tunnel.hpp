@@ -13,12 +13,33 @@
 #include "address.hpp"
 #include "base.hpp"
 #include "cipher.hpp"
+#include "udprelay.hpp"
+#include "upstream.hpp"
+
+#include <memory>
+
+/**
+   Forward declaration
+ **/
+class Server;
 
 class Tunnel
 {
 public:
-    Tunnel(std::shared_ptr<ServerBase> base, int inConnFd,
-           const Address &address, const std::string &key);
+    /**
+       Create the tunnel of the client inConnFd. outConn is an
+       established connection to the upstream proxy server taken from
+       the pool or a multiplexed stream, or nullptr to open a new one.
+       With a router the tunnel answers the greeting itself and
+       connects once the request tells where to, directly or through a
+       proxy server and a connection the router gives. The tunnel
+       copies cryptor with compression contexts of its own. Return
+       nullptr if the connections can't be made, the tunnel is deleted
+       then and outConn freed
+     **/
+    static Tunnel *create(std::shared_ptr<ServerBase> base, int inConnFd,
+                          Upstream *upstream, const Cryptor &cryptor,
+                          bufferevent *outConn = nullptr, Server *router = nullptr);
 
     ~Tunnel();
     
@@ -32,13 +53,87 @@ public:
     // Decrypt and transfer data from proxy server to the client
     void decryptTransfer();
 
+    /**
+       Close the client connection once the data queued for the
+       client is written, the tunnel must be deleted afterwards
+     **/
+    void closeAfterWrite();
+
+    // Answer a client waiting for the direct connection
+    void onConnected();
+
+    // Called when the outgoing connection fails
+    void onConnectError(int err);
+
+    // Called when the proxy server closes the connection
+    void onProxyClosed();
+
+    /**
+       Whether the client got an error reply, the tunnel
+       must close the client connection and be deleted
+     **/
+    bool failed() const
+    {
+        return failed_;
+    }
+
+    // the monitor of the event loop, nullptr if it isn't measured
+    LoopMonitor *loopMonitor() const
+    {
+        return base_->loopMonitor();
+    }
+
+    // Called for each datagram the client sends to the udp relay
+    void onDatagram(const sockaddr *from, socklen_t fromLength,
+                    const unsigned char *data, std::size_t length);
+    
     // Return the client socket descriptor
     inline int clientFd() const
     {
         return inConnFd_;
     }
     
-private:    
+private:
+    Tunnel(std::shared_ptr<ServerBase> base, int inConnFd,
+           const Cryptor &cryptor, Server *router);
+
+    // Accept the client and connect to upstream unless there's a router
+    bool start(Upstream *upstream, bufferevent *outConn);
+
+    /**
+       Use outConn to the upstream proxy server, or
+       open a new connection if it's nullptr
+     **/
+    bool connectProxy(Upstream *upstream, bufferevent *outConn);
+
+    /**
+       Answer the greeting, the login and the request of the client
+       and connect where the routes say, return true once there is an
+       outgoing connection. A login is passed on to the proxy server
+     **/
+    bool route();
+
+    // Connect to the destination of the client without the proxy server
+    bool connectDirect(const Address &destination);
+
+    // Send the request of the client to the proxy server
+    bool tunnelRequest(const Cryptor::Buffer &request);
+
+    // Answer the request of the client with an error and give up
+    void replyError(unsigned char code);
+
+    // Pass a reply of the handshake to the client
+    void handleReply(Cryptor::Buffer &reply);
+
+    /**
+       Open the udp relay for the client and put its address
+       in the reply, a failure turns the reply into an error
+     **/
+    void startUdpAssociation(Cryptor::Buffer &reply);
+
+    // Send the datagrams from the proxy server to the client
+    void relayToClient();
+    
     std::shared_ptr<ServerBase>  base_;
 
     int                          inConnFd_;       // client socket descriptor
@@ -46,6 +141,30 @@ private:
     bufferevent                  *outConn_;       // outgoing connection
     
     Cryptor                      cryptor_;
+    SocketTuner                  inTuner_;        // tunes the client connection
+    SocketTuner                  outTuner_;       // tunes the connection to the proxy server
+    bool                         handshake_;      // the request is not answered yet
+    bool                         greeted_;        // the greeting of the client is sent
+    bool                         requested_;      // the request of the client is sent
+
+    Server                       *router_;        // nullptr if the client isn't routed
+    Upstream                     *upstream_;      // nullptr before the client is routed
+    long                         connectingSince_; // of a new connection to the proxy server, or -1
+    bool                         answered_;       // the proxy server replied
+    bool                         routing_;        // waiting for the request to route it
+    bool                         direct_;         // connected without the proxy server
+    unsigned char                method_;         // chosen for the client by us
+    Cryptor::Buffer              login_;          // username/password of the client
+    Cryptor::Buffer              request_;        // waits for the method of the proxy server
+    int                          skipReplies_;    // replies already answered by us
+    bool                         failed_;
+
+    std::unique_ptr<UdpRelay>    udp_;            // relay of the udp association
+    UdpAssociations::Handle      udpEntry_;
+    Cryptor::Buffer              fromServer_;     // a datagram of the proxy server being opened
+    sockaddr_storage             peer_;           // the client, datagrams come from its host
+    sockaddr_storage             client_;         // where the client sends datagrams from
+    socklen_t                    clientLength_;   // 0 before the first datagram
 };
 
 #endif /* TUNNEL_H */
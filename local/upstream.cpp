@@ -0,0 +1,259 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "upstream.hpp"
+
+#include <assert.h>
+
+#include <glog/logging.h>
+
+#include <event2/bufferevent.h>
+
+constexpr int Upstream::PROBE_TIMEOUT;
+
+static void probeReadCallback(bufferevent *conn, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto upstream = static_cast<Upstream *>(arg);
+    if (upstream->cryptor().hasFrame(conn))
+    {
+        upstream->onProbeAnswered();
+    }
+}
+
+static void probeEventCallback(bufferevent *conn, short what, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto upstream = static_cast<Upstream *>(arg);
+
+    if (what & BEV_EVENT_CONNECTED)
+    {
+        upstream->onProbeConnected();
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+    {
+        upstream->onProbeFailed();
+    }
+}
+
+/**
+   Called if a multiplexed connection fails before
+   createConnection() returns, the session isn't there yet
+ **/
+static void sessionEventCallback(bufferevent *conn, short what, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto failed = static_cast<bool *>(arg);
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    {
+        *failed = true;
+    }
+}
+
+Upstream::Upstream(std::shared_ptr<ServerBase> base, Balancer &balancer, std::size_t index,
+                   const Address &address, const std::string &key)
+    : base_(base),
+      balancer_(balancer),
+      index_(index),
+      address_(address),
+      cryptor_(key, "0000000000000000"),  // FIXME: use random initialized vector
+      probe_(nullptr),
+      probeStartedAt_(0),
+      probeFailed_(false)
+{
+}
+
+Upstream::~Upstream()
+{
+    closeProbe();
+}
+
+void Upstream::enablePool(int poolSize, int maxIdle)
+{
+    if (poolSize > 0)
+    {
+        pool_.reset(new ConnectionPool(base_, address_, poolSize, maxIdle));
+    }
+}
+
+void Upstream::enableMux(int connections)
+{
+    sessions_.resize(connections);
+}
+
+bufferevent *Upstream::openStream()
+{
+    // replace the connections which are gone
+    for (auto &session : sessions_)
+    {
+        if (session == nullptr || session->closed())
+        {
+            bool failed = false;
+            auto conn = base_->createConnection(address_, nullptr, sessionEventCallback, &failed);
+            if (conn == nullptr || failed)
+            {
+                if (conn != nullptr)
+                {
+                    bufferevent_free(conn);
+                }
+                
+                onFailure();
+                continue;
+            }
+            
+            session.reset(new MuxSession(base_->base(), conn, cryptor_));
+        }
+    }
+
+    MuxSession *best = nullptr;
+    for (auto &session : sessions_)
+    {
+        if (session != nullptr && !session->closed() &&
+            (best == nullptr || session->streams() < best->streams()))
+        {
+            best = session.get();
+        }
+    }
+
+    return best != nullptr ? best->openStream() : nullptr;
+}
+
+bool Upstream::take(int inConnFd, bufferevent *&outConn)
+{
+    outConn = nullptr;
+    if (!sessions_.empty())
+    {
+        outConn = openStream();
+        if (outConn == nullptr)
+        {
+            LOG(ERROR) << "No multiplexed connection to the proxy server "
+                       << address_ << " for client-" << inConnFd;
+            return false;
+        }
+    }
+    else if (pool_ != nullptr)
+    {
+        outConn = pool_->take();
+    }
+
+    return true;
+}
+
+void Upstream::probe()
+{
+    if (probe_ != nullptr)
+    {
+        return;
+    }
+
+    /**
+       the connection may fail before createConnection() returns,
+       onProbeFailed() leaves it to us in that case
+    **/
+    probeStartedAt_ = base_->now();
+    probeFailed_ = false;
+    auto conn = base_->createConnection(address_, probeReadCallback, probeEventCallback, this);
+
+    if (conn == nullptr || probeFailed_)
+    {
+        if (conn != nullptr)
+        {
+            bufferevent_free(conn);
+        }
+        else
+        {
+            onFailure();
+        }
+        return;
+    }
+    probe_ = conn;
+
+    struct timeval timeout = {PROBE_TIMEOUT, 0};
+    bufferevent_set_timeouts(probe_, &timeout, &timeout);
+}
+
+void Upstream::onProbeConnected()
+{
+    balancer_.onConnected(index_, base_->now() - probeStartedAt_);
+
+    // any answer to a greeting shows the proxy server is serving
+    static const unsigned char greeting[] = {0x05, 0x01, 0x00};
+    cryptor_.encryptTo(probe_, greeting, sizeof(greeting));
+}
+
+void Upstream::onProbeAnswered()
+{
+    if (balancer_.ejected(index_, base_->now()) || balancer_.target(index_).failures > 0)
+    {
+        LOG(WARNING) << "Proxy server " << address_ << " is back";
+    }
+
+    balancer_.onSuccess(index_);
+    closeProbe();
+}
+
+void Upstream::onProbeFailed()
+{
+    LOG(ERROR) << "Probe of the proxy server " << address_ << " failed";
+
+    onFailure();
+    if (probe_ == nullptr)
+    {
+        probeFailed_ = true;
+        return;
+    }
+    closeProbe();
+}
+
+void Upstream::closeProbe()
+{
+    if (probe_ != nullptr)
+    {
+        bufferevent_free(probe_);
+        probe_ = nullptr;
+    }
+}
+
+void Upstream::acquire()
+{
+    balancer_.acquire(index_);
+}
+
+void Upstream::release()
+{
+    balancer_.release(index_);
+}
+
+void Upstream::onConnected(long latency)
+{
+    balancer_.onConnected(index_, latency);
+}
+
+void Upstream::onSuccess()
+{
+    balancer_.onSuccess(index_);
+}
+
+void Upstream::onFailure()
+{
+    auto now = base_->now();
+    auto ejections = balancer_.target(index_).ejections;
+
+    balancer_.onFailure(index_, now);
+    if (balancer_.target(index_).ejections != ejections)
+    {
+        LOG(ERROR) << "Eject the proxy server " << address_ << " for "
+                   << balancer_.target(index_).ejectedUntil - now << " ms";
+    }
+}
@@ -0,0 +1,120 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "address.hpp"
+#include "balancer.hpp"
+#include "base.hpp"
+#include "cipher.hpp"
+#include "mux.hpp"
+#include "pool.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+
+/**
+   One of the proxy servers of the local server, with its pooled or
+   multiplexed connections. The tunnels and the probes report to the
+   balancer how it does
+ **/
+class Upstream
+{
+public:
+    // Seconds a probe may wait for the greeting to be answered
+    static constexpr int PROBE_TIMEOUT = 3;
+
+    Upstream(std::shared_ptr<ServerBase> base, Balancer &balancer, std::size_t index,
+             const Address &address, const std::string &key);
+    ~Upstream();
+
+    // disable the copy operations
+    Upstream(const Upstream &) = delete;
+    Upstream &operator=(const Upstream &) = delete;
+
+    // Keep poolSize connections open to the proxy server
+    void enablePool(int poolSize, int maxIdle);
+
+    // Carry the tunnels over this many multiplexed connections
+    void enableMux(int connections);
+
+    /**
+       Take a connection to the proxy server for the client, outConn is
+       nullptr if the tunnel opens a new one. Return false if there is
+       no multiplexed connection to open a stream on
+     **/
+    bool take(int inConnFd, bufferevent *&outConn);
+
+    /**
+       Send a greeting on a new connection and wait for the
+       answer, unless the last probe is still running
+     **/
+    void probe();
+
+    // Called by the probe connection
+    void onProbeConnected();
+    void onProbeAnswered();
+    void onProbeFailed();
+
+    // Count the tunnels on the proxy server
+    void acquire();
+    void release();
+
+    // A new connection of a tunnel was established after latency milliseconds
+    void onConnected(long latency);
+
+    // The proxy server answered a tunnel
+    void onSuccess();
+
+    // A connection of a tunnel failed or was closed before an answer
+    void onFailure();
+
+    const Address &address() const
+    {
+        return address_;
+    }
+
+    const Cryptor &cryptor() const
+    {
+        return cryptor_;
+    }
+
+    // Put the flag of the compressed frames on the probes too
+    void enableCompression(const FrameCompressor::Options &options)
+    {
+        cryptor_.enableCompression(options);
+    }
+
+private:
+    // Open a stream on the least loaded multiplexed connection
+    bufferevent *openStream();
+
+    // Free the probe connection
+    void closeProbe();
+
+    std::shared_ptr<ServerBase>       base_;
+    Balancer                          &balancer_;
+    std::size_t                       index_;      // in the balancer
+    Address                           address_;    // address of the proxy server
+    Cryptor                           cryptor_;
+    std::unique_ptr<ConnectionPool>   pool_;       // established connections
+    std::vector<std::unique_ptr<MuxSession>> sessions_; // multiplexed connections
+    bufferevent                       *probe_;     // nullptr if no probe is running
+    long                              probeStartedAt_;
+    bool                              probeFailed_; // before createConnection() returned
+};
+
+#endif /* UPSTREAM_H */
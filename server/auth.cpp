@@ -1,7 +1,5 @@
 #include "auth.hpp"
 
-#include <vector>
-
 #include <glog/logging.h>
 
 #include <event2/buffer.h>
@@ -11,18 +9,15 @@ Auth::Auth(const Cryptor &cryptor, bufferevent *inConn)
     : cryptor_(cryptor),
       inConn_(inConn),
       authMethod_(AUTH_NO_ACCEPTABLE),
-      supportMethods_{AUTH_NONE}
+      supportMethod_(AUTH_NONE)
 {    
 }
 
-Auth::Auth(const Cryptor &cryptor, bufferevent *inConn,
-           const std::string &username, const std::string &password)
+Auth::Auth(const Cryptor &cryptor, bufferevent *inConn, bool userPassword)
     : cryptor_(cryptor),
       inConn_(inConn),
       authMethod_(AUTH_NO_ACCEPTABLE),
-      supportMethods_{AUTH_USER_PASSWORD},
-      username_(username),
-      password_(password)
+      supportMethod_(userPassword ? AUTH_USER_PASSWORD : AUTH_NONE)
 {
 }
 
@@ -52,44 +47,27 @@ Auth::Auth(const Cryptor &cryptor, bufferevent *inConn,
 **/
 Auth::State Auth::authenticate()
 {
-    auto data = cryptor_.decryptFrom(inConn_);
-    if (data == nullptr)
+    std::size_t length;
+    if (!readMessage(length))
     {
         return State::error;
     }
 
-    int size = data->size();
-    if (size < 2)
+    Handshake::Greeting greeting;
+    auto result = Handshake::parseGreeting(message_, length, greeting);
+    if (result == Handshake::Result::incomplete)
     {
         return State::incomplete;
     }
-
-    // check protocol version number
-    if ((*data)[0] != SOCKS5_VERSION)
-    {
-        return State::error;
-    }
-
-    // how many kinds of methods
-    unsigned char nmethods = (*data)[1];    
-    if (size < 2 + nmethods)
-    {
-        return State::incomplete;
-    }    
-    else if (size > 2 + nmethods)
+    else if (result != Handshake::Result::done)
     {
         return State::error;
     }
     cryptor_.removeFrom(inConn_);
 
-    for (int i = 2; i < size; i++)
+    if (greeting.offers(supportMethod_))
     {
-        auto method = (*data)[i];
-        if (supportMethods_.find(method) != supportMethods_.end())
-        {
-            authMethod_ = method;
-            break;
-        }        
+        authMethod_ = supportMethod_;
     }
     
     unsigned char response[2];
@@ -114,51 +92,45 @@ Auth::State Auth::authenticate()
     return State::success;
 }
 
-
-Auth::State Auth::validateUsernamePassword()
+/**
+   The username/password message of the client:
+   +----+------+----------+------+----------+
+   |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+   +----+------+----------+------+----------+
+   | 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+   +----+------+----------+------+----------+
+ **/
+Auth::State Auth::readUsernamePassword(Handshake::Login &login)
 {    
-    auto data = cryptor_.decryptFrom(inConn_);
-    if (data == nullptr)
+    std::size_t length;
+    if (!readMessage(length))
     {
         return State::error;
     }
 
-    int size = data->size();
-    if (size < 2)
+    auto result = Handshake::parseLogin(message_, length, login);
+    if (result == Handshake::Result::incomplete)
     {
         return State::incomplete;
     }
-
-    // check version number
-    if ((*data)[0] != USER_AUTH_VERSION)
-    {
-        return State::error;
-    }
-
-    // get length of username
-    auto userLength = (*data)[1];    
-    if (size < 3 + userLength)
-    {
-        return State::incomplete;
-    }
-
-    // get length of password
-    auto passLength = (*data)[userLength + 2];    
-    if (size < 3 + userLength + passLength)
-    {
-        return State::incomplete;        
-    }
-    else if (size > 3 + userLength + passLength)
+    else if (result != Handshake::Result::done)
     {
         return State::error;
     }
     cryptor_.removeFrom(inConn_);
 
-    std::string username(&(*data)[2], &(*data)[2 + userLength]);
-    std::string password(&(*data)[3 + userLength], &(*data)[size]);
+    return State::success;
+}
 
+bool Auth::readMessage(std::size_t &length)
+{
+    return cryptor_.decryptFrom(inConn_, message_, sizeof(message_), length);
+}
+
+Auth::State Auth::replyUsernamePassword(bool allowed)
+{
     unsigned char reply[2] = {USER_AUTH_VERSION, USER_AUTH_SUCCESS};
-    if (username != username_ || password != password_)
+    if (!allowed)
     {
         reply[1] = USER_AUTH_FAILED;
 
@@ -2,9 +2,9 @@
 #define AUTH_H
 
 #include "cipher.hpp"
+#include "handshake.hpp"
 
 #include <string>
-#include <unordered_set>
 
 /**
    Forward declaration
@@ -14,37 +14,48 @@ struct bufferevent;
 class Auth
 {
 public:
-    enum class State { incomplete, success, failed, error, waitUserPassAuth };
+    static constexpr unsigned char      SOCKS5_VERSION          = 0x05;    
+
+    static constexpr unsigned char      AUTH_NONE               = 0x00;
+    static constexpr unsigned char      AUTH_USER_PASSWORD      = 0x02;        
+    static constexpr unsigned char      AUTH_NO_ACCEPTABLE      = 0xFF;
+
+    static constexpr unsigned char      USER_AUTH_VERSION       = 0x01;
+    static constexpr unsigned char      USER_AUTH_SUCCESS       = 0x00;
+    static constexpr unsigned char      USER_AUTH_FAILED        = 0x01;    
+
+    enum class State { incomplete, success, failed, error, waitUserPassAuth, pending };
     
     Auth(const Cryptor &cryptor, bufferevent *inConn);
 
-    Auth(const Cryptor &cryptor, bufferevent *inConn,
-         const std::string &username, const std::string &password);
+    // Ask the client to log in if userPassword is set
+    Auth(const Cryptor &cryptor, bufferevent *inConn, bool userPassword);
     
     // disable the copy operations    
     Auth(const Auth &) = delete;
     Auth &operator=(const Auth &) = delete;
 
     State authenticate();
-    State validateUsernamePassword();
-    
-private:
-    static constexpr unsigned char      SOCKS5_VERSION          = 0x05;    
 
-    static constexpr unsigned char      AUTH_NONE               = 0x00;
-    static constexpr unsigned char      AUTH_USER_PASSWORD      = 0x02;        
-    static constexpr unsigned char      AUTH_NO_ACCEPTABLE      = 0xFF;
+    /**
+       Read the username/password message without answering it,
+       return State::success once it's complete. The fields of login
+       point into this Auth and last as long as it
+     **/
+    State readUsernamePassword(Handshake::Login &login);
 
-    static constexpr unsigned char      USER_AUTH_VERSION       = 0x01;
-    static constexpr unsigned char      USER_AUTH_SUCCESS       = 0x00;
-    static constexpr unsigned char      USER_AUTH_FAILED        = 0x01;    
+    // Answer the username/password message once the login is checked
+    State replyUsernamePassword(bool allowed);
+    
+private:
+    // Read the frame of a message into message_, return false if it's broken
+    bool readMessage(std::size_t &length);
 
     Cryptor                             cryptor_;
     bufferevent                         *inConn_;
     unsigned char                       authMethod_;
-    std::unordered_set<unsigned char>   supportMethods_;
-    std::string                         username_;
-    std::string                         password_;
+    unsigned char                       supportMethod_;
+    unsigned char                       message_[Handshake::MAX_MESSAGE + Cryptor::BLOCK_SIZE];
 };
 
 #endif /* AUTH_H */
@@ -11,12 +11,24 @@
 #define CONFIG_H
 
 #include "address.hpp"
+#include "authbackend.hpp"
+#include "compress.hpp"
+#include "connecthistory.hpp"
+#include "dnscache.hpp"
+#include "loopmonitor.hpp"
+#include "mux.hpp"
+#include "qos.hpp"
+#include "ratelimit.hpp"
+#include "sockets.hpp"
+#include "sourcelimit.hpp"
+#include "zerocopy.hpp"
 
 #include <assert.h>
 
 #include <string>
 #include <memory>
 #include <utility>
+#include <vector>
  
 class Config
 {
@@ -28,7 +40,19 @@ public:
            const std::string &key)
         : address_(Address::FromHostOrder(host, port)),          
           userPassAuth_(nullptr),
-          key_(key)
+          key_(key),
+          useAuthBackend_(false),
+          useDnsCache_(false),
+          useConnectHistory_(false),
+          useCompression_(false),
+          useLoopMonitor_(false),
+          useZeroCopy_(false),
+          coroutineSessions_(false),
+          fastOpen_(0),
+          backlog_(-1),
+          deferAccept_(0),
+          udpTimeout_(0),
+          muxMaxStreams_(MuxSession::MAX_STREAMS)
     {
         assert(!key_.empty());
         
@@ -54,6 +78,12 @@ public:
     }
     
     bool useUserPassAuth() const
+    {
+        return userPassAuth_ != nullptr || !credentialsFile_.empty() || useAuthBackend_;
+    }
+
+    // Whether the single user of -username and -password is set
+    bool hasUser() const
     {
         return userPassAuth_ != nullptr;
     }
@@ -72,20 +102,323 @@ public:
         return std::get<1>(*userPassAuth_);        
     }
 
+    // File of the users, reloaded on SIGHUP, it replaces the single user
+    void setCredentialsFile(const std::string &path)
+    {
+        credentialsFile_ = path;
+    }
+
+    std::string credentialsFile() const
+    {
+        return credentialsFile_;
+    }
+
+    // File of the destination rules, reloaded on SIGHUP
+    void setAclFile(const std::string &path)
+    {
+        aclFile_ = path;
+    }
+
+    std::string aclFile() const
+    {
+        return aclFile_;
+    }
+
+    // Ask a verifier process about the users which aren't known locally
+    void setAuthBackend(const AuthBackend::Options &options)
+    {
+        useAuthBackend_ = true;
+        authBackendOptions_ = options;
+    }
+
+    bool useAuthBackend() const
+    {
+        return useAuthBackend_;
+    }
+
+    AuthBackend::Options authBackendOptions() const
+    {
+        return authBackendOptions_;
+    }
+
     std::string key() const
     {
         return key_;
     }
+
+    void setKey(const std::string &key)
+    {
+        assert(!key.empty());
+        key_ = key;
+    }
+
+    // File of the settings which a reload on SIGHUP may change
+    void setConfigFile(const std::string &path)
+    {
+        configFile_ = path;
+    }
+
+    std::string configFile() const
+    {
+        return configFile_;
+    }
     
     Address address() const
     {
         return address_;
     }
+
+    void setDnsCache(const DnsCache::Options &options)
+    {
+        useDnsCache_ = true;
+        dnsCacheOptions_ = options;
+    }
+
+    bool useDnsCache() const
+    {
+        return useDnsCache_;
+    }
+
+    DnsCache::Options dnsCacheOptions() const
+    {
+        return dnsCacheOptions_;
+    }
+
+    // Fail fast and time out the connections to a destination by its history
+    void setConnectHistory(const ConnectHistory::Options &options)
+    {
+        useConnectHistory_ = true;
+        connectHistoryOptions_ = options;
+    }
+
+    bool useConnectHistory() const
+    {
+        return useConnectHistory_;
+    }
+
+    ConnectHistory::Options connectHistoryOptions() const
+    {
+        return connectHistoryOptions_;
+    }
+
+    // Compress the frames to the local server, which must compress as well
+    void setCompression(const FrameCompressor::Options &options)
+    {
+        useCompression_ = true;
+        compressionOptions_ = options;
+    }
+
+    bool useCompression() const
+    {
+        return useCompression_;
+    }
+
+    FrameCompressor::Options compressionOptions() const
+    {
+        return compressionOptions_;
+    }
+
+    // Send the large frames of the bulk tunnels to the clients with MSG_ZEROCOPY
+    void setZeroCopy(const ZeroCopySender::Options &options)
+    {
+        useZeroCopy_ = true;
+        zeroCopyOptions_ = options;
+    }
+
+    bool useZeroCopy() const
+    {
+        return useZeroCopy_;
+    }
+
+    ZeroCopySender::Options zeroCopyOptions() const
+    {
+        return zeroCopyOptions_;
+    }
+
+    // Run the handshakes of the tunnels as coroutines instead of callbacks
+    void setCoroutineSessions(bool enabled)
+    {
+        coroutineSessions_ = enabled;
+    }
+
+    bool coroutineSessions() const
+    {
+        return coroutineSessions_;
+    }
+
+    // Measure the lag of the event loop and the time of the callbacks
+    void setLoopMonitor(const LoopMonitor::Options &options)
+    {
+        useLoopMonitor_ = true;
+        loopMonitorOptions_ = options;
+    }
+
+    bool useLoopMonitor() const
+    {
+        return useLoopMonitor_;
+    }
+
+    LoopMonitor::Options loopMonitorOptions() const
+    {
+        return loopMonitorOptions_;
+    }
+
+    // TCP_FASTOPEN queue length of the listening socket, 0 to disable
+    void setFastOpen(int queueLength)
+    {
+        fastOpen_ = queueLength;
+    }
+
+    int fastOpen() const
+    {
+        return fastOpen_;
+    }
+
+    // Endpoints to listen on, the address of the config if there are none
+    void setListenEndpoints(const std::vector<ListenEndpoint> &endpoints)
+    {
+        listenEndpoints_ = endpoints;
+    }
+
+    std::vector<ListenEndpoint> listenEndpoints() const
+    {
+        if (listenEndpoints_.empty())
+        {
+            return {ListenEndpoint::tcp(address_.host().c_str(), address_.portString())};
+        }
+
+        return listenEndpoints_;
+    }
+
+    // Queue length of the accepted connections, -1 for the default
+    void setBacklog(int backlog)
+    {
+        backlog_ = backlog;
+    }
+
+    int backlog() const
+    {
+        return backlog_;
+    }
+
+    // Seconds to hold a connection in the kernel until its first bytes, 0 to disable
+    void setDeferAccept(int seconds)
+    {
+        deferAccept_ = seconds;
+    }
+
+    int deferAccept() const
+    {
+        return deferAccept_;
+    }
+
+    // Seconds before an idle udp association expires, 0 disables UDP ASSOCIATE
+    void setUdpTimeout(int timeout)
+    {
+        udpTimeout_ = timeout;
+    }
+
+    int udpTimeout() const
+    {
+        return udpTimeout_;
+    }
+
+    // Streams a multiplexed connection may have open at once
+    void setMuxMaxStreams(std::size_t streams)
+    {
+        muxMaxStreams_ = streams;
+    }
+
+    std::size_t muxMaxStreams() const
+    {
+        return muxMaxStreams_;
+    }
+
+    void setSocketOptions(const SocketOptions &options)
+    {
+        socketOptions_ = options;
+    }
+
+    SocketOptions socketOptions() const
+    {
+        return socketOptions_;
+    }
+
+    void setRateLimits(const RateLimiter::Options &options)
+    {
+        rateLimits_ = options;
+    }
+
+    RateLimiter::Options rateLimits() const
+    {
+        return rateLimits_;
+    }
+
+    // Limit the connections of each source address as they're accepted
+    void setSourceLimits(const SourceLimiter::Options &options)
+    {
+        sourceLimits_ = options;
+    }
+
+    SourceLimiter::Options sourceLimits() const
+    {
+        return sourceLimits_;
+    }
+
+    bool useSourceLimiter() const
+    {
+        return sourceLimits_.maxConnections > 0 || sourceLimits_.rate > 0;
+    }
+
+    void setQos(const QosOptions &options)
+    {
+        qos_ = options;
+    }
+
+    const QosOptions &qos() const
+    {
+        return qos_;
+    }
+
+    // The bytes of the users are counted when they authenticate
+    bool useRateLimiter() const
+    {
+        return useUserPassAuth() ||
+            rateLimits_.tunnel.rate > 0 ||
+            rateLimits_.user.rate > 0 ||
+            rateLimits_.listener.rate > 0;
+    }
     
 private:    
     Address                 address_;
     std::shared_ptr<Pair>   userPassAuth_;
+    std::string             credentialsFile_;
+    std::string             aclFile_;
+    std::string             configFile_;
     std::string             key_;
+    bool                    useAuthBackend_;
+    AuthBackend::Options    authBackendOptions_;
+    bool                    useDnsCache_;
+    DnsCache::Options       dnsCacheOptions_;
+    bool                    useConnectHistory_;
+    ConnectHistory::Options connectHistoryOptions_;
+    bool                    useCompression_;
+    FrameCompressor::Options compressionOptions_;
+    bool                    useLoopMonitor_;
+    LoopMonitor::Options    loopMonitorOptions_;
+    bool                    useZeroCopy_;
+    ZeroCopySender::Options zeroCopyOptions_;
+    bool                    coroutineSessions_;
+    int                     fastOpen_;
+    std::vector<ListenEndpoint> listenEndpoints_;
+    int                     backlog_;
+    int                     deferAccept_;
+    int                     udpTimeout_;
+    std::size_t             muxMaxStreams_;
+    SocketOptions           socketOptions_;
+    RateLimiter::Options    rateLimits_;
+    SourceLimiter::Options  sourceLimits_;
+    QosOptions              qos_;
 };
 
 #endif /* CONFIG_H */
@@ -3,6 +3,7 @@
 #include "request.hpp"
 
 #include <assert.h>
+#include <errno.h>
 #include <array>
 #include <algorithm>
 
@@ -40,38 +41,50 @@ Request::State Request::handleRequest()
         return State::error;
     }
 
-    auto data = cryptor_.decryptFrom(inConn_);
-    if (data == nullptr)
+    std::size_t length;
+    if (!cryptor_.decryptFrom(inConn_, message_, sizeof(message_), length))
     {
         return State::error;
     }
 
-    auto size = data->size();
-    if (size < 4)
+    Handshake::Request request;
+    auto result = Handshake::parseRequest(message_, length, request);
+    if (result == Handshake::Result::incomplete)
     {
         return State::incomplete;
     }
-    
-    unsigned char version = (*data)[0];
-    unsigned char command = (*data)[1];
-    unsigned char addressType = (*data)[3];
-
-    // check protocol version
-    if (version != SOCKS5_VERSION)
+    else if (result == Handshake::Result::unsupported)
+    {
+        replyForError(cryptor_, inConn_, REPLY_ADDRESS_TYPE_NOT_SUPPORTED);        
+        return State::error;
+    }
+    else if (result != Handshake::Result::done)
     {
         return State::error;
     }
 
-    Address address;
-    auto state = readAddress(addressType, address, data);
-    if (state != State::success)
+    auto address = request.address();
+    if (!address.isValid())
     {
-        return state;
+        return State::error;
     }
+    LOG(INFO) << "Read destination address: " << address;
+
     cryptor_.removeFrom(inConn_);
-    
+
+    auto command = request.command;
     if (command == CMD_CONNECT)
     {
+        auto &acl = base_->acl();
+        if (acl != nullptr && acl->check(address) == Acl::Action::deny)
+        {
+            LOG(WARNING) << "Client-" << tunnel_->clientID()
+                         << " is denied to connect " << address;
+            
+            replyForError(cryptor_, inConn_, REPLY_RULE_FAILURE);
+            return State::error;
+        }
+        
         return handleConnect(address);
     }
     else if (command == CMD_BIND)
@@ -80,7 +93,7 @@ Request::State Request::handleRequest()
     }
     else if (command == CMD_UDP_ASSOCIATE)
     {
-        return handleUDPAssociate();
+        return handleUDPAssociate(address);
     }
     else
     {
@@ -91,103 +104,34 @@ Request::State Request::handleRequest()
     return State::success;
 }
 
-/**
-   Read address
+void Request::replyForError(const Cryptor &cryptor, bufferevent *inConn, unsigned char code)
+{
+    assert(inConn != nullptr);
+    assert(code != REPLY_SUCCESS);
+     
+    return sendReply(cryptor, inConn, code, Address());
+}
 
-   Returns:
-     State::incomplete   the data received by server is incomplete
-     State::success      read address success
-     State::error        an error occurred
-**/
-Request::State Request::readAddress(unsigned char addressType, Address &address, Cryptor::BufferPtr &data)
+unsigned char Request::replyForErrno(int err)
 {
-    // check address type
-    if (addressType != ADDRESS_TYPE_IPV4 &&
-        addressType != ADDRESS_TYPE_IPV6 &&
-        addressType != ADDRESS_TYPE_DOMAIN_NAME)
-    {
-        replyForError(cryptor_, inConn_, REPLY_ADDRESS_TYPE_NOT_SUPPORTED);        
-        return State::error;
-    }
-    
-    unsigned short port;
-    if (addressType == ADDRESS_TYPE_IPV4)
+    if (err == ENETUNREACH)
     {
-        if (data->size() < 10)
-        {
-            return State::incomplete;
-        }
-        else if (data->size() > 10)
-        {
-            return State::error;
-        }
-
-        std::array<unsigned char, 4> rawAddr;        
-        std::copy(data->begin() + 4, data->begin() + 8, rawAddr.data());
-        std::copy(data->begin() + 8, data->end(),
-                  reinterpret_cast<unsigned char *>(&port));
-
-        address = Address(rawAddr, port);
+        return REPLY_NETWORK_UNREACHABLE;
     }
-    else if (addressType == ADDRESS_TYPE_IPV6)
+    else if (err == ECONNREFUSED)
     {
-        if (data->size() < 22)
-        {
-            return State::incomplete;
-        }
-        else if (data->size() > 22)
-        {
-            return State::error;
-        }
-        
-        std::array<unsigned char, 16> rawAddr;
-        std::copy(data->begin() + 4, data->begin() + 20, rawAddr.data());
-        std::copy(data->begin() + 20, data->end(),
-                  reinterpret_cast<unsigned char *>(&port));
-        
-        address = Address(rawAddr, port);
+        return REPLY_CONNECTIONREFUSED;
     }
-    else
+    else if (err == EHOSTUNREACH || err == ETIMEDOUT)
     {
-        int size = data->size();
-        if (size < 5)
-        {
-            return State::incomplete;
-        }        
-
-        int domainLength = (*data)[4];
-        if (size < domainLength + 7)
-        {
-            return State::incomplete;
-        }
-        else if (size > domainLength + 7)
-        {
-            return State::error;            
-        }
-
-        std::string domain(domainLength, '\0');
-        std::copy(data->begin() + 5, data->begin() + 5 + domainLength, &domain[0]);   
-        std::copy(data->begin() + 5 + domainLength, data->end(),
-                  reinterpret_cast<unsigned char *>(&port));
-        
-        address = Address(domain, port);
+        return REPLY_HOST_UNREACHABLE;
     }
-
-    if (!address.isValid())
+    else if (err == EACCES)
     {
-        return State::error;
+        return REPLY_RULE_FAILURE;
     }
 
-    LOG(INFO) << "Read destination address: " << address;
-    return State::success;
-}
-
-void Request::replyForError(const Cryptor &cryptor, bufferevent *inConn, unsigned char code)
-{
-    assert(inConn != nullptr);
-    assert(code != REPLY_SUCCESS);
-     
-    return sendReply(cryptor, inConn, code, Address());
+    return REPLY_SERVER_FAILURE;
 }
 
 void Request::replyForSuccess(const Cryptor &cryptor, bufferevent *inConn, const Address &address)
@@ -201,45 +145,10 @@ void Request::replyForSuccess(const Cryptor &cryptor, bufferevent *inConn, const
 
 void Request::sendReply(const Cryptor &cryptor, bufferevent *inConn, unsigned char code, const Address &address)
 {
-    unsigned char reply[4];
-
-    reply[0] = SOCKS5_VERSION;
-    reply[1] = code;
-    reply[2] = 0x00;
-
-    std::vector<unsigned char> data;
-    std::array<unsigned char, 2> port;
-    
-    if (address.type() == Address::Type::ipv4)
-    {
-        reply[3] = ADDRESS_TYPE_IPV4;        
-        auto ip = address.toRawIPv4();
-        port = address.rawPortNetworkOrder();
-        
-        data.insert(data.end(), std::begin(reply), std::end(reply));
-        data.insert(data.end(), std::begin(ip), std::end(ip));
-    }
-    else if (address.type() == Address::Type::ipv6)
-    {
-        reply[3] = ADDRESS_TYPE_IPV6;
-        auto ip = address.toRawIPv6();
-        port = address.rawPortNetworkOrder();
-        
-        data.insert(data.end(), std::begin(reply), std::end(reply));
-        data.insert(data.end(), std::begin(ip), std::end(ip));
-    }
-    else
-    {
-        reply[3] = ADDRESS_TYPE_IPV4;        
-        std::array<unsigned char, 4> ip = {{ 0, 0, 0, 0 }};
-        port = {{ 0, 0 }};
-        
-        data.insert(data.end(), std::begin(reply), std::end(reply));
-        data.insert(data.end(), std::begin(ip), std::end(ip));
-    }
+    unsigned char reply[Handshake::MAX_REPLY];
 
-    data.insert(data.end(), std::begin(port), std::end(port));    
-    cryptor.encryptTo(inConn, data.data(), data.size());            
+    auto length = Handshake::writeReply(code, address, reply);
+    cryptor.encryptTo(inConn, reply, length);            
 }
 
 /**
@@ -259,17 +168,34 @@ Request::State Request::handleBind()
 
 /**
    Handle UDP ASSOCIATE command
+
+   The datagrams are carried as frames on the connection of the client,
+   so the reply has no relay address, the local server relays the
+   datagrams of the client and puts its own address in the reply
    
    Returns:
      State::success      success 
      State::error        an error occurred
 **/
-Request::State Request::handleUDPAssociate()
+Request::State Request::handleUDPAssociate(const Address &address)
 {
-    // FIXME: support UDP ASSOCIATE command
-    replyForError(cryptor_, inConn_, REPLY_COMMAND_NOT_SUPPORTED);
+    LOG(INFO) << "Handle udp associate for client-" << tunnel_->clientID()
+              << ", client address " << address;
     
-    return State::error;
+    if (base_->udpAssociations() == nullptr)
+    {
+        replyForError(cryptor_, inConn_, REPLY_COMMAND_NOT_SUPPORTED);
+        return State::error;
+    }
+    
+    if (!tunnel_->startUdpAssociation())
+    {
+        replyForError(cryptor_, inConn_, REPLY_SERVER_FAILURE);
+        return State::error;
+    }
+
+    replyForSuccess(cryptor_, inConn_, Address(std::array<unsigned char, 4>{{0, 0, 0, 0}}, 0));
+    return State::success;
 }
 
 static void outConnReadCallback(bufferevent *outConn, void *arg)
@@ -283,6 +209,8 @@ static void outConnReadCallback(bufferevent *outConn, void *arg)
         return;
     }
 
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::outConnRead);
+
     tunnel->encryptTransfer();
 }
 
@@ -293,6 +221,8 @@ static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
     {
         return;
     }
+
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::event);
     
     int outConnFd = bufferevent_getfd(outConn);
     auto inConn = tunnel->inConnection();
@@ -305,9 +235,14 @@ static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
             addr.type() == Address::Type::ipv6)
         {
             Request::replyForSuccess(tunnel->cryptor(), inConn, addr);
+            tunnel->endConnect(0);
             tunnel->setState(Tunnel::State::connected);
             
             LOG(INFO) << "Connect to destination success for client-" << clientID;
+
+            // send the data the client wrote ahead of the reply
+            bufferevent_setwatermark(inConn, EV_READ, 0, 0);
+            tunnel->decryptTransfer();
         }
         else
         {
@@ -319,19 +254,45 @@ static void outConnEventCallback(bufferevent *outConn, short what, void *arg)
     if (what & BEV_EVENT_EOF)
     {
         LOG(INFO) << "Connection closed by server for client-" << clientID;
+
+        // the client still gets what the server sent before it closed
+        tunnel->closeAfterWrite();
         delete tunnel;
     }
 
-    if (what & BEV_EVENT_ERROR)
+    if (what & (BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
     {
-        int err = EVUTIL_SOCKET_ERROR();
+        // only a connection past its deadline times out
+        int err = what & BEV_EVENT_TIMEOUT ? ETIMEDOUT : EVUTIL_SOCKET_ERROR();
         LOG(ERROR) << "Connection to server error for client-" << clientID
                    << ": " << evutil_socket_error_to_string(err);
+
+        // tell the client why its connection failed
+        if (tunnel->state() == Tunnel::State::waitForConnect)
+        {
+            // without a socket the name wasn't resolved, the destination wasn't tried
+            if (outConnFd == -1)
+            {
+                tunnel->cancelConnect();
+            }
+            else
+            {
+                tunnel->endConnect(err);
+            }
+            
+            Request::replyForError(tunnel->cryptor(), inConn, Request::replyForErrno(err));
+            tunnel->closeAfterWrite();
+        }
         
         delete tunnel;
     }    
 }
 
+void Request::relay(bufferevent *outConn, Tunnel *tunnel)
+{
+    bufferevent_setcb(outConn, outConnReadCallback, nullptr, outConnEventCallback, tunnel);
+}
+
 /**
    Handle CONNECT command
 
@@ -344,30 +305,33 @@ Request::State Request::handleConnect(const Address &address)
     
     LOG(INFO) << "Handle connect for client-" << tunnel_->clientID();
 
+    // a destination that failed just now isn't waited for again
+    int err;
+    if (!tunnel_->beginConnect(address, err))
+    {
+        replyForError(cryptor_, inConn_, replyForErrno(err));
+        return State::error;
+    }
+
     auto outConn = base_->createConnection(
         address, outConnReadCallback, outConnEventCallback, tunnel_
     );
 
     if (outConn == nullptr)
     {
-        int err = EVUTIL_SOCKET_ERROR();
-
-        if (err == ENETUNREACH)
-        {
-            replyForError(cryptor_, inConn_, REPLY_NETWORK_UNREACHABLE);
-        }
-        else if (err == ECONNREFUSED)
-        {
-            replyForError(cryptor_, inConn_, REPLY_CONNECTIONREFUSED);
-        }
-        else
-        {
-            replyForError(cryptor_, inConn_, REPLY_SERVER_FAILURE);
-        }
+        err = EVUTIL_SOCKET_ERROR();
+        tunnel_->endConnect(err);
         
+        replyForError(cryptor_, inConn_, replyForErrno(err));
         return State::error;        
     }
     
     tunnel_->setOutConnection(outConn);
+    tunnel_->setState(Tunnel::State::waitForConnect);
+    tunnel_->classify(address.port());
+
+    // buffer what the client sends ahead, but stop reading past the limit
+    bufferevent_setwatermark(inConn_, EV_READ, 0, EARLY_DATA_LIMIT);
+    
     return State::success;
 }
@@ -3,6 +3,7 @@
 
 #include "cipher.hpp"
 #include "address.hpp"
+#include "handshake.hpp"
 
 /**
    Forward declaration
@@ -33,6 +34,9 @@ public:
     static constexpr unsigned char REPLY_TTL_EXPIRED                = 0x06;
     static constexpr unsigned char REPLY_COMMAND_NOT_SUPPORTED      = 0x07;
     static constexpr unsigned char REPLY_ADDRESS_TYPE_NOT_SUPPORTED = 0x08;
+
+    // Bytes a client may send ahead while its connection to the destination is pending
+    static constexpr std::size_t   EARLY_DATA_LIMIT                 = 256 * 1024;
     
     enum class State {incomplete, success, error};
     
@@ -49,15 +53,18 @@ public:
     // Send reply to client when error occured
     static void replyForError(const Cryptor &cryptor, bufferevent *inConn, unsigned char code);   
     
+    // The reply for a failed connection to the destination
+    static unsigned char replyForErrno(int err);
+
     // Send reply to client connection when success
     static void replyForSuccess(const Cryptor &cryptor, bufferevent *inConn, const Address &address);
+
+    // Relay the data of outConn, the connection of tunnel to its destination
+    static void relay(bufferevent *outConn, Tunnel *tunnel);
 private:
     // Send reply to client connection
     static void sendReply(const Cryptor &cryptor, bufferevent *inConn, unsigned char code, const Address &address);
     
-    // Read destination address
-    State readAddress(unsigned char addressType, Address &address, Cryptor::BufferPtr &data);
-
     // Handle CONNECT command
     State handleConnect(const Address &address);
 
@@ -65,12 +72,13 @@ private:
     State handleBind();
 
     // Handle UDP ASSOCIATE command
-    State handleUDPAssociate();
+    State handleUDPAssociate(const Address &address);
 
     std::shared_ptr<ServerBase>  base_;    
     Cryptor                      cryptor_;
     Tunnel                       *tunnel_;
     bufferevent                  *inConn_;
+    unsigned char                message_[Handshake::MAX_MESSAGE + Cryptor::BLOCK_SIZE];
 };
 
 #endif /* REQUEST_H */
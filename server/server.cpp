@@ -8,11 +8,22 @@
  ******************************************************************************/
 
 #include "address.hpp"
+#include "cipher.hpp"
+#include "configfile.hpp"
 #include "server.hpp"
 #include "tunnel.hpp"
 
+#include <limits.h>
+#include <sys/resource.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <vector>
+
 #include <glog/logging.h>
 
+#include <event2/event.h>
+
 /**
    Called when the server accept new connection
  **/
@@ -20,15 +31,35 @@ static void acceptCallback(evconnlistener *listener, evutil_socket_t inConnFd,
                            sockaddr *address, int socklen, void *arg)
 {
     Address addr(address);
-    if (addr.type() == Address::Type::unknown)
+    if (address->sa_family == AF_UNIX)
+    {
+        LOG(INFO) << "Accept new connection on a unix socket: client-" << inConnFd;
+    }
+    else if (addr.type() == Address::Type::unknown)
     {
         LOG(ERROR) << "Address of Client-" << inConnFd << " is unknown";
+        evutil_closesocket(inConnFd);
         return;
     }
-    LOG(INFO) << "Accept new connection from: " << addr;
+    else
+    {
+        LOG(INFO) << "Accept new connection from: " << addr;
+    }
     
     auto server = static_cast<Server *>(arg);
-    server->createTunnel(inConnFd);
+
+    // refused before a tunnel is allocated for it
+    int sourceSlot;
+    if (!server->admit(address, sourceSlot))
+    {
+        LOG(INFO) << "Refuse client-" << inConnFd << " from " << addr
+                  << ": over the limits of its address";
+
+        evutil_closesocket(inConnFd);
+        return;
+    }
+
+    server->createTunnel(inConnFd, sourceSlot);
 }
 
 /**
@@ -48,12 +79,359 @@ static void acceptErrorCallback(evconnlistener *listener, void *arg)
     event_base_loopexit(base, nullptr); 
 }
 
+/**
+   Called periodically to report the dns cache and bandwidth counters
+ **/
+static void statsCallback(evutil_socket_t, short, void *arg)
+{
+    auto server = static_cast<Server *>(arg);
+    server->logDnsCacheStats();
+    server->logConnectStats();
+    server->logUsage();
+    server->logCredentialStats();
+    server->logAuthBackendStats();
+    server->logCompressionStats();
+    server->logAcceptStats();
+    server->logLoopStats();
+    server->logRelayStats();
+}
+
+/**
+   Called on SIGHUP to reload the settings, credentials and acl files
+ **/
+static void reloadCallback(evutil_socket_t, short, void *arg)
+{
+    auto server = static_cast<Server *>(arg);
+    server->reload();
+}
+
+/**
+   The destination rules of the server
+ **/
+static std::shared_ptr<const Acl> loadAcl(const Config &config)
+{
+    std::string error;
+    std::shared_ptr<const Acl> acl = Acl::load(config.aclFile(), error);
+    
+    if (acl == nullptr)
+    {
+        LOG(FATAL) << "Failed to load the acl: " << error;
+    }
+
+    return acl;
+}
+
+/**
+   The users of the server, from the credentials file
+   or the single user of the command line
+ **/
+static std::unique_ptr<CredentialTable> loadCredentials(const Config &config)
+{
+    std::string error;
+    std::unique_ptr<CredentialTable> table;
+
+    if (!config.credentialsFile().empty())
+    {
+        table = CredentialTable::load(config.credentialsFile(), error);
+    }
+    else
+    {
+        auto entry = CredentialTable::makeEntry(config.username(), config.password(),
+                                                CredentialStore::ITERATIONS);
+        table = CredentialTable::build(entry.data(), entry.size(), error);
+    }
+
+    if (table == nullptr)
+    {
+        LOG(FATAL) << "Failed to load the credentials: " << error;
+    }
+
+    return table;
+}
+
+/**
+   Read an integer setting of file into value, it must fit in [min, INT_MAX]
+ **/
+static bool getInt(const ConfigFile &file, const std::string &name, int &value,
+                   int min, std::string &error)
+{
+    int64_t parsed = value;
+    if (!file.get(name, parsed, error))
+    {
+        return false;
+    }
+
+    if (parsed < min || parsed > INT_MAX)
+    {
+        error = name + " is out of range";
+        return false;
+    }
+
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+/**
+   Read a setting of file which can't be negative into value
+ **/
+static bool getSize(const ConfigFile &file, const std::string &name, std::size_t &value,
+                    std::string &error)
+{
+    int64_t parsed = static_cast<int64_t>(std::min<std::size_t>(value, INT64_MAX));
+    if (!file.get(name, parsed, error))
+    {
+        return false;
+    }
+
+    if (parsed < 0)
+    {
+        error = name + " is out of range";
+        return false;
+    }
+
+    value = static_cast<std::size_t>(parsed);
+    return true;
+}
+
+/**
+   Read a rate setting of file which can't be negative into value
+ **/
+static bool getRate(const ConfigFile &file, const std::string &name, double &value,
+                    std::string &error)
+{
+    if (!file.get(name, value, error))
+    {
+        return false;
+    }
+
+    if (value < 0)
+    {
+        error = name + " is out of range";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+   The settings of the command line with those of the configuration
+   file on top, so a setting removed from the file goes back to its
+   flag. Return nullptr and set error if the file is broken
+ **/
+static std::shared_ptr<const Config> loadConfig(const Config &flags, std::string &error)
+{
+    static const std::vector<std::string> names = {
+        "key",
+        "tcpNoDelay", "tcpNotSentLowat", "tcpKeepAlive", "tcpCongestion",
+        "tcpSendBuffer", "tcpReceiveBuffer", "tcpAdaptive", "tcpMaxBuffer",
+        "qos", "qosInteractivePorts", "qosBulkPorts", "qosBulkRate",
+        "rateLimit", "rateBurst", "userRateLimit", "userRateBurst",
+        "listenerRateLimit", "listenerRateBurst",
+        "maxConnectionsPerIP", "connectRatePerIP", "connectBurstPerIP"
+    };
+
+    auto path = flags.configFile();
+    auto file = ConfigFile::load(path, error);
+    if (file == nullptr)
+    {
+        return nullptr;
+    }
+
+    auto name = file->unknown(names);
+    if (!name.empty())
+    {
+        error = path + ": " + name + " can't be set in the file";
+        return nullptr;
+    }
+
+    auto key = flags.key();
+    auto socket = flags.socketOptions();
+    auto qos = flags.qos();
+    int bulkRate = static_cast<int>(std::min<std::size_t>(qos.bulkRate, INT_MAX));
+    std::string interactivePorts, bulkPorts;
+    auto rateLimits = flags.rateLimits();
+    auto sourceLimits = flags.sourceLimits();
+
+    if (!file->get("key", key, error) ||
+        !file->get("tcpNoDelay", socket.noDelay, error) ||
+        !getInt(*file, "tcpNotSentLowat", socket.notSentLowat, 0, error) ||
+        !getInt(*file, "tcpKeepAlive", socket.keepAlive, 0, error) ||
+        !file->get("tcpCongestion", socket.congestion, error) ||
+        !getInt(*file, "tcpSendBuffer", socket.sendBuffer, 0, error) ||
+        !getInt(*file, "tcpReceiveBuffer", socket.receiveBuffer, 0, error) ||
+        !file->get("tcpAdaptive", socket.adaptive, error) ||
+        !getInt(*file, "tcpMaxBuffer", socket.maxBuffer, 0, error) ||
+        !file->get("qos", qos.enabled, error) ||
+        !getInt(*file, "qosBulkRate", bulkRate, 1, error) ||
+        !file->get("qosInteractivePorts", interactivePorts, error) ||
+        !file->get("qosBulkPorts", bulkPorts, error) ||
+        !getSize(*file, "rateLimit", rateLimits.tunnel.rate, error) ||
+        !getSize(*file, "rateBurst", rateLimits.tunnel.burst, error) ||
+        !getSize(*file, "userRateLimit", rateLimits.user.rate, error) ||
+        !getSize(*file, "userRateBurst", rateLimits.user.burst, error) ||
+        !getSize(*file, "listenerRateLimit", rateLimits.listener.rate, error) ||
+        !getSize(*file, "listenerRateBurst", rateLimits.listener.burst, error) ||
+        !getSize(*file, "maxConnectionsPerIP", sourceLimits.maxConnections, error) ||
+        !getRate(*file, "connectRatePerIP", sourceLimits.rate, error) ||
+        !getRate(*file, "connectBurstPerIP", sourceLimits.burst, error))
+    {
+        error = path + ": " + error;
+        return nullptr;
+    }
+
+    if (key.size() != Cryptor::KEY_SIZE)
+    {
+        error = path + ": key must be " + std::to_string(Cryptor::KEY_SIZE) + " bytes";
+        return nullptr;
+    }
+
+    if ((file->has("qosInteractivePorts") && !qos.setInteractivePorts(interactivePorts)) ||
+        (file->has("qosBulkPorts") && !qos.setBulkPorts(bulkPorts)))
+    {
+        error = path + ": invalid port list of qosInteractivePorts or qosBulkPorts";
+        return nullptr;
+    }
+    qos.bulkRate = static_cast<std::size_t>(bulkRate);
+
+    auto config = std::make_shared<Config>(flags);
+    config->setKey(key);
+    config->setSocketOptions(socket);
+    config->setQos(qos);
+    config->setRateLimits(rateLimits);
+    config->setSourceLimits(sourceLimits);
+
+    return config;
+}
+
+/**
+   Options of the listening socket
+ **/
+static ListenOptions listenOptions(const Config &config)
+{
+    ListenOptions options;
+    options.fastOpen = config.fastOpen();
+    options.backlog = config.backlog();
+    options.deferAccept = config.deferAccept();
+
+    return options;
+}
+
+/**
+   Microseconds of cpu time the process has used
+ **/
+static uint64_t cpuMicros()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
 Server::Server(const Config &config)
-    : config_(config),
-      base_(new ServerBase(config.address(), acceptCallback, acceptErrorCallback, this))
+    : flags_(config),
+      config_(std::make_shared<const Config>(config)),
+      base_(new ServerBase(config.listenEndpoints(), acceptCallback, acceptErrorCallback, this,
+                           listenOptions(config))),
+      statsTimer_(nullptr),
+      reloadSignal_(nullptr),
+      accepted_(0),
+      acceptedAt_(base_->now()),
+      relayed_(0),
+      cpuMicros_(cpuMicros()),
+      aclReload_(base_->base()),
+      configReload_(base_->base())
 {
+    if (!flags_.configFile().empty())
+    {
+        std::string error;
+        auto loaded = loadConfig(flags_, error);
+        if (loaded == nullptr)
+        {
+            LOG(FATAL) << "Failed to load the settings: " << error;
+        }
+        config_ = std::move(loaded);
+    }
+
+    base_->setSocketOptions(config_->socketOptions());
+    if (flags_.udpTimeout() > 0)
+    {
+        base_->enableUdp(flags_.udpTimeout());
+    }
+    
+    if (config_->useRateLimiter())
+    {
+        base_->enableRateLimits(config_->rateLimits());
+    }
+
+    if (config_->useSourceLimiter())
+    {
+        base_->enableSourceLimits(config_->sourceLimits());
+    }
+    
+    if (flags_.useDnsCache())
+    {
+        base_->enableDnsCache(flags_.dnsCacheOptions());
+    }
+
+    if (flags_.useConnectHistory())
+    {
+        base_->enableConnectHistory(flags_.connectHistoryOptions());
+    }
+
+    if (flags_.hasUser() || !flags_.credentialsFile().empty())
+    {
+        base_->enableCredentials(loadCredentials(flags_));
+        LOG(WARNING) << "Load the credentials: " << base_->credentials()->size() << " users";
+    }
+
+    if (flags_.useAuthBackend())
+    {
+        base_->enableAuthBackend(flags_.authBackendOptions());
+    }
+
+    if (!flags_.aclFile().empty())
+    {
+        base_->setAcl(loadAcl(flags_));
+        LOG(WARNING) << "Load the acl: " << base_->acl()->size() << " rules";
+    }
+
+    if (!flags_.credentialsFile().empty() || !flags_.aclFile().empty() ||
+        !flags_.configFile().empty())
+    {
+        reloadSignal_ = evsignal_new(base_->base(), SIGHUP, reloadCallback, this);
+        evsignal_add(reloadSignal_, nullptr);
+    }
+
+    if (flags_.useLoopMonitor())
+    {
+        base_->enableLoopMonitor(flags_.loopMonitorOptions());
+    }
+
+    // a reload may turn the limits on
+    if (flags_.useDnsCache() || flags_.useConnectHistory() || config_->useRateLimiter() ||
+        flags_.useCompression() || flags_.useLoopMonitor() || flags_.useZeroCopy() ||
+        config_->useSourceLimiter() || !flags_.configFile().empty())
+    {
+        statsTimer_ = event_new(base_->base(), -1, EV_PERSIST, statsCallback, this);
+        struct timeval interval = {60, 0};
+        event_add(statsTimer_, &interval);
+    }
 } 
 
+Server::~Server()
+{
+    if (statsTimer_ != nullptr)
+    {
+        event_free(statsTimer_);
+    }
+
+    if (reloadSignal_ != nullptr)
+    {
+        event_free(reloadSignal_);
+    }
+}
+
 /**
    Run the event loop
  **/
@@ -62,7 +440,281 @@ void Server::run()
     base_->run();
 }
 
-void Server::createTunnel(int inConnFd)
+void Server::logDnsCacheStats() const
+{
+    auto cache = base_->dnsCache();
+    if (cache == nullptr)
+    {
+        return;
+    }
+
+    auto stats = cache->stats();
+    LOG(INFO) << "DNS cache: names = " << cache->size()
+              << ", hits = " << stats.hits
+              << ", stale hits = " << stats.staleHits
+              << ", negative hits = " << stats.negativeHits
+              << ", misses = " << stats.misses
+              << ", coalesced = " << stats.coalesced
+              << ", queries = " << stats.queries;
+}
+
+void Server::logConnectStats() const
+{
+    auto history = base_->connectHistory();
+    if (history == nullptr)
+    {
+        return;
+    }
+
+    auto stats = history->stats();
+    LOG(INFO) << "Connect: destinations = " << history->size()
+              << ", connected = " << stats.connected
+              << ", failed = " << stats.failed
+              << ", timeouts = " << stats.timeouts
+              << ", fast failures = " << stats.fastFailures;
+}
+
+void Server::logUsage()
+{
+    auto limiter = base_->rateLimiter();
+    if (limiter == nullptr)
+    {
+        return;
+    }
+
+    for (auto &user : limiter->takeUsage())
+    {
+        LOG(INFO) << "Usage of user " << user.first
+                  << ": received = " << user.second.received
+                  << ", sent = " << user.second.sent;
+    }
+}
+
+void Server::logCredentialStats() const
+{
+    auto credentials = base_->credentials();
+    if (credentials == nullptr)
+    {
+        return;
+    }
+
+    auto stats = credentials->stats();
+    LOG(INFO) << "Credentials: users = " << credentials->size()
+              << ", cache hits = " << stats.cacheHits
+              << ", verified = " << stats.verified
+              << ", failures = " << stats.failures
+              << ", overflows = " << stats.overflows
+              << ", reloads = " << stats.reloads;
+}
+
+void Server::logAuthBackendStats() const
+{
+    auto backend = base_->authBackend();
+    if (backend == nullptr)
+    {
+        return;
+    }
+
+    auto stats = backend->stats();
+    LOG(INFO) << "Auth backend: cached = " << backend->size()
+              << ", hits = " << stats.hits
+              << ", misses = " << stats.misses
+              << ", coalesced = " << stats.coalesced
+              << ", requests = " << stats.requests
+              << ", errors = " << stats.errors;
+}
+
+void Server::logCompressionStats() const
 {
-    new Tunnel(config_, base_, inConnFd);    
+    if (!flags_.useCompression())
+    {
+        return;
+    }
+
+    auto &stats = FrameCompressor::totals();
+    LOG(INFO) << "Compression: frames = " << stats.frames
+              << ", deflated = " << stats.deflated
+              << ", bytes in = " << stats.bytesIn
+              << ", bytes out = " << stats.bytesOut
+              << ", deflate us = " << stats.deflateMicros
+              << ", inflate us = " << stats.inflateMicros;
+}
+
+void Server::logAcceptStats()
+{
+    auto now = base_->now();
+    auto accepted = base_->accepted();
+
+    if (now > acceptedAt_)
+    {
+        LOG(INFO) << "Accept: connections = " << accepted
+                  << ", per second = " << (accepted - accepted_) * 1000 / (now - acceptedAt_);
+    }
+
+    accepted_ = accepted;
+    acceptedAt_ = now;
+
+    auto limiter = base_->sourceLimiter();
+    if (limiter != nullptr)
+    {
+        auto stats = limiter->takeStats();
+        LOG(INFO) << "Source limits: admitted = " << stats.admitted
+                  << ", over connections = " << stats.overConnections
+                  << ", over rate = " << stats.overRate
+                  << ", untracked = " << stats.untracked;
+    }
+}
+
+void Server::logLoopStats() const
+{
+    auto monitor = base_->loopMonitor();
+    if (monitor != nullptr)
+    {
+        monitor->report();
+
+        auto frames = FrameTimer::takeTotals();
+        LOG(INFO) << "Frames: relayed = " << frames.frames
+                  << ", bytes = " << frames.bytes
+                  << ", microseconds = " << frames.micros
+                  << ", nanoseconds per frame = "
+                  << (frames.frames > 0 ? frames.micros * 1000 / frames.frames : 0);
+    }
+}
+
+void Server::logRelayStats()
+{
+    if (flags_.useZeroCopy())
+    {
+        auto &stats = ZeroCopySender::totals();
+        LOG(INFO) << "Zero copy: sends = " << stats.sends
+                  << ", bytes = " << stats.bytes
+                  << ", copied = " << stats.copied
+                  << ", fallbacks = " << stats.fallbacks;
+    }
+
+    auto relayed = base_->relayed();
+    auto cpu = cpuMicros();
+
+    // the cost of moving the bytes, compare it with and without -zeroCopy
+    if (relayed > relayed_)
+    {
+        auto bytes = relayed - relayed_;
+        LOG(INFO) << "Relay: MB = " << bytes / (1024 * 1024)
+                  << ", cpu ms = " << (cpu - cpuMicros_) / 1000
+                  << ", cpu ms per GB = "
+                  << (cpu - cpuMicros_) * 1024 / (bytes / 1024 + 1);
+    }
+
+    relayed_ = relayed;
+    cpuMicros_ = cpu;
+}
+
+void Server::setConfig(std::shared_ptr<const Config> config)
+{
+    config_ = std::move(config);
+
+    // the connections opened from now on get the new options
+    base_->setSocketOptions(config_->socketOptions());
+
+    auto rateLimiter = base_->rateLimiter();
+    if (rateLimiter != nullptr)
+    {
+        rateLimiter->setOptions(config_->rateLimits());
+    }
+    else if (config_->useRateLimiter())
+    {
+        base_->enableRateLimits(config_->rateLimits());
+    }
+
+    auto sourceLimiter = base_->sourceLimiter();
+    if (sourceLimiter != nullptr)
+    {
+        sourceLimiter->setLimits(config_->sourceLimits());
+    }
+    else if (config_->useSourceLimiter())
+    {
+        base_->enableSourceLimits(config_->sourceLimits());
+    }
+}
+
+void Server::reload()
+{
+    if (!flags_.configFile().empty())
+    {
+        // the tunnels keep the settings they hold, only new ones see the reload
+        auto work = [this]() {
+            reloadedConfig_ = loadConfig(flags_, configError_);
+        };
+
+        auto done = [this]() {
+            if (reloadedConfig_ == nullptr)
+            {
+                LOG(ERROR) << "Failed to reload the settings, keep the settings loaded: "
+                           << configError_;
+                return;
+            }
+
+            setConfig(std::move(reloadedConfig_));
+            LOG(WARNING) << "Reload the settings: " << flags_.configFile();
+        };
+
+        if (!configReload_.run(work, done))
+        {
+            LOG(WARNING) << "A reload of the settings is already running";
+        }
+    }
+
+    auto credentials = base_->credentials();
+    if (!flags_.credentialsFile().empty() &&
+        !credentials->reload(flags_.credentialsFile()))
+    {
+        LOG(WARNING) << "A reload of the credentials is already running";
+    }
+
+    if (flags_.aclFile().empty())
+    {
+        return;
+    }
+
+    // the tunnels being checked keep the rules they hold
+    auto path = flags_.aclFile();
+    auto work = [this, path]() {
+        reloadedAcl_ = Acl::load(path, aclError_);
+    };
+    
+    auto done = [this]() {
+        if (reloadedAcl_ == nullptr)
+        {
+            LOG(ERROR) << "Failed to reload the acl, keep the "
+                       << base_->acl()->size() << " rules loaded: " << aclError_;
+            return;
+        }
+
+        base_->setAcl(std::move(reloadedAcl_));
+        LOG(WARNING) << "Reload the acl: " << base_->acl()->size() << " rules";
+    };
+
+    if (!aclReload_.run(work, done))
+    {
+        LOG(WARNING) << "A reload of the acl is already running";
+    }
+}
+
+bool Server::admit(const sockaddr *address, int &sourceSlot)
+{
+    auto limiter = base_->sourceLimiter();
+    if (limiter == nullptr)
+    {
+        sourceSlot = SourceLimiter::NONE;
+        return true;
+    }
+
+    return limiter->admit(address, base_->now(), sourceSlot);
+}
+
+void Server::createTunnel(int inConnFd, int sourceSlot)
+{
+    LoopMonitor::Scope timing(base_->loopMonitor(), LoopMonitor::Category::accept);
+
+    new Tunnel(config_, base_, inConnFd, sourceSlot);    
 }
@@ -10,6 +10,7 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "background.hpp"
 #include "base.hpp"
 #include "config.hpp"
 
@@ -19,20 +20,79 @@ class Server
 {
 public:
     Server(const Config &config);
+    ~Server();
 
     // disable the copy operations
     Server(const Server &) = delete;
     Server &operator=(const Server &) = delete;
 
+    /**
+       Whether a connection from address is within the limits of its
+       source, sourceSlot is released once the connection closes
+     **/
+    bool admit(const sockaddr *address, int &sourceSlot);
+    
     // create the tunnel between the local server and the proxy server
-    void createTunnel(int inConnFd);
+    void createTunnel(int inConnFd, int sourceSlot);
     
     // run the event loop
     void run();
 
+    // log the counters of the dns cache
+    void logDnsCacheStats() const;
+
+    // log the outcomes of the connections to the destinations
+    void logConnectStats() const;
+    // log the bytes relayed for each user since the last report
+    // log the bytes relayed for each user
+    void logUsage();
+
+    // log the counters of the credential store
+    void logCredentialStats() const;
+
+    // log the counters of the external verifier
+    void logAuthBackendStats() const;
+
+    // log the counters of the compressed frames
+    void logCompressionStats() const;
+
+    // log the connections accepted and their rate since the last call
+    void logAcceptStats();
+
+    // log the lag and the callback times since the last report
+    void logLoopStats() const;
+
+    // log the zerocopy sends and the cpu time per GB relayed since the last call
+    void logRelayStats();
+
+    // load the settings, the credentials and the acl files again
+    void reload();
+
+    // the settings of the new tunnels
+    const std::shared_ptr<const Config> &config() const
+    {
+        return config_;
+    }
+
 private:
-    Config                       config_;
-    std::shared_ptr<ServerBase>  base_;
+    // publish the settings for the tunnels accepted from now on
+    void setConfig(std::shared_ptr<const Config> config);
+
+    const Config                   flags_;            // the settings of the command line
+    std::shared_ptr<const Config>  config_;           // replaced whole, never changed
+    std::shared_ptr<ServerBase>    base_;
+    event                          *statsTimer_;
+    event                          *reloadSignal_;    // SIGHUP
+    uint64_t                       accepted_;         // connections at the last stats
+    long                           acceptedAt_;       // milliseconds
+    uint64_t                       relayed_;          // bytes at the last stats
+    uint64_t                       cpuMicros_;        // cpu time at the last stats
+    std::unique_ptr<Acl>           reloadedAcl_;      // built by the reload thread
+    std::string                    aclError_;
+    BackgroundTask                 aclReload_;        // joined before the fields above go
+    std::shared_ptr<const Config>  reloadedConfig_;   // built by the reload thread
+    std::string                    configError_;
+    BackgroundTask                 configReload_;     // joined before the fields above go
 };
 
 #endif /* SERVER_H */
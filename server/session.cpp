@@ -0,0 +1,581 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#include "session.hpp"
+#include "auth.hpp"
+#include "mux.hpp"
+#include "request.hpp"
+#include "sockets.hpp"
+#include "tunnel.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <array>
+
+#include <glog/logging.h>
+
+#include <event2/dns.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+/**
+   Called when the credentials or the verifier answer the login of a client
+ **/
+static void verifiedCallback(bool allowed, void *arg)
+{
+    auto session = static_cast<Session *>(arg);
+
+    LoopMonitor::Scope timing(session->tunnel()->loopMonitor(), LoopMonitor::Category::event);
+    session->onVerified(allowed);
+}
+
+/**
+   Called with the address of the destination, the session may be
+   gone meanwhile
+ **/
+static void resolvedCallback(int result, const sockaddr *address, socklen_t length, void *arg)
+{
+    std::unique_ptr<Session::PendingLookup> pending(static_cast<Session::PendingLookup *>(arg));
+
+    auto session = pending->session;
+    if (session == nullptr)
+    {
+        return;
+    }
+
+    LoopMonitor::Scope timing(session->tunnel()->loopMonitor(), LoopMonitor::Category::event);
+    session->onResolved(result, address, length);
+}
+
+/**
+   Called when the connection to the destination is made or fails,
+   the tunnel takes the connection over afterwards
+ **/
+static void connectCallback(bufferevent *, short what, void *arg)
+{
+    auto session = static_cast<Session *>(arg);
+
+    LoopMonitor::Scope timing(session->tunnel()->loopMonitor(), LoopMonitor::Category::event);
+    session->onConnected(what, EVUTIL_SOCKET_ERROR());
+}
+
+Session::Session(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+                 Tunnel *tunnel, bool allowMux)
+    : config_(std::move(config)),
+      base_(std::move(base)),
+      tunnel_(tunnel),
+      inConn_(tunnel->inConnection()),
+      cryptor_(tunnel->cryptor()),
+      result_(Result::wait),
+      waiting_(Wait::none),
+      running_(false),
+      allowMux_(allowMux),
+      mux_(false),
+      broken_(false),
+      method_(Auth::AUTH_NO_ACCEPTABLE),
+      allowed_(false),
+      resolvedLength_(0),
+      lookupError_(DNS_ERR_NONE),
+      lookup_(nullptr),
+      connectEvents_(0),
+      connectError_(0),
+      length_(0)
+{
+}
+
+Session::~Session()
+{
+    if (waiting_ == Wait::verifier)
+    {
+        // either of them may be checking the login
+        if (base_->credentials() != nullptr)
+        {
+            base_->credentials()->cancel(this);
+        }
+        if (base_->authBackend() != nullptr)
+        {
+            base_->authBackend()->cancel(this);
+        }
+    }
+    else if (waiting_ == Wait::resolver)
+    {
+        // the answer of the resolver comes to nobody
+        lookup_->session = nullptr;
+    }
+}
+
+void *Session::operator new(std::size_t size, FramePool &pool)
+{
+    return pool.allocate(size);
+}
+
+void Session::operator delete(void *block)
+{
+    FramePool::release(block);
+}
+
+void Session::operator delete(void *block, FramePool &)
+{
+    FramePool::release(block);
+}
+
+Session::Result Session::resume()
+{
+    running_ = true;
+    run();
+    running_ = false;
+
+    return result_;
+}
+
+void Session::onVerified(bool allowed)
+{
+    assert(waiting_ == Wait::verifier);
+
+    allowed_ = allowed;
+    waiting_ = Wait::none;
+
+    Tunnel::resumeSession(tunnel_);
+}
+
+void Session::onResolved(int result, const sockaddr *address, socklen_t length)
+{
+    assert(waiting_ == Wait::resolver);
+
+    lookupError_ = result;
+    if (result == DNS_ERR_NONE)
+    {
+        memcpy(&resolved_, address, length);
+        resolvedLength_ = length;
+    }
+
+    lookup_ = nullptr;
+    waiting_ = Wait::none;
+
+    // the resolver may answer before resolve() returns, run() goes on then
+    if (!running_)
+    {
+        Tunnel::resumeSession(tunnel_);
+    }
+}
+
+void Session::onConnected(short what, int err)
+{
+    if (waiting_ != Wait::connection)
+    {
+        return;
+    }
+
+    // only a connection past its deadline times out
+    connectEvents_ = what;
+    connectError_ = what & BEV_EVENT_TIMEOUT ? ETIMEDOUT : err;
+    waiting_ = Wait::none;
+
+    if (!running_)
+    {
+        Tunnel::resumeSession(tunnel_);
+    }
+}
+
+/**
+   The handshake, every await returns to the event loop until its
+   condition holds
+ **/
+void Session::run()
+{
+    COROUTINE_BEGIN(coroutine_);
+
+    if (allowMux_)
+    {
+        COROUTINE_AWAIT(coroutine_, muxChecked());
+        if (mux_)
+        {
+            LOG(INFO) << "Client-" << tunnel_->clientID() << " opens a multiplexed connection";
+
+            tunnel_->upgradeToMux();
+            finish(Result::upgraded);
+            return;
+        }
+    }
+
+    COROUTINE_AWAIT(coroutine_, readMessage());
+    if (!answerGreeting())
+    {
+        return;
+    }
+
+    if (method_ == Auth::AUTH_USER_PASSWORD)
+    {
+        COROUTINE_AWAIT(coroutine_, readMessage());
+        if (!checkLogin())
+        {
+            return;
+        }
+
+        COROUTINE_AWAIT(coroutine_, answered());
+        if (!answerLogin())
+        {
+            return;
+        }
+    }
+
+    COROUTINE_AWAIT(coroutine_, readMessage());
+    if (!readRequest())
+    {
+        return;
+    }
+
+    if (destination_.type() == Address::Type::domain)
+    {
+        startLookup();
+
+        COROUTINE_AWAIT(coroutine_, answered());
+        if (!checkLookup())
+        {
+            return;
+        }
+    }
+
+    if (!startConnect())
+    {
+        return;
+    }
+
+    COROUTINE_AWAIT(coroutine_, answered());
+    connected();
+
+    COROUTINE_END(coroutine_);
+}
+
+void Session::finish(Result result)
+{
+    result_ = result;
+    coroutine_.finish();
+}
+
+bool Session::muxChecked()
+{
+    bool incomplete;
+    mux_ = MuxSession::hasMagic(cryptor_, inConn_, incomplete);
+
+    return mux_ || !incomplete;
+}
+
+bool Session::readMessage()
+{
+    if (!cryptor_.hasFrame(inConn_))
+    {
+        return false;
+    }
+
+    broken_ = !cryptor_.decryptFrom(inConn_, message_, sizeof(message_), length_);
+    cryptor_.removeFrom(inConn_);
+
+    return true;
+}
+
+void Session::fail(unsigned char code)
+{
+    Request::replyForError(cryptor_, inConn_, code);
+    finish(Result::closeAfterWrite);
+}
+
+bool Session::answerGreeting()
+{
+    Handshake::Greeting greeting;
+    if (broken_ || Handshake::parseGreeting(message_, length_, greeting) != Handshake::Result::done)
+    {
+        finish(Result::close);
+        return false;
+    }
+
+    auto supported = config_->useUserPassAuth() ? Auth::AUTH_USER_PASSWORD : Auth::AUTH_NONE;
+    if (greeting.offers(supported))
+    {
+        method_ = supported;
+    }
+
+    unsigned char response[2] = {Auth::SOCKS5_VERSION, method_};
+    if (!cryptor_.encryptTo(inConn_, response, 2))
+    {
+        finish(Result::close);
+        return false;
+    }
+
+    if (method_ == Auth::AUTH_NO_ACCEPTABLE)
+    {
+        LOG(WARNING) << "Client-" << tunnel_->clientID() << " offers no acceptable method";
+
+        finish(Result::closeAfterWrite);
+        return false;
+    }
+
+    return true;
+}
+
+bool Session::checkLogin()
+{
+    Handshake::Login login;
+    if (broken_ || Handshake::parseLogin(message_, length_, login) != Handshake::Result::done)
+    {
+        finish(Result::close);
+        return false;
+    }
+
+    username_.assign(reinterpret_cast<const char *>(login.username.data), login.username.length);
+
+    auto credentials = base_->credentials();
+    auto backend = base_->authBackend();
+
+    // the password is read in place, only a login waiting for its check copies it
+    if (backend == nullptr || (credentials != nullptr && credentials->contains(login.username)))
+    {
+        // PBKDF2 runs in another thread unless the login is cached
+        auto result = credentials != nullptr ?
+            credentials->lookup(login) : CredentialStore::Result::denied;
+        if (result == CredentialStore::Result::miss &&
+            credentials->check(username_, login.password.toString(), verifiedCallback, this))
+        {
+            waiting_ = Wait::verifier;
+            return true;
+        }
+
+        allowed_ = result == CredentialStore::Result::allowed;
+        return true;
+    }
+
+    auto result = backend->lookup(login);
+    if (result == AuthBackend::Result::miss)
+    {
+        LOG(INFO) << "Client-" << tunnel_->clientID() << " waits for the verifier";
+
+        waiting_ = Wait::verifier;
+        backend->check(username_, login.password.toString(), verifiedCallback, this);
+        return true;
+    }
+
+    allowed_ = result == AuthBackend::Result::allowed;
+    return true;
+}
+
+bool Session::answerLogin()
+{
+    unsigned char reply[2] = {
+        Auth::USER_AUTH_VERSION,
+        allowed_ ? Auth::USER_AUTH_SUCCESS : Auth::USER_AUTH_FAILED
+    };
+
+    if (!cryptor_.encryptTo(inConn_, reply, 2))
+    {
+        finish(Result::close);
+        return false;
+    }
+
+    if (!allowed_)
+    {
+        LOG(WARNING) << "Client-" << tunnel_->clientID() << " failed to log in as " << username_;
+
+        finish(Result::closeAfterWrite);
+        return false;
+    }
+
+    tunnel_->setUser(username_.data(), username_.size());
+    return true;
+}
+
+bool Session::readRequest()
+{
+    Handshake::Request request;
+    auto result = broken_ ? Handshake::Result::invalid :
+        Handshake::parseRequest(message_, length_, request);
+
+    if (result == Handshake::Result::unsupported)
+    {
+        fail(Request::REPLY_ADDRESS_TYPE_NOT_SUPPORTED);
+        return false;
+    }
+
+    destination_ = result == Handshake::Result::done ? request.address() : Address();
+    if (!destination_.isValid())
+    {
+        finish(Result::close);
+        return false;
+    }
+
+    LOG(INFO) << "Read destination address: " << destination_;
+
+    if (request.command == Request::CMD_UDP_ASSOCIATE)
+    {
+        if (base_->udpAssociations() == nullptr)
+        {
+            fail(Request::REPLY_COMMAND_NOT_SUPPORTED);
+        }
+        else if (!tunnel_->startUdpAssociation())
+        {
+            fail(Request::REPLY_SERVER_FAILURE);
+        }
+        else
+        {
+            Request::replyForSuccess(cryptor_, inConn_,
+                                     Address(std::array<unsigned char, 4>{{0, 0, 0, 0}}, 0));
+            finish(Result::relay);
+        }
+        return false;
+    }
+    else if (request.command != Request::CMD_CONNECT)
+    {
+        fail(Request::REPLY_COMMAND_NOT_SUPPORTED);
+        return false;
+    }
+
+    auto &acl = base_->acl();
+    if (acl != nullptr && acl->check(destination_) == Acl::Action::deny)
+    {
+        LOG(WARNING) << "Client-" << tunnel_->clientID()
+                     << " is denied to connect " << destination_;
+
+        fail(Request::REPLY_RULE_FAILURE);
+        return false;
+    }
+
+    // a destination that failed just now isn't waited for again
+    int err;
+    if (!tunnel_->beginConnect(destination_, err))
+    {
+        fail(Request::replyForErrno(err));
+        return false;
+    }
+
+    return true;
+}
+
+void Session::startLookup()
+{
+    auto cache = base_->dnsCache();
+    auto result = cache != nullptr ?
+        cache->lookup(destination_.host(), AF_UNSPEC, &resolved_, &resolvedLength_) :
+        DnsCache::Result::miss;
+
+    if (result == DnsCache::Result::hit)
+    {
+        lookupError_ = DNS_ERR_NONE;
+        return;
+    }
+    else if (result == DnsCache::Result::negative)
+    {
+        lookupError_ = DNS_ERR_NOTEXIST;
+        return;
+    }
+
+    lookup_ = new PendingLookup{this};
+    waiting_ = Wait::resolver;
+
+    base_->resolve(destination_.host(), resolvedCallback, lookup_);
+}
+
+bool Session::checkLookup()
+{
+    if (lookupError_ != DNS_ERR_NONE)
+    {
+        LOG(ERROR) << "Failed to resolve " << destination_ << ": "
+                   << evdns_err_to_string(lookupError_);
+
+        // the resolver failed, not the destination
+        tunnel_->cancelConnect();
+        fail(Request::replyForErrno(ServerBase::lookupErrno(lookupError_)));
+        return false;
+    }
+
+    auto address = reinterpret_cast<sockaddr *>(&resolved_);
+    setPort(&resolved_, destination_.portNetworkOrder());
+
+    // a name may point to an address the rules deny
+    auto &acl = base_->acl();
+    if (acl != nullptr && acl->check(address) == Acl::Action::deny)
+    {
+        LOG(WARNING) << "Client-" << tunnel_->clientID()
+                     << " is denied to connect " << destination_;
+
+        tunnel_->endConnect(EACCES);
+        fail(Request::REPLY_RULE_FAILURE);
+        return false;
+    }
+
+    destination_ = Address(address);
+    return true;
+}
+
+bool Session::startConnect()
+{
+    LOG(INFO) << "Handle connect for client-" << tunnel_->clientID();
+
+    // the connection may fail before createConnection() returns
+    waiting_ = Wait::connection;
+
+    auto outConn = base_->createConnection(destination_, nullptr, connectCallback, this);
+    if (outConn == nullptr)
+    {
+        waiting_ = Wait::none;
+
+        int err = EVUTIL_SOCKET_ERROR();
+        tunnel_->endConnect(err);
+        fail(Request::replyForErrno(err));
+        return false;
+    }
+
+    tunnel_->setOutConnection(outConn);
+    tunnel_->setState(Tunnel::State::waitForConnect);
+    tunnel_->classify(destination_.port());
+
+    // buffer what the client sends ahead, but stop reading past the limit
+    bufferevent_setwatermark(inConn_, EV_READ, 0, Request::EARLY_DATA_LIMIT);
+
+    return true;
+}
+
+void Session::connected()
+{
+    int clientID = tunnel_->clientID();
+
+    if (!(connectEvents_ & BEV_EVENT_CONNECTED))
+    {
+        LOG(ERROR) << "Connection to server error for client-" << clientID
+                   << ": " << evutil_socket_error_to_string(connectError_);
+
+        // tell the client why its connection failed
+        tunnel_->endConnect(connectError_);
+        fail(Request::replyForErrno(connectError_));
+        return;
+    }
+
+    auto outConn = tunnel_->outConnection();
+
+    Address addr = getSocketLocalAddress(bufferevent_getfd(outConn));
+    if (addr.type() != Address::Type::ipv4 && addr.type() != Address::Type::ipv6)
+    {
+        Request::replyForError(cryptor_, inConn_, Request::REPLY_SERVER_FAILURE);
+        finish(Result::close);
+        return;
+    }
+
+    Request::replyForSuccess(cryptor_, inConn_, addr);
+    tunnel_->endConnect(0);
+    LOG(INFO) << "Connect to destination success for client-" << clientID;
+
+    Request::relay(outConn, tunnel_);
+    tunnel_->setState(Tunnel::State::connected);
+
+    // send the data the client wrote ahead of the reply
+    bufferevent_setwatermark(inConn_, EV_READ, 0, 0);
+    tunnel_->decryptTransfer();
+
+    finish(Result::relay);
+}
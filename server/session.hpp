@@ -0,0 +1,150 @@
+/*******************************************************************************
+ *
+ * socks5
+ * A C++11 socks5 proxy server based on Libevent
+ *
+ * Copyright 2018 Senlin Zhan. All rights reserved.
+ *
+ ******************************************************************************/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "address.hpp"
+#include "base.hpp"
+#include "cipher.hpp"
+#include "config.hpp"
+#include "coroutine.hpp"
+#include "handshake.hpp"
+
+#include <sys/socket.h>
+
+#include <memory>
+#include <string>
+
+/**
+   Forward declaration
+ **/
+struct bufferevent;
+class  Tunnel;
+
+/**
+   The SOCKS5 handshake of a tunnel as one coroutine: the greeting,
+   the login, the request, the lookup of the name and the connection
+   to the destination follow each other in run(), which waits for a
+   whole message of the client, the verifier, the resolver or the
+   connection where the callbacks of the other engine keep a state.
+
+   A message is decrypted once when its frame is whole, and the
+   session is allocated from the frame pool of the loop. The tunnel
+   resumes it on every event until it's done
+ **/
+class Session
+{
+public:
+    enum class Result
+    {
+        wait,               // resume on the next event
+        relay,              // the tunnel relays, the session is done
+        close,              // delete the tunnel
+        closeAfterWrite,    // the client reads the reply first
+        upgraded            // the connection went to a multiplexed session
+    };
+
+    Session(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+            Tunnel *tunnel, bool allowMux);
+
+    ~Session();
+
+    // disable the copy operations
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    static void *operator new(std::size_t size, FramePool &pool);
+    static void operator delete(void *block);
+    static void operator delete(void *block, FramePool &pool);
+
+    // Run the handshake until it waits or ends
+    Result resume();
+
+    // Called with the answer of the credentials or the verifier
+    void onVerified(bool allowed);
+
+    // Called with the answer of the resolver
+    void onResolved(int result, const sockaddr *address, socklen_t length);
+
+    // Called when the connection to the destination is made or fails
+    void onConnected(short what, int err);
+
+    Tunnel *tunnel() const
+    {
+        return tunnel_;
+    }
+
+    // A lookup of the resolver, it outlives a session gone meanwhile
+    struct PendingLookup
+    {
+        Session  *session;      // null once the session is gone
+    };
+
+private:
+    enum class Wait { none, verifier, resolver, connection };
+
+    // the body of the coroutine
+    void run();
+
+    // end the coroutine with result
+    void finish(Result result);
+
+    // awaitable, whether the first bytes tell a multiplexed connection or not
+    bool muxChecked();
+
+    // awaitable, decrypt a whole message of the client into message_
+    bool readMessage();
+
+    // awaitable, whether the answer of the pending operation came
+    bool answered() const
+    {
+        return waiting_ == Wait::none;
+    }
+
+    // the steps between the awaits, false if the session finished
+    bool answerGreeting();
+    bool checkLogin();
+    bool answerLogin();
+    bool readRequest();
+    void startLookup();
+    bool checkLookup();
+    bool startConnect();
+    void connected();
+
+    // answer the request with code and close after it's written
+    void fail(unsigned char code);
+
+    std::shared_ptr<const Config>  config_;
+    std::shared_ptr<ServerBase>    base_;
+    Tunnel                         *tunnel_;
+    bufferevent                    *inConn_;
+    Cryptor                        cryptor_;
+    Coroutine                      coroutine_;
+    Result                         result_;
+    Wait                           waiting_;
+    bool                           running_;     // in run(), an answer doesn't resume it
+    bool                           allowMux_;
+    bool                           mux_;
+    bool                           broken_;      // the last message didn't decrypt
+    unsigned char                  method_;      // the method of authentication
+    std::string                    username_;
+    bool                           allowed_;     // the login is valid
+    Address                        destination_;
+    sockaddr_storage               resolved_;
+    socklen_t                      resolvedLength_;
+    int                            lookupError_;
+    PendingLookup                  *lookup_;
+    short                          connectEvents_;
+    int                            connectError_;
+    std::size_t                    length_;
+    unsigned char                  message_[Handshake::MAX_MESSAGE + Cryptor::BLOCK_SIZE];
+};
+
+#endif /* SESSION_H */
@@ -11,6 +11,9 @@
 #include "config.hpp"
 #include "server.hpp"
 
+#include <algorithm>
+#include <iostream>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -29,14 +32,113 @@ static bool isValidSecretKey(const char *flagname, const std::string &value)
 // Listening address of the proxy server
 DEFINE_string(host, "0.0.0.0", "Listening host");
 DEFINE_int32(port, 6060, "Listening port");
+DEFINE_string(listen, "", "Endpoints like 0.0.0.0:6060,[::]:6060,unix:/run/socks5.sock,unix:@socks5, replaces host and port");
 
 // Username and password for authentication
 DEFINE_string(username, "", "Username for login <optional>");
 DEFINE_string(password, "", "Password for login <optional>");
 
+// Users of the server, the file is reloaded on SIGHUP
+DEFINE_string(credentials, "", "File of the users, it replaces -username and -password <optional>");
+DEFINE_string(authSocket, "", "Unix socket of a verifier process for the users not in -credentials <optional>");
+DEFINE_int32(authCacheTTL, 60, "Seconds to cache a login allowed by the verifier");
+DEFINE_int32(authNegativeTTL, 5, "Seconds to cache a login denied by the verifier");
+DEFINE_int32(authTimeout, 3000, "Milliseconds to wait for the verifier");
+DEFINE_string(printCredential, "", "Print the credentials line of \"user:password\" and exit");
+
 // Secret key
 DEFINE_string(key, "12345678123456781234567812345678", "Secret key");
 
+// Destination rules, the file is reloaded on SIGHUP
+DEFINE_string(acl, "", "File of the allow/deny rules of the destinations <optional>");
+
+// Settings which a reload may change, the file is reloaded on SIGHUP
+DEFINE_string(config, "", "File of \"name = value\" settings over the flags of the same names <optional>");
+
+// Resolver cache
+DEFINE_bool(dnsCache, true, "Cache the answers of the dns resolver");
+DEFINE_int32(dnsMinTTL, 5, "Minimum seconds to keep a dns answer");
+DEFINE_int32(dnsMaxTTL, 3600, "Maximum seconds to keep a dns answer");
+DEFINE_int32(dnsNegativeTTL, 5, "Seconds to keep a NXDOMAIN/SERVFAIL answer");
+DEFINE_int32(dnsStaleTTL, 30, "Seconds to serve an expired answer while refreshing it");
+DEFINE_int32(dnsCacheSize, 10000, "Maximum number of names in the dns cache");
+
+// History of the connections to the destinations
+DEFINE_bool(connectHistory, false, "Fail fast and time out the connections to a destination by its history");
+DEFINE_int32(connectTimeout, 10000, "Milliseconds to connect to a destination without a history");
+DEFINE_int32(connectTimeoutMin, 2000, "Minimum milliseconds to connect to a destination");
+DEFINE_int32(connectFailures, 3, "Failed connections in a row after which a destination fails fast");
+DEFINE_int32(connectFailWindow, 5000, "Milliseconds a destination fails fast after its last failure");
+DEFINE_int32(connectHistorySize, 10000, "Maximum number of destinations in the history");
+
+// TCP Fast Open
+DEFINE_int32(fastOpen, 0, "Queue length of TCP Fast Open requests, e.g. 256, 0 to disable");
+
+// Accept path
+DEFINE_int32(backlog, 1024, "Queue length of the connections waiting for accept, capped by net.core.somaxconn");
+DEFINE_int32(deferAccept, 0, "Seconds the kernel holds a new connection until its first bytes, 0 to disable");
+
+// Limits of each source address
+DEFINE_int32(maxConnectionsPerIP, 0, "Connections open at once from an address, 0 for no limit");
+DEFINE_double(connectRatePerIP, 0, "New connections per second from an address, 0 for no limit");
+DEFINE_double(connectBurstPerIP, 0, "New connections at once from an address, at least -connectRatePerIP");
+DEFINE_int32(sourceTableSize, 65536, "Addresses tracked by the limits of each address");
+
+// Multiplexed connections from the local servers
+DEFINE_int32(muxMaxStreams, 256, "Streams a multiplexed connection may have open at once");
+
+// Event loop monitor
+DEFINE_bool(loopMonitor, false, "Report the lag of the event loop and the time of the callbacks every minute");
+DEFINE_int32(slowCallback, 10, "Milliseconds above which a callback is reported as slow");
+
+// UDP ASSOCIATE
+DEFINE_int32(udpTimeout, 0, "Seconds before an idle udp association expires, e.g. 60, 0 to disable udp");
+
+// Compression of the frames, the local server must compress as well
+DEFINE_bool(compress, false, "Compress the frames to the local server, which must use -compress too");
+DEFINE_int32(compressLevel, 1, "Level of the compression, 1 (fastest) to 9 (smallest)");
+
+// Zero copy sends of the bulk tunnels
+DEFINE_bool(zeroCopy, false, "Send the large frames of bulk tunnels to the clients with MSG_ZEROCOPY");
+DEFINE_int32(zeroCopyMinWrite, 32 * 1024, "Bytes of a frame below which it's copied as usual");
+
+// Engine of the handshakes
+DEFINE_string(sessionEngine, "callbacks", "Engine of the SOCKS5 handshakes, callbacks or coroutine");
+
+// Socket options of the accepted and outgoing connections
+DEFINE_bool(tcpNoDelay, true, "Disable Nagle's algorithm");
+DEFINE_int32(tcpNotSentLowat, 0, "Bytes of unsent data kept in the kernel, 0 for the default");
+DEFINE_int32(tcpKeepAlive, 60, "Seconds before probing an idle connection, 0 to disable");
+DEFINE_string(tcpCongestion, "", "Congestion control algorithm, e.g. bbr, empty for the default");
+DEFINE_int32(tcpSendBuffer, 0, "Socket send buffer in bytes, 0 for the default");
+DEFINE_int32(tcpReceiveBuffer, 0, "Socket receive buffer in bytes, 0 for the default");
+DEFINE_bool(tcpAdaptive, false, "Size the buffers of busy connections from TCP_INFO");
+DEFINE_int32(tcpMaxBuffer, 4 * 1024 * 1024, "Upper bound of the adapted send buffer in bytes");
+
+// Bandwidth limits in bytes per second, 0 for no limit, a burst of 0 is one second of rate
+DEFINE_int64(rateLimit, 0, "Bandwidth of each tunnel in bytes per second");
+DEFINE_int64(rateBurst, 0, "Burst of each tunnel in bytes");
+DEFINE_int64(userRateLimit, 0, "Bandwidth shared by the tunnels of a user in bytes per second");
+DEFINE_int64(userRateBurst, 0, "Burst of a user in bytes");
+DEFINE_int64(listenerRateLimit, 0, "Bandwidth shared by the clients of the listener in bytes per second");
+DEFINE_int64(listenerRateBurst, 0, "Burst of the listener in bytes");
+
+// Priority classes of the tunnels
+DEFINE_bool(qos, false, "Serve interactive tunnels ahead of bulk transfers");
+DEFINE_string(qosInteractivePorts, "22,23,53,3389,5900", "Ports of interactive destinations, e.g. 22,5900-5999");
+DEFINE_string(qosBulkPorts, "", "Ports of bulk destinations");
+DEFINE_int64(qosBulkRate, 256 * 1024, "Bytes per second above which other tunnels are bulk");
+
+// Set a token bucket from the flags, negative values mean no limit
+static RateLimit rateLimit(gflags::int64 rate, gflags::int64 burst)
+{
+    RateLimit limit;
+    limit.rate = static_cast<std::size_t>(std::max<gflags::int64>(rate, 0));
+    limit.burst = static_cast<std::size_t>(std::max<gflags::int64>(burst, 0));
+
+    return limit;
+}
+
 int main(int argc, char *argv[])
 {
     if (!gflags::RegisterFlagValidator(&FLAGS_port, &isValidPort))
@@ -52,17 +154,187 @@ int main(int argc, char *argv[])
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
 
+    if (!FLAGS_printCredential.empty())
+    {
+        auto colon = FLAGS_printCredential.find(':');
+        if (colon == 0 || colon == std::string::npos)
+        {
+            LOG(FATAL) << "-printCredential expects user:password";
+        }
+
+        std::cout << CredentialTable::makeEntry(FLAGS_printCredential.substr(0, colon),
+                                                FLAGS_printCredential.substr(colon + 1),
+                                                CredentialStore::ITERATIONS)
+                  << std::endl;
+        return 0;
+    }
+
     Config config(
         FLAGS_host, static_cast<unsigned short>(FLAGS_port),
         FLAGS_username, FLAGS_password, FLAGS_key
     );     
+
+    if (FLAGS_dnsCache)
+    {
+        DnsCache::Options options;
+        options.minTTL = FLAGS_dnsMinTTL;
+        options.maxTTL = std::max(FLAGS_dnsMinTTL, FLAGS_dnsMaxTTL);
+        options.negativeTTL = FLAGS_dnsNegativeTTL;
+        options.staleTTL = FLAGS_dnsStaleTTL;
+        options.maxEntries = static_cast<std::size_t>(std::max(1, FLAGS_dnsCacheSize));
+        
+        config.setDnsCache(options);
+    }
+
+    if (FLAGS_connectHistory)
+    {
+        ConnectHistory::Options options;
+        options.failures = std::max(FLAGS_connectFailures, 1);
+        options.failWindow = std::max(FLAGS_connectFailWindow, 0);
+        options.minTimeout = std::max(FLAGS_connectTimeoutMin, 100);
+        options.maxTimeout = std::max(FLAGS_connectTimeout, 100);
+        options.maxEntries = static_cast<std::size_t>(std::max(1, FLAGS_connectHistorySize));
+
+        config.setConnectHistory(options);
+    }
+
+    config.setCredentialsFile(FLAGS_credentials);
+    config.setAclFile(FLAGS_acl);
+    config.setConfigFile(FLAGS_config);
+
+    if (!FLAGS_authSocket.empty())
+    {
+        AuthBackend::Options options;
+        options.path = FLAGS_authSocket;
+        options.ttl = std::max(FLAGS_authCacheTTL, 0);
+        options.negativeTTL = std::max(FLAGS_authNegativeTTL, 0);
+        options.timeout = std::max(FLAGS_authTimeout, 1);
+
+        config.setAuthBackend(options);
+    }
+    if (!FLAGS_listen.empty())
+    {
+        std::vector<ListenEndpoint> endpoints;
+        std::string error;
+        if (!ListenEndpoint::parseList(FLAGS_listen, endpoints, error))
+        {
+            LOG(FATAL) << "Invalid list of listening endpoints: " << error;
+        }
+
+        config.setListenEndpoints(endpoints);
+    }
+    config.setFastOpen(std::max(FLAGS_fastOpen, 0));
+    config.setBacklog(FLAGS_backlog > 0 ? FLAGS_backlog : -1);
+    config.setDeferAccept(std::max(FLAGS_deferAccept, 0));
+
+    SourceLimiter::Options sourceLimits;
+    sourceLimits.maxConnections = static_cast<std::size_t>(std::max(FLAGS_maxConnectionsPerIP, 0));
+    sourceLimits.rate = std::max(FLAGS_connectRatePerIP, 0.0);
+    sourceLimits.burst = std::max(FLAGS_connectBurstPerIP, 0.0);
+    sourceLimits.slots = static_cast<std::size_t>(std::max(FLAGS_sourceTableSize, 1024));
+    config.setSourceLimits(sourceLimits);
+    config.setUdpTimeout(std::max(FLAGS_udpTimeout, 0));
+    config.setMuxMaxStreams(static_cast<std::size_t>(std::max(FLAGS_muxMaxStreams, 1)));
+
+    if (FLAGS_loopMonitor)
+    {
+        LoopMonitor::Options options;
+        options.slowCallback = static_cast<uint64_t>(std::max(FLAGS_slowCallback, 1)) * 1000;
+
+        config.setLoopMonitor(options);
+    }
+
+    if (FLAGS_compress)
+    {
+        FrameCompressor::Options options;
+        options.level = std::min(std::max(FLAGS_compressLevel, 1), 9);
+
+        config.setCompression(options);
+    }
+
+    SocketOptions socketOptions;
+    socketOptions.noDelay = FLAGS_tcpNoDelay;
+    socketOptions.notSentLowat = FLAGS_tcpNotSentLowat;
+    socketOptions.keepAlive = FLAGS_tcpKeepAlive;
+    socketOptions.congestion = FLAGS_tcpCongestion;
+    socketOptions.sendBuffer = FLAGS_tcpSendBuffer;
+    socketOptions.receiveBuffer = FLAGS_tcpReceiveBuffer;
+    socketOptions.adaptive = FLAGS_tcpAdaptive;
+    socketOptions.maxBuffer = FLAGS_tcpMaxBuffer;
+    config.setSocketOptions(socketOptions);
+
+    RateLimiter::Options rateLimits;
+    rateLimits.tunnel = rateLimit(FLAGS_rateLimit, FLAGS_rateBurst);
+    rateLimits.user = rateLimit(FLAGS_userRateLimit, FLAGS_userRateBurst);
+    rateLimits.listener = rateLimit(FLAGS_listenerRateLimit, FLAGS_listenerRateBurst);
+    config.setRateLimits(rateLimits);
+
+    QosOptions qos;
+    qos.enabled = FLAGS_qos;
+    qos.bulkRate = static_cast<std::size_t>(std::max<gflags::int64>(FLAGS_qosBulkRate, 1));
+    if (!qos.setInteractivePorts(FLAGS_qosInteractivePorts) ||
+        !qos.setBulkPorts(FLAGS_qosBulkPorts))
+    {
+        LOG(FATAL) << "Invalid port list of -qosInteractivePorts or -qosBulkPorts";
+    }
+    config.setQos(qos);
+
+    if (FLAGS_zeroCopy)
+    {
+        ZeroCopySender::Options options;
+        options.minWrite = static_cast<std::size_t>(std::max(FLAGS_zeroCopyMinWrite, 4096));
+
+        config.setZeroCopy(options);
+
+        // only the bulk tunnels without a rate limit send this way
+        if (!FLAGS_qos)
+        {
+            LOG(WARNING) << "-zeroCopy needs -qos to tell the bulk tunnels";
+        }
+        if (config.useRateLimiter())
+        {
+            LOG(WARNING) << "The rate limited tunnels don't use -zeroCopy";
+        }
+    }
+
+    if (FLAGS_sessionEngine != "callbacks" && FLAGS_sessionEngine != "coroutine")
+    {
+        LOG(FATAL) << "Invalid -sessionEngine " << FLAGS_sessionEngine
+                   << ", expected callbacks or coroutine";
+    }
+    config.setCoroutineSessions(FLAGS_sessionEngine == "coroutine");
     
-    LOG(WARNING) << "Socks5 options: "
-                 << "Listening host = " << config.host() << ", "
-                 << "Listening port = " << config.port() << ", "
-                 << "Secret key = " << config.key();
+    if (FLAGS_listen.empty())
+    {
+        LOG(WARNING) << "Socks5 options: "
+                     << "Listening host = " << config.host() << ", "
+                     << "Listening port = " << config.port() << ", "
+                     << "Secret key = " << config.key();
+    }
+    else
+    {
+        LOG(WARNING) << "Socks5 options: "
+                     << "Listening endpoints = " << FLAGS_listen << ", "
+                     << "Secret key = " << config.key();
+    }
 
-    if (config.useUserPassAuth())
+    if (!config.configFile().empty())
+    {
+        LOG(WARNING) << "Load the settings: " << config.configFile();
+    }
+
+    if (!config.credentialsFile().empty())
+    {
+        LOG(WARNING) << "Enable Username/Password authentication: "
+                     << "credentials = " << config.credentialsFile();
+    }
+
+    if (config.useAuthBackend())
+    {
+        LOG(WARNING) << "Enable Username/Password authentication: "
+                     << "verifier = " << config.authBackendOptions().path;
+    }
+    else if (config.hasUser())
     {
         LOG(WARNING) << "Enable Username/Password authentication: "
                      << "username = " << config.username()
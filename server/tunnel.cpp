@@ -11,8 +11,10 @@
 #include "auth.hpp"
 #include "tunnel.hpp"
 #include "cipher.hpp"
+#include "mux.hpp"
 
 #include <assert.h>
+#include <string.h>
 
 #include <glog/logging.h>
 
@@ -21,19 +23,118 @@
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
 
-static void inConnReadCallback(bufferevent *inConn, void *arg)
+// Bytes of datagrams queued for a client before the next ones are dropped
+static constexpr std::size_t UDP_BACKLOG = 1024 * 1024;
+
+// Bytes a bulk tunnel sending without copies reads from the remote at a time
+static constexpr std::size_t ZERO_COPY_READ = 64 * 1024;
+
+/**
+   The slot of the source address of a multiplexed connection,
+   released along with the session holding it. Each stream of the
+   connection is counted for the source as well
+ **/
+struct SourceHold
 {
-    auto tunnel = static_cast<Tunnel *>(arg);
-    if (inConn == nullptr || tunnel == nullptr)
+    SourceHold(std::shared_ptr<ServerBase> base, int fd, int slot)
+        : base(std::move(base)),
+          slot(slot)
     {
-        LOG(ERROR) << "inConnReadCallback receive invalid arguments";
-        return;
+        // a source without an address, e.g. a unix socket, isn't limited
+        memset(&address, 0, sizeof(address));
+        socklen_t length = sizeof(address);
+        if (getpeername(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            address.ss_family = AF_UNSPEC;
+        }
+    }
+
+    ~SourceHold()
+    {
+        if (slot != SourceLimiter::NONE)
+        {
+            base->sourceLimiter()->release(slot);
+        }
+    }
+
+    // Whether a new stream is let in, streamSlot is released along with its tunnel
+    bool admit(int &streamSlot) const
+    {
+        auto limiter = base->sourceLimiter();
+        if (limiter == nullptr)
+        {
+            streamSlot = SourceLimiter::NONE;
+            return true;
+        }
+
+        return limiter->admit(reinterpret_cast<const sockaddr *>(&address), base->now(),
+                              streamSlot);
+    }
+
+    std::shared_ptr<ServerBase>  base;
+    sockaddr_storage             address;
+    int                          slot;
+};
+
+/**
+   Move the tunnel on after a username/password authentication,
+   return false if the tunnel is deleted
+ **/
+static bool handleUserPassState(Tunnel *tunnel, Auth::State state)
+{
+    if (state == Auth::State::success)
+    {
+        tunnel->setState(Tunnel::State::authorized);            
+    }
+    else if (state == Auth::State::failed)
+    {
+        // authentication failed, we let client close it's connection
+        tunnel->setState(Tunnel::State::clientMustClose);            
+    }
+    else if (state == Auth::State::error)
+    {
+        // error occurred, we close client connection
+        delete tunnel;
+        return false;
+    }
+    else if (state == Auth::State::pending)
+    {
+        LOG(INFO) << "Client-" << tunnel->clientID() << " waits for its login to be checked";
+    }
+    else
+    {
+        // the data received is incomplete, nothing to do here
+        assert(state == Auth::State::incomplete);
     }
 
+    return true;
+}
+
+/**
+   Handle the input of the client in the current state,
+   return false if the tunnel is deleted
+ **/
+static bool handleInput(Tunnel *tunnel, bufferevent *inConn)
+{
     int clientID = tunnel->clientID();
     
     if (tunnel->state() == Tunnel::State::init)
     {
+        // the local server may carry many clients over this connection
+        bool incomplete;
+        if (MuxSession::hasMagic(tunnel->cryptor(), inConn, incomplete))
+        {
+            LOG(INFO) << "Client-" << clientID << " opens a multiplexed connection";
+            
+            tunnel->upgradeToMux();
+            delete tunnel;
+            return false;
+        }
+        else if (incomplete || !tunnel->cryptor().hasFrame(inConn))
+        {
+            return true;
+        }
+        
         LOG(INFO) << "Handle Authentication for client-" << clientID;
         
         auto state = tunnel->handleAuthentication(inConn);
@@ -57,6 +158,7 @@ static void inConnReadCallback(bufferevent *inConn, void *arg)
         {
             // error occurred, we close client connection
             delete tunnel;
+            return false;
         }
         else
         {
@@ -64,29 +166,22 @@ static void inConnReadCallback(bufferevent *inConn, void *arg)
             assert(state == Auth::State::incomplete);
         }
     }
+    else if (!tunnel->cryptor().hasFrame(inConn) &&
+             (tunnel->state() == Tunnel::State::waitUserPassAuth ||
+              tunnel->state() == Tunnel::State::authorized))
+    {
+        // a message of the handshake is split over several reads
+    }
     else if (tunnel->state() == Tunnel::State::waitUserPassAuth)
     {
-        auto state = tunnel->handleUserPassAuth(inConn);
-
-        if (state == Auth::State::success)
-        {
-            tunnel->setState(Tunnel::State::authorized);            
-        }
-        else if (state == Auth::State::failed)
+        if (tunnel->authPending())
         {
-            // authentication failed, we let client close it's connection
-            tunnel->setState(Tunnel::State::clientMustClose);            
-        }
-        else if (state == Auth::State::error)
-        {
-            // error occurred, we close client connection
-            delete tunnel;
-        }
-        else
-        {
-            // the data received is incomplete, nothing to do here
-            assert(state == Auth::State::incomplete);
+            // the request stays in the input until the verifier answers
+            return true;
         }
+        
+        auto state = tunnel->handleUserPassAuth(inConn);
+        return handleUserPassState(tunnel, state);
     }
     else if (tunnel->state() == Tunnel::State::authorized)
     {
@@ -95,15 +190,18 @@ static void inConnReadCallback(bufferevent *inConn, void *arg)
         auto state = tunnel->handleRequest(inConn);
         if (state == Request::State::success)
         {
-            tunnel->setState(Tunnel::State::waitForConnect);
             LOG(INFO) << "Handle Request for client-" << clientID
                       << " successful";            
         }
         else if (state == Request::State::error)
         {
             LOG(INFO) << "Handle Request for client-" << clientID
-                      << " error";            
+                      << " error";
+
+            // the client still reads the reply that tells why
+            tunnel->closeAfterWrite();
             delete tunnel;
+            return false;
         }
         else
         {
@@ -114,21 +212,90 @@ static void inConnReadCallback(bufferevent *inConn, void *arg)
     else if (tunnel->state() == Tunnel::State::waitForConnect)
     {
         /** 
-            Waiting for establishing connection to the server,
-            at this point the clien can't send any data to the socks5 server
+            Waiting for establishing connection to the server, the data
+            the client sends ahead stays in the input until it's connected
          **/
-        delete tunnel;
     }
     else if (tunnel->state() == Tunnel::State::connected)
     {
-        LOG(INFO) << "Transfer data from client-" << clientID << " to server";   
+        // the data the client sent along with its request, the rest is relayed
         tunnel->decryptTransfer();
     }
+    else if (tunnel->state() == Tunnel::State::udpAssociated)
+    {
+        tunnel->relayDatagrams();
+    }
     else if (tunnel->state() == Tunnel::State::clientMustClose)
     {
+        /**
+           The client may have sent its request along with the failed
+           authentication, discard it and let the client read the reply
+         **/
         LOG(ERROR) << "At this point the client-" << clientID
                    << " shouldn't send any data";
-        delete tunnel;
+        evbuffer_drain(bufferevent_get_input(inConn),
+                       evbuffer_get_length(bufferevent_get_input(inConn)));
+    }
+
+    return true;
+}
+
+static void inConnReadCallback(bufferevent *inConn, void *arg)
+{
+    auto tunnel = static_cast<Tunnel *>(arg);
+    if (inConn == nullptr || tunnel == nullptr)
+    {
+        LOG(ERROR) << "inConnReadCallback receive invalid arguments";
+        return;
+    }
+
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::inConnRead);
+
+    if (tunnel->hasSession())
+    {
+        Tunnel::resumeSession(tunnel);
+        return;
+    }
+
+    /**
+       A client may send its greeting, authentication, request and
+       first data in one write, so keep going while the state moves on
+     **/
+    auto input = bufferevent_get_input(inConn);
+    while (evbuffer_get_length(input) > 0)
+    {
+        auto state = tunnel->state();
+        if (!handleInput(tunnel, inConn) || tunnel->state() == state)
+        {
+            return;
+        }
+    }
+}
+
+/**
+   The read callback of a connected tunnel, the data of the client goes
+   to the destination without the checks of the handshake
+ **/
+static void inConnRelayCallback(bufferevent *, void *arg)
+{
+    auto tunnel = static_cast<Tunnel *>(arg);
+
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::inConnRead);
+    tunnel->decryptTransfer();
+}
+
+/**
+   Called when the credentials or the verifier answer the login of a client
+ **/
+static void authCallback(bool allowed, void *arg)
+{
+    auto tunnel = static_cast<Tunnel *>(arg);
+    
+    auto state = tunnel->onAuthResult(allowed);
+    if (handleUserPassState(tunnel, state))
+    {
+        // the client may have sent its request along with the login
+        inConnReadCallback(tunnel->inConnection(), tunnel);
     }
 }
 
@@ -141,6 +308,8 @@ static void inConnEventCallback(bufferevent *bev, short what, void *arg)
         return;
     }
 
+    LoopMonitor::Scope timing(tunnel->loopMonitor(), LoopMonitor::Category::event);
+
     int clientID = tunnel->clientID();    
     if (what & BEV_EVENT_EOF)
     {
@@ -182,23 +351,137 @@ static void closeOnWriteComplete(bufferevent *bev, void *arg)
 }
 **/
 
-Tunnel::Tunnel(const Config &config, std::shared_ptr<ServerBase> base, int inConnFd)
-    : config_(config),
+/**
+   Called for each datagram from a remote host
+ **/
+static void udpReadCallback(const sockaddr *from, socklen_t fromLength,
+                            const unsigned char *data, std::size_t length, void *arg)
+{
+    assert(arg != nullptr);
+
+    auto tunnel = static_cast<Tunnel *>(arg);
+    tunnel->onDatagram(from, data, length);
+}
+
+/**
+   Called when the udp association of the client is idle for too long
+ **/
+static void udpExpiredCallback(void *arg)
+{
+    assert(arg != nullptr);
+    
+    auto tunnel = static_cast<Tunnel *>(arg);
+    LOG(INFO) << "UDP association of client-" << tunnel->clientID() << " expired";
+
+    delete tunnel;
+}
+
+/**
+   A datagram waiting for the address of its destination,
+   it's dropped if the association is gone meanwhile
+ **/
+struct PendingDatagram
+{
+    std::weak_ptr<UdpRelay>  relay;
+    unsigned short           port;     // network byte order
+    Cryptor::Buffer          data;
+    std::shared_ptr<const Acl>  acl;   // checks the resolved address
+};
+
+static void datagramResolvedCallback(int result, const sockaddr *address,
+                                     socklen_t length, void *arg)
+{
+    std::unique_ptr<PendingDatagram> pending(static_cast<PendingDatagram *>(arg));
+
+    auto relay = pending->relay.lock();
+    if (relay == nullptr || result != DNS_ERR_NONE)
+    {
+        return;
+    }
+
+    sockaddr_storage storage;
+    memcpy(&storage, address, length);
+    setPort(&storage, pending->port);
+
+    if (pending->acl != nullptr &&
+        pending->acl->check(reinterpret_cast<sockaddr *>(&storage)) == Acl::Action::deny)
+    {
+        return;
+    }
+
+    relay->send(reinterpret_cast<sockaddr *>(&storage), length,
+                pending->data.data(), pending->data.size());
+    relay->flush();
+}
+
+Tunnel::Tunnel(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+               int inConnFd, int sourceSlot)
+    : config_(std::move(config)),
       base_(base),
       inConnFd_(inConnFd),
+      clientID_(inConnFd),
+      sourceSlot_(sourceSlot),
       inConn_(nullptr),
       outConn_(nullptr),
       state_(State::init),
-      cryptor_(config_.key(), "0000000000000000")
+      cryptor_(config_->key(), "0000000000000000"),
+      userLength_(0),
+      authPending_(false),
+      connectStarted_(0),
+      priority_(Priority::normal),
+      pinned_(false)
 {
+    if (config_->useCompression())
+    {
+        cryptor_.enableCompression(config_->compressionOptions());
+    }
+
     inConn_ = base_->acceptConnection(
         inConnFd_, inConnReadCallback, inConnEventCallback, this
     );
+
+    if (inConn_ != nullptr && config_->coroutineSessions())
+    {
+        session_.reset(new (base_->framePool()) Session(config_, base_, this, true));
+    }
+}
+
+Tunnel::Tunnel(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+               bufferevent *inConn, int clientID, int sourceSlot)
+    : config_(std::move(config)),
+      base_(base),
+      inConnFd_(-1),
+      clientID_(clientID),
+      sourceSlot_(sourceSlot),
+      inConn_(inConn),
+      outConn_(nullptr),
+      state_(State::init),
+      cryptor_(config_->key(), "0000000000000000"),
+      userLength_(0),
+      authPending_(false),
+      connectStarted_(0),
+      priority_(Priority::normal),
+      pinned_(false)
+{
+    assert(inConn_ != nullptr);
+
+    if (config_->useCompression())
+    {
+        cryptor_.enableCompression(config_->compressionOptions());
+    }
+    
+    if (config_->coroutineSessions())
+    {
+        session_.reset(new (base_->framePool()) Session(config_, base_, this, false));
+    }
+    
+    bufferevent_setcb(inConn_, inConnReadCallback, nullptr, inConnEventCallback, this);
+    bufferevent_enable(inConn_, EV_READ | EV_WRITE);
 }
 
 int Tunnel::clientID() const
 {
-    return inConnFd_;
+    return clientID_;
 }
 
 Tunnel::State Tunnel::state() const
@@ -209,19 +492,58 @@ Tunnel::State Tunnel::state() const
 void Tunnel::setState(Tunnel::State state)
 {
     state_ = state;
+
+    if (state_ == State::connected)
+    {
+        bufferevent_setcb(inConn_, inConnRelayCallback, nullptr, inConnEventCallback, this);
+    }
 }
 
 Tunnel::~Tunnel()
 {
-    LOG(INFO) << "Free client-" << inConnFd_;
+    LOG(INFO) << "Free client-" << clientID_;
+
+    if (authPending_)
+    {
+        // either of them may be checking the login
+        if (base_->credentials() != nullptr)
+        {
+            base_->credentials()->cancel(this);
+        }
+        if (base_->authBackend() != nullptr)
+        {
+            base_->authBackend()->cancel(this);
+        }
+    }
+
+    if (udp_ != nullptr)
+    {
+        base_->udpAssociations()->remove(udpEntry_);
+    }
+
+    if (sourceSlot_ != SourceLimiter::NONE)
+    {
+        base_->sourceLimiter()->release(sourceSlot_);
+    }
+    
+    // the sender stops listening on the socket before it's closed
+    zeroCopy_.reset();
     
     if (inConn_ != nullptr)
     {
+        // a stream of a multiplexed connection needs to know it's closed
+        bufferevent_flush(inConn_, EV_WRITE, BEV_FINISHED);
         bufferevent_free(inConn_);
     }
 
     if (outConn_ != nullptr)
     {
+        auto limiter = base_->rateLimiter();
+        if (limiter != nullptr)
+        {
+            limiter->release(outConn_, std::string(user_, userLength_));
+        }
+        
         bufferevent_free(outConn_);
     }
 }
@@ -230,9 +552,9 @@ Auth::State Tunnel::handleAuthentication(bufferevent *inConn)
 {
     assert(inConn == inConn_);
 
-    if (config_.useUserPassAuth())
+    if (config_->useUserPassAuth())
     {
-        Auth auth(cryptor_, inConn, config_.username(), config_.password());
+        Auth auth(cryptor_, inConn, true);
         return auth.authenticate();        
     }
     
@@ -243,10 +565,113 @@ Auth::State Tunnel::handleAuthentication(bufferevent *inConn)
 Auth::State Tunnel::handleUserPassAuth(bufferevent *inConn)
 {
     assert(inConn == inConn_);
-    assert(config_.useUserPassAuth());
+    assert(config_->useUserPassAuth());
+
+    auto credentials = base_->credentials();
+    auto backend = base_->authBackend();
+    
+    // the fields point into the message, only a login waiting for its check copies them
+    Auth auth(cryptor_, inConn);
+    Handshake::Login login;
+    auto state = auth.readUsernamePassword(login);
+    if (state != Auth::State::success)
+    {
+        return state;
+    }
+
+    bool allowed = false;
+    if (backend == nullptr || (credentials != nullptr && credentials->contains(login.username)))
+    {
+        // PBKDF2 runs in another thread unless the login is cached
+        if (credentials != nullptr)
+        {
+            auto result = credentials->lookup(login);
+            if (result == CredentialStore::Result::miss &&
+                credentials->check(login.username.toString(), login.password.toString(),
+                                   authCallback, this))
+            {
+                pendingUser_ = login.username.toString();
+                authPending_ = true;
+                return Auth::State::pending;
+            }
+            allowed = result == CredentialStore::Result::allowed;
+        }
+    }
+    else
+    {
+        auto result = backend->lookup(login);
+        if (result == AuthBackend::Result::miss)
+        {
+            pendingUser_ = login.username.toString();
+            authPending_ = true;
+            
+            backend->check(pendingUser_, login.password.toString(), authCallback, this);
+            return Auth::State::pending;
+        }
+        allowed = result == AuthBackend::Result::allowed;
+    }
+
+    state = auth.replyUsernamePassword(allowed);
+    if (state == Auth::State::success)
+    {
+        setUser(reinterpret_cast<const char *>(login.username.data), login.username.length);
+    }
+
+    return state;
+}
 
-    Auth auth(cryptor_, inConn, config_.username(), config_.password());
-    return auth.validateUsernamePassword();
+Auth::State Tunnel::onAuthResult(bool allowed)
+{
+    assert(authPending_);
+    authPending_ = false;
+
+    Auth auth(cryptor_, inConn_);
+    
+    auto state = auth.replyUsernamePassword(allowed);
+    if (state == Auth::State::success)
+    {
+        setUser(pendingUser_.data(), pendingUser_.size());
+    }
+    pendingUser_.clear();
+
+    return state;
+}
+
+void Tunnel::setUser(const char *user, std::size_t length)
+{
+    assert(length <= sizeof(user_));
+
+    memcpy(user_, user, length);
+    userLength_ = length;
+}
+
+void Tunnel::upgradeToMux()
+{
+    assert(state_ == State::init);
+    assert(inConnFd_ != -1);
+
+    // the streams share the settings of the connection
+    auto config = config_;
+    auto base = base_;
+
+    // the connection counts for its source until the session is gone
+    auto source = std::make_shared<SourceHold>(base_, inConnFd_, sourceSlot_);
+    sourceSlot_ = SourceLimiter::NONE;
+    
+    new MuxSession(base_->base(), inConn_, cryptor_, [config, base, source](bufferevent *stream, uint32_t id) {
+            // a stream is one more connection of the source
+            int streamSlot;
+            if (!source->admit(streamSlot))
+            {
+                LOG(WARNING) << "Refuse multiplexed stream-" << id << ": over the source limits";
+                return false;
+            }
+            
+            new Tunnel(config, base, stream, static_cast<int>(id), streamSlot);
+            return true;
+        }, config_->muxMaxStreams());
+    
+    inConn_ = nullptr;
 }
 
 Request::State Tunnel::handleRequest(bufferevent *inConn)
@@ -257,6 +682,39 @@ Request::State Tunnel::handleRequest(bufferevent *inConn)
     return request.handleRequest();
 }
 
+void Tunnel::resumeSession(Tunnel *tunnel)
+{
+    assert(tunnel->session_ != nullptr);
+    
+    auto result = tunnel->session_->resume();
+    switch (result)
+    {
+    case Session::Result::wait:
+        break;
+        
+    case Session::Result::relay:
+        tunnel->session_.reset();
+        
+        // the datagrams the client sent along with its request
+        if (tunnel->state_ == State::udpAssociated)
+        {
+            tunnel->relayDatagrams();
+        }
+        break;
+        
+    case Session::Result::closeAfterWrite:
+        // the client still reads the reply that tells why
+        tunnel->closeAfterWrite();
+        delete tunnel;
+        break;
+        
+    case Session::Result::close:
+    case Session::Result::upgraded:
+        delete tunnel;
+        break;
+    }
+}
+
 bufferevent *Tunnel::inConnection() const
 {
     assert(inConn_ != nullptr);
@@ -271,10 +729,300 @@ bufferevent *Tunnel::outConnection() const
     return outConn_;
 }
 
+bool Tunnel::beginConnect(const Address &destination, int &err)
+{
+    auto history = base_->connectHistory();
+    if (history == nullptr)
+    {
+        return true;
+    }
+
+    connectKey_ = destination.host() + ":" + destination.portString();
+    if (history->failing(connectKey_, base_->now(), err))
+    {
+        LOG(INFO) << "Connect to " << destination << " fails fast for client-" << clientID_
+                  << ": " << evutil_socket_error_to_string(err);
+
+        connectKey_.clear();
+        return false;
+    }
+
+    connectStarted_ = base_->now();
+    return true;
+}
+
+void Tunnel::endConnect(int err)
+{
+    auto history = base_->connectHistory();
+    if (history == nullptr || connectKey_.empty())
+    {
+        return;
+    }
+
+    if (err == 0)
+    {
+        history->onConnected(connectKey_, base_->now() - connectStarted_, base_->now());
+
+        // the deadline was only for the connection
+        bufferevent_set_timeouts(outConn_, nullptr, nullptr);
+    }
+    else
+    {
+        history->onFailed(connectKey_, err, base_->now());
+    }
+
+    connectKey_.clear();
+}
+
+void Tunnel::cancelConnect()
+{
+    connectKey_.clear();
+}
+
 void Tunnel::setOutConnection(bufferevent *outConn)
 {
     assert(outConn != nullptr);
     assert(outConn_ == nullptr);
 
     outConn_ = outConn;
+
+    // a connection not made in time ends with BEV_EVENT_TIMEOUT
+    if (!connectKey_.empty())
+    {
+        auto timeout = base_->connectHistory()->timeout(connectKey_);
+        struct timeval deadline = {timeout / 1000, (timeout % 1000) * 1000};
+        bufferevent_set_timeouts(outConn_, nullptr, &deadline);
+    }
+
+    auto limiter = base_->rateLimiter();
+    if (limiter != nullptr)
+    {
+        limiter->limitTunnel(inConn_, outConn_, std::string(user_, userLength_));
+    }
+}
+
+void Tunnel::closeAfterWrite()
+{
+    assert(inConn_ != nullptr);
+
+    zeroCopy_.reset();
+    ServerBase::closeAfterWrite(inConn_);
+    inConn_ = nullptr;
+}
+
+void Tunnel::encryptTransfer()
+{
+    assert(inConn_ != nullptr);        
+    assert(outConn_ != nullptr);
+
+    /**
+       What's read from the host is counted, the output of a stream of a
+       mux is passed on to its peer at once and a frame sent without a
+       copy never shows in the output
+     **/
+    auto input = bufferevent_get_input(outConn_);
+    auto before = evbuffer_get_length(input);
+    
+    // the large frames of a bulk tunnel go out without a copy
+    auto sender = priority_ == Priority::bulk ? zeroCopy_.get() : nullptr;
+    cryptor_.encryptTransfer(outConn_, inConn_, sender);
+
+    auto bytes = before - evbuffer_get_length(input);
+    base_->tune(inTuner_, inConn_, bytes);
+    measure(bytes);
+}
+    
+void Tunnel::decryptTransfer()
+{
+    assert(inConn_ != nullptr);        
+    assert(outConn_ != nullptr);
+
+    // the frames read from the client, as in encryptTransfer()
+    auto input = bufferevent_get_input(inConn_);
+    auto before = evbuffer_get_length(input);
+    
+    cryptor_.decryptTransfer(inConn_, outConn_);
+
+    auto bytes = before - evbuffer_get_length(input);
+    base_->tune(outTuner_, outConn_, bytes);
+    measure(bytes);
+}
+
+void Tunnel::classify(unsigned short port)
+{
+    auto &qos = config_->qos();
+    if (!qos.enabled)
+    {
+        return;
+    }
+
+    pinned_ = qos.pinned(port);
+    setPriority(qos.classify(port));
+}
+
+void Tunnel::setPriority(Priority priority)
+{
+    priority_ = priority;
+    
+    ServerBase::setPriority(inConn_, priority);
+    ServerBase::setPriority(outConn_, priority);
+
+    if (priority != Priority::bulk || !config_->useZeroCopy())
+    {
+        return;
+    }
+
+    // the sends of a rate limited connection must go through its bucket
+    if (zeroCopy_ == nullptr && base_->rateLimiter() == nullptr)
+    {
+        zeroCopy_ = ZeroCopySender::create(base_->base(), inConn_, config_->zeroCopyOptions());
+    }
+
+    // a copy is saved on large frames, so they're read in large pieces
+    if (zeroCopy_ != nullptr && zeroCopy_->enabled())
+    {
+        bufferevent_set_max_single_read(outConn_, ZERO_COPY_READ);
+    }
+}
+
+void Tunnel::measure(std::size_t bytes)
+{
+    auto &qos = config_->qos();
+    if (!qos.enabled || pinned_)
+    {
+        return;
+    }
+    
+    auto priority = meter_.onTransfer(bytes, base_->now(), qos.bulkRate);
+    if (priority != priority_)
+    {
+        LOG(INFO) << "Client-" << clientID_ << " turns "
+                  << (priority == Priority::bulk ? "bulk" : "normal");
+        
+        setPriority(priority);
+    }
+}
+
+bool Tunnel::startUdpAssociation()
+{
+    auto associations = base_->udpAssociations();
+    if (associations == nullptr)
+    {
+        return false;
+    }
+
+    // a dual stack socket reaches both ipv4 and ipv6 hosts
+    int fd = createUdpSocket(Address::FromHostOrder("::", 0));
+    if (fd == -1)
+    {
+        fd = createUdpSocket(Address::FromHostOrder("0.0.0.0", 0));
+    }
+    
+    if (fd == -1)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        LOG(ERROR) << "Failed to create udp socket for client-" << clientID_
+                   << ": " << evutil_socket_error_to_string(err);
+        
+        return false;
+    }
+
+    udp_ = std::make_shared<UdpRelay>(base_->base(), fd, udpReadCallback, this);
+    udpEntry_ = associations->add(udpExpiredCallback, this);
+    state_ = State::udpAssociated;
+
+    // the largest frame of a datagram the client may send
+    fromClient_.resize(UdpHeader::MAX_BYTES + UdpRelay::MAX_DATAGRAM + Cryptor::BLOCK_SIZE);
+
+    LOG(INFO) << "UDP association of client-" << clientID_ << " relays through "
+              << udp_->localAddress();
+    
+    return true;
+}
+
+void Tunnel::relayDatagrams()
+{
+    assert(udp_ != nullptr);
+    
+    // each frame is opened and drained on its own, a backlog costs no more than its bytes
+    while (cryptor_.hasFrame(inConn_))
+    {
+        std::size_t dataLength = 0;
+        bool opened = cryptor_.decryptFrom(inConn_, fromClient_.data(), fromClient_.size(),
+                                           dataLength);
+        cryptor_.removeFrom(inConn_);
+        
+        Address address;
+        auto headerLength = opened ?
+            UdpHeader::parse(fromClient_.data(), dataLength, address) : 0;
+        if (headerLength == 0)
+        {
+            LOG(ERROR) << "Invalid datagram from client-" << clientID_;
+            continue;
+        }
+
+        auto payload = fromClient_.data() + headerLength;
+        auto payloadLength = dataLength - headerLength;
+
+        // datagrams to a denied destination are dropped
+        auto &acl = base_->acl();
+        if (acl != nullptr && acl->check(address) == Acl::Action::deny)
+        {
+            continue;
+        }
+
+        sockaddr_storage storage;
+        socklen_t length = toSockaddr(address, &storage);
+
+        if (length == 0)
+        {
+            auto cache = base_->dnsCache();
+            auto result = cache != nullptr ?
+                cache->lookup(address.host(), AF_UNSPEC, &storage, &length) :
+                DnsCache::Result::miss;
+
+            if (result == DnsCache::Result::negative)
+            {
+                continue;
+            }
+            else if (result == DnsCache::Result::miss)
+            {
+                base_->resolve(address.host(), datagramResolvedCallback,
+                               new PendingDatagram{
+                                   udp_, address.portNetworkOrder(),
+                                   Cryptor::Buffer(payload, payload + payloadLength),
+                                   acl
+                               });
+                continue;
+            }
+            
+            setPort(&storage, address.portNetworkOrder());
+            if (acl != nullptr &&
+                acl->check(reinterpret_cast<sockaddr *>(&storage)) == Acl::Action::deny)
+            {
+                continue;
+            }
+        }
+
+        udp_->send(reinterpret_cast<sockaddr *>(&storage), length, payload, payloadLength);
+    }
+
+    udp_->flush();
+    base_->udpAssociations()->touch(udpEntry_);
+}
+
+void Tunnel::onDatagram(const sockaddr *from, const unsigned char *data, std::size_t length)
+{
+    // the client doesn't keep up, drop as the network would
+    if (evbuffer_get_length(bufferevent_get_output(inConn_)) >= UDP_BACKLOG)
+    {
+        return;
+    }
+
+    datagram_.resize(UdpHeader::MAX_BYTES + length);
+    auto headerLength = UdpHeader::write(from, datagram_.data());
+    memcpy(datagram_.data() + headerLength, data, length);
+
+    cryptor_.encryptTo(inConn_, datagram_.data(), headerLength + length);
+    base_->udpAssociations()->touch(udpEntry_);
 }
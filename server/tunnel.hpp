@@ -16,8 +16,11 @@
 #include "config.hpp"
 #include "cipher.hpp"
 #include "request.hpp"
+#include "session.hpp"
+#include "udprelay.hpp"
 
 #include <memory>
+#include <string>
 
 /**
    Forward declaration
@@ -33,10 +36,22 @@ public:
     enum class State
     {
         init, waitUserPassAuth, authorized,
-        clientMustClose, connected, waitForConnect
+        clientMustClose, connected, waitForConnect,
+        udpAssociated
     };
     
-    Tunnel(const Config &config, std::shared_ptr<ServerBase> base, int inConnFd);
+    /**
+       The tunnel keeps the settings of config until it's freed,
+       a reload in the meantime only changes the later tunnels.
+       sourceSlot counts the connection for its source address
+     **/
+    Tunnel(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+           int inConnFd, int sourceSlot);
+
+    // Tunnel over a stream of a multiplexed connection, sourceSlot counts the stream
+    Tunnel(std::shared_ptr<const Config> config, std::shared_ptr<ServerBase> base,
+           bufferevent *inConn, int clientID, int sourceSlot);
+    
     ~Tunnel();
 
     Tunnel(const Tunnel &) = delete;
@@ -47,14 +62,84 @@ public:
 
     Auth::State handleAuthentication(bufferevent *inConn);
     Auth::State handleUserPassAuth(bufferevent *inConn);
+
+    /**
+       Answer the client once the verifier allowed or denied it,
+       the login is pending meanwhile
+     **/
+    Auth::State onAuthResult(bool allowed);
+
+    bool authPending() const
+    {
+        return authPending_;
+    }
     
     Request::State handleRequest(bufferevent *inConn);
+
+    /**
+       Run the handshake of the coroutine engine on, and act on how it
+       ends, the tunnel may be deleted afterwards
+     **/
+    static void resumeSession(Tunnel *tunnel);
+
+    // Whether the coroutine engine runs the handshake
+    bool hasSession() const
+    {
+        return session_ != nullptr;
+    }
+
+    // The user who logged in, at most 255 bytes
+    void setUser(const char *user, std::size_t length);
+
+    /**
+       Hand the client connection over to a multiplexed session,
+       the tunnel must be deleted afterwards
+     **/
+    void upgradeToMux();
+    
+    /**
+       Relay datagrams for the client, each frame on the client
+       connection is then a datagram with its SOCKS5 UDP header.
+       Return false if udp is disabled or fails
+     **/
+    bool startUdpAssociation();
+
+    // Send the datagrams the client wrote on its connection
+    void relayDatagrams();
+
+    // Called for each datagram from a remote host
+    void onDatagram(const sockaddr *from, const unsigned char *data, std::size_t length);
     
     bufferevent *inConnection() const;
     bufferevent *outConnection() const;
     
+    /**
+       Start the connection to destination, false if its recent
+       connections failed, err is the error to answer the client then
+     **/
+    bool beginConnect(const Address &destination, int &err);
+
+    // Record how the connection begun ended, err is 0 once it's connected
+    void endConnect(int err);
+
+    /**
+       End the connection begun without recording it, the destination
+       wasn't tried, e.g. its name didn't resolve
+     **/
+    void cancelConnect();
+
+    /**
+       The connection to the destination, a connection begun must be
+       made within the deadline of its destination
+     **/
     void setOutConnection(bufferevent *outConn);
 
+    /**
+       Close the client connection once the data queued for the
+       client is written, the tunnel must be deleted afterwards
+     **/
+    void closeAfterWrite();
+
     int clientID() const;
 
     Cryptor cryptor() const
@@ -62,30 +147,57 @@ public:
         return cryptor_;
     }
 
-    void encryptTransfer()
+    // the monitor of the event loop, nullptr if it isn't measured
+    LoopMonitor *loopMonitor() const
     {
-        assert(inConn_ != nullptr);        
-        assert(outConn_ != nullptr);
-        
-        cryptor_.encryptTransfer(outConn_, inConn_);
-    }
-    
-    void decryptTransfer()
-    {
-        assert(inConn_ != nullptr);        
-        assert(outConn_ != nullptr);
-        
-        cryptor_.decryptTransfer(inConn_, outConn_);
+        return base_->loopMonitor();
     }
+
+    /**
+       Set the class of the tunnel from the port of its destination,
+       the tunnel is measured afterwards unless a rule fixes it
+     **/
+    void classify(unsigned short port);
+
+    // Encrypt and transfer data from the remote server to the client
+    void encryptTransfer();
+
+    // Decrypt and transfer data from the client to the remote server
+    void decryptTransfer();
     
 private:
-    Config                       config_;
+    // Run the callbacks of both connections at priority
+    void setPriority(Priority priority);
+
+    // Called after bytes went through the tunnel
+    void measure(std::size_t bytes);
+    
+    std::shared_ptr<const Config> config_;     // the settings it started with
     std::shared_ptr<ServerBase>  base_;
     int                          inConnFd_;    
+    int                          clientID_;
+    int                          sourceSlot_;  // of the source limiter, released when freed
     bufferevent                  *inConn_;
     bufferevent                  *outConn_;
     State                        state_;
     Cryptor                      cryptor_;
+    SocketTuner                  inTuner_;     // tunes the client connection
+    SocketTuner                  outTuner_;    // tunes the remote connection
+    std::shared_ptr<UdpRelay>    udp_;         // relay of the udp association
+    UdpAssociations::Handle      udpEntry_;
+    Cryptor::Buffer              datagram_;    // a reply being framed
+    Cryptor::Buffer              fromClient_;  // a datagram of the client being opened
+    char                         user_[255];   // kept in place, a login copies nothing
+    std::size_t                  userLength_;  // 0 if the client didn't authenticate
+    std::string                  pendingUser_; // waiting for the verifier
+    bool                         authPending_;
+    std::string                  connectKey_;  // the destination being connected to
+    long                         connectStarted_; // milliseconds
+    Priority                     priority_;
+    bool                         pinned_;      // the class is set by a port rule
+    FlowMeter                    meter_;
+    std::unique_ptr<ZeroCopySender> zeroCopy_;  // sends to the client while bulk
+    std::unique_ptr<Session>     session_;     // the handshake of the coroutine engine
 };
 
 #endif /* TUNNEL_H */
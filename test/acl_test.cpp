@@ -0,0 +1,157 @@
+#include "acl.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+static std::unique_ptr<Acl> buildAcl(const std::string &text)
+{
+    std::string error;
+    auto acl = Acl::build(text.data(), text.size(), error);
+    EXPECT_TRUE(acl != nullptr) << error;
+
+    return acl;
+}
+
+static Acl::Action checkHost(const Acl &acl, const std::string &host, unsigned short port)
+{
+    return acl.check(Address::FromHostOrder(host, port));
+}
+
+TEST(AclTest, Cidr)
+{
+    auto acl = buildAcl(
+        "deny  10.0.0.0/8\n"
+        "allow 10.1.0.0/16\n"
+        "deny  10.1.2.3\n"
+        "deny  192.168.0.0/16  22,25\n"
+        "deny  fc00::/7\n"
+        "allow fd00::1\n"
+    );
+    ASSERT_TRUE(acl != nullptr);
+    EXPECT_EQ(7u, acl->size());
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "10.2.3.4", 80));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "10.1.9.9", 80));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "10.1.2.3", 80));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "11.0.0.1", 80));
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "192.168.1.1", 22));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "192.168.1.1", 25));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "192.168.1.1", 80));
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "fd12::1", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "fd00::1", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "2001:db8::1", 443));
+
+    // IPv4 mapped IPv6 addresses are IPv4 addresses
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "::ffff:10.2.3.4", 80));
+}
+
+TEST(AclTest, Domain)
+{
+    auto acl = buildAcl(
+        "# abusive domains\n"
+        "deny  example.com\n"
+        "allow api.example.com\n"
+        "deny  *.mail.test      25\n"
+        "deny  Upper.Test.\n"
+    );
+    ASSERT_TRUE(acl != nullptr);
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "example.com", 443));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "www.example.com", 443));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "WWW.EXAMPLE.COM.", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "api.example.com", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "v1.api.example.com", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "badexample.com", 443));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "com", 443));
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "smtp.mail.test", 25));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "smtp.mail.test", 587));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "upper.test", 80));
+}
+
+TEST(AclTest, Any)
+{
+    auto acl = buildAcl(
+        "deny  *  25\n"
+        "allow 127.0.0.1\n"
+        "allow mail.test\n"
+        "deny  *\n"
+    );
+    ASSERT_TRUE(acl != nullptr);
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "8.8.8.8", 25));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "8.8.8.8", 80));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "a.test", 80));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "127.0.0.1", 25));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "smtp.mail.test", 25));
+}
+
+TEST(AclTest, Resolved)
+{
+    auto acl = buildAcl("deny 127.0.0.0/8 1-1024\n");
+    ASSERT_TRUE(acl != nullptr);
+
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+    sin.sin_port = htons(80);
+    EXPECT_EQ(Acl::Action::deny, acl->check(reinterpret_cast<sockaddr *>(&sin)));
+    sin.sin_port = htons(8080);
+    EXPECT_EQ(Acl::Action::allow, acl->check(reinterpret_cast<sockaddr *>(&sin)));
+}
+
+TEST(AclTest, Malformed)
+{
+    const char *lines[] = {
+        "block 10.0.0.0/8",
+        "deny",
+        "deny 10.0.0.0/33",
+        "deny 10.0.0.0/8 0",
+        "deny 10.0.0.0/8 90-80",
+        "deny 10.0.0.0/8 80 extra",
+        "deny bad..domain",
+        "deny bad/domain",
+    };
+
+    for (auto line : lines)
+    {
+        std::string error;
+        std::string text(line);
+        EXPECT_TRUE(Acl::build(text.data(), text.size(), error) == nullptr) << line;
+        EXPECT_FALSE(error.empty());
+    }
+}
+
+TEST(AclTest, ManyRules)
+{
+    std::string text;
+    for (int i = 0; i < 100000; i++)
+    {
+        text += "deny 10." + std::to_string(i >> 8 & 0xff) + "." +
+            std::to_string(i & 0xff) + ".0/24\n";
+        text += "deny host" + std::to_string(i) + ".example.org\n";
+    }
+
+    auto acl = buildAcl(text);
+    ASSERT_TRUE(acl != nullptr);
+    EXPECT_EQ(200000u, acl->size());
+
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "10.134.159.1", 80));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "11.134.159.1", 80));
+    EXPECT_EQ(Acl::Action::deny, checkHost(*acl, "www.host99999.example.org", 80));
+    EXPECT_EQ(Acl::Action::allow, checkHost(*acl, "host100000.example.org", 80));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,252 @@
+#include "authbackend.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <gtest/gtest.h>
+
+// A login message with the fields of username and password
+static Handshake::Login loginOf(const std::string &username, const std::string &password)
+{
+    Handshake::Login login;
+    login.username = {reinterpret_cast<const unsigned char *>(username.data()), username.size()};
+    login.password = {reinterpret_cast<const unsigned char *>(password.data()), password.size()};
+
+    return login;
+}
+
+/**
+   A stub verifier on a Unix socket, it allows alice with the password
+   "secret", never answers for bob and denies everyone else
+ **/
+class AuthBackendTest : public testing::Test
+{
+protected:
+    AuthBackendTest()
+        : base_(event_base_new()),
+          listener_(nullptr),
+          requests_(0)
+    {
+        path_ = "/tmp/authbackend_test." + std::to_string(getpid());
+        unlink(path_.c_str());
+
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path_.c_str());
+
+        listener_ = evconnlistener_new_bind(base_, acceptCallback, this,
+                                            LEV_OPT_CLOSE_ON_FREE, -1,
+                                            reinterpret_cast<sockaddr *>(&address),
+                                            sizeof(address));
+
+        options_.path = path_;
+        options_.timeout = 100;
+    }
+
+    ~AuthBackendTest()
+    {
+        for (auto conn : conns_)
+        {
+            bufferevent_free(conn);
+        }
+        evconnlistener_free(listener_);
+        event_base_free(base_);
+        unlink(path_.c_str());
+    }
+
+    static void acceptCallback(evconnlistener *listener, evutil_socket_t fd,
+                               sockaddr *address, int length, void *arg)
+    {
+        auto test = static_cast<AuthBackendTest *>(arg);
+        auto conn = bufferevent_socket_new(test->base_, fd, BEV_OPT_CLOSE_ON_FREE);
+        bufferevent_setcb(conn, readCallback, nullptr, nullptr, test);
+        bufferevent_enable(conn, EV_READ | EV_WRITE);
+        test->conns_.push_back(conn);
+    }
+
+    static void readCallback(bufferevent *conn, void *arg)
+    {
+        auto test = static_cast<AuthBackendTest *>(arg);
+        auto input = bufferevent_get_input(conn);
+
+        while (true)
+        {
+            auto length = evbuffer_get_length(input);
+            auto data = evbuffer_pullup(input, -1);
+            if (length < 5 || length < 6u + data[4] ||
+                length < 6u + data[4] + data[5 + data[4]])
+            {
+                return;
+            }
+
+            std::string username(data + 5, data + 5 + data[4]);
+            std::string password(data + 6 + data[4], data + 6 + data[4] + data[5 + data[4]]);
+            
+            unsigned char answer[5];
+            memcpy(answer, data, 4);
+            answer[4] = username == "alice" && password == "secret" ? 0 : 1;
+            
+            evbuffer_drain(input, 6 + username.size() + password.size());
+            test->requests_++;
+            
+            if (username != "bob")
+            {
+                bufferevent_write(conn, answer, sizeof(answer));
+            }
+        }
+    }
+
+    struct Answer
+    {
+        Answer()
+            : done(false),
+              allowed(false)
+        {
+        }
+
+        bool  done;
+        bool  allowed;
+    };
+
+    static void callback(bool allowed, void *arg)
+    {
+        auto answer = static_cast<Answer *>(arg);
+        answer->done = true;
+        answer->allowed = allowed;
+    }
+
+    // Run the event loop until the answer arrives
+    void wait(const Answer &answer)
+    {
+        for (int i = 0; i < 100 && !answer.done; i++)
+        {
+            event_base_loop(base_, EVLOOP_ONCE);
+        }
+    }
+
+    event_base                 *base_;
+    evconnlistener             *listener_;
+    std::vector<bufferevent *> conns_;
+    std::string                path_;
+    AuthBackend::Options       options_;
+    int                        requests_;
+};
+
+TEST_F(AuthBackendTest, Allowed)
+{
+    AuthBackend backend(base_, options_);
+    EXPECT_EQ(AuthBackend::Result::miss, backend.lookup(loginOf("alice", "secret")));
+
+    Answer answer;
+    backend.check("alice", "secret", callback, &answer);
+    EXPECT_FALSE(answer.done);
+
+    wait(answer);
+    EXPECT_TRUE(answer.done);
+    EXPECT_TRUE(answer.allowed);
+
+    EXPECT_EQ(AuthBackend::Result::allowed, backend.lookup(loginOf("alice", "secret")));
+    EXPECT_EQ(AuthBackend::Result::miss, backend.lookup(loginOf("alice", "guess")));
+    EXPECT_EQ(1, requests_);
+}
+
+TEST_F(AuthBackendTest, Denied)
+{
+    AuthBackend backend(base_, options_);
+
+    Answer answer;
+    backend.check("alice", "guess", callback, &answer);
+    wait(answer);
+    
+    EXPECT_TRUE(answer.done);
+    EXPECT_FALSE(answer.allowed);
+    EXPECT_EQ(AuthBackend::Result::denied, backend.lookup(loginOf("alice", "guess")));
+}
+
+TEST_F(AuthBackendTest, Coalesced)
+{
+    AuthBackend backend(base_, options_);
+
+    Answer answers[3];
+    for (auto &answer : answers)
+    {
+        backend.check("alice", "secret", callback, &answer);
+    }
+
+    Answer other;
+    backend.check("carol", "secret", callback, &other);
+    
+    wait(answers[0]);
+    wait(other);
+    for (auto &answer : answers)
+    {
+        EXPECT_TRUE(answer.done);
+        EXPECT_TRUE(answer.allowed);
+    }
+    EXPECT_FALSE(other.allowed);
+
+    EXPECT_EQ(2, requests_);
+    EXPECT_EQ(2u, backend.stats().coalesced);
+}
+
+TEST_F(AuthBackendTest, Timeout)
+{
+    AuthBackend backend(base_, options_);
+
+    Answer answer;
+    backend.check("bob", "secret", callback, &answer);
+    wait(answer);
+
+    EXPECT_TRUE(answer.done);
+    EXPECT_FALSE(answer.allowed);
+    EXPECT_EQ(1u, backend.stats().errors);
+
+    // a timeout isn't cached
+    EXPECT_EQ(AuthBackend::Result::miss, backend.lookup(loginOf("bob", "secret")));
+}
+
+TEST_F(AuthBackendTest, Cancel)
+{
+    AuthBackend backend(base_, options_);
+
+    Answer cancelled, answer;
+    backend.check("alice", "secret", callback, &cancelled);
+    backend.check("alice", "secret", callback, &answer);
+    backend.cancel(&cancelled);
+    
+    wait(answer);
+    EXPECT_TRUE(answer.allowed);
+    EXPECT_FALSE(cancelled.done);
+}
+
+TEST_F(AuthBackendTest, NoVerifier)
+{
+    options_.path = path_ + ".missing";
+    AuthBackend backend(base_, options_);
+
+    Answer answer;
+    backend.check("alice", "secret", callback, &answer);
+    EXPECT_FALSE(answer.done);
+    
+    wait(answer);
+    EXPECT_TRUE(answer.done);
+    EXPECT_FALSE(answer.allowed);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
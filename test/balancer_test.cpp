@@ -0,0 +1,114 @@
+#include "balancer.hpp"
+
+#include <gtest/gtest.h>
+
+TEST(BalancerTest, Latency)
+{
+    Balancer balancer(3, Balancer::Options());
+
+    balancer.onConnected(0, 50);
+    balancer.onConnected(1, 10);
+    balancer.onConnected(2, 20);
+    EXPECT_EQ(1u, balancer.pick(0));
+
+    // the average follows the samples
+    for (int i = 0; i < 20; i++)
+    {
+        balancer.onConnected(1, 100);
+    }
+    EXPECT_NEAR(100.0, balancer.target(1).latency, 1.0);
+    EXPECT_EQ(2u, balancer.pick(0));
+
+    // a busy server loses to a slower idle one
+    for (int i = 0; i < 3; i++)
+    {
+        balancer.acquire(2);
+    }
+    EXPECT_EQ(0u, balancer.pick(0));
+
+    for (int i = 0; i < 3; i++)
+    {
+        balancer.release(2);
+    }
+    EXPECT_EQ(2u, balancer.pick(0));
+    EXPECT_EQ(2u, balancer.target(2).picks);
+}
+
+TEST(BalancerTest, LeastLoaded)
+{
+    Balancer::Options options;
+    options.policy = Balancer::Policy::leastLoaded;
+    Balancer balancer(2, options);
+
+    balancer.onConnected(0, 10);
+    balancer.onConnected(1, 90);
+
+    // the tunnels are spread, the latency breaks the ties
+    for (int i = 0; i < 4; i++)
+    {
+        balancer.acquire(balancer.pick(0));
+    }
+    EXPECT_EQ(2, balancer.target(0).tunnels);
+    EXPECT_EQ(2, balancer.target(1).tunnels);
+    EXPECT_EQ(0u, balancer.pick(0));
+}
+
+TEST(BalancerTest, Eject)
+{
+    Balancer::Options options;
+    options.maxFails = 2;
+    options.minBackoff = 1000;
+    options.maxBackoff = 3000;
+    Balancer balancer(2, options);
+
+    balancer.onConnected(0, 10);
+    balancer.onConnected(1, 50);
+
+    balancer.onFailure(0, 0);
+    EXPECT_FALSE(balancer.ejected(0, 0));
+    EXPECT_EQ(0u, balancer.pick(0));
+
+    balancer.onFailure(0, 0);
+    EXPECT_TRUE(balancer.ejected(0, 0));
+    EXPECT_EQ(1u, balancer.pick(500));
+
+    // the backoff is over, one more failure ejects it for twice as long
+    EXPECT_EQ(0u, balancer.pick(1000));
+    balancer.onFailure(0, 1000);
+    EXPECT_TRUE(balancer.ejected(0, 2999));
+    EXPECT_FALSE(balancer.ejected(0, 3000));
+
+    balancer.onFailure(0, 3000);
+    EXPECT_TRUE(balancer.ejected(0, 5999));
+    EXPECT_EQ(3u, balancer.target(0).ejections);
+
+    // a success takes it back
+    balancer.onSuccess(0);
+    EXPECT_FALSE(balancer.ejected(0, 3000));
+    EXPECT_EQ(0u, balancer.pick(3000));
+
+    balancer.onFailure(0, 3000);
+    balancer.onFailure(0, 3000);
+    EXPECT_FALSE(balancer.ejected(0, 4000));
+}
+
+TEST(BalancerTest, AllEjected)
+{
+    Balancer::Options options;
+    options.maxFails = 1;
+    Balancer balancer(2, options);
+
+    balancer.onFailure(1, 0);
+    balancer.onFailure(0, 500);
+
+    // the server back first is tried anyway
+    EXPECT_TRUE(balancer.ejected(0, 600));
+    EXPECT_TRUE(balancer.ejected(1, 600));
+    EXPECT_EQ(1u, balancer.pick(600));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,100 @@
+#include "compress.hpp"
+
+#include <stdlib.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+static FrameCompressor::Buffer textFrame(int seed)
+{
+    std::string text;
+    for (int i = 0; i < 40; i++)
+    {
+        text += "GET /index.html?page=" + std::to_string(seed * 100 + i) +
+            " HTTP/1.1\r\nHost: example.com\r\nAccept: text/html\r\n\r\n";
+    }
+
+    return FrameCompressor::Buffer(text.begin(), text.end());
+}
+
+static FrameCompressor::Buffer randomFrame(std::size_t length)
+{
+    FrameCompressor::Buffer data(length);
+    for (auto &byte : data)
+    {
+        byte = static_cast<unsigned char>(rand());
+    }
+
+    return data;
+}
+
+TEST(CompressTest, Entropy)
+{
+    FrameCompressor::Buffer zeros(1000, 0);
+    EXPECT_NEAR(0.0, FrameCompressor::entropy(zeros.data(), zeros.size()), 1e-9);
+
+    FrameCompressor::Buffer bytes(256 * 64);
+    for (std::size_t i = 0; i < bytes.size(); i++)
+    {
+        bytes[i] = static_cast<unsigned char>(i);
+    }
+    EXPECT_NEAR(8.0, FrameCompressor::entropy(bytes.data(), bytes.size()), 1e-9);
+
+    auto text = textFrame(0);
+    EXPECT_LT(FrameCompressor::entropy(text.data(), text.size()), 6.0);
+
+    auto noise = randomFrame(64 * 1024);
+    EXPECT_GT(FrameCompressor::entropy(noise.data(), noise.size()), 7.5);
+}
+
+TEST(CompressTest, RoundTrip)
+{
+    FrameCompressor sender{FrameCompressor::Options()};
+    FrameCompressor receiver{FrameCompressor::Options()};
+
+    std::vector<FrameCompressor::Buffer> frames = {
+        textFrame(1), FrameCompressor::Buffer{0x05, 0x01, 0x00},
+        randomFrame(20000), textFrame(2), FrameCompressor::Buffer()
+    };
+
+    std::vector<std::size_t> sizes;
+    for (auto &frame : frames)
+    {
+        FrameCompressor::Buffer packed, unpacked;
+        ASSERT_TRUE(sender.compress(frame.data(), frame.size(), packed));
+        ASSERT_TRUE(receiver.decompress(packed.data(), packed.size(), unpacked));
+        EXPECT_EQ(frame, unpacked);
+
+        sizes.push_back(packed.size());
+    }
+
+    // text shrinks, the later frame refers back to the earlier one
+    EXPECT_LT(sizes[0], frames[0].size() / 4);
+    EXPECT_LT(sizes[3], sizes[0]);
+
+    // small and random frames go raw behind the flag
+    EXPECT_EQ(frames[1].size() + 1, sizes[1]);
+    EXPECT_EQ(frames[2].size() + 1, sizes[2]);
+    EXPECT_EQ(1u, sizes[4]);
+}
+
+TEST(CompressTest, Malformed)
+{
+    FrameCompressor compressor{FrameCompressor::Options()};
+    FrameCompressor::Buffer out;
+
+    EXPECT_FALSE(compressor.decompress(nullptr, 0, out));
+
+    FrameCompressor::Buffer unknown = {0x07, 0x01};
+    EXPECT_FALSE(compressor.decompress(unknown.data(), unknown.size(), out));
+
+    FrameCompressor::Buffer garbage = {FrameCompressor::DEFLATED, 0xff, 0xff, 0xff, 0xff};
+    EXPECT_FALSE(compressor.decompress(garbage.data(), garbage.size(), out));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
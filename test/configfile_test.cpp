@@ -0,0 +1,105 @@
+#include "configfile.hpp"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+static std::unique_ptr<ConfigFile> buildFile(const std::string &text)
+{
+    std::string error;
+    auto file = ConfigFile::build(text.data(), text.size(), error);
+    EXPECT_TRUE(file != nullptr) << error;
+
+    return file;
+}
+
+TEST(ConfigFileTest, Values)
+{
+    auto file = buildFile(
+        "# settings reloaded on SIGHUP\n"
+        "\n"
+        "tcpNoDelay = false\n"
+        "  tcpKeepAlive=30   # seconds\n"
+        "tcpCongestion = bbr\n"
+        "qosBulkPorts =\n"
+        "connectRatePerIP = 0.5\n"
+    );
+    ASSERT_TRUE(file != nullptr);
+    EXPECT_EQ(5u, file->size());
+
+    std::string error;
+    bool noDelay = true;
+    EXPECT_TRUE(file->get("tcpNoDelay", noDelay, error));
+    EXPECT_FALSE(noDelay);
+
+    int64_t keepAlive = 60;
+    EXPECT_TRUE(file->get("tcpKeepAlive", keepAlive, error));
+    EXPECT_EQ(30, keepAlive);
+
+    std::string congestion, bulkPorts = "80";
+    EXPECT_TRUE(file->get("tcpCongestion", congestion, error));
+    EXPECT_EQ("bbr", congestion);
+    EXPECT_TRUE(file->get("qosBulkPorts", bulkPorts, error));
+    EXPECT_EQ("", bulkPorts);
+
+    double rate = 0;
+    EXPECT_TRUE(file->get("connectRatePerIP", rate, error));
+    EXPECT_EQ(0.5, rate);
+
+    // a setting the file doesn't have keeps its value
+    int64_t lowat = 16384;
+    EXPECT_FALSE(file->has("tcpNotSentLowat"));
+    EXPECT_TRUE(file->get("tcpNotSentLowat", lowat, error));
+    EXPECT_EQ(16384, lowat);
+
+    EXPECT_EQ("", file->unknown({"tcpNoDelay", "tcpKeepAlive", "tcpCongestion", "qosBulkPorts",
+                                 "connectRatePerIP"}));
+    EXPECT_EQ("tcpNoDelay", file->unknown({"tcpKeepAlive", "tcpCongestion", "qosBulkPorts",
+                                           "connectRatePerIP"}));
+}
+
+TEST(ConfigFileTest, Malformed)
+{
+    std::string error;
+    EXPECT_TRUE(ConfigFile::build("tcpNoDelay\n", 11, error) == nullptr);
+    EXPECT_EQ("malformed line 1", error);
+
+    std::string text = "tcpKeepAlive = 30\n= 5\n";
+    EXPECT_TRUE(ConfigFile::build(text.data(), text.size(), error) == nullptr);
+    EXPECT_EQ("malformed line 2", error);
+
+    text = "tcp KeepAlive = 30\n";
+    EXPECT_TRUE(ConfigFile::build(text.data(), text.size(), error) == nullptr);
+
+    text = "tcpKeepAlive = 30\ntcpKeepAlive = 40\n";
+    EXPECT_TRUE(ConfigFile::build(text.data(), text.size(), error) == nullptr);
+    EXPECT_EQ("tcpKeepAlive is set twice on line 2", error);
+
+    auto file = buildFile("tcpNoDelay = maybe\ntcpKeepAlive = 30s\nrateLimit = 99999999999999999999\n"
+                          "connectRatePerIP = fast\n");
+    ASSERT_TRUE(file != nullptr);
+
+    bool noDelay = true;
+    EXPECT_FALSE(file->get("tcpNoDelay", noDelay, error));
+    EXPECT_EQ("tcpNoDelay expects true or false", error);
+    EXPECT_TRUE(noDelay);
+
+    int64_t value = 7;
+    EXPECT_FALSE(file->get("tcpKeepAlive", value, error));
+    EXPECT_EQ("tcpKeepAlive expects an integer", error);
+    EXPECT_FALSE(file->get("rateLimit", value, error));
+    EXPECT_EQ(7, value);
+
+    double rate = 2;
+    EXPECT_FALSE(file->get("connectRatePerIP", rate, error));
+    EXPECT_EQ("connectRatePerIP expects a number", error);
+    EXPECT_EQ(2, rate);
+
+    EXPECT_TRUE(ConfigFile::load("/nonexistent/socks5.conf", error) == nullptr);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,113 @@
+#include "connecthistory.hpp"
+
+#include <errno.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+TEST(ConnectHistoryTest, FailsFastAfterFailuresInARow)
+{
+    ConnectHistory::Options options;
+    options.failures = 3;
+    options.failWindow = 5000;
+    ConnectHistory history(options);
+
+    int err = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        history.onFailed("down.example:80", ECONNREFUSED, 1000);
+        EXPECT_FALSE(history.failing("down.example:80", 1000, err));
+    }
+
+    history.onFailed("down.example:80", EHOSTUNREACH, 1000);
+    EXPECT_TRUE(history.failing("down.example:80", 1000, err));
+    EXPECT_EQ(EHOSTUNREACH, err);
+    EXPECT_TRUE(history.failing("down.example:80", 5999, err));
+
+    // the other destinations aren't affected
+    EXPECT_FALSE(history.failing("down.example:443", 1000, err));
+
+    // after the window one connection goes through, its failure starts another
+    EXPECT_FALSE(history.failing("down.example:80", 6000, err));
+    history.onFailed("down.example:80", ETIMEDOUT, 7000);
+    EXPECT_TRUE(history.failing("down.example:80", 7000, err));
+    EXPECT_EQ(ETIMEDOUT, err);
+
+    // a connection made forgets the failures
+    history.onConnected("down.example:80", 10, 13000);
+    EXPECT_FALSE(history.failing("down.example:80", 13000, err));
+
+    auto stats = history.stats();
+    EXPECT_EQ(4u, stats.failed);
+    EXPECT_EQ(1u, stats.timeouts);
+    EXPECT_EQ(3u, stats.fastFailures);
+    EXPECT_EQ(1u, stats.connected);
+}
+
+TEST(ConnectHistoryTest, LocalErrorsDontCount)
+{
+    ConnectHistory::Options options;
+    options.failures = 1;
+    ConnectHistory history(options);
+
+    int err = 0;
+    history.onFailed("10.0.0.1:22", EMFILE, 0);
+    history.onFailed("10.0.0.1:22", EACCES, 0);
+    EXPECT_FALSE(history.failing("10.0.0.1:22", 0, err));
+}
+
+TEST(ConnectHistoryTest, TimeoutFollowsLatency)
+{
+    ConnectHistory::Options options;
+    options.minTimeout = 200;
+    options.maxTimeout = 10000;
+    ConnectHistory history(options);
+
+    // nothing is known yet
+    EXPECT_EQ(10000, history.timeout("far.example:443"));
+
+    // 100 and a deviation of 50 at first
+    history.onConnected("far.example:443", 100, 0);
+    EXPECT_EQ(300, history.timeout("far.example:443"));
+
+    // steady latencies shrink the deviation
+    for (int i = 0; i < 50; i++)
+    {
+        history.onConnected("far.example:443", 100, i);
+    }
+    EXPECT_EQ(200, history.timeout("far.example:443"));
+
+    // a jump widens it again
+    history.onConnected("far.example:443", 2000, 100);
+    EXPECT_GT(history.timeout("far.example:443"), 1000);
+
+    // a slow destination is capped
+    history.onConnected("slow.example:443", 8000, 0);
+    EXPECT_EQ(10000, history.timeout("slow.example:443"));
+}
+
+TEST(ConnectHistoryTest, TableIsBounded)
+{
+    ConnectHistory::Options options;
+    options.failures = 1;
+    options.maxEntries = 100;
+    ConnectHistory history(options);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        history.onFailed("host" + std::to_string(i) + ":80", ECONNREFUSED, i);
+        EXPECT_LE(history.size(), 100u);
+    }
+
+    // the destinations used the longest ago are dropped first
+    int err = 0;
+    EXPECT_TRUE(history.failing("host999:80", 999, err));
+    EXPECT_FALSE(history.failing("host0:80", 999, err));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,154 @@
+#include "coroutine.hpp"
+
+#include <stdint.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+/**
+   Reads two numbers and adds them, the numbers come one by one
+   from the test as the events of a loop would
+ **/
+class Adder
+{
+public:
+    Adder()
+        : input_(0),
+          ready_(false),
+          first_(0),
+          sum_(0)
+    {
+    }
+
+    void resume()
+    {
+        COROUTINE_BEGIN(coroutine_);
+
+        trace_ += "start ";
+        COROUTINE_AWAIT(coroutine_, take(first_));
+        trace_ += "first ";
+
+        COROUTINE_AWAIT(coroutine_, take(sum_));
+        sum_ += first_;
+        trace_ += "second";
+
+        COROUTINE_END(coroutine_);
+    }
+
+    void give(int number)
+    {
+        input_ = number;
+        ready_ = true;
+        resume();
+    }
+
+    bool take(int &number)
+    {
+        if (!ready_)
+        {
+            return false;
+        }
+
+        number = input_;
+        ready_ = false;
+        return true;
+    }
+
+    Coroutine    coroutine_;
+    int          input_;
+    bool         ready_;
+    int          first_;
+    int          sum_;
+    std::string  trace_;
+};
+
+TEST(CoroutineTest, AwaitAndResume)
+{
+    Adder adder;
+
+    adder.resume();
+    EXPECT_EQ("start ", adder.trace_);
+    EXPECT_FALSE(adder.coroutine_.done());
+
+    // resuming without an answer stays at the await
+    adder.resume();
+    EXPECT_EQ("start ", adder.trace_);
+
+    adder.give(2);
+    EXPECT_EQ("start first ", adder.trace_);
+    EXPECT_FALSE(adder.coroutine_.done());
+
+    adder.give(3);
+    EXPECT_EQ("start first second", adder.trace_);
+    EXPECT_EQ(5, adder.sum_);
+    EXPECT_TRUE(adder.coroutine_.done());
+
+    // a finished coroutine returns at once
+    adder.give(4);
+    EXPECT_EQ(5, adder.sum_);
+}
+
+TEST(CoroutineTest, ReadyAwaitsDontReturn)
+{
+    Adder adder;
+    adder.input_ = 1;
+    adder.ready_ = true;
+
+    adder.resume();
+    EXPECT_EQ("start first ", adder.trace_);
+
+    adder.give(1);
+    EXPECT_TRUE(adder.coroutine_.done());
+    EXPECT_EQ(2, adder.sum_);
+}
+
+TEST(FramePoolTest, ReusesBlocks)
+{
+    FramePool pool;
+
+    auto first = pool.allocate(100);
+    auto second = pool.allocate(100);
+    EXPECT_NE(first, second);
+    EXPECT_EQ(2u, pool.allocated());
+    EXPECT_EQ(0u, pool.free());
+
+    // the blocks are aligned for any object
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(first) % alignof(std::max_align_t));
+
+    FramePool::release(first);
+    EXPECT_EQ(1u, pool.allocated());
+    EXPECT_EQ(1u, pool.free());
+
+    EXPECT_EQ(first, pool.allocate(100));
+    EXPECT_EQ(0u, pool.free());
+
+    FramePool::release(first);
+    FramePool::release(second);
+    FramePool::release(nullptr);
+    EXPECT_EQ(0u, pool.allocated());
+    EXPECT_EQ(2u, pool.free());
+}
+
+TEST(FramePoolTest, BlocksGoBackToTheirPool)
+{
+    FramePool one;
+    FramePool other;
+
+    auto block = one.allocate(32);
+    auto otherBlock = other.allocate(64);
+    FramePool::release(block);
+
+    EXPECT_EQ(1u, one.free());
+    EXPECT_EQ(0u, other.free());
+    EXPECT_EQ(1u, other.allocated());
+
+    FramePool::release(otherBlock);
+    EXPECT_EQ(1u, other.free());
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
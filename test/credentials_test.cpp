@@ -0,0 +1,258 @@
+#include "credentials.hpp"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+// Few iterations, the tests needn't be slow
+static const int ITERATIONS = 10;
+
+static std::unique_ptr<CredentialTable> buildTable(const std::string &text)
+{
+    std::string error;
+    auto table = CredentialTable::build(text.data(), text.size(), error);
+    EXPECT_TRUE(table != nullptr) << error;
+
+    return table;
+}
+
+// A login message with the fields of username and password
+static Handshake::Login loginOf(const std::string &username, const std::string &password)
+{
+    Handshake::Login login;
+    login.username = {reinterpret_cast<const unsigned char *>(username.data()), username.size()};
+    login.password = {reinterpret_cast<const unsigned char *>(password.data()), password.size()};
+
+    return login;
+}
+
+/**
+   Check a login the way the server does, with the cache
+   first and PBKDF2 in the loop of base on a miss
+ **/
+static bool verify(event_base *base, CredentialStore &store,
+                   const std::string &username, const std::string &password)
+{
+    auto result = store.lookup(loginOf(username, password));
+    if (result != CredentialStore::Result::miss)
+    {
+        return result == CredentialStore::Result::allowed;
+    }
+
+    int answer = -1;
+    EXPECT_TRUE(store.check(username, password, [](bool allowed, void *arg) {
+                *static_cast<int *>(arg) = allowed ? 1 : 0;
+            }, &answer));
+
+    while (answer == -1)
+    {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+
+    return answer == 1;
+}
+
+TEST(CredentialsTest, Build)
+{
+    std::string text = "# users\n\n";
+    for (int i = 0; i < 100; i++)
+    {
+        auto user = "user" + std::to_string(i);
+        text += CredentialTable::makeEntry(user, "secret" + std::to_string(i), ITERATIONS) + "\n";
+    }
+
+    auto table = buildTable(text);
+    ASSERT_TRUE(table != nullptr);
+    EXPECT_EQ(100u, table->size());
+
+    for (int i = 0; i < 100; i++)
+    {
+        auto slot = table->find("user" + std::to_string(i));
+        ASSERT_TRUE(slot != nullptr);
+        EXPECT_EQ(static_cast<uint32_t>(ITERATIONS), slot->iterations);
+    }
+
+    EXPECT_TRUE(table->find("user100") == nullptr);
+    EXPECT_TRUE(table->find("") == nullptr);
+}
+
+TEST(CredentialsTest, Malformed)
+{
+    auto entry = CredentialTable::makeEntry("admin", "admin", ITERATIONS);
+    const char *lines[] = {
+        "admin",
+        "admin:md5:10:00:00",
+        "admin:pbkdf2-sha256:x:00:00",
+        ":pbkdf2-sha256:10:00:00",
+        "admin:pbkdf2-sha256:10:00:00",
+    };
+
+    for (auto line : lines)
+    {
+        std::string error;
+        std::string text(line);
+        EXPECT_TRUE(CredentialTable::build(text.data(), text.size(), error) == nullptr) << line;
+        EXPECT_FALSE(error.empty());
+    }
+
+    std::string error;
+    auto duplicate = entry + "\n" + entry;
+    EXPECT_TRUE(CredentialTable::build(duplicate.data(), duplicate.size(), error) == nullptr);
+}
+
+TEST(CredentialsTest, Verify)
+{
+    auto base = event_base_new();
+    {
+        CredentialStore store(base);
+        store.setTable(buildTable(CredentialTable::makeEntry("alice", "wonderland", ITERATIONS)));
+
+        EXPECT_TRUE(verify(base, store, "alice", "wonderland"));
+        EXPECT_FALSE(verify(base, store, "alice", "wonder"));
+        EXPECT_FALSE(verify(base, store, "bob", "wonderland"));
+        EXPECT_EQ(0u, store.stats().cacheHits);
+        EXPECT_EQ(2u, store.stats().failures);
+
+        // a login again hits the cache, a wrong password doesn't
+        EXPECT_TRUE(verify(base, store, "alice", "wonderland"));
+        EXPECT_EQ(1u, store.stats().cacheHits);
+        EXPECT_FALSE(verify(base, store, "alice", "land"));
+        EXPECT_EQ(1u, store.stats().cacheHits);
+    }
+    event_base_free(base);
+}
+
+TEST(CredentialsTest, TypicalIterations)
+{
+    auto table = buildTable(CredentialTable::makeEntry("alice", "a", ITERATIONS) + "\n" +
+                            CredentialTable::makeEntry("bob", "b", ITERATIONS) + "\n" +
+                            CredentialTable::makeEntry("carol", "c", 2 * ITERATIONS) + "\n");
+    ASSERT_TRUE(table != nullptr);
+    EXPECT_EQ(static_cast<uint32_t>(ITERATIONS), table->typicalIterations());
+
+    // the slower of a tie
+    table = buildTable(CredentialTable::makeEntry("alice", "a", ITERATIONS) + "\n" +
+                       CredentialTable::makeEntry("carol", "c", 2 * ITERATIONS) + "\n");
+    ASSERT_TRUE(table != nullptr);
+    EXPECT_EQ(static_cast<uint32_t>(2 * ITERATIONS), table->typicalIterations());
+}
+
+TEST(CredentialsTest, CheckInBackground)
+{
+    auto base = event_base_new();
+    {
+        CredentialStore store(base);
+        store.setTable(buildTable(CredentialTable::makeEntry("alice", "wonderland", ITERATIONS)));
+
+        std::vector<int> answers(3, -1);
+        auto callback = [](bool allowed, void *arg) {
+            *static_cast<int *>(arg) = allowed ? 1 : 0;
+        };
+
+        EXPECT_EQ(CredentialStore::Result::miss, store.lookup(loginOf("alice", "wonderland")));
+        EXPECT_TRUE(store.check("alice", "wonderland", callback, &answers[0]));
+        EXPECT_TRUE(store.check("alice", "wonder", callback, &answers[1]));
+        EXPECT_TRUE(store.check("bob", "wonderland", callback, &answers[2]));
+
+        // never before check() returns
+        EXPECT_EQ(std::vector<int>(3, -1), answers);
+
+        // a client gone doesn't hear the answer
+        store.cancel(&answers[1]);
+
+        while (store.stats().verified < 2)
+        {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+
+        EXPECT_EQ(1, answers[0]);
+        EXPECT_EQ(-1, answers[1]);
+        EXPECT_EQ(0, answers[2]);
+        EXPECT_EQ(CredentialStore::Result::allowed, store.lookup(loginOf("alice", "wonderland")));
+    }
+    event_base_free(base);
+}
+
+TEST(CredentialsTest, TooManyChecks)
+{
+    auto base = event_base_new();
+    {
+        CredentialStore store(base);
+        store.setTable(buildTable(CredentialTable::makeEntry("alice", "wonderland", ITERATIONS)));
+
+        int answers = 0;
+        auto callback = [](bool, void *arg) {
+            ++*static_cast<int *>(arg);
+        };
+
+        for (std::size_t i = 0; i < CredentialStore::MAX_PENDING; i++)
+        {
+            EXPECT_TRUE(store.check("alice", "guess" + std::to_string(i), callback, &answers));
+        }
+        EXPECT_FALSE(store.check("alice", "wonderland", callback, &answers));
+        EXPECT_EQ(1u, store.stats().overflows);
+
+        while (answers < static_cast<int>(CredentialStore::MAX_PENDING))
+        {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+        EXPECT_EQ(CredentialStore::MAX_PENDING, store.stats().failures);
+    }
+    event_base_free(base);
+}
+
+TEST(CredentialsTest, Reload)
+{
+    char path[] = "/tmp/credentials_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(-1, fd);
+
+    auto write = [&](const std::string &text) {
+        FILE *file = fopen(path, "w");
+        fputs(text.c_str(), file);
+        fclose(file);
+    };
+    write(CredentialTable::makeEntry("alice", "first", ITERATIONS) + "\n");
+
+    auto base = event_base_new();
+    {
+        CredentialStore store(base);
+        std::string error;
+        store.setTable(CredentialTable::load(path, error));
+        EXPECT_TRUE(verify(base, store, "alice", "first"));
+
+        write(CredentialTable::makeEntry("alice", "second", ITERATIONS) + "\n" +
+              CredentialTable::makeEntry("bob", "third", ITERATIONS) + "\n");
+        EXPECT_TRUE(store.reload(path));
+        event_base_loop(base, EVLOOP_ONCE);
+
+        EXPECT_EQ(1u, store.stats().reloads);
+        EXPECT_EQ(2u, store.size());
+        EXPECT_FALSE(verify(base, store, "alice", "first"));
+        EXPECT_TRUE(verify(base, store, "alice", "second"));
+        EXPECT_TRUE(verify(base, store, "bob", "third"));
+
+        // a broken file keeps the table
+        write("bob\n");
+        EXPECT_TRUE(store.reload(path));
+        event_base_loop(base, EVLOOP_ONCE);
+
+        EXPECT_EQ(1u, store.stats().reloads);
+        EXPECT_TRUE(verify(base, store, "bob", "third"));
+    }
+    event_base_free(base);
+
+    close(fd);
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
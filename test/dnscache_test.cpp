@@ -0,0 +1,229 @@
+#include "dnscache.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include <gtest/gtest.h>
+
+/**
+   A stub dns server on loopback, it answers "good.test" with 10.0.0.1,
+   "ttl0.test" with 10.0.0.2 and a zero TTL, everything else with NXDOMAIN
+ **/
+class DnsCacheTest : public testing::Test
+{
+protected:
+    DnsCacheTest()
+        : base_(event_base_new()),
+          dns_(nullptr),
+          port_(nullptr),
+          queries_(0)
+    {
+        auto fd = socket(AF_INET, SOCK_DGRAM, 0);
+        evutil_make_socket_nonblocking(fd);
+
+        sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin));
+
+        socklen_t len = sizeof(sin);
+        getsockname(fd, reinterpret_cast<sockaddr *>(&sin), &len);
+        port_ = evdns_add_server_port_with_base(base_, fd, 0, serverCallback, this);
+
+        dns_ = evdns_base_new(base_, 0);
+        auto nameserver = "127.0.0.1:" + std::to_string(ntohs(sin.sin_port));
+        evdns_base_nameserver_ip_add(dns_, nameserver.c_str());
+    }
+
+    ~DnsCacheTest()
+    {
+        evdns_base_free(dns_, 0);
+        evdns_close_server_port(port_);
+        event_base_free(base_);
+    }
+
+    static void serverCallback(evdns_server_request *request, void *arg)
+    {
+        auto test = static_cast<DnsCacheTest *>(arg);
+        test->queries_++;
+
+        auto question = request->questions[0];
+        std::string name(question->name);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        if (question->type == EVDNS_TYPE_A && name == "good.test")
+        {
+            uint32_t address = htonl(0x0a000001);
+            evdns_server_request_add_a_reply(request, question->name, 1, &address, 300);
+            evdns_server_request_respond(request, DNS_ERR_NONE);
+        }
+        else if (question->type == EVDNS_TYPE_A && name == "ttl0.test")
+        {
+            uint32_t address = htonl(0x0a000002);
+            evdns_server_request_add_a_reply(request, question->name, 1, &address, 0);
+            evdns_server_request_respond(request, DNS_ERR_NONE);
+        }
+        else
+        {
+            evdns_server_request_respond(request, DNS_ERR_NOTEXIST);
+        }
+    }
+
+    struct Answer
+    {
+        int          result;
+        std::string  host;
+        int          *remaining;
+        event_base   *base;
+    };
+
+    static void resolvedCallback(int result, const sockaddr *address,
+                                 socklen_t length, void *arg)
+    {
+        auto answer = static_cast<Answer *>(arg);
+        answer->result = result;
+
+        if (address != nullptr)
+        {
+            char host[INET_ADDRSTRLEN];
+            auto sin = reinterpret_cast<const sockaddr_in *>(address);
+            inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+            answer->host = host;
+        }
+
+        if (--*answer->remaining == 0)
+        {
+            event_base_loopbreak(answer->base);
+        }
+    }
+
+    // resolve the names concurrently and run the loop until all are answered
+    std::vector<Answer> resolveAll(DnsCache &cache, const std::vector<std::string> &names)
+    {
+        int remaining = names.size();
+        std::vector<Answer> answers(names.size(), Answer{-1, "", &remaining, base_});
+
+        for (std::size_t i = 0; i < names.size(); i++)
+        {
+            cache.resolve(names[i], AF_INET, resolvedCallback, &answers[i]);
+        }
+        event_base_dispatch(base_);
+
+        return answers;
+    }
+
+    event_base          *base_;
+    evdns_base          *dns_;
+    evdns_server_port   *port_;
+    int                 queries_;
+};
+
+TEST_F(DnsCacheTest, CoalesceConcurrentLookups)
+{
+    DnsCache cache(base_, dns_, DnsCache::Options());
+
+    auto answers = resolveAll(cache, {"good.test", "good.test", "GOOD.test"});
+    for (auto &answer : answers)
+    {
+        EXPECT_EQ(answer.result, DNS_ERR_NONE);
+        EXPECT_EQ(answer.host, "10.0.0.1");
+    }
+
+    EXPECT_EQ(queries_, 1);
+    EXPECT_EQ(cache.stats().coalesced, 2u);
+}
+
+TEST_F(DnsCacheTest, HitAfterAnswer)
+{
+    DnsCache cache(base_, dns_, DnsCache::Options());
+
+    sockaddr_storage address;
+    socklen_t length;
+    EXPECT_EQ(cache.lookup("good.test", AF_INET, &address, &length),
+              DnsCache::Result::miss);
+
+    resolveAll(cache, {"good.test"});
+
+    EXPECT_EQ(cache.lookup("good.test", AF_INET, &address, &length),
+              DnsCache::Result::hit);
+    EXPECT_EQ(length, sizeof(sockaddr_in));
+    EXPECT_EQ(queries_, 1);
+    EXPECT_EQ(cache.stats().hits, 1u);
+    EXPECT_EQ(cache.stats().misses, 1u);
+}
+
+TEST_F(DnsCacheTest, NegativeCaching)
+{
+    DnsCache cache(base_, dns_, DnsCache::Options());
+
+    auto answers = resolveAll(cache, {"missing.test"});
+    EXPECT_EQ(answers[0].result, DNS_ERR_NOTEXIST);
+
+    sockaddr_storage address;
+    socklen_t length;
+    EXPECT_EQ(cache.lookup("missing.test", AF_INET, &address, &length),
+              DnsCache::Result::negative);
+    EXPECT_EQ(queries_, 1);
+    EXPECT_EQ(cache.stats().negativeHits, 1u);
+}
+
+TEST_F(DnsCacheTest, TTLFloor)
+{
+    DnsCache::Options options;
+    options.minTTL = 60;
+    DnsCache cache(base_, dns_, options);
+
+    resolveAll(cache, {"ttl0.test"});
+
+    sockaddr_storage address;
+    socklen_t length;
+    EXPECT_EQ(cache.lookup("ttl0.test", AF_INET, &address, &length),
+              DnsCache::Result::hit);
+}
+
+TEST_F(DnsCacheTest, StaleWhileRevalidate)
+{
+    DnsCache::Options options;
+    options.minTTL = 1;
+    options.maxTTL = 1;
+    options.staleTTL = 60;
+    DnsCache cache(base_, dns_, options);
+
+    sockaddr_storage address;
+    socklen_t length;
+
+    resolveAll(cache, {"good.test"});
+    EXPECT_EQ(cache.lookup("good.test", AF_INET, &address, &length),
+              DnsCache::Result::hit);
+
+    sleep(2);
+
+    // expired but hot: served stale and refreshed in the background
+    EXPECT_EQ(cache.lookup("good.test", AF_INET, &address, &length),
+              DnsCache::Result::hit);
+    EXPECT_EQ(cache.stats().staleHits, 1u);
+
+    resolveAll(cache, {"good.test"});
+    EXPECT_EQ(queries_, 2);
+    EXPECT_EQ(cache.stats().coalesced, 1u);
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
@@ -0,0 +1,61 @@
+#include "endpoint.hpp"
+
+#include <gtest/gtest.h>
+
+TEST(EndpointTest, Parse)
+{
+    std::vector<ListenEndpoint> endpoints;
+    std::string error;
+
+    ASSERT_TRUE(ListenEndpoint::parseList(
+        "127.0.0.1:5050, [::1]:5050,*:6060,localhost:7070,unix:/run/socks5.sock,unix:@socks5",
+        endpoints, error)) << error;
+    ASSERT_EQ(6u, endpoints.size());
+
+    EXPECT_EQ(ListenEndpoint::Type::tcp, endpoints[0].type());
+    EXPECT_EQ("127.0.0.1", endpoints[0].host());
+    EXPECT_EQ("5050", endpoints[0].port());
+
+    EXPECT_EQ("::1", endpoints[1].host());
+    EXPECT_EQ("[::1]:5050", endpoints[1].toString());
+
+    EXPECT_EQ("", endpoints[2].host());
+    EXPECT_EQ("*:6060", endpoints[2].toString());
+
+    EXPECT_EQ("localhost", endpoints[3].host());
+
+    EXPECT_EQ(ListenEndpoint::Type::local, endpoints[4].type());
+    EXPECT_EQ("/run/socks5.sock", endpoints[4].path());
+    EXPECT_FALSE(endpoints[4].abstract());
+
+    EXPECT_EQ("@socks5", endpoints[5].path());
+    EXPECT_TRUE(endpoints[5].abstract());
+    EXPECT_EQ("unix:@socks5", endpoints[5].toString());
+}
+
+TEST(EndpointTest, Malformed)
+{
+    std::vector<ListenEndpoint> endpoints;
+    std::string error;
+
+    for (auto text : {"", "127.0.0.1", "127.0.0.1:0", "127.0.0.1:65536", "host:port",
+                      "::1:5050", "[::1]5050", "unix:", "unix:@", "1.2.3.4:80,,1.2.3.5:80",
+                      "1.2.3.4:80,1.2.3.4:80"})
+    {
+        error.clear();
+        EXPECT_FALSE(ListenEndpoint::parseList(text, endpoints, error)) << text;
+        EXPECT_FALSE(error.empty()) << text;
+    }
+    EXPECT_TRUE(endpoints.empty());
+
+    std::string path(ListenEndpoint::MAX_PATH, 'a');
+    EXPECT_TRUE(ListenEndpoint::parseList("unix:" + path, endpoints, error));
+    EXPECT_TRUE(ListenEndpoint::parseList("unix:@" + path, endpoints, error));
+    EXPECT_FALSE(ListenEndpoint::parseList("unix:" + path + "a", endpoints, error));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,176 @@
+#include "handshake.hpp"
+
+#include <stdlib.h>
+
+#include <new>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// Heap allocations of the test, counted while counting is set
+static bool counting = false;
+static std::size_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    if (counting)
+    {
+        allocations++;
+    }
+
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+using Bytes = std::vector<unsigned char>;
+
+TEST(HandshakeTest, Greeting)
+{
+    Handshake::Greeting greeting;
+    Bytes data = {0x05, 0x02, 0x00, 0x02};
+
+    EXPECT_EQ(Handshake::Result::done,
+              Handshake::parseGreeting(data.data(), data.size(), greeting));
+    EXPECT_TRUE(greeting.offers(0x00));
+    EXPECT_TRUE(greeting.offers(0x02));
+    EXPECT_FALSE(greeting.offers(0x01));
+
+    EXPECT_EQ(Handshake::Result::incomplete, Handshake::parseGreeting(data.data(), 1, greeting));
+    EXPECT_EQ(Handshake::Result::incomplete, Handshake::parseGreeting(data.data(), 3, greeting));
+
+    data.push_back(0x01);
+    EXPECT_EQ(Handshake::Result::invalid,
+              Handshake::parseGreeting(data.data(), data.size(), greeting));
+
+    data[0] = 0x04;
+    EXPECT_EQ(Handshake::Result::invalid, Handshake::parseGreeting(data.data(), 4, greeting));
+}
+
+TEST(HandshakeTest, Login)
+{
+    Handshake::Login login;
+    Bytes data = {0x01, 0x03, 'b', 'o', 'b', 0x02, 'p', 'w'};
+
+    EXPECT_EQ(Handshake::Result::done,
+              Handshake::parseLogin(data.data(), data.size(), login));
+    EXPECT_EQ("bob", std::string(login.username.data, login.username.data + login.username.length));
+    EXPECT_EQ("pw", std::string(login.password.data, login.password.data + login.password.length));
+
+    EXPECT_EQ(Handshake::Result::incomplete, Handshake::parseLogin(data.data(), 4, login));
+    EXPECT_EQ(Handshake::Result::incomplete, Handshake::parseLogin(data.data(), 7, login));
+
+    data[0] = 0x05;
+    EXPECT_EQ(Handshake::Result::invalid, Handshake::parseLogin(data.data(), data.size(), login));
+}
+
+TEST(HandshakeTest, Request)
+{
+    Handshake::Request request;
+
+    Bytes ipv4 = {0x05, 0x01, 0x00, 0x01, 10, 1, 2, 3, 0x01, 0xbb};
+    EXPECT_EQ(Handshake::Result::done,
+              Handshake::parseRequest(ipv4.data(), ipv4.size(), request));
+    EXPECT_EQ(0x01, request.command);
+    EXPECT_EQ(443, request.port);
+    EXPECT_STREQ("10.1.2.3", request.address().host().c_str());
+    EXPECT_EQ(443, request.address().port());
+    EXPECT_EQ(Handshake::Result::incomplete, Handshake::parseRequest(ipv4.data(), 9, request));
+
+    Bytes domain = {0x05, 0x03, 0x00, 0x03, 7, 'a', '.', 'b', '.', 'c', 'o', 'm', 0x00, 0x50};
+    EXPECT_EQ(Handshake::Result::done,
+              Handshake::parseRequest(domain.data(), domain.size(), request));
+    EXPECT_EQ(0x03, request.command);
+    EXPECT_EQ(Address::Type::domain, request.address().type());
+    EXPECT_EQ("a.b.com", request.address().host());
+    EXPECT_EQ(80, request.address().port());
+
+    Bytes ipv6(22, 0);
+    ipv6[0] = 0x05;
+    ipv6[1] = 0x01;
+    ipv6[3] = 0x04;
+    ipv6[19] = 1;
+    ipv6[21] = 22;
+    EXPECT_EQ(Handshake::Result::done,
+              Handshake::parseRequest(ipv6.data(), ipv6.size(), request));
+    EXPECT_STREQ("::1", request.address().host().c_str());
+    EXPECT_EQ(22, request.address().port());
+
+    ipv6.push_back(0);
+    EXPECT_EQ(Handshake::Result::invalid,
+              Handshake::parseRequest(ipv6.data(), ipv6.size(), request));
+
+    Bytes unknown = {0x05, 0x01, 0x00, 0x07, 0x00};
+    EXPECT_EQ(Handshake::Result::unsupported,
+              Handshake::parseRequest(unknown.data(), unknown.size(), request));
+}
+
+TEST(HandshakeTest, Reply)
+{
+    unsigned char reply[Handshake::MAX_REPLY];
+
+    auto length = Handshake::writeReply(0x00, Address::FromHostOrder("10.1.2.3", 8080), reply);
+    EXPECT_EQ(Bytes({0x05, 0x00, 0x00, 0x01, 10, 1, 2, 3, 0x1f, 0x90}),
+              Bytes(reply, reply + length));
+
+    length = Handshake::writeReply(0x00, Address::FromHostOrder("::1", 53), reply);
+    ASSERT_EQ(22u, length);
+    EXPECT_EQ(0x04, reply[3]);
+    EXPECT_EQ(1, reply[19]);
+    EXPECT_EQ(53, reply[21]);
+
+    length = Handshake::writeReply(0x05, Address(), reply);
+    EXPECT_EQ(Bytes({0x05, 0x05, 0x00, 0x01, 0, 0, 0, 0, 0, 0}),
+              Bytes(reply, reply + length));
+}
+
+// The parsers alone, session_test counts the handshake of the server up to its reply
+TEST(HandshakeTest, NoAllocation)
+{
+    Bytes greetingData = {0x05, 0x02, 0x00, 0x02};
+    Bytes loginData = {0x01, 0x05, 'a', 'l', 'i', 'c', 'e', 0x06, 's', 'e', 'c', 'r', 'e', 't'};
+    Bytes requestData = {0x05, 0x01, 0x00, 0x03, 18,
+                         'a', '-', 'l', 'o', 'n', 'g', '-', 'h', 'o', 's', 't',
+                         '.', 'e', 'x', 'a', 'm', 'p', 'l', 0x01, 0xbb};
+    auto bound = Address::FromHostOrder("2001:db8::1", 40000);
+
+    Handshake::Greeting greeting;
+    Handshake::Login login;
+    Handshake::Request request;
+    unsigned char reply[Handshake::MAX_REPLY];
+    std::size_t length = 0;
+
+    counting = true;
+    allocations = 0;
+
+    auto greeted = Handshake::parseGreeting(greetingData.data(), greetingData.size(), greeting);
+    auto offered = greeting.offers(0x02);
+    auto loggedIn = Handshake::parseLogin(loginData.data(), loginData.size(), login);
+    auto requested = Handshake::parseRequest(requestData.data(), requestData.size(), request);
+    length = Handshake::writeReply(0x00, bound, reply);
+
+    counting = false;
+
+    EXPECT_EQ(0u, allocations);
+    EXPECT_EQ(Handshake::Result::done, greeted);
+    EXPECT_TRUE(offered);
+    EXPECT_EQ(Handshake::Result::done, loggedIn);
+    EXPECT_EQ(Handshake::Result::done, requested);
+    EXPECT_EQ(18u, request.host.length);
+    EXPECT_EQ(22u, length);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
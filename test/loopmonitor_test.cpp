@@ -0,0 +1,71 @@
+#include "loopmonitor.hpp"
+
+#include <gtest/gtest.h>
+
+TEST(LoopMonitorTest, Histogram)
+{
+    LoopMonitor monitor(nullptr, LoopMonitor::Options());
+    auto histogram = monitor.lag();
+
+    EXPECT_EQ(0u, histogram.percentile(50));
+
+    for (int i = 0; i < 98; i++)
+    {
+        histogram.add(100);     // [64, 128)
+    }
+    histogram.add(0);
+    histogram.add(5000);        // [4096, 8192)
+
+    EXPECT_EQ(100u, histogram.samples);
+    EXPECT_EQ(5000u, histogram.max);
+    EXPECT_EQ(1u, histogram.counts[0]);
+    EXPECT_EQ(98u, histogram.counts[6]);
+    EXPECT_EQ(1u, histogram.counts[12]);
+
+    EXPECT_EQ(127u, histogram.percentile(50));
+    EXPECT_EQ(127u, histogram.percentile(99));
+    EXPECT_EQ(8191u, histogram.percentile(100));
+
+    // past the last bucket the largest sample is the bound
+    histogram.add(uint64_t(1) << 40);
+    EXPECT_EQ(1u, histogram.counts[LoopMonitor::BUCKETS - 1]);
+    EXPECT_EQ(uint64_t(1) << 40, histogram.percentile(100));
+}
+
+TEST(LoopMonitorTest, Callbacks)
+{
+    LoopMonitor::Options options;
+    options.slowCallback = 1000;
+    LoopMonitor monitor(nullptr, options);
+
+    monitor.record(LoopMonitor::Category::inConnRead, 10);
+    monitor.record(LoopMonitor::Category::inConnRead, 2500);
+    monitor.record(LoopMonitor::Category::accept, 999);
+
+    auto &read = monitor.callbacks(LoopMonitor::Category::inConnRead);
+    EXPECT_EQ(2u, read.calls);
+    EXPECT_EQ(2510u, read.micros);
+    EXPECT_EQ(1u, read.slow);
+    EXPECT_EQ(2500u, read.max);
+
+    auto &accept = monitor.callbacks(LoopMonitor::Category::accept);
+    EXPECT_EQ(1u, accept.calls);
+    EXPECT_EQ(0u, accept.slow);
+
+    {
+        LoopMonitor::Scope scope(&monitor, LoopMonitor::Category::event);
+        LoopMonitor::Scope ignored(nullptr, LoopMonitor::Category::event);
+    }
+    EXPECT_EQ(1u, monitor.callbacks(LoopMonitor::Category::event).calls);
+
+    // a report starts the counters again
+    monitor.report();
+    EXPECT_EQ(0u, monitor.callbacks(LoopMonitor::Category::inConnRead).calls);
+    EXPECT_EQ(0u, monitor.callbacks(LoopMonitor::Category::event).calls);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,400 @@
+#include "mux.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+static const std::string KEY = "12345678123456781234567812345678";
+static const std::string IV  = "0000000000000000";
+
+/**
+   A client and a server session over a bufferevent pair, the client
+   end may be driven by hand with headers sealed by the test
+ **/
+class MuxSessionTest : public testing::Test
+{
+protected:
+    MuxSessionTest()
+        : base_(event_base_new()),
+          cryptor_(KEY, IV),
+          server_(nullptr),
+          serverClosed_(false),
+          sequence_(0)
+    {
+        bufferevent_pair_new(base_, 0, pair_);
+
+        // the server end holds what comes until the session takes it
+        bufferevent_enable(pair_[1], EV_READ | EV_WRITE);
+    }
+
+    ~MuxSessionTest()
+    {
+        for (auto stream : accepted_)
+        {
+            bufferevent_free(stream);
+        }
+
+        // a server session owns its end, and is gone if it closed
+        if (server_ == nullptr)
+        {
+            bufferevent_free(pair_[1]);
+        }
+        else if (!serverClosed_)
+        {
+            server_->onClosed();
+        }
+
+        if (pair_[0] != nullptr)
+        {
+            bufferevent_free(pair_[0]);
+        }
+
+        // the bufferevents are finished by the loop
+        event_base_loop(base_, EVLOOP_NONBLOCK);
+        event_base_free(base_);
+    }
+
+    // Run the loop until done holds, at most a thousand rounds
+    bool runUntil(const std::function<bool ()> &done)
+    {
+        for (int i = 0; i < 1000 && !done(); i++)
+        {
+            event_base_loop(base_, EVLOOP_NONBLOCK);
+        }
+
+        return done();
+    }
+
+    // Take the connection with a server session once the opening is in
+    void startServer(std::size_t maxStreams = MuxSession::MAX_STREAMS)
+    {
+        bool incomplete;
+        ASSERT_TRUE(runUntil([this, &incomplete]() {
+                    return MuxSession::hasMagic(cryptor_, pair_[1], incomplete);
+                }));
+
+        server_ = new MuxSession(base_, pair_[1], cryptor_, [this](bufferevent *stream, uint32_t) {
+                accepted_.push_back(stream);
+                return true;
+            }, maxStreams);
+    }
+
+    // Drive the client end by hand, it sends the opening of nonce
+    void startRawClient(const unsigned char nonce[MuxSession::NONCE_BYTES])
+    {
+        unsigned char opening[sizeof(MuxSession::MAGIC) + MuxSession::NONCE_BYTES];
+        memcpy(opening, MuxSession::MAGIC, sizeof(MuxSession::MAGIC));
+        memcpy(opening + sizeof(MuxSession::MAGIC), nonce, MuxSession::NONCE_BYTES);
+        memcpy(&sequence_, nonce, 4);
+
+        unsigned char sealed[MuxSession::HEADER_BYTES];
+        ASSERT_TRUE(cryptor_.sealBlock(opening, sizeof(opening), sealed));
+        bufferevent_write(pair_[0], sealed, sizeof(sealed));
+        bufferevent_enable(pair_[0], EV_READ | EV_WRITE);
+    }
+
+    // Open stream 1 by hand, the server closing the connection closes it
+    void openRawStream()
+    {
+        writeRawHeader(MuxSession::FRAME_OPEN, 1, 0);
+        ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 1; }));
+
+        bufferevent_setcb(accepted_[0], nullptr, nullptr, [](bufferevent *, short what, void *arg) {
+                if (what & BEV_EVENT_EOF)
+                {
+                    *static_cast<bool *>(arg) = true;
+                }
+            }, &serverClosed_);
+        bufferevent_enable(accepted_[0], EV_READ);
+    }
+
+    // A stream is closed by flushing it before it's freed
+    static void closeStream(bufferevent *stream)
+    {
+        bufferevent_flush(stream, EV_WRITE, BEV_FINISHED);
+        bufferevent_free(stream);
+    }
+
+    // Seal a header as the client would, the sequence is the next one unless given
+    void writeRawHeader(unsigned char type, uint32_t id, uint32_t value)
+    {
+        writeRawHeader(type, id, value, sequence_++);
+    }
+
+    void writeRawHeader(unsigned char type, uint32_t id, uint32_t value, uint32_t sequence)
+    {
+        unsigned char header[13];
+        header[0] = type;
+
+        uint32_t idNetwork = htonl(id);
+        uint32_t valueNetwork = htonl(value);
+        uint32_t sequenceNetwork = htonl(sequence);
+        memcpy(header + 1, &idNetwork, 4);
+        memcpy(header + 5, &valueNetwork, 4);
+        memcpy(header + 9, &sequenceNetwork, 4);
+
+        unsigned char sealed[MuxSession::HEADER_BYTES];
+        ASSERT_TRUE(cryptor_.sealBlock(header, sizeof(header), sealed));
+        bufferevent_write(pair_[0], sealed, sizeof(sealed));
+    }
+
+    static std::string readAll(bufferevent *conn)
+    {
+        auto input = bufferevent_get_input(conn);
+        std::string data(evbuffer_get_length(input), '\0');
+        evbuffer_remove(input, &data[0], data.size());
+
+        return data;
+    }
+
+    event_base                 *base_;
+    Cryptor                    cryptor_;
+    bufferevent                *pair_[2];
+    MuxSession                 *server_;
+    bool                       serverClosed_;
+    uint32_t                   sequence_;
+    std::vector<bufferevent *> accepted_;
+};
+
+TEST_F(MuxSessionTest, OpeningIsSealed)
+{
+    MuxSession client(base_, pair_[0], cryptor_);
+    pair_[0] = nullptr;
+
+    auto input = bufferevent_get_input(pair_[1]);
+    ASSERT_TRUE(runUntil([input]() { return evbuffer_get_length(input) > 0; }));
+    ASSERT_EQ(static_cast<std::size_t>(MuxSession::HEADER_BYTES), evbuffer_get_length(input));
+
+    // nothing of the magic is on the wire
+    std::string wire(MuxSession::HEADER_BYTES, '\0');
+    evbuffer_copyout(input, &wire[0], wire.size());
+    EXPECT_EQ(std::string::npos, wire.find("SMUX"));
+
+    bool incomplete;
+    EXPECT_TRUE(MuxSession::hasMagic(cryptor_, pair_[1], incomplete));
+    EXPECT_FALSE(incomplete);
+
+    // nor does it open with another key
+    Cryptor other("abcdefghabcdefghabcdefghabcdefgh", IV);
+    EXPECT_FALSE(MuxSession::hasMagic(other, pair_[1], incomplete));
+
+    evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+TEST_F(MuxSessionTest, PlainConnectionsAreNotMultiplexed)
+{
+    bool incomplete;
+    bufferevent_write(pair_[0], "\x00\x00", 2);
+    ASSERT_TRUE(runUntil([this]() { return evbuffer_get_length(bufferevent_get_input(pair_[1])) > 0; }));
+    EXPECT_FALSE(MuxSession::hasMagic(cryptor_, pair_[1], incomplete));
+    EXPECT_TRUE(incomplete);
+
+    evbuffer_drain(bufferevent_get_input(pair_[1]), 2);
+
+    // the greeting of a plain client
+    const unsigned char greeting[] = {0x05, 0x01, 0x00};
+    ASSERT_TRUE(cryptor_.encryptTo(pair_[0], greeting, sizeof(greeting)));
+    ASSERT_TRUE(runUntil([this]() { return evbuffer_get_length(bufferevent_get_input(pair_[1])) > 0; }));
+    EXPECT_FALSE(MuxSession::hasMagic(cryptor_, pair_[1], incomplete));
+    EXPECT_FALSE(incomplete);
+
+    evbuffer_drain(bufferevent_get_input(pair_[1]), evbuffer_get_length(bufferevent_get_input(pair_[1])));
+}
+
+TEST_F(MuxSessionTest, StreamsBothWays)
+{
+    MuxSession client(base_, pair_[0], cryptor_);
+    pair_[0] = nullptr;
+    startServer();
+
+    auto first = client.openStream();
+    auto second = client.openStream();
+    ASSERT_NE(nullptr, first);
+    ASSERT_NE(nullptr, second);
+    bufferevent_enable(first, EV_READ | EV_WRITE);
+    bufferevent_enable(second, EV_READ | EV_WRITE);
+
+    bufferevent_write(first, "ping-1", 6);
+    bufferevent_write(second, "ping-2", 6);
+    ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 2; }));
+    for (auto stream : accepted_)
+    {
+        bufferevent_enable(stream, EV_READ | EV_WRITE);
+    }
+
+    std::string got[2];
+    ASSERT_TRUE(runUntil([&]() {
+                got[0] += readAll(accepted_[0]);
+                got[1] += readAll(accepted_[1]);
+                return got[0].size() == 6 && got[1].size() == 6;
+            }));
+    EXPECT_EQ("ping-1", got[0]);
+    EXPECT_EQ("ping-2", got[1]);
+    EXPECT_EQ(2u, server_->streams());
+
+    bufferevent_write(accepted_[1], "pong-2", 6);
+    std::string reply;
+    ASSERT_TRUE(runUntil([&]() {
+                reply += readAll(second);
+                return reply.size() == 6;
+            }));
+    EXPECT_EQ("pong-2", reply);
+
+    // the server frees the stream once the client closes it
+    closeStream(first);
+    EXPECT_TRUE(runUntil([this]() { return server_->streams() == 1; }));
+    EXPECT_EQ(1u, client.streams());
+
+    closeStream(second);
+    EXPECT_TRUE(runUntil([this]() { return server_->streams() == 0; }));
+}
+
+TEST_F(MuxSessionTest, FramesWithTheOpening)
+{
+    // the opening, an OPEN and data come in one read of the server
+    MuxSession client(base_, pair_[0], cryptor_);
+    pair_[0] = nullptr;
+
+    auto stream = client.openStream();
+    bufferevent_enable(stream, EV_READ | EV_WRITE);
+    bufferevent_write(stream, "early", 5);
+
+    auto input = bufferevent_get_input(pair_[1]);
+    auto whole = static_cast<std::size_t>(3 * MuxSession::HEADER_BYTES + 5);
+    ASSERT_TRUE(runUntil([input, whole]() { return evbuffer_get_length(input) == whole; }));
+
+    // nothing more comes from the client, the session takes what's there
+    startServer();
+    ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 1; }));
+    bufferevent_enable(accepted_[0], EV_READ);
+
+    std::string got;
+    ASSERT_TRUE(runUntil([&]() {
+                got += readAll(accepted_[0]);
+                return got.size() == 5;
+            }));
+    EXPECT_EQ("early", got);
+
+    closeStream(stream);
+}
+
+TEST_F(MuxSessionTest, CreditWindow)
+{
+    MuxSession client(base_, pair_[0], cryptor_);
+    pair_[0] = nullptr;
+    startServer();
+
+    auto stream = client.openStream();
+    bufferevent_enable(stream, EV_READ | EV_WRITE);
+
+    std::string data(MuxSession::WINDOW + 100 * 1024, 'x');
+    for (std::size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = static_cast<char>('a' + i % 26);
+    }
+    bufferevent_write(stream, data.data(), data.size());
+
+    ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 1; }));
+    auto accepted = accepted_[0];
+
+    // the server holds no more than the window while nobody reads
+    bufferevent_enable(accepted, EV_READ);
+    runUntil([]() { return false; });
+    EXPECT_EQ(MuxSession::WINDOW, evbuffer_get_length(bufferevent_get_input(accepted)));
+
+    // the credit comes back as the data is taken
+    std::string got;
+    ASSERT_TRUE(runUntil([&]() {
+                got += readAll(accepted);
+                return got.size() == data.size();
+            }));
+    EXPECT_TRUE(got == data);
+
+    closeStream(stream);
+}
+
+TEST_F(MuxSessionTest, StreamsPastTheCapAreClosed)
+{
+    MuxSession client(base_, pair_[0], cryptor_);
+    pair_[0] = nullptr;
+    startServer(2);
+
+    std::vector<bufferevent *> streams;
+    for (int i = 0; i < 3; i++)
+    {
+        streams.push_back(client.openStream());
+        bufferevent_enable(streams.back(), EV_READ | EV_WRITE);
+    }
+
+    // the third stream is closed by the server
+    bool closed = false;
+    bufferevent_setcb(streams[2], nullptr, nullptr, [](bufferevent *, short what, void *arg) {
+            if (what & BEV_EVENT_EOF)
+            {
+                *static_cast<bool *>(arg) = true;
+            }
+        }, &closed);
+
+    EXPECT_TRUE(runUntil([&closed]() { return closed; }));
+    EXPECT_EQ(2u, accepted_.size());
+    EXPECT_EQ(2u, server_->streams());
+    EXPECT_EQ(2u, client.streams());
+
+    for (auto stream : streams)
+    {
+        closeStream(stream);
+    }
+}
+
+TEST_F(MuxSessionTest, TooMuchCreditClosesTheConnection)
+{
+    const unsigned char nonce[MuxSession::NONCE_BYTES] = {1, 2, 3, 4, 5, 6, 7, 8};
+    startRawClient(nonce);
+    startServer();
+    openRawStream();
+
+    // the stream holds a whole window already
+    writeRawHeader(MuxSession::FRAME_WINDOW, 1, 1);
+    EXPECT_TRUE(runUntil([this]() { return serverClosed_; }));
+}
+
+TEST_F(MuxSessionTest, ReplayedHeaderClosesTheConnection)
+{
+    const unsigned char nonce[MuxSession::NONCE_BYTES] = {8, 7, 6, 5, 4, 3, 2, 1};
+    startRawClient(nonce);
+    startServer();
+    openRawStream();
+
+    writeRawHeader(MuxSession::FRAME_OPEN, 3, 0, sequence_ - 1);
+    EXPECT_TRUE(runUntil([this]() { return serverClosed_; }));
+    EXPECT_EQ(1u, accepted_.size());
+}
+
+TEST_F(MuxSessionTest, ForgedHeaderClosesTheConnection)
+{
+    const unsigned char nonce[MuxSession::NONCE_BYTES] = {0};
+    startRawClient(nonce);
+    startServer();
+    openRawStream();
+
+    unsigned char garbage[MuxSession::HEADER_BYTES];
+    memset(garbage, 0x5a, sizeof(garbage));
+    bufferevent_write(pair_[0], garbage, sizeof(garbage));
+
+    EXPECT_TRUE(runUntil([this]() { return serverClosed_; }));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
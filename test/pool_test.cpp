@@ -0,0 +1,127 @@
+#include "pool.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <gtest/gtest.h>
+
+/**
+   A proxy server that accepts the connections of the pool
+   and keeps their sockets for the test
+ **/
+class ConnectionPoolTest : public testing::Test
+{
+protected:
+    ConnectionPoolTest()
+        : base_(std::make_shared<ServerBase>(std::vector<ListenEndpoint>(),
+                                             nullptr, nullptr, nullptr))
+    {
+        sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        listener_ = evconnlistener_new_bind(base_->base(), acceptCallback, this,
+                                            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+                                            reinterpret_cast<sockaddr *>(&sin), sizeof(sin));
+
+        socklen_t length = sizeof(sin);
+        getsockname(evconnlistener_get_fd(listener_), reinterpret_cast<sockaddr *>(&sin), &length);
+        address_ = Address::FromHostOrder("127.0.0.1", ntohs(sin.sin_port));
+    }
+
+    ~ConnectionPoolTest()
+    {
+        for (auto fd : accepted_)
+        {
+            close(fd);
+        }
+
+        evconnlistener_free(listener_);
+    }
+
+    static void acceptCallback(evconnlistener *, evutil_socket_t fd, sockaddr *, int, void *arg)
+    {
+        auto test = static_cast<ConnectionPoolTest *>(arg);
+        test->accepted_.push_back(fd);
+    }
+
+    // Run the loop until done holds, at most a few seconds
+    bool runUntil(const std::function<bool ()> &done)
+    {
+        struct timeval limit = {5, 0};
+        auto timer = evtimer_new(base_->base(), [](evutil_socket_t, short, void *arg) {
+                event_base_loopbreak(static_cast<event_base *>(arg));
+            }, base_->base());
+        evtimer_add(timer, &limit);
+
+        while (!done() && event_base_got_break(base_->base()) == 0)
+        {
+            event_base_loop(base_->base(), EVLOOP_ONCE);
+        }
+
+        event_free(timer);
+        return done();
+    }
+
+    std::shared_ptr<ServerBase>  base_;
+    evconnlistener               *listener_;
+    Address                      address_;
+    std::vector<int>             accepted_;
+};
+
+TEST_F(ConnectionPoolTest, FillsAndRefills)
+{
+    ConnectionPool pool(base_, address_, 2, 60);
+    ASSERT_TRUE(runUntil([&pool]() { return pool.idle() == 2; }));
+
+    auto conn = pool.take();
+    ASSERT_NE(nullptr, conn);
+    EXPECT_EQ(1u, pool.idle());
+
+    // the pool is topped up from the loop
+    EXPECT_TRUE(runUntil([&pool]() { return pool.idle() == 2; }));
+    EXPECT_TRUE(runUntil([this]() { return accepted_.size() == 3; }));
+
+    bufferevent_free(conn);
+}
+
+TEST_F(ConnectionPoolTest, EvictsClosedConnections)
+{
+    ConnectionPool pool(base_, address_, 1, 60);
+    ASSERT_TRUE(runUntil([&pool]() { return pool.idle() == 1; }));
+    ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 1; }));
+
+    close(accepted_.back());
+    accepted_.pop_back();
+
+    // the dead connection leaves the pool before anyone takes it
+    EXPECT_TRUE(runUntil([&pool]() { return pool.idle() == 0; }));
+}
+
+TEST_F(ConnectionPoolTest, EvictsConnectionsWithData)
+{
+    ConnectionPool pool(base_, address_, 1, 60);
+    ASSERT_TRUE(runUntil([&pool]() { return pool.idle() == 1; }));
+    ASSERT_TRUE(runUntil([this]() { return accepted_.size() == 1; }));
+
+    // a server out of step with the client
+    ASSERT_EQ(5, write(accepted_.back(), "hello", 5));
+
+    EXPECT_TRUE(runUntil([&pool]() { return pool.idle() == 0; }));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
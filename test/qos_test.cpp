@@ -0,0 +1,67 @@
+#include "qos.hpp"
+
+#include <gtest/gtest.h>
+
+TEST(QosTest, Ports)
+{
+    QosOptions options;
+    EXPECT_TRUE(options.setInteractivePorts("22,53,5900-5902"));
+    EXPECT_TRUE(options.setBulkPorts("873"));
+
+    EXPECT_EQ(Priority::interactive, options.classify(22));
+    EXPECT_EQ(Priority::interactive, options.classify(5901));
+    EXPECT_EQ(Priority::bulk, options.classify(873));
+    EXPECT_EQ(Priority::normal, options.classify(80));
+    EXPECT_EQ(Priority::normal, options.classify(5903));
+
+    EXPECT_TRUE(options.pinned(53));
+    EXPECT_FALSE(options.pinned(443));
+}
+
+TEST(QosTest, InvalidPorts)
+{
+    QosOptions options;
+    EXPECT_TRUE(options.setInteractivePorts("22"));
+
+    EXPECT_FALSE(options.setInteractivePorts("22,"));
+    EXPECT_FALSE(options.setInteractivePorts("0"));
+    EXPECT_FALSE(options.setInteractivePorts("65536"));
+    EXPECT_FALSE(options.setInteractivePorts("30-20"));
+    EXPECT_FALSE(options.setInteractivePorts("ssh"));
+
+    // a malformed list leaves the rules as they were
+    EXPECT_EQ(Priority::interactive, options.classify(22));
+
+    EXPECT_TRUE(options.setInteractivePorts(""));
+    EXPECT_EQ(Priority::normal, options.classify(22));
+}
+
+TEST(QosTest, Meter)
+{
+    const std::size_t rate = 100 * 1000;
+    FlowMeter meter;
+
+    // small request and response
+    EXPECT_EQ(Priority::normal, meter.onTransfer(500, 0, rate));
+    EXPECT_EQ(Priority::normal, meter.onTransfer(20 * 1000, 500, rate));
+    EXPECT_EQ(Priority::normal, meter.onTransfer(500, 1000, rate));
+
+    // a download turns bulk before the interval ends
+    EXPECT_EQ(Priority::normal, meter.onTransfer(60 * 1000, 1200, rate));
+    EXPECT_EQ(Priority::bulk, meter.onTransfer(60 * 1000, 1400, rate));
+    EXPECT_EQ(Priority::bulk, meter.onTransfer(60 * 1000, 2000, rate));
+
+    // slows down a bit, still bulk
+    EXPECT_EQ(Priority::bulk, meter.onTransfer(50 * 1000, 3000, rate));
+
+    // idle for a while
+    EXPECT_EQ(Priority::normal, meter.onTransfer(500, 10000, rate));
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}
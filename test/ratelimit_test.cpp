@@ -0,0 +1,193 @@
+#include "ratelimit.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+/**
+   Tunnels of socket pairs, the outgoing end of a tunnel
+   writes to the peer its test keeps
+ **/
+class RateLimiterTest : public testing::Test
+{
+protected:
+    struct Tunnel
+    {
+        bufferevent  *inConn;
+        bufferevent  *outConn;
+        int          peer;      // the remote host of outConn
+    };
+
+    RateLimiterTest()
+        : base_(event_base_new())
+    {
+    }
+
+    ~RateLimiterTest()
+    {
+        for (auto &tunnel : tunnels_)
+        {
+            bufferevent_free(tunnel.inConn);
+            bufferevent_free(tunnel.outConn);
+            close(tunnel.peer);
+        }
+
+        event_base_free(base_);
+    }
+
+    Tunnel newTunnel()
+    {
+        int in[2], out[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, in));
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, out));
+        close(in[1]);
+
+        Tunnel tunnel;
+        tunnel.inConn = bufferevent_socket_new(base_, in[0], BEV_OPT_CLOSE_ON_FREE);
+        tunnel.outConn = bufferevent_socket_new(base_, out[0], BEV_OPT_CLOSE_ON_FREE);
+        tunnel.peer = out[1];
+        bufferevent_enable(tunnel.outConn, EV_WRITE);
+
+        tunnels_.push_back(tunnel);
+        return tunnel;
+    }
+
+    // Write size bytes to the remote host of tunnel and wait until they're sent
+    void send(const Tunnel &tunnel, std::size_t size)
+    {
+        std::vector<char> data(size, 'x');
+        bufferevent_write(tunnel.outConn, data.data(), data.size());
+
+        while (evbuffer_get_length(bufferevent_get_output(tunnel.outConn)) > 0)
+        {
+            event_base_loop(base_, EVLOOP_ONCE);
+        }
+    }
+
+    event_base           *base_;
+    std::vector<Tunnel>  tunnels_;
+};
+
+TEST_F(RateLimiterTest, LimitsBothConnections)
+{
+    RateLimiter::Options options;
+    options.tunnel.rate = 1000;
+    RateLimiter limiter(base_, options);
+
+    auto tunnel = newTunnel();
+    limiter.limitTunnel(tunnel.inConn, tunnel.outConn, "");
+
+    // the buckets start with one tick of the rate
+    EXPECT_EQ(100, bufferevent_get_read_limit(tunnel.inConn));
+    EXPECT_EQ(100, bufferevent_get_write_limit(tunnel.inConn));
+    EXPECT_EQ(100, bufferevent_get_read_limit(tunnel.outConn));
+    EXPECT_EQ(100, bufferevent_get_write_limit(tunnel.outConn));
+
+    // a client who didn't authenticate has no group
+    EXPECT_EQ(0u, limiter.users());
+}
+
+TEST_F(RateLimiterTest, NewLimitsOnReload)
+{
+    RateLimiter::Options options;
+    options.tunnel.rate = 1000;
+    options.user.rate = 5000;
+    RateLimiter limiter(base_, options);
+
+    auto before = newTunnel();
+    limiter.limitTunnel(before.inConn, before.outConn, "alice");
+
+    options.tunnel.rate = 2000;
+    options.user.rate = 0;
+    limiter.setOptions(options);
+
+    // an open tunnel keeps its bucket, a new one gets the new limit
+    auto after = newTunnel();
+    limiter.limitTunnel(after.inConn, after.outConn, "alice");
+    EXPECT_EQ(100, bufferevent_get_read_limit(before.outConn));
+    EXPECT_EQ(200, bufferevent_get_read_limit(after.inConn));
+    EXPECT_EQ(200, bufferevent_get_read_limit(after.outConn));
+
+    // the group of the user still counts without a limit
+    EXPECT_EQ(1u, limiter.users());
+    send(after, 100);
+    EXPECT_EQ(100u, limiter.takeUsage()["alice"].sent);
+
+    limiter.release(before.outConn, "alice");
+    limiter.release(after.outConn, "alice");
+}
+
+TEST_F(RateLimiterTest, GroupIsFreedWithTheLastTunnel)
+{
+    RateLimiter limiter(base_, RateLimiter::Options());
+
+    auto first = newTunnel();
+    auto second = newTunnel();
+    auto other = newTunnel();
+    limiter.limitTunnel(first.inConn, first.outConn, "alice");
+    limiter.limitTunnel(second.inConn, second.outConn, "alice");
+    limiter.limitTunnel(other.inConn, other.outConn, "bob");
+    EXPECT_EQ(2u, limiter.users());
+
+    limiter.release(first.outConn, "alice");
+    EXPECT_EQ(2u, limiter.users());
+
+    limiter.release(second.outConn, "alice");
+    EXPECT_EQ(1u, limiter.users());
+
+    limiter.release(other.outConn, "bob");
+    EXPECT_EQ(0u, limiter.users());
+}
+
+TEST_F(RateLimiterTest, UsageOutlivesTheGroup)
+{
+    RateLimiter limiter(base_, RateLimiter::Options());
+
+    auto first = newTunnel();
+    auto second = newTunnel();
+    limiter.limitTunnel(first.inConn, first.outConn, "alice");
+    limiter.limitTunnel(second.inConn, second.outConn, "alice");
+
+    send(first, 100);
+    limiter.release(first.outConn, "alice");
+    send(second, 50);
+    limiter.release(second.outConn, "alice");
+    ASSERT_EQ(0u, limiter.users());
+
+    auto usage = limiter.takeUsage();
+    ASSERT_EQ(1u, usage.count("alice"));
+    EXPECT_EQ(150u, usage["alice"].sent);
+    EXPECT_EQ(0u, usage["alice"].received);
+
+    // each byte is reported once
+    EXPECT_TRUE(limiter.takeUsage().empty());
+}
+
+TEST_F(RateLimiterTest, UsageIsSinceTheLastCall)
+{
+    RateLimiter limiter(base_, RateLimiter::Options());
+
+    auto tunnel = newTunnel();
+    limiter.limitTunnel(tunnel.inConn, tunnel.outConn, "alice");
+
+    send(tunnel, 100);
+    EXPECT_EQ(100u, limiter.takeUsage()["alice"].sent);
+
+    send(tunnel, 30);
+    EXPECT_EQ(30u, limiter.takeUsage()["alice"].sent);
+
+    limiter.release(tunnel.outConn, "alice");
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,161 @@
+#include "cipher.hpp"
+#include "relay.hpp"
+
+#include <string>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+static const std::string KEY = "12345678123456781234567812345678";
+static const std::string IV  = "0000000000000000";
+
+class RelayTest : public testing::Test
+{
+protected:
+    RelayTest()
+        : base_(event_base_new()),
+          in_(bufferevent_socket_new(base_, -1, 0)),
+          out_(bufferevent_socket_new(base_, -1, 0))
+    {
+        // without a socket the test plays it, adding to the inputs and taking the outputs
+        for (auto conn : {in_, out_})
+        {
+            evbuffer_unfreeze(bufferevent_get_input(conn), 0);
+            evbuffer_unfreeze(bufferevent_get_output(conn), 1);
+        }
+    }
+
+    ~RelayTest()
+    {
+        bufferevent_free(in_);
+        bufferevent_free(out_);
+        event_base_free(base_);
+    }
+
+    void append(bufferevent *conn, const std::string &data)
+    {
+        evbuffer_add(bufferevent_get_input(conn), data.data(), data.size());
+    }
+
+    // move the output of from to the input of to, as the peer reads it
+    void deliver(bufferevent *from, bufferevent *to)
+    {
+        evbuffer_add_buffer(bufferevent_get_input(to), bufferevent_get_output(from));
+    }
+
+    std::string output(bufferevent *conn)
+    {
+        auto buffer = bufferevent_get_output(conn);
+        std::string data(evbuffer_get_length(buffer), '\0');
+        evbuffer_remove(buffer, &data[0], data.size());
+
+        return data;
+    }
+
+    event_base   *base_;
+    bufferevent  *in_;
+    bufferevent  *out_;
+};
+
+TEST_F(RelayTest, SealedFramesOpenWithCryptor)
+{
+    CbcCipher cipher(reinterpret_cast<const unsigned char *>(KEY.data()),
+                     reinterpret_cast<const unsigned char *>(IV.data()));
+    RawFrames framing;
+    NoInstrument none;
+    FrameRelay<CbcCipher, RawFrames, NoInstrument> relay(cipher, framing, none);
+
+    append(in_, "Hello, World!");
+    ASSERT_TRUE(relay.seal(in_, out_, nullptr));
+    EXPECT_EQ(0u, evbuffer_get_length(bufferevent_get_input(in_)));
+
+    append(in_, std::string(5000, 'x'));
+    ASSERT_TRUE(relay.seal(in_, out_, nullptr));
+
+    // the frames of the relay are the frames of the cryptor
+    Cryptor cryptor(KEY, IV);
+    deliver(out_, in_);
+    ASSERT_TRUE(cryptor.decryptTransfer(in_, out_));
+    EXPECT_EQ("Hello, World!" + std::string(5000, 'x'), output(out_));
+}
+
+TEST_F(RelayTest, OpenFramesOfCryptor)
+{
+    Cryptor cryptor(KEY, IV);
+    append(in_, "first");
+    ASSERT_TRUE(cryptor.encryptTransfer(in_, out_));
+    append(in_, "second");
+    ASSERT_TRUE(cryptor.encryptTransfer(in_, out_));
+
+    auto frames = output(out_);
+
+    CbcCipher cipher(reinterpret_cast<const unsigned char *>(KEY.data()),
+                     reinterpret_cast<const unsigned char *>(IV.data()));
+    RawFrames framing;
+    FrameTimer timer;
+    FrameRelay<CbcCipher, RawFrames, FrameTimer> relay(cipher, framing, timer);
+
+    // a partial frame waits for the rest
+    append(in_, frames.substr(0, frames.size() - 1));
+    ASSERT_TRUE(relay.open(in_, out_));
+    EXPECT_EQ("first", output(out_));
+
+    append(in_, frames.substr(frames.size() - 1));
+    ASSERT_TRUE(relay.open(in_, out_));
+    EXPECT_EQ("second", output(out_));
+    EXPECT_EQ(0u, evbuffer_get_length(bufferevent_get_input(in_)));
+
+    auto totals = FrameTimer::takeTotals();
+    EXPECT_EQ(2u, totals.frames);
+    EXPECT_EQ(frames.size(), totals.bytes);
+    EXPECT_EQ(0u, FrameTimer::takeTotals().frames);
+}
+
+TEST_F(RelayTest, CompressedRoundTrip)
+{
+    FrameCompressor sender((FrameCompressor::Options()));
+    FrameCompressor receiver((FrameCompressor::Options()));
+    CompressedFrames sending(sender);
+    CompressedFrames receiving(receiver);
+    NullCipher cipher;
+    NoInstrument none;
+
+    std::string text;
+    for (int i = 0; i < 200; i++)
+    {
+        text += "GET /index.html HTTP/1.1\r\n";
+    }
+
+    append(in_, text);
+    ASSERT_TRUE((FrameRelay<NullCipher, CompressedFrames, NoInstrument>(cipher, sending, none)
+                 .seal(in_, out_, nullptr)));
+    EXPECT_LT(evbuffer_get_length(bufferevent_get_output(out_)), text.size());
+
+    deliver(out_, in_);
+    ASSERT_TRUE((FrameRelay<NullCipher, CompressedFrames, NoInstrument>(cipher, receiving, none)
+                 .open(in_, out_)));
+    EXPECT_EQ(text, output(out_));
+}
+
+TEST_F(RelayTest, CorruptFrame)
+{
+    CbcCipher cipher(reinterpret_cast<const unsigned char *>(KEY.data()),
+                     reinterpret_cast<const unsigned char *>(IV.data()));
+    RawFrames framing;
+    NoInstrument none;
+    FrameRelay<CbcCipher, RawFrames, NoInstrument> relay(cipher, framing, none);
+
+    // the padding of a block of garbage doesn't check out
+    append(in_, std::string("\x00\x00\x00\x10", 4) + std::string(16, 'g'));
+    EXPECT_FALSE(relay.open(in_, out_));
+    EXPECT_EQ(0u, evbuffer_get_length(bufferevent_get_output(out_)));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
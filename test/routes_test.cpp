@@ -0,0 +1,128 @@
+#include "routes.hpp"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+static std::unique_ptr<Acl> buildTable(const std::string &text)
+{
+    std::string error;
+    auto table = Routes::build(text.data(), text.size(), error);
+    EXPECT_TRUE(table != nullptr) << error;
+
+    return table;
+}
+
+TEST(RoutesTest, Route)
+{
+    auto base = event_base_new();
+    {
+        Routes routes(base);
+        EXPECT_EQ(Routes::Route::tunnel,
+                  routes.route(Address::FromHostOrder("192.168.1.1", 80)));
+
+        routes.setTable(buildTable("direct 192.168.0.0/16\n"
+                                   "direct cn\n"
+                                   "tunnel google.cn\n"
+                                   "direct * 53\n"));
+        // "*" is a rule of the addresses and one of the domains
+        EXPECT_EQ(5u, routes.size());
+
+        EXPECT_EQ(Routes::Route::direct,
+                  routes.route(Address::FromHostOrder("192.168.1.1", 80)));
+        EXPECT_EQ(Routes::Route::tunnel,
+                  routes.route(Address::FromHostOrder("10.0.0.1", 80)));
+        EXPECT_EQ(Routes::Route::direct,
+                  routes.route(Address::FromHostOrder("10.0.0.1", 53)));
+        EXPECT_EQ(Routes::Route::direct,
+                  routes.route(Address::FromHostOrder("www.baidu.cn", 443)));
+        EXPECT_EQ(Routes::Route::tunnel,
+                  routes.route(Address::FromHostOrder("www.google.cn", 443)));
+        EXPECT_EQ(Routes::Route::tunnel,
+                  routes.route(Address::FromHostOrder("example.com", 443)));
+        EXPECT_EQ(0u, routes.stats().cacheHits);
+
+        // domains are answered from the cache the next time
+        EXPECT_EQ(Routes::Route::direct,
+                  routes.route(Address::FromHostOrder("www.baidu.cn", 443)));
+        EXPECT_EQ(Routes::Route::tunnel,
+                  routes.route(Address::FromHostOrder("www.google.cn", 443)));
+        EXPECT_EQ(2u, routes.stats().cacheHits);
+        EXPECT_EQ(9u, routes.stats().lookups);
+        EXPECT_EQ(4u, routes.stats().direct);
+    }
+    event_base_free(base);
+}
+
+TEST(RoutesTest, Malformed)
+{
+    const char *lines[] = {
+        "allow 10.0.0.0/8",
+        "deny example.com",
+        "direct",
+        "tunnel 10.0.0.0/33",
+    };
+
+    for (auto line : lines)
+    {
+        std::string error;
+        std::string text(line);
+        EXPECT_TRUE(Routes::build(text.data(), text.size(), error) == nullptr) << line;
+        EXPECT_FALSE(error.empty());
+    }
+}
+
+TEST(RoutesTest, Reload)
+{
+    char path[] = "/tmp/routes_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_NE(-1, fd);
+
+    auto write = [&](const std::string &text) {
+        FILE *file = fopen(path, "w");
+        fputs(text.c_str(), file);
+        fclose(file);
+    };
+    write("direct example.com\n");
+
+    auto base = event_base_new();
+    {
+        Routes routes(base);
+        std::string error;
+        routes.setTable(Routes::load(path, error));
+
+        auto address = Address::FromHostOrder("www.example.com", 80);
+        EXPECT_EQ(Routes::Route::direct, routes.route(address));
+
+        // the cached answer goes with the table
+        write("tunnel example.com\ndirect 10.0.0.0/8\n");
+        EXPECT_TRUE(routes.reload(path));
+        event_base_loop(base, EVLOOP_ONCE);
+
+        EXPECT_EQ(1u, routes.stats().reloads);
+        EXPECT_EQ(2u, routes.size());
+        EXPECT_EQ(Routes::Route::tunnel, routes.route(address));
+
+        // a broken file keeps the table
+        write("direct\n");
+        EXPECT_TRUE(routes.reload(path));
+        event_base_loop(base, EVLOOP_ONCE);
+
+        EXPECT_EQ(1u, routes.stats().reloads);
+        EXPECT_EQ(Routes::Route::direct,
+                  routes.route(Address::FromHostOrder("10.1.2.3", 80)));
+    }
+    event_base_free(base);
+
+    close(fd);
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
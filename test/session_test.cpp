@@ -0,0 +1,294 @@
+#include "auth.hpp"
+#include "tunnel.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+/**
+   Allocations of the test with operator new, counted while counting
+   is set. libevent's own buffers come from malloc() and aren't counted
+ **/
+static bool counting = false;
+static std::size_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    if (counting)
+    {
+        allocations++;
+    }
+
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+static const std::string KEY = "12345678901234567890123456789012";
+
+// Past the inline buffer of std::string, a copy of them allocates
+static const std::string LONG_USER = "a-user-whose-name-is-long";
+static const std::string LONG_PASSWORD = "a-password-that-is-long-too";
+
+// The username/password message of a login
+static std::vector<unsigned char> loginMessage(const std::string &username,
+                                               const std::string &password)
+{
+    std::vector<unsigned char> message = {0x01, static_cast<unsigned char>(username.size())};
+    message.insert(message.end(), username.begin(), username.end());
+    message.push_back(static_cast<unsigned char>(password.size()));
+    message.insert(message.end(), password.begin(), password.end());
+
+    return message;
+}
+
+/**
+   A client on one end of a bufferevent pair, the handshake of
+   the proxy server runs on the other end
+ **/
+class SessionTest : public testing::Test
+{
+protected:
+    SessionTest()
+        : base_(std::make_shared<ServerBase>(std::vector<ListenEndpoint>(),
+                                             nullptr, nullptr, nullptr)),
+          cryptor_(KEY, "0000000000000000")
+    {
+        bufferevent_pair_new(base_->base(), BEV_OPT_CLOSE_ON_FREE, pair_);
+        bufferevent_enable(pair_[0], EV_READ | EV_WRITE);
+
+        // few iterations, the tests needn't be slow
+        std::string error;
+        auto entries = CredentialTable::makeEntry("alice", "wonderland", 10) + "\n" +
+            CredentialTable::makeEntry(LONG_USER, LONG_PASSWORD, 10);
+        base_->enableCredentials(CredentialTable::build(entries.data(), entries.size(), error));
+    }
+
+    ~SessionTest()
+    {
+        // the tunnel sees the client go
+        bufferevent_flush(pair_[0], EV_WRITE, BEV_FINISHED);
+        bufferevent_free(pair_[0]);
+        event_base_loop(base_->base(), EVLOOP_NONBLOCK);
+    }
+
+    // Run the loop until done holds, at most a few seconds
+    bool runUntil(const std::function<bool ()> &done)
+    {
+        struct timeval limit = {5, 0};
+        auto timer = evtimer_new(base_->base(), [](evutil_socket_t, short, void *arg) {
+                event_base_loopbreak(static_cast<event_base *>(arg));
+            }, base_->base());
+        evtimer_add(timer, &limit);
+
+        while (!done() && event_base_got_break(base_->base()) == 0)
+        {
+            event_base_loop(base_->base(), EVLOOP_ONCE);
+        }
+
+        event_free(timer);
+        return done();
+    }
+
+    // Log in once, so the next login is answered from the cache
+    void cacheLogin(const std::string &username = "alice",
+                    const std::string &password = "wonderland")
+    {
+        bool answered = false;
+        ASSERT_TRUE(base_->credentials()->check(username, password, [](bool, void *arg) {
+                    *static_cast<bool *>(arg) = true;
+                }, &answered));
+        ASSERT_TRUE(runUntil([&answered]() { return answered; }));
+    }
+
+    // Send a message and wait for the reply of the server
+    bool exchange(const std::vector<unsigned char> &message, unsigned char *reply,
+                  std::size_t &length)
+    {
+        if (!cryptor_.encryptTo(pair_[0], message.data(), message.size()) ||
+            !runUntil([this]() { return cryptor_.hasFrame(pair_[0]); }))
+        {
+            return false;
+        }
+
+        bool decrypted = cryptor_.decryptFrom(pair_[0], reply, Handshake::MAX_REPLY, length);
+        cryptor_.removeFrom(pair_[0]);
+
+        return decrypted;
+    }
+
+    std::shared_ptr<ServerBase>  base_;
+    Cryptor                      cryptor_;
+    bufferevent                  *pair_[2];
+};
+
+TEST_F(SessionTest, NoAllocationToLogIn)
+{
+    auto config = std::make_shared<Config>("127.0.0.1", 1080, "alice", "wonderland", KEY);
+    config->setCoroutineSessions(true);
+
+    cacheLogin();
+    new Tunnel(config, base_, pair_[1], 1, SourceLimiter::NONE);
+
+    std::vector<unsigned char> greeting = {0x05, 0x01, 0x02};
+    std::vector<unsigned char> login = {0x01, 0x05, 'a', 'l', 'i', 'c', 'e',
+                                        0x0a, 'w', 'o', 'n', 'd', 'e', 'r', 'l', 'a', 'n', 'd'};
+    unsigned char method[Handshake::MAX_REPLY], status[Handshake::MAX_REPLY];
+    std::size_t methodLength = 0, statusLength = 0;
+
+    counting = true;
+    allocations = 0;
+
+    bool greeted = exchange(greeting, method, methodLength);
+    bool loggedIn = exchange(login, status, statusLength);
+
+    counting = false;
+
+    EXPECT_EQ(0u, allocations);
+    ASSERT_TRUE(greeted);
+    ASSERT_TRUE(loggedIn);
+    EXPECT_EQ(std::vector<unsigned char>({0x05, 0x02}),
+              std::vector<unsigned char>(method, method + methodLength));
+    EXPECT_EQ(std::vector<unsigned char>({0x01, 0x00}),
+              std::vector<unsigned char>(status, status + statusLength));
+}
+
+TEST_F(SessionTest, DeniedAddressOfHostsName)
+{
+    // the resolver answers a name of the hosts file before it returns
+    std::string error, rules = "deny 127.0.0.0/8\n";
+    base_->setAcl(Acl::build(rules.data(), rules.size(), error));
+    auto config = std::make_shared<Config>("127.0.0.1", 1080, "alice", "wonderland", KEY);
+
+    cacheLogin();
+    new Tunnel(config, base_, pair_[1], 1, SourceLimiter::NONE);
+
+    std::vector<unsigned char> greeting = {0x05, 0x01, 0x02};
+    std::vector<unsigned char> login = {0x01, 0x05, 'a', 'l', 'i', 'c', 'e',
+                                        0x0a, 'w', 'o', 'n', 'd', 'e', 'r', 'l', 'a', 'n', 'd'};
+    std::vector<unsigned char> request = {0x05, 0x01, 0x00, 0x03, 0x09,
+                                          'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't', 0x00, 0x50};
+    unsigned char reply[Handshake::MAX_REPLY];
+    std::size_t length = 0;
+
+    ASSERT_TRUE(exchange(greeting, reply, length));
+    ASSERT_TRUE(exchange(login, reply, length));
+    ASSERT_TRUE(exchange(request, reply, length));
+
+    // the tunnel hears of it once it waits for the connection
+    ASSERT_LE(2u, length);
+    EXPECT_EQ(static_cast<int>(Request::REPLY_RULE_FAILURE), reply[1]);
+}
+
+TEST_F(SessionTest, NoAllocationToGreetWithAuth)
+{
+    std::vector<unsigned char> greeting = {0x05, 0x02, 0x00, 0x02};
+    auto login = loginMessage(LONG_USER, LONG_PASSWORD);
+    Cryptor cryptor(KEY, "0000000000000000");
+    bufferevent_enable(pair_[1], EV_READ | EV_WRITE);
+
+    counting = true;
+    allocations = 0;
+
+    // the steps of the callbacks engine, as the server end reads them
+    cryptor.encryptTo(pair_[0], greeting.data(), greeting.size());
+    runUntil([this, &cryptor]() { return cryptor.hasFrame(pair_[1]); });
+    Auth::State greeted;
+    {
+        Auth auth(cryptor, pair_[1], true);
+        greeted = auth.authenticate();
+    }
+
+    cryptor.encryptTo(pair_[0], login.data(), login.size());
+    runUntil([this, &cryptor]() { return cryptor.hasFrame(pair_[1]); });
+    Auth auth(cryptor, pair_[1]);
+    Handshake::Login fields;
+    auto read = auth.readUsernamePassword(fields);
+
+    counting = false;
+
+    EXPECT_EQ(0u, allocations);
+    EXPECT_EQ(Auth::State::waitUserPassAuth, greeted);
+    ASSERT_EQ(Auth::State::success, read);
+    EXPECT_EQ(LONG_USER, fields.username.toString());
+    EXPECT_EQ(LONG_PASSWORD, fields.password.toString());
+
+    bufferevent_free(pair_[1]);
+}
+
+TEST_F(SessionTest, NoAllocationToConnect)
+{
+    // a destination that takes the connection, the kernel accepts it
+    int listening = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    ASSERT_EQ(0, bind(listening, reinterpret_cast<sockaddr *>(&address), length));
+    ASSERT_EQ(0, listen(listening, 1));
+    ASSERT_EQ(0, getsockname(listening, reinterpret_cast<sockaddr *>(&address), &length));
+    auto port = reinterpret_cast<const unsigned char *>(&address.sin_port);
+
+    auto config = std::make_shared<Config>("127.0.0.1", 1080, "alice", "wonderland", KEY);
+    cacheLogin(LONG_USER, LONG_PASSWORD);
+    new Tunnel(config, base_, pair_[1], 1, SourceLimiter::NONE);
+
+    std::vector<unsigned char> greeting = {0x05, 0x01, 0x02};
+    auto login = loginMessage(LONG_USER, LONG_PASSWORD);
+    std::vector<unsigned char> request = {0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, port[0], port[1]};
+    unsigned char method[Handshake::MAX_REPLY], status[Handshake::MAX_REPLY];
+    unsigned char reply[Handshake::MAX_REPLY];
+    std::size_t methodLength = 0, statusLength = 0, replyLength = 0;
+
+    counting = true;
+    allocations = 0;
+
+    // the whole handshake of the callbacks engine, up to the reply to CONNECT
+    bool greeted = exchange(greeting, method, methodLength);
+    bool loggedIn = exchange(login, status, statusLength);
+    bool connected = exchange(request, reply, replyLength);
+
+    counting = false;
+    close(listening);
+
+    EXPECT_EQ(0u, allocations);
+    ASSERT_TRUE(greeted);
+    ASSERT_TRUE(loggedIn);
+    ASSERT_TRUE(connected);
+    EXPECT_EQ(std::vector<unsigned char>({0x05, 0x02}),
+              std::vector<unsigned char>(method, method + methodLength));
+    EXPECT_EQ(std::vector<unsigned char>({0x01, 0x00}),
+              std::vector<unsigned char>(status, status + statusLength));
+    ASSERT_LE(2u, replyLength);
+    EXPECT_EQ(0x00, reply[1]);
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,207 @@
+#include "sourcelimit.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/un.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+static sockaddr_storage ipv4(const char *host)
+{
+    sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+
+    auto address = reinterpret_cast<sockaddr_in *>(&storage);
+    address->sin_family = AF_INET;
+    inet_pton(AF_INET, host, &address->sin_addr);
+
+    return storage;
+}
+
+static sockaddr_storage ipv6(const char *host)
+{
+    sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+
+    auto address = reinterpret_cast<sockaddr_in6 *>(&storage);
+    address->sin6_family = AF_INET6;
+    inet_pton(AF_INET6, host, &address->sin6_addr);
+
+    return storage;
+}
+
+static const sockaddr *raw(const sockaddr_storage &storage)
+{
+    return reinterpret_cast<const sockaddr *>(&storage);
+}
+
+TEST(SourceLimiterTest, ConnectionsAtOnce)
+{
+    SourceLimiter::Options options;
+    options.maxConnections = 2;
+    SourceLimiter limiter(options);
+
+    auto client = ipv4("192.0.2.1");
+    int first, second, third;
+    EXPECT_TRUE(limiter.admit(raw(client), 0, first));
+    EXPECT_TRUE(limiter.admit(raw(client), 0, second));
+    EXPECT_FALSE(limiter.admit(raw(client), 0, third));
+    EXPECT_EQ(SourceLimiter::NONE, third);
+    EXPECT_EQ(2u, limiter.connections(raw(client)));
+
+    // another address has limits of its own
+    auto other = ipv4("192.0.2.2");
+    int slot;
+    EXPECT_TRUE(limiter.admit(raw(other), 0, slot));
+
+    limiter.release(first);
+    EXPECT_EQ(1u, limiter.connections(raw(client)));
+    EXPECT_TRUE(limiter.admit(raw(client), 0, third));
+
+    auto stats = limiter.takeStats();
+    EXPECT_EQ(4u, stats.admitted);
+    EXPECT_EQ(1u, stats.overConnections);
+    EXPECT_EQ(0u, limiter.takeStats().admitted);
+}
+
+TEST(SourceLimiterTest, LimitsChangeOnReload)
+{
+    SourceLimiter::Options options;
+    options.maxConnections = 1;
+    SourceLimiter limiter(options);
+
+    auto client = ipv4("192.0.2.1");
+    int first, second;
+    EXPECT_TRUE(limiter.admit(raw(client), 0, first));
+    EXPECT_FALSE(limiter.admit(raw(client), 0, second));
+
+    // the open connection still counts under the new limit
+    options.maxConnections = 2;
+    limiter.setLimits(options);
+    EXPECT_TRUE(limiter.admit(raw(client), 0, second));
+    EXPECT_FALSE(limiter.admit(raw(client), 0, second));
+    EXPECT_EQ(2u, limiter.connections(raw(client)));
+
+    options.maxConnections = 0;
+    limiter.setLimits(options);
+    EXPECT_TRUE(limiter.admit(raw(client), 0, second));
+}
+
+TEST(SourceLimiterTest, ConnectionsPerSecond)
+{
+    SourceLimiter::Options options;
+    options.rate = 2;
+    options.burst = 3;
+    SourceLimiter limiter(options);
+
+    auto client = ipv4("198.51.100.7");
+    int slot;
+    for (int i = 0; i < 3; i++)
+    {
+        EXPECT_TRUE(limiter.admit(raw(client), 1000, slot));
+        limiter.release(slot);
+    }
+    EXPECT_FALSE(limiter.admit(raw(client), 1000, slot));
+
+    // the bucket refills by 2 a second
+    EXPECT_TRUE(limiter.admit(raw(client), 1500, slot));
+    limiter.release(slot);
+    EXPECT_FALSE(limiter.admit(raw(client), 1500, slot));
+
+    EXPECT_EQ(2u, limiter.takeStats().overRate);
+}
+
+TEST(SourceLimiterTest, Ipv6PrefixAndMappedAddresses)
+{
+    SourceLimiter::Options options;
+    options.maxConnections = 1;
+    SourceLimiter limiter(options);
+
+    // a host of a /64 counts as the whole block
+    auto host = ipv6("2001:db8:1:2::10");
+    auto neighbour = ipv6("2001:db8:1:2::20");
+    auto elsewhere = ipv6("2001:db8:1:3::10");
+    int slot;
+    EXPECT_TRUE(limiter.admit(raw(host), 0, slot));
+    EXPECT_FALSE(limiter.admit(raw(neighbour), 0, slot));
+    EXPECT_TRUE(limiter.admit(raw(elsewhere), 0, slot));
+
+    // an IPv4 client of a dual stack socket is the same source
+    auto client = ipv4("203.0.113.5");
+    auto mapped = ipv6("::ffff:203.0.113.5");
+    EXPECT_TRUE(limiter.admit(raw(client), 0, slot));
+    EXPECT_FALSE(limiter.admit(raw(mapped), 0, slot));
+}
+
+TEST(SourceLimiterTest, UnixClientsAreNotCounted)
+{
+    SourceLimiter::Options options;
+    options.maxConnections = 1;
+    SourceLimiter limiter(options);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    int slot;
+    for (int i = 0; i < 3; i++)
+    {
+        EXPECT_TRUE(limiter.admit(reinterpret_cast<sockaddr *>(&address), 0, slot));
+        EXPECT_EQ(SourceLimiter::NONE, slot);
+    }
+    limiter.release(slot);
+}
+
+TEST(SourceLimiterTest, FloodStaysInTheTable)
+{
+    SourceLimiter::Options options;
+    options.maxConnections = 1;
+    options.slots = 1024;
+    SourceLimiter limiter(options);
+
+    // the first client keeps a connection open through a flood of others
+    auto client = ipv4("10.255.255.1");
+    int kept;
+    ASSERT_TRUE(limiter.admit(raw(client), 0, kept));
+
+    std::vector<int> open;
+    for (uint32_t i = 0; i < 100000; i++)
+    {
+        sockaddr_storage storage;
+        memset(&storage, 0, sizeof(storage));
+        auto address = reinterpret_cast<sockaddr_in *>(&storage);
+        address->sin_family = AF_INET;
+        address->sin_addr.s_addr = htonl(0x0a000000 + i);
+
+        int slot;
+        EXPECT_TRUE(limiter.admit(raw(storage), i, slot));
+        if (i % 100 == 0)
+        {
+            open.push_back(slot);
+        }
+        else
+        {
+            limiter.release(slot);
+        }
+    }
+
+    EXPECT_EQ(1u, limiter.connections(raw(client)));
+    int slot;
+    EXPECT_FALSE(limiter.admit(raw(client), 0, slot));
+
+    for (auto openSlot : open)
+    {
+        limiter.release(openSlot);
+    }
+    limiter.release(kept);
+    EXPECT_EQ(0u, limiter.connections(raw(client)));
+}
+
+int main(int argc, char *argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,206 @@
+#include "udprelay.hpp"
+#include "sockets.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <event2/event.h>
+
+#include <gtest/gtest.h>
+
+TEST(UdpHeaderTest, RoundTrip)
+{
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(5353);
+    inet_pton(AF_INET, "10.1.2.3", &sin.sin_addr);
+
+    unsigned char header[UdpHeader::MAX_BYTES + 4];
+    auto length = UdpHeader::write(reinterpret_cast<sockaddr *>(&sin), header);
+    EXPECT_EQ(10u, length);
+    memcpy(header + length, "ping", 4);
+
+    Address address;
+    EXPECT_EQ(length, UdpHeader::parse(header, length + 4, address));
+    EXPECT_EQ(Address::Type::ipv4, address.type());
+    EXPECT_STREQ("10.1.2.3", address.host().c_str());
+    EXPECT_EQ(5353, address.port());
+}
+
+TEST(UdpHeaderTest, MappedAddress)
+{
+    sockaddr_in6 sin6;
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(53);
+    inet_pton(AF_INET6, "::ffff:192.168.0.1", &sin6.sin6_addr);
+
+    unsigned char header[UdpHeader::MAX_BYTES];
+    EXPECT_EQ(10u, UdpHeader::write(reinterpret_cast<sockaddr *>(&sin6), header));
+
+    Address address;
+    EXPECT_EQ(10u, UdpHeader::parse(header, 10, address));
+    EXPECT_STREQ("192.168.0.1", address.host().c_str());
+    EXPECT_EQ(53, address.port());
+}
+
+TEST(UdpHeaderTest, Domain)
+{
+    const unsigned char header[] = {
+        0, 0, 0, 3, 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0, 80
+    };
+
+    Address address;
+    EXPECT_EQ(0u, UdpHeader::parse(header, sizeof(header) - 1, address));
+    EXPECT_EQ(sizeof(header), UdpHeader::parse(header, sizeof(header), address));
+    EXPECT_EQ(Address::Type::domain, address.type());
+    EXPECT_EQ("example:80", address.toString());
+}
+
+TEST(UdpHeaderTest, Invalid)
+{
+    Address address;
+
+    // fragments are not supported
+    const unsigned char fragment[] = {0, 0, 1, 1, 127, 0, 0, 1, 0, 80};
+    EXPECT_EQ(0u, UdpHeader::parse(fragment, sizeof(fragment), address));
+
+    const unsigned char type[] = {0, 0, 0, 2, 127, 0, 0, 1, 0, 80};
+    EXPECT_EQ(0u, UdpHeader::parse(type, sizeof(type), address));
+
+    const unsigned char truncated[] = {0, 0, 0, 4, 0, 0, 0, 0};
+    EXPECT_EQ(0u, UdpHeader::parse(truncated, sizeof(truncated), address));
+}
+
+class UdpRelayTest : public testing::Test
+{
+protected:
+    UdpRelayTest()
+        : base_(event_base_new())
+    {
+    }
+
+    ~UdpRelayTest()
+    {
+        event_base_free(base_);
+    }
+
+    static void readCallback(const sockaddr *, socklen_t,
+                             const unsigned char *data, std::size_t length,
+                             void *arg)
+    {
+        auto received = static_cast<std::vector<std::string> *>(arg);
+        received->emplace_back(reinterpret_cast<const char *>(data), length);
+    }
+
+    event_base *base_;
+};
+
+TEST_F(UdpRelayTest, Batch)
+{
+    auto loopback = Address::FromHostOrder("127.0.0.1", 0);
+
+    std::vector<std::string> received;
+    UdpRelay sender(base_, createUdpSocket(loopback), readCallback, nullptr);
+    UdpRelay receiver(base_, createUdpSocket(loopback), readCallback, &received);
+
+    sockaddr_storage to;
+    auto toLength = toSockaddr(receiver.localAddress(), &to);
+    ASSERT_GT(toLength, 0u);
+
+    const int count = UdpRelay::BATCH + 8;
+    for (int i = 0; i < count; i++)
+    {
+        // same sized datagrams, so the kernel may coalesce them with GSO
+        auto data = "datagram-" + std::to_string(100 + i);
+        sender.send(reinterpret_cast<sockaddr *>(&to), toLength,
+                    reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    }
+    sender.flush();
+
+    EXPECT_EQ(static_cast<uint64_t>(count), sender.stats().sent);
+    EXPECT_EQ(0u, sender.stats().dropped);
+    EXPECT_LE(sender.stats().sendCalls, 2u);
+
+    while (received.size() < static_cast<std::size_t>(count))
+    {
+        event_base_loop(base_, EVLOOP_ONCE);
+    }
+
+    EXPECT_EQ(static_cast<uint64_t>(count), receiver.stats().received);
+    EXPECT_LT(receiver.stats().recvCalls, static_cast<uint64_t>(count));
+    EXPECT_EQ("datagram-100", received.front());
+    EXPECT_EQ("datagram-" + std::to_string(100 + count - 1), received.back());
+}
+
+/**
+   Each association removes itself when it expires, as the tunnels do
+ **/
+class UdpAssociationsTest : public testing::Test
+{
+protected:
+    UdpAssociationsTest()
+        : base_(event_base_new()),
+          associations_(nullptr),
+          expired_(0)
+    {
+    }
+
+    ~UdpAssociationsTest()
+    {
+        event_base_free(base_);
+    }
+
+    static void expireCallback(void *arg)
+    {
+        auto test = static_cast<UdpAssociationsTest *>(arg);
+        test->associations_->remove(test->handle_);
+        test->expired_++;
+    }
+
+    event_base                 *base_;
+    UdpAssociations            *associations_;
+    UdpAssociations::Handle    handle_;
+    int                        expired_;
+};
+
+TEST_F(UdpAssociationsTest, Idle)
+{
+    UdpAssociations associations(base_, 60);
+    associations_ = &associations;
+
+    handle_ = associations.add(expireCallback, this);
+    associations.touch(handle_);
+    associations.expire();
+
+    EXPECT_EQ(0, expired_);
+    EXPECT_EQ(1u, associations.size());
+
+    associations.remove(handle_);
+    EXPECT_EQ(0u, associations.size());
+}
+
+TEST_F(UdpAssociationsTest, Expire)
+{
+    UdpAssociations associations(base_, 0);
+    associations_ = &associations;
+
+    handle_ = associations.add(expireCallback, this);
+    associations.expire();
+
+    EXPECT_EQ(1, expired_);
+    EXPECT_EQ(0u, associations.size());
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+
+    int ret = RUN_ALL_TESTS();
+    return ret;
+}